@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file bench_calendar.c
+@author Tony Pottier
+@brief Host benchmark of the incremental calendar against the localtime path it replaces
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Walks a range of timestamps one second at a time, the way clock_tick does, once with
+localtime and once with calendar_advance. Every broken down time is compared so the
+benchmark doubles as a check of the roll-over logic, leap years included. A few jumps
+are thrown in to exercise the slow path.
+
+Usage: bench_calendar [--from UTC] [--seconds N]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "calendar.h"
+
+
+/** @brief 1999-12-31 00:00:00: crosses 2000 (leap, divisible by 400) early on */
+#define BENCH_DEFAULT_FROM				946598400LL
+
+/** @brief a bit more than 4 years, so that every month of a leap cycle is seen */
+#define BENCH_DEFAULT_SECONDS			(4LL * 366 * 86400)
+
+/** @brief a jump happens this often, like a DST transition or a re-alignment would */
+#define BENCH_JUMP_PERIOD				(180LL * 86400)
+
+
+static double bench_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int bench_tm_cmp(const struct tm *a, const struct tm *b){
+	return a->tm_sec != b->tm_sec || a->tm_min != b->tm_min || a->tm_hour != b->tm_hour ||
+			a->tm_mday != b->tm_mday || a->tm_mon != b->tm_mon || a->tm_year != b->tm_year ||
+			a->tm_wday != b->tm_wday || a->tm_yday != b->tm_yday;
+}
+
+/** @brief next timestamp of the walk: +1s, with an hour jump from time to time */
+static inline time_t bench_next(time_t t, time_t from){
+	return ((t - from) % BENCH_JUMP_PERIOD == BENCH_JUMP_PERIOD - 1) ? t + 3601 : t + 1;
+}
+
+int main(int argc, char **argv){
+
+	time_t from = (time_t)BENCH_DEFAULT_FROM;
+	long long seconds = BENCH_DEFAULT_SECONDS;
+
+	static const struct option options[] = {
+		{ "from", required_argument, NULL, 'f' },
+		{ "seconds", required_argument, NULL, 'n' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int c;
+	while((c = getopt_long(argc, argv, "", options, NULL)) != -1){
+		switch(c){
+			case 'f': from = (time_t)atoll(optarg); break;
+			case 'n': seconds = atoll(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [--from UTC] [--seconds N]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	/* the esp32 newlib has no timezone set: localtime is gmtime */
+	setenv("TZ", "UTC0", 1);
+	tzset();
+
+	/* reference: what clock_tick used to do */
+	volatile int sink = 0;
+	time_t t = from;
+	double start = bench_now();
+	for(long long i = 0; i < seconds; i++){
+		struct tm *tm = localtime(&t);
+		sink += tm->tm_sec;
+		t = bench_next(t, from);
+	}
+	double localtime_s = bench_now() - start;
+
+	/* incremental calendar */
+	calendar_t cal;
+	calendar_set(&cal, from - 1);
+	t = from;
+	start = bench_now();
+	for(long long i = 0; i < seconds; i++){
+		const struct tm *tm = calendar_advance(&cal, t);
+		sink += tm->tm_sec;
+		t = bench_next(t, from);
+	}
+	double calendar_s = bench_now() - start;
+
+	/* correctness, outside of the timed loops */
+	long long mismatches = 0;
+	calendar_set(&cal, from - 1);
+	t = from;
+	for(long long i = 0; i < seconds; i++){
+		struct tm ref;
+		gmtime_r(&t, &ref);
+		if(bench_tm_cmp(calendar_advance(&cal, t), &ref)){
+			if(mismatches++ == 0){
+				fprintf(stderr, "first mismatch at %lld\n", (long long)t);
+			}
+		}
+		t = bench_next(t, from);
+	}
+
+	printf("ticks:            %lld from %lld\n", seconds, (long long)from);
+	printf("localtime:        %.1f ns/tick\n", 1e9 * localtime_s / (double)seconds);
+	printf("calendar:         %.1f ns/tick (x%.1f)\n", 1e9 * calendar_s / (double)seconds, localtime_s / calendar_s);
+	printf("mismatches:       %lld\n", mismatches);
+
+	return mismatches ? 1 : 0;
+}
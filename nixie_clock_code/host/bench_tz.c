@@ -0,0 +1,216 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file bench_tz.c
+@author Tony Pottier
+@brief Host benchmark of the offline timezone rules against the host's localtime
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Every zone of timezones.json is looked up in the compiled database (tz.bin) and its offset is
+compared, hour by hour over a few years, with what glibc and the full tz database of the host
+say. Zones flagged irregular by tz_compile.py are skipped. Every transition given by tz_transitions is also checked to the second. Then the cost of a
+call is measured: tz_offset second by second the way the clock would call it, tz_offset on
+random times (a cache miss nearly every call), tz_find, and localtime_r for reference.
+
+Usage: bench_tz [--zones timezones.json] [--from UTC] [--years N]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "tz.h"
+
+
+/** @brief 2026-01-01 00:00:00 UTC: the year tz.bin was compiled for. Rules changed before that */
+#define BENCH_DEFAULT_FROM				1767225600LL
+
+#define BENCH_DEFAULT_YEARS				8
+
+#define BENCH_MAX_ZONES					512
+
+#define BENCH_CALLS						10000000LL
+
+
+static double bench_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/** @brief the zone names of timezones.json: a flat list of strings, with "\/" escapes */
+static int bench_load_zones(const char *path, char **zones, int max){
+	FILE *f = fopen(path, "rb");
+	if(!f){
+		perror(path);
+		return -1;
+	}
+	static char buf[32768];
+	size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	int count = 0;
+	char *p = buf;
+	while(count < max && (p = strchr(p, '"')) != NULL){
+		char *name = ++p, *w = p;
+		for(; *p && *p != '"'; p++){
+			if(*p == '\\') p++;
+			*w++ = *p;
+		}
+		if(*p) p++;
+		*w = '\0';
+		zones[count++] = name;
+	}
+	return count;
+}
+
+static int32_t bench_host_offset(time_t t){
+	struct tm tm;
+	localtime_r(&t, &tm);
+	return (int32_t)tm.tm_gmtoff;
+}
+
+int main(int argc, char **argv){
+
+	const char *zones_path = "../main/timezones.json";
+	time_t from = (time_t)BENCH_DEFAULT_FROM;
+	int years = BENCH_DEFAULT_YEARS;
+
+	static const struct option options[] = {
+		{ "zones", required_argument, NULL, 'z' },
+		{ "from", required_argument, NULL, 'f' },
+		{ "years", required_argument, NULL, 'y' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int c;
+	while((c = getopt_long(argc, argv, "", options, NULL)) != -1){
+		switch(c){
+			case 'z': zones_path = optarg; break;
+			case 'f': from = (time_t)atoll(optarg); break;
+			case 'y': years = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [--zones timezones.json] [--from UTC] [--years N]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	static char *zones[BENCH_MAX_ZONES];
+	int zone_count = bench_load_zones(zones_path, zones, BENCH_MAX_ZONES);
+	if(zone_count <= 0){
+		return 1;
+	}
+	const time_t to = from + (time_t)years * 365 * 86400;
+
+	/* correctness, zone by zone */
+	long long samples = 0, mismatches = 0, transitions = 0;
+	int missing = 0, irregular = 0;
+	for(int z = 0; z < zone_count; z++){
+		tz_rule_t rule;
+		tz_t tz;
+		esp_err_t err = tz_find(zones[z], &rule);
+		if(err == ESP_ERR_NOT_SUPPORTED){
+			irregular++;
+			continue;
+		}
+		else if(err != ESP_OK){
+			fprintf(stderr, "%s: not in the database\n", zones[z]);
+			missing++;
+			continue;
+		}
+		tz_init(&tz, &rule);
+		setenv("TZ", zones[z], 1);
+		tzset();
+
+		long long before = mismatches;
+		for(time_t t = from; t < to; t += 3600){
+			samples++;
+			if(tz_offset(&tz, t) != bench_host_offset(t)){
+				if(mismatches++ == before){
+					fprintf(stderr, "%s: offset %d instead of %d at %lld\n", zones[z], tz_offset(&tz, t), bench_host_offset(t), (long long)t);
+				}
+			}
+		}
+
+		tz_transition_t list[4 * BENCH_DEFAULT_YEARS * 2];
+		int n = tz_transitions(&tz, from, to, list, sizeof(list) / sizeof(list[0]));
+		for(int i = 0; i < n; i++){
+			transitions++;
+			if(bench_host_offset(list[i].timestamp) != list[i].offset || bench_host_offset(list[i].timestamp - 1) == list[i].offset){
+				if(mismatches++ == before){
+					fprintf(stderr, "%s: transition to %d at %lld is wrong\n", zones[z], list[i].offset, (long long)list[i].timestamp);
+				}
+			}
+		}
+	}
+
+	/* timing, with the clock's zone */
+	tz_rule_t rule;
+	tz_t tz;
+	tz_find("Europe/Paris", &rule);
+	tz_init(&tz, &rule);
+	setenv("TZ", "Europe/Paris", 1);
+	tzset();
+
+	volatile int32_t sink = 0;
+	double start = bench_now();
+	for(long long i = 0; i < BENCH_CALLS; i++){
+		sink += bench_host_offset(from + (time_t)i);
+	}
+	double localtime_s = bench_now() - start;
+
+	start = bench_now();
+	for(long long i = 0; i < BENCH_CALLS; i++){
+		sink += tz_offset(&tz, from + (time_t)i);
+	}
+	double sequential_s = bench_now() - start;
+
+	/* random times over the range: defeats the per-year cache */
+	uint32_t x = 2463534242u;
+	start = bench_now();
+	for(long long i = 0; i < BENCH_CALLS; i++){
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		sink += tz_offset(&tz, from + (time_t)(x % (uint32_t)(to - from)));
+	}
+	double random_s = bench_now() - start;
+
+	start = bench_now();
+	for(long long i = 0; i < BENCH_CALLS / 10; i++){
+		sink += tz_find(zones[i % zone_count], &rule);
+	}
+	double find_s = bench_now() - start;
+
+	printf("zones:            %d (%d irregular, %d missing)\n", zone_count, irregular, missing);
+	printf("samples:          %lld hourly, %lld transitions from %lld over %d years\n", samples, transitions, (long long)from, years);
+	printf("localtime_r:      %.1f ns/call\n", 1e9 * localtime_s / (double)BENCH_CALLS);
+	printf("tz_offset:        %.1f ns/call sequential (x%.1f), %.1f ns/call random\n",
+			1e9 * sequential_s / (double)BENCH_CALLS, localtime_s / sequential_s, 1e9 * random_s / (double)BENCH_CALLS);
+	printf("tz_find:          %.1f ns/call\n", 1e9 * find_s / (double)(BENCH_CALLS / 10));
+	printf("mismatches:       %lld\n", mismatches);
+
+	return (mismatches || missing) ? 1 : 0;
+}
@@ -0,0 +1,41 @@
+/**
+@file rmt.h
+@brief Host simulation stand-in for ESP-IDF's driver/rmt.h
+*/
+
+#ifndef HOST_DRIVER_RMT_H_
+#define HOST_DRIVER_RMT_H_
+
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "soc/rmt_struct.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	RMT_CHANNEL_0 = 0,
+	RMT_CHANNEL_1,
+	RMT_CHANNEL_2,
+	RMT_CHANNEL_3,
+	RMT_CHANNEL_4,
+	RMT_CHANNEL_5,
+	RMT_CHANNEL_6,
+	RMT_CHANNEL_7,
+	RMT_CHANNEL_MAX
+} rmt_channel_t;
+
+typedef enum {
+	RMT_MODE_TX = 0,
+	RMT_MODE_RX,
+	RMT_MODE_MAX
+} rmt_mode_t;
+
+esp_err_t rmt_set_pin(rmt_channel_t channel, rmt_mode_t mode, gpio_num_t gpio_num);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_DRIVER_RMT_H_ */
@@ -0,0 +1,89 @@
+/**
+@file timer.h
+@brief Host simulation stand-in for ESP-IDF's driver/timer.h
+
+Only alarm driven timers with auto reload are modelled: the alarm fires
+every alarm_value ticks of simulated time while the timer is started.
+*/
+
+#ifndef HOST_DRIVER_TIMER_H_
+#define HOST_DRIVER_TIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_intr_alloc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief timers are clocked by the 80MHz APB clock before the divider */
+#define TIMER_BASE_CLK				80000000
+
+typedef enum {
+	TIMER_GROUP_0 = 0,
+	TIMER_GROUP_1 = 1,
+	TIMER_GROUP_MAX
+} timer_group_t;
+
+typedef enum {
+	TIMER_0 = 0,
+	TIMER_1 = 1,
+	TIMER_MAX
+} timer_idx_t;
+
+typedef enum {
+	TIMER_COUNT_DOWN = 0,
+	TIMER_COUNT_UP = 1,
+	TIMER_COUNT_MAX
+} timer_count_dir_t;
+
+typedef enum {
+	TIMER_PAUSE = 0,
+	TIMER_START = 1
+} timer_start_t;
+
+typedef enum {
+	TIMER_ALARM_DIS = 0,
+	TIMER_ALARM_EN = 1,
+	TIMER_ALARM_MAX
+} timer_alarm_t;
+
+typedef enum {
+	TIMER_INTR_LEVEL = 0,
+	TIMER_INTR_MAX
+} timer_intr_mode_t;
+
+typedef enum {
+	TIMER_AUTORELOAD_DIS = 0,
+	TIMER_AUTORELOAD_EN = 1,
+	TIMER_AUTORELOAD_MAX
+} timer_autoreload_t;
+
+typedef struct {
+	timer_alarm_t alarm_en;
+	timer_start_t counter_en;
+	timer_intr_mode_t intr_type;
+	timer_count_dir_t counter_dir;
+	timer_autoreload_t auto_reload;
+	uint32_t divider;
+} timer_config_t;
+
+typedef struct intr_handle_data_t *timer_isr_handle_t;
+
+esp_err_t timer_init(timer_group_t group_num, timer_idx_t timer_num, const timer_config_t *config);
+esp_err_t timer_set_counter_value(timer_group_t group_num, timer_idx_t timer_num, uint64_t load_val);
+esp_err_t timer_set_alarm_value(timer_group_t group_num, timer_idx_t timer_num, uint64_t alarm_value);
+esp_err_t timer_enable_intr(timer_group_t group_num, timer_idx_t timer_num);
+esp_err_t timer_isr_register(timer_group_t group_num, timer_idx_t timer_num, void (*fn)(void*), void *arg, int intr_alloc_flags, timer_isr_handle_t *handle);
+esp_err_t timer_start(timer_group_t group_num, timer_idx_t timer_num);
+esp_err_t timer_pause(timer_group_t group_num, timer_idx_t timer_num);
+void timer_group_clr_intr_status_in_isr(timer_group_t group_num, timer_idx_t timer_num);
+void timer_group_enable_alarm_in_isr(timer_group_t group_num, timer_idx_t timer_num);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_DRIVER_TIMER_H_ */
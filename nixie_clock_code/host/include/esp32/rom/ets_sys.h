@@ -0,0 +1,24 @@
+/**
+@file ets_sys.h
+@brief Host simulation stand-in for ESP-IDF's esp32/rom/ets_sys.h
+
+ets_delay_us busy-waits on the esp32. In the simulation it lets simulated
+time run for the duration, like any other delay.
+*/
+
+#ifndef HOST_ESP32_ROM_ETS_SYS_H_
+#define HOST_ESP32_ROM_ETS_SYS_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ets_delay_us(uint32_t us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP32_ROM_ETS_SYS_H_ */
@@ -0,0 +1,24 @@
+/**
+@file gpio.h
+@brief Host simulation stand-in for ESP-IDF's esp32/rom/gpio.h
+
+Routing a pin back to SIG_GPIO_OUT_IDX detaches it from any LEDC channel.
+*/
+
+#ifndef HOST_ESP32_ROM_GPIO_H_
+#define HOST_ESP32_ROM_GPIO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP32_ROM_GPIO_H_ */
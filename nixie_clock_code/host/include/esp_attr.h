@@ -0,0 +1,14 @@
+/**
+@file esp_attr.h
+@brief Host simulation stand-in for ESP-IDF's esp_attr.h
+*/
+
+#ifndef HOST_ESP_ATTR_H_
+#define HOST_ESP_ATTR_H_
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_DATA_ATTR
+#define WORD_ALIGNED_ATTR __attribute__((aligned(4)))
+
+#endif /* HOST_ESP_ATTR_H_ */
@@ -0,0 +1,43 @@
+/**
+@file esp_heap_caps.h
+@brief Host simulation stand-in for ESP-IDF's esp_heap_caps.h
+
+The host has a single heap: capabilities are accepted and ignored.
+*/
+
+#ifndef HOST_ESP_HEAP_CAPS_H_
+#define HOST_ESP_HEAP_CAPS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MALLOC_CAP_EXEC				(1<<0)
+#define MALLOC_CAP_32BIT			(1<<1)
+#define MALLOC_CAP_8BIT				(1<<2)
+#define MALLOC_CAP_DMA				(1<<3)
+#define MALLOC_CAP_INTERNAL			(1<<11)
+#define MALLOC_CAP_DEFAULT			(1<<12)
+
+static inline void *heap_caps_malloc(size_t size, uint32_t caps){
+	(void)caps;
+	return malloc(size);
+}
+
+static inline void *heap_caps_calloc(size_t n, size_t size, uint32_t caps){
+	(void)caps;
+	return calloc(n, size);
+}
+
+static inline void heap_caps_free(void *ptr){
+	free(ptr);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_HEAP_CAPS_H_ */
@@ -0,0 +1,32 @@
+/**
+@file esp_intr_alloc.h
+@brief Host simulation stand-in for ESP-IDF's esp_intr_alloc.h
+*/
+
+#ifndef HOST_ESP_INTR_ALLOC_H_
+#define HOST_ESP_INTR_ALLOC_H_
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ESP_INTR_FLAG_LEVEL1		(1<<1)
+#define ESP_INTR_FLAG_LEVEL2		(1<<2)
+#define ESP_INTR_FLAG_LEVEL3		(1<<3)
+#define ESP_INTR_FLAG_IRAM			(1<<10)
+
+#define ETS_RMT_INTR_SOURCE			47
+
+typedef void (*intr_handler_t)(void *arg);
+typedef struct intr_handle_data_t* intr_handle_t;
+
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg, intr_handle_t *ret_handle);
+esp_err_t esp_intr_free(intr_handle_t handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_INTR_ALLOC_H_ */
@@ -0,0 +1,26 @@
+/**
+@file esp_system.h
+@brief Host simulation stand-in for ESP-IDF's esp_system.h
+*/
+
+#ifndef HOST_ESP_SYSTEM_H_
+#define HOST_ESP_SYSTEM_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_attr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+uint32_t esp_random(void);
+void esp_restart(void) __attribute__ ((noreturn));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_SYSTEM_H_ */
@@ -0,0 +1,24 @@
+/**
+@file esp_timer.h
+@brief Host simulation stand-in for ESP-IDF's esp_timer.h
+
+esp_timer_get_time returns the simulated time since boot in microseconds.
+*/
+
+#ifndef HOST_ESP_TIMER_H_
+#define HOST_ESP_TIMER_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int64_t esp_timer_get_time(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_TIMER_H_ */
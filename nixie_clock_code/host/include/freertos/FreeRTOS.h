@@ -0,0 +1,67 @@
+/**
+@file FreeRTOS.h
+@brief Host simulation stand-in for the ESP-IDF flavour of FreeRTOS.h
+
+Tasks are backed by POSIX threads and all blocking primitives are driven by
+the simulated clock of the host build (see sim.h). Only the subset of the
+FreeRTOS API used by the clock firmware is provided.
+*/
+
+#ifndef HOST_FREERTOS_H_
+#define HOST_FREERTOS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define configTICK_RATE_HZ				CONFIG_FREERTOS_HZ
+#define configMAX_PRIORITIES			25
+
+#define portMAX_DELAY					(TickType_t)0xffffffffUL
+#define portTICK_PERIOD_MS				((TickType_t)1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS				portTICK_PERIOD_MS
+#define portNUM_PROCESSORS				2
+
+#define pdMS_TO_TICKS(xTimeInMs)		((TickType_t)(((TickType_t)(xTimeInMs) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000))
+
+#define pdFALSE							((BaseType_t)0)
+#define pdTRUE							((BaseType_t)1)
+#define pdPASS							(pdTRUE)
+#define pdFAIL							(pdFALSE)
+#define errQUEUE_EMPTY					((BaseType_t)0)
+#define errQUEUE_FULL					((BaseType_t)0)
+
+#define tskNO_AFFINITY					0x7FFFFFFF
+
+/* critical sections are a single global lock in the simulation */
+typedef struct {
+	uint32_t owner;
+	uint32_t count;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED	{ .owner = 0, .count = 0 }
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+#define portENTER_CRITICAL(mux)			vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)			vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux)		vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux)		vPortExitCritical(mux)
+#define portYIELD_FROM_ISR()			do { } while(0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_FREERTOS_H_ */
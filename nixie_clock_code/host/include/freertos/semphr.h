@@ -0,0 +1,38 @@
+/**
+@file semphr.h
+@brief Host simulation stand-in for FreeRTOS semphr.h
+
+As in FreeRTOS, semaphores are queues with a zero item size.
+*/
+
+#ifndef HOST_FREERTOS_SEMPHR_H_
+#define HOST_FREERTOS_SEMPHR_H_
+
+#include "freertos/queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef SemaphoreHandle_t xSemaphoreHandle;
+
+SemaphoreHandle_t xQueueCreateCountingSemaphore(const UBaseType_t uxMaxCount, const UBaseType_t uxInitialCount);
+BaseType_t xQueueSemaphoreTake(QueueHandle_t xQueue, TickType_t xTicksToWait);
+BaseType_t xQueueGiveFromISR(QueueHandle_t xQueue, BaseType_t * const pxHigherPriorityTaskWoken);
+
+#define xSemaphoreCreateBinary()					xQueueCreateCountingSemaphore(1, 0)
+#define xSemaphoreCreateMutex()						xQueueCreateCountingSemaphore(1, 1)
+#define xSemaphoreCreateCounting(uxMaxCount, uxInitialCount) xQueueCreateCountingSemaphore((uxMaxCount), (uxInitialCount))
+#define vSemaphoreDelete(xSemaphore)				vQueueDelete((QueueHandle_t)(xSemaphore))
+#define xSemaphoreTake(xSemaphore, xBlockTime)		xQueueSemaphoreTake((xSemaphore), (xBlockTime))
+#define xSemaphoreGive(xSemaphore)					xQueueGenericSend((QueueHandle_t)(xSemaphore), NULL, 0, queueSEND_TO_BACK)
+#define xSemaphoreGiveFromISR(xSemaphore, pxHigherPriorityTaskWoken) xQueueGiveFromISR((QueueHandle_t)(xSemaphore), (pxHigherPriorityTaskWoken))
+#define xSemaphoreTakeFromISR(xSemaphore, pxHigherPriorityTaskWoken) xQueueReceiveFromISR((QueueHandle_t)(xSemaphore), NULL, (pxHigherPriorityTaskWoken))
+#define uxSemaphoreGetCount(xSemaphore)				uxQueueMessagesWaiting((QueueHandle_t)(xSemaphore))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_FREERTOS_SEMPHR_H_ */
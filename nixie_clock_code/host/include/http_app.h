@@ -0,0 +1,24 @@
+/**
+@file http_app.h
+@brief Host simulation stand-in for the esp32-wifi-manager http_app.h
+
+Only the handler hooks used by webapp.c are provided. The simulation calls
+them directly through sim_httpd_request().
+*/
+
+#ifndef HOST_HTTP_APP_H_
+#define HOST_HTTP_APP_H_
+
+#include "esp_http_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t http_app_set_handler_hook(httpd_method_t method, esp_err_t (*handler)(httpd_req_t *r));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_HTTP_APP_H_ */
@@ -0,0 +1,15 @@
+/**
+@file sntp.h
+@brief Host simulation stand-in for lwIP's apps/sntp.h
+
+On the esp32, lwIP headers pull in the FreeRTOS port (sys_arch.h) and with it
+freertos/semphr.h, which clock.c relies on.
+*/
+
+#ifndef HOST_LWIP_APPS_SNTP_H_
+#define HOST_LWIP_APPS_SNTP_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#endif /* HOST_LWIP_APPS_SNTP_H_ */
@@ -0,0 +1,13 @@
+/**
+@file err.h
+@brief Host simulation stand-in for lwIP's err.h
+*/
+
+#ifndef HOST_LWIP_ERR_H_
+#define HOST_LWIP_ERR_H_
+
+typedef signed char err_t;
+
+#define ERR_OK			0
+
+#endif /* HOST_LWIP_ERR_H_ */
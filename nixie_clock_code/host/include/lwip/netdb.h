@@ -0,0 +1,27 @@
+/**
+@file netdb.h
+@brief Host simulation stand-in for lwIP's netdb.h
+
+Every host name resolves to the simulated NTP server of sim_ntp.c.
+*/
+
+#ifndef HOST_LWIP_NETDB_H_
+#define HOST_LWIP_NETDB_H_
+
+#include <netdb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int sim_lwip_getaddrinfo(const char *nodename, const char *servname, const struct addrinfo *hints, struct addrinfo **res);
+void sim_lwip_freeaddrinfo(struct addrinfo *ai);
+
+#define getaddrinfo(nodename, servname, hints, res)		sim_lwip_getaddrinfo(nodename, servname, hints, res)
+#define freeaddrinfo(ai)								sim_lwip_freeaddrinfo(ai)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_LWIP_NETDB_H_ */
@@ -0,0 +1,37 @@
+/**
+@file sockets.h
+@brief Host simulation stand-in for lwIP's sockets.h
+
+The BSD socket calls are routed to the simulated network of sim_ntp.c the way
+lwIP maps them to its lwip_ functions. Types and constants are the host's.
+*/
+
+#ifndef HOST_LWIP_SOCKETS_H_
+#define HOST_LWIP_SOCKETS_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int sim_lwip_socket(int domain, int type, int protocol);
+int sim_lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen);
+ssize_t sim_lwip_sendto(int s, const void *data, size_t size, int flags, const struct sockaddr *to, socklen_t tolen);
+ssize_t sim_lwip_recvfrom(int s, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen);
+int sim_lwip_close(int s);
+
+#define socket(domain, type, protocol)					sim_lwip_socket(domain, type, protocol)
+#define setsockopt(s, level, optname, optval, optlen)	sim_lwip_setsockopt(s, level, optname, optval, optlen)
+#define sendto(s, data, size, flags, to, tolen)			sim_lwip_sendto(s, data, size, flags, to, tolen)
+#define recvfrom(s, mem, len, flags, from, fromlen)		sim_lwip_recvfrom(s, mem, len, flags, from, fromlen)
+#define closesocket(s)									sim_lwip_close(s)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_LWIP_SOCKETS_H_ */
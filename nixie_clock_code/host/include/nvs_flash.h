@@ -0,0 +1,13 @@
+/**
+@file nvs_flash.h
+@brief Host simulation stand-in for ESP-IDF's nvs_flash.h
+*/
+
+#ifndef HOST_NVS_FLASH_H_
+#define HOST_NVS_FLASH_H_
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init(void);
+
+#endif /* HOST_NVS_FLASH_H_ */
@@ -0,0 +1,25 @@
+/**
+@file sdkconfig.h
+@brief Host simulation stand-in for the sdkconfig.h generated by menuconfig.
+
+Only the options referenced by the clock firmware are defined here. Values
+mirror the defaults of main/Kconfig.projbuild.
+*/
+
+#ifndef HOST_SDKCONFIG_H_
+#define HOST_SDKCONFIG_H_
+
+#define CONFIG_CLOCK_TASK_PRIORITY			10
+#define CONFIG_FREERTOS_HZ					100
+#define CONFIG_LOG_DEFAULT_LEVEL			3
+#define CONFIG_WS2812_ONE_SHOT				1
+#define CONFIG_WS2812_FRAME_RATE			50
+#define CONFIG_DISPLAY_FRAME_RATE			500
+#define CONFIG_DISPLAY_TRANSITION_MS		250
+#define CONFIG_CLOCK_SNTP					1
+#define CONFIG_CLOCK_SNTP_SERVER			"pool.ntp.org"
+#define CONFIG_CLOCK_SNTP_SAMPLES			4
+#define CONFIG_CLOCK_SNTP_INTERVAL			60
+#define CONFIG_CLOCK_RTC_TRIM				1
+
+#endif /* HOST_SDKCONFIG_H_ */
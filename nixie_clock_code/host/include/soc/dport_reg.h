@@ -0,0 +1,19 @@
+/**
+@file dport_reg.h
+@brief Host simulation stand-in for ESP-IDF's soc/dport_reg.h
+
+Peripheral clock gating has no meaning in the simulation.
+*/
+
+#ifndef HOST_SOC_DPORT_REG_H_
+#define HOST_SOC_DPORT_REG_H_
+
+#define DPORT_PERIP_CLK_EN_REG					0
+#define DPORT_PERIP_RST_EN_REG					0
+#define DPORT_RMT_CLK_EN						(1<<9)
+#define DPORT_RMT_RST							(1<<9)
+
+#define DPORT_SET_PERI_REG_MASK(reg, mask)		do { (void)(reg); (void)(mask); } while(0)
+#define DPORT_CLEAR_PERI_REG_MASK(reg, mask)	do { (void)(reg); (void)(mask); } while(0)
+
+#endif /* HOST_SOC_DPORT_REG_H_ */
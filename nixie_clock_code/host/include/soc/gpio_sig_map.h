@@ -0,0 +1,12 @@
+/**
+@file gpio_sig_map.h
+@brief Host simulation stand-in for ESP-IDF's soc/gpio_sig_map.h
+*/
+
+#ifndef HOST_SOC_GPIO_SIG_MAP_H_
+#define HOST_SOC_GPIO_SIG_MAP_H_
+
+#define RMT_SIG_OUT0_IDX						87
+#define SIG_GPIO_OUT_IDX						256
+
+#endif /* HOST_SOC_GPIO_SIG_MAP_H_ */
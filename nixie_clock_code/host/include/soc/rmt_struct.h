@@ -0,0 +1,139 @@
+/**
+@file rmt_struct.h
+@brief Host simulation stand-in for ESP-IDF's soc/rmt_struct.h
+
+The register block only carries the fields the WS2812 driver touches. The
+simulated RMT peripheral (sim_periph.c) watches tx_start, plays the channel
+memory back and raises the threshold and end interrupts like the hardware.
+*/
+
+#ifndef HOST_SOC_RMT_STRUCT_H_
+#define HOST_SOC_RMT_STRUCT_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef union {
+	struct {
+			uint32_t ch0_tx_end: 1;
+			uint32_t ch0_rx_end: 1;
+			uint32_t ch0_err: 1;
+			uint32_t ch1_tx_end: 1;
+			uint32_t ch1_rx_end: 1;
+			uint32_t ch1_err: 1;
+			uint32_t ch2_tx_end: 1;
+			uint32_t ch2_rx_end: 1;
+			uint32_t ch2_err: 1;
+			uint32_t ch3_tx_end: 1;
+			uint32_t ch3_rx_end: 1;
+			uint32_t ch3_err: 1;
+			uint32_t ch4_tx_end: 1;
+			uint32_t ch4_rx_end: 1;
+			uint32_t ch4_err: 1;
+			uint32_t ch5_tx_end: 1;
+			uint32_t ch5_rx_end: 1;
+			uint32_t ch5_err: 1;
+			uint32_t ch6_tx_end: 1;
+			uint32_t ch6_rx_end: 1;
+			uint32_t ch6_err: 1;
+			uint32_t ch7_tx_end: 1;
+			uint32_t ch7_rx_end: 1;
+			uint32_t ch7_err: 1;
+			uint32_t ch0_tx_thr_event: 1;
+			uint32_t ch1_tx_thr_event: 1;
+			uint32_t ch2_tx_thr_event: 1;
+			uint32_t ch3_tx_thr_event: 1;
+			uint32_t ch4_tx_thr_event: 1;
+			uint32_t ch5_tx_thr_event: 1;
+			uint32_t ch6_tx_thr_event: 1;
+			uint32_t ch7_tx_thr_event: 1;
+	};
+	uint32_t val;
+} rmt_int_reg_t;
+
+typedef volatile struct rmt_dev_s {
+	uint32_t data_ch[8];
+	struct {
+		union {
+			struct {
+				uint32_t div_cnt: 8;
+				uint32_t idle_thres: 16;
+				uint32_t mem_size: 4;
+				uint32_t carrier_en: 1;
+				uint32_t carrier_out_lv: 1;
+				uint32_t mem_pd: 1;
+				uint32_t clk_en: 1;
+			};
+			uint32_t val;
+		} conf0;
+		union {
+			struct {
+				uint32_t tx_start: 1;
+				uint32_t rx_en: 1;
+				uint32_t mem_wr_rst: 1;
+				uint32_t mem_rd_rst: 1;
+				uint32_t apb_mem_rst: 1;
+				uint32_t mem_owner: 1;
+				uint32_t tx_conti_mode: 1;
+				uint32_t rx_filter_en: 1;
+				uint32_t rx_filter_thres: 8;
+				uint32_t ref_cnt_rst: 1;
+				uint32_t ref_always_on: 1;
+				uint32_t idle_out_lv: 1;
+				uint32_t idle_out_en: 1;
+				uint32_t reserved20: 12;
+			};
+			uint32_t val;
+		} conf1;
+	} conf_ch[8];
+	rmt_int_reg_t int_raw;
+	rmt_int_reg_t int_st;
+	rmt_int_reg_t int_ena;
+	rmt_int_reg_t int_clr;
+	union {
+		struct {
+			uint32_t limit: 9;
+			uint32_t reserved9: 23;
+		};
+		uint32_t val;
+	} tx_lim_ch[8];
+	union {
+		struct {
+			uint32_t fifo_mask: 1;
+			uint32_t mem_tx_wrap_en: 1;
+			uint32_t reserved2: 30;
+		};
+		uint32_t val;
+	} apb_conf;
+} rmt_dev_t;
+
+extern rmt_dev_t RMT;
+
+typedef struct {
+	union {
+		struct {
+			uint32_t duration0 :15;
+			uint32_t level0 :1;
+			uint32_t duration1 :15;
+			uint32_t level1 :1;
+		};
+		uint32_t val;
+	};
+} rmt_item32_t;
+
+typedef volatile struct rmt_mem_s {
+	struct {
+		rmt_item32_t data32[64];
+	} chan[8];
+} rmt_mem_t;
+
+extern rmt_mem_t RMTMEM;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_SOC_RMT_STRUCT_H_ */
@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim.h
+@author Tony Pottier
+@brief Host simulation of the clock: simulated time, devices and statistics
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The host build runs the firmware modules unmodified on top of thin ESP-IDF and
+FreeRTOS stand-ins (see the include folder). Time is simulated: a scheduler only
+moves the clock forward once every task is blocked, jumping straight to the next
+event (a DS3231 SQW edge, a task timeout...). This is how a year of clock_tick
+can be soak tested in minutes. An optional speed factor paces the simulation
+against the wall clock instead.
+
+*/
+
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_US_PER_SECOND				1000000LL
+
+/** @brief sentinel for a device or task with nothing scheduled */
+#define SIM_NEVER						INT64_MAX
+
+/** @brief heap size reported as free at boot, roughly what is left to an esp32 app */
+#define SIM_HEAP_SIZE					(300 * 1024)
+
+/**
+ * @brief a simulated peripheral.
+ * next_event returns the simulated time of its next spontaneous event, fire is called when that time is reached.
+ * poll gives the device a chance to react to register writes once all tasks are blocked; it returns true if it did something.
+ * All callbacks run on the scheduler thread, which plays the role of interrupt context.
+ */
+typedef struct sim_device_t{
+	const char *name;
+	int64_t (*next_event)(void);
+	void (*fire)(int64_t now);
+	bool (*poll)(void);
+	struct sim_device_t *next;
+}sim_device_t;
+
+typedef struct sim_heap_stats_t{
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes_allocated;
+	int64_t live_bytes;
+	int64_t peak_bytes;
+}sim_heap_stats_t;
+
+typedef struct sim_http_stats_t{
+	uint64_t requests;
+	uint64_t cycles;						/**< bursts of requests, e.g. a time API call and the transitions call it triggers */
+	uint64_t handshakes;
+	uint64_t dns_lookups;
+	uint64_t stale;							/**< requests sent on a connection the server had closed */
+	int64_t busy_us;						/**< time spent in esp_http_client_perform */
+	int64_t heap_peak;						/**< most heap used by a request */
+}sim_http_stats_t;
+
+
+/* scheduler -- sim_freertos.c */
+int64_t sim_now(void);
+void sim_register_device(sim_device_t *dev);
+void sim_run(int64_t until, double speed);
+bool sim_in_task(void);
+void sim_sleep(int64_t us);
+double sim_task_cpu_seconds(const char *name);
+void sim_print_tasks(FILE *f);
+
+/* reference time: what a perfect clock would read */
+void sim_set_epoch(time_t utc);
+time_t sim_true_utc(void);
+int64_t sim_true_utc_us(void);
+
+/* heap accounting -- sim_esp.c */
+void sim_heap_get_stats(sim_heap_stats_t *stats);
+/* allocations of the calling thread are not accounted: the simulated servers are not part of the clock */
+void sim_heap_set_untracked(bool untracked);
+/* highest heap use since sim_heap_window_start, above the use at that time */
+void sim_heap_window_start(void);
+int64_t sim_heap_window_peak(void);
+
+/* gpio, spi, rmt, ledc, timers -- sim_periph.c */
+void sim_periph_init(void);
+void sim_gpio_raise_isr(int gpio_num);
+int sim_gpio_get_output(int gpio_num);
+/* called from gpio_set_level with the new level: lets a device follow a line driven by hand */
+void sim_gpio_set_level_hook(int gpio_num, void (*hook)(int level));
+/* a device pulling an open drain line down: gpio_get_level reads 0 whatever is driven */
+void sim_gpio_hold_low(int gpio_num, bool low);
+uint64_t sim_spi_frames(void);
+void sim_spi_last_frame(uint16_t words[], int count);
+uint64_t sim_rmt_frames(void);
+uint64_t sim_rmt_interrupts(void);
+size_t sim_rmt_last_frame(uint8_t *grb, size_t len);
+double sim_ledc_output_level(int gpio_num);
+uint64_t sim_ledc_fades(void);
+uint64_t sim_timer_alarms(void);
+
+/* i2c bus and ds3231 -- sim_ds3231.c */
+void sim_ds3231_init(time_t utc, bool valid);
+void sim_ds3231_set_ppm(double ppm);
+/* frequency error left once the aging offset register is applied */
+double sim_ds3231_get_ppm(void);
+int8_t sim_ds3231_get_aging(void);
+time_t sim_ds3231_get_time(void);
+/* time of the DS3231 including the fraction of the current second */
+int64_t sim_ds3231_get_time_us(void);
+uint64_t sim_i2c_transactions(void);
+/* command links created, each one a heap allocation plus one per queued command */
+uint64_t sim_i2c_links(void);
+uint64_t sim_ds3231_sqw_edges(void);
+/* one edge of the square wave in every period_us never reaches the ESP32 */
+void sim_ds3231_drop_edges(int64_t period_us);
+uint64_t sim_ds3231_dropped_edges(void);
+/* from that simulated time the DS3231 hangs the bus, holding SDA low until it is given a few clocks */
+void sim_i2c_hang_at(int64_t us);
+
+/* nvs -- sim_nvs.c */
+uint64_t sim_nvs_bytes_written(void);
+uint64_t sim_nvs_commits(void);
+
+/* http client and server -- sim_http.c */
+void sim_http_set_network(bool online);
+void sim_http_get_stats(sim_http_stats_t *stats);
+int sim_httpd_request(int method, const char *uri, const char *body, char *response, size_t response_len);
+
+/* udp sockets and ntp server -- sim_ntp.c */
+void sim_ntp_set_network(bool online);
+void sim_ntp_set_jitter(int64_t jitter_us);
+void sim_ntp_set_kiss(const char *code);
+uint64_t sim_ntp_requests(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_SIM_H_ */
@@ -0,0 +1,499 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_ds3231.c
+@author Tony Pottier
+@brief Simulated I2C bus and DS3231 real time clock for the host build
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Command links are built exactly like the ESP-IDF driver builds them (one heap
+allocation per queued command) and replayed against a register level model of
+the DS3231 when i2c_master_cmd_begin is called. The calling task is blocked
+for the time the transfer takes on a 400kHz bus, and each byte written reaches
+the DS3231 at the time it is acknowledged within the transfer.
+
+The DS3231 model keeps its own count of seconds. Its oscillator can be given a
+frequency error in ppm, which the aging offset register trims by about 0.1ppm
+per LSB, and writing the seconds register resets the countdown chain like the
+real chip does. Each second rollover raises the SQW interrupt when the 1Hz
+square wave is enabled.
+
+A hang of the bus can be scheduled: the DS3231 then holds SDA low as if it had
+lost track of a read, every transfer times out, and it only lets go once SCL
+has been clocked by hand a few times. Edges of the square wave can also be
+lost on their way to the ESP32, as a glitch on the SQW line would.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "driver/i2c.h"
+#include "esp_err.h"
+
+#include "sim.h"
+
+
+#define SIM_DS3231_ADDR					0x68
+#define SIM_DS3231_REGISTERS			0x13
+#define SIM_DS3231_SQW_GPIO				4
+#define SIM_I2C_SDA_GPIO				21
+#define SIM_I2C_SCL_GPIO				22
+#define SIM_I2C_FREQ_HZ					400000
+
+#define SIM_DS3231_CONTROL				0x0E
+#define SIM_DS3231_STATUS				0x0F
+#define SIM_DS3231_AGING				0x10
+#define SIM_DS3231_TEMP_MSB				0x11
+#define SIM_DS3231_TEMP_LSB				0x12
+
+#define SIM_DS3231_CONTROL_INTCN		(1<<2)
+#define SIM_DS3231_CONTROL_RS			(3<<3)
+#define SIM_DS3231_CONTROL_CONV			(1<<5)
+#define SIM_DS3231_STATUS_BSY			(1<<2)
+
+/** @brief clocks a hung DS3231 needs to shift out the rest of the byte it was sending */
+#define SIM_I2C_HANG_CLOCKS				5
+
+/** @brief a temperature conversion takes 125ms typical, 200ms max */
+#define SIM_DS3231_CONVERSION_US		(150 * 1000)
+
+typedef enum sim_i2c_op_type_t{
+	SIM_I2C_OP_START,
+	SIM_I2C_OP_WRITE,
+	SIM_I2C_OP_READ,
+	SIM_I2C_OP_STOP
+}sim_i2c_op_type_t;
+
+typedef struct sim_i2c_op_t{
+	sim_i2c_op_type_t type;
+	uint8_t byte;
+	const uint8_t *write_data;
+	uint8_t *read_data;
+	size_t len;
+	bool ack_en;
+	i2c_ack_type_t ack;
+	struct sim_i2c_op_t *next;
+}sim_i2c_op_t;
+
+typedef struct sim_i2c_cmd_t{
+	sim_i2c_op_t *first;
+	sim_i2c_op_t *last;
+}sim_i2c_cmd_t;
+
+static pthread_mutex_t sim_ds3231_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool sim_i2c_installed[I2C_NUM_MAX] = { false };
+static uint64_t sim_i2c_transaction_count = 0;
+static uint64_t sim_i2c_link_count = 0;
+static int64_t sim_i2c_hang = SIM_NEVER;
+static bool sim_i2c_hung = false;
+static int sim_i2c_hang_clocks = 0;
+
+static uint8_t sim_ds3231_regs[SIM_DS3231_REGISTERS];
+/** @brief register pointer: kept from one transaction to the next, like the chip does */
+static uint8_t sim_ds3231_pointer = 0;
+static time_t sim_ds3231_seconds = 0;
+static int64_t sim_ds3231_next_edge = SIM_US_PER_SECOND;
+static int64_t sim_ds3231_conv_done = 0;
+static double sim_ds3231_ppm = 0.0;
+static uint64_t sim_ds3231_edge_count = 0;
+static int64_t sim_ds3231_drop_period = 0;
+static int64_t sim_ds3231_next_drop = SIM_NEVER;
+static uint64_t sim_ds3231_dropped_count = 0;
+static sim_device_t sim_ds3231_device;
+
+
+
+static uint8_t sim_dec2bcd(int val){
+	return (uint8_t)(((val / 10) << 4) | (val % 10));
+}
+
+static int sim_bcd2dec(uint8_t val){
+	return ((val >> 4) * 10) + (val & 0x0f);
+}
+
+/** @brief length of a second as measured by the DS3231 oscillator, in simulated microseconds */
+static int64_t sim_ds3231_period(void){
+	double ppm = sim_ds3231_ppm - 0.1 * (double)(int8_t)sim_ds3231_regs[SIM_DS3231_AGING];
+	return (int64_t)llround((double)SIM_US_PER_SECOND / (1.0 + ppm * 1e-6));
+}
+
+/** @brief die temperature: a slow daily swing around 24C, quantized to 0.25C like the chip */
+static void sim_ds3231_convert(int64_t now){
+	double t = 24.0 + 2.0 * sin(2.0 * M_PI * (double)now / (86400.0 * SIM_US_PER_SECOND));
+	int16_t q = (int16_t)lround(t * 4.0);
+	sim_ds3231_regs[SIM_DS3231_TEMP_MSB] = (uint8_t)(q >> 2);
+	sim_ds3231_regs[SIM_DS3231_TEMP_LSB] = (uint8_t)((q & 0x03) << 6);
+}
+
+static void sim_ds3231_latch_time(void){
+	struct tm tm;
+	gmtime_r(&sim_ds3231_seconds, &tm);
+	sim_ds3231_regs[0x00] = sim_dec2bcd(tm.tm_sec);
+	sim_ds3231_regs[0x01] = sim_dec2bcd(tm.tm_min);
+	sim_ds3231_regs[0x02] = sim_dec2bcd(tm.tm_hour);
+	sim_ds3231_regs[0x03] = (uint8_t)(tm.tm_wday + 1);
+	sim_ds3231_regs[0x04] = sim_dec2bcd(tm.tm_mday);
+	sim_ds3231_regs[0x05] = sim_dec2bcd(tm.tm_mon + 1) | (tm.tm_year >= 100 ? 0x80 : 0x00);
+	sim_ds3231_regs[0x06] = sim_dec2bcd(tm.tm_year % 100);
+}
+
+static void sim_ds3231_parse_time(void){
+	struct tm tm;
+	memset(&tm, 0x00, sizeof(tm));
+	tm.tm_sec = sim_bcd2dec(sim_ds3231_regs[0x00] & 0x7f);
+	tm.tm_min = sim_bcd2dec(sim_ds3231_regs[0x01] & 0x7f);
+	tm.tm_hour = sim_bcd2dec(sim_ds3231_regs[0x02] & 0x3f);
+	tm.tm_mday = sim_bcd2dec(sim_ds3231_regs[0x04]);
+	tm.tm_mon = sim_bcd2dec(sim_ds3231_regs[0x05] & 0x1f) - 1;
+	tm.tm_year = sim_bcd2dec(sim_ds3231_regs[0x06]) + ((sim_ds3231_regs[0x05] & 0x80) ? 100 : 0);
+	sim_ds3231_seconds = timegm(&tm);
+}
+
+static uint8_t sim_ds3231_read(uint8_t reg, int64_t now){
+
+	if(reg <= 0x06){
+		sim_ds3231_latch_time();
+	}
+	else if(reg == SIM_DS3231_CONTROL || reg == SIM_DS3231_STATUS){
+		if(sim_ds3231_conv_done && now >= sim_ds3231_conv_done){
+			sim_ds3231_convert(now);
+			sim_ds3231_regs[SIM_DS3231_CONTROL] &= ~SIM_DS3231_CONTROL_CONV;
+			sim_ds3231_regs[SIM_DS3231_STATUS] &= ~SIM_DS3231_STATUS_BSY;
+			sim_ds3231_conv_done = 0;
+		}
+	}
+	else if(reg == SIM_DS3231_TEMP_MSB && sim_ds3231_conv_done == 0){
+		/* automatic conversion every 64 seconds */
+		sim_ds3231_convert((now / (64 * SIM_US_PER_SECOND)) * (64 * SIM_US_PER_SECOND));
+	}
+
+	return sim_ds3231_regs[reg];
+}
+
+static void sim_ds3231_write(uint8_t reg, uint8_t value, int64_t now){
+
+	sim_ds3231_regs[reg] = value;
+
+	if(reg <= 0x06){
+		sim_ds3231_parse_time();
+		if(reg == 0x00){
+			/* the countdown chain is reset whenever the seconds register is written */
+			sim_ds3231_next_edge = now + sim_ds3231_period();
+		}
+	}
+	else if(reg == SIM_DS3231_CONTROL && (value & SIM_DS3231_CONTROL_CONV) && sim_ds3231_conv_done == 0){
+		sim_ds3231_regs[SIM_DS3231_STATUS] |= SIM_DS3231_STATUS_BSY;
+		sim_ds3231_conv_done = now + SIM_DS3231_CONVERSION_US;
+	}
+}
+
+void sim_ds3231_init(time_t utc, bool valid){
+	memset(sim_ds3231_regs, 0x00, sizeof(sim_ds3231_regs));
+	sim_ds3231_regs[SIM_DS3231_CONTROL] = 0x1C; /* POR value: SQW disabled */
+	sim_ds3231_convert(0);
+
+	if(valid){
+		sim_ds3231_seconds = utc;
+	}
+	else{
+		/* lost power: registers read 00-01-01 00:00:00 with the century bit cleared, i.e. 1900 */
+		struct tm tm = { .tm_year = 0, .tm_mon = 0, .tm_mday = 1 };
+		sim_ds3231_seconds = timegm(&tm);
+	}
+	sim_ds3231_next_edge = sim_now() + SIM_US_PER_SECOND;
+	sim_register_device(&sim_ds3231_device);
+}
+
+void sim_ds3231_set_ppm(double ppm){
+	sim_ds3231_ppm = ppm;
+}
+
+double sim_ds3231_get_ppm(void){
+	pthread_mutex_lock(&sim_ds3231_lock);
+	double ppm = sim_ds3231_ppm - 0.1 * (double)(int8_t)sim_ds3231_regs[SIM_DS3231_AGING];
+	pthread_mutex_unlock(&sim_ds3231_lock);
+	return ppm;
+}
+
+int8_t sim_ds3231_get_aging(void){
+	return (int8_t)sim_ds3231_regs[SIM_DS3231_AGING];
+}
+
+time_t sim_ds3231_get_time(void){
+	return sim_ds3231_seconds;
+}
+
+int64_t sim_ds3231_get_time_us(void){
+	pthread_mutex_lock(&sim_ds3231_lock);
+	int64_t period = sim_ds3231_period();
+	int64_t elapsed = sim_now() - (sim_ds3231_next_edge - period);
+	int64_t t = (int64_t)sim_ds3231_seconds * SIM_US_PER_SECOND + elapsed * SIM_US_PER_SECOND / period;
+	pthread_mutex_unlock(&sim_ds3231_lock);
+	return t;
+}
+
+uint64_t sim_ds3231_sqw_edges(void){
+	return sim_ds3231_edge_count;
+}
+
+void sim_ds3231_drop_edges(int64_t period_us){
+	sim_ds3231_drop_period = period_us;
+	sim_ds3231_next_drop = period_us > 0 ? sim_now() + period_us : SIM_NEVER;
+}
+
+uint64_t sim_ds3231_dropped_edges(void){
+	return sim_ds3231_dropped_count;
+}
+
+uint64_t sim_i2c_transactions(void){
+	return sim_i2c_transaction_count;
+}
+
+uint64_t sim_i2c_links(void){
+	return sim_i2c_link_count;
+}
+
+/** @brief rising edges of SCL driven by hand: one more bit of the stuck byte shifted out */
+static void sim_i2c_scl_hook(int level){
+	pthread_mutex_lock(&sim_ds3231_lock);
+	if(sim_i2c_hung && level && --sim_i2c_hang_clocks <= 0){
+		sim_i2c_hung = false;
+		sim_gpio_hold_low(SIM_I2C_SDA_GPIO, false);
+	}
+	pthread_mutex_unlock(&sim_ds3231_lock);
+}
+
+void sim_i2c_hang_at(int64_t us){
+	pthread_mutex_lock(&sim_ds3231_lock);
+	sim_i2c_hang = us;
+	pthread_mutex_unlock(&sim_ds3231_lock);
+	sim_gpio_set_level_hook(SIM_I2C_SCL_GPIO, sim_i2c_scl_hook);
+}
+
+static int64_t sim_ds3231_next_event(void){
+	return sim_ds3231_next_edge;
+}
+
+static void sim_ds3231_fire(int64_t now){
+	bool sqw;
+
+	pthread_mutex_lock(&sim_ds3231_lock);
+	sim_ds3231_seconds++;
+	sim_ds3231_next_edge += sim_ds3231_period();
+	sqw = (sim_ds3231_regs[SIM_DS3231_CONTROL] & (SIM_DS3231_CONTROL_INTCN | SIM_DS3231_CONTROL_RS)) == 0;
+	pthread_mutex_unlock(&sim_ds3231_lock);
+
+	if(sqw && now >= sim_ds3231_next_drop){
+		sim_ds3231_next_drop += sim_ds3231_drop_period;
+		sim_ds3231_dropped_count++;
+	}
+	else if(sqw){
+		sim_ds3231_edge_count++;
+		sim_gpio_raise_isr(SIM_DS3231_SQW_GPIO);
+	}
+}
+
+static sim_device_t sim_ds3231_device = {
+	.name = "ds3231",
+	.next_event = sim_ds3231_next_event,
+	.fire = sim_ds3231_fire,
+	.poll = NULL
+};
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* I2C driver                                                                                                       */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+esp_err_t i2c_param_config(i2c_port_t i2c_num, const i2c_config_t *i2c_conf){
+	if(i2c_num < 0 || i2c_num >= I2C_NUM_MAX || i2c_conf == NULL) return ESP_ERR_INVALID_ARG;
+	return ESP_OK;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t i2c_num, i2c_mode_t mode, size_t slv_rx_buf_len, size_t slv_tx_buf_len, int intr_alloc_flags){
+	if(i2c_num < 0 || i2c_num >= I2C_NUM_MAX) return ESP_ERR_INVALID_ARG;
+	if(sim_i2c_installed[i2c_num]) return ESP_FAIL;
+	sim_i2c_installed[i2c_num] = true;
+	return ESP_OK;
+}
+
+esp_err_t i2c_driver_delete(i2c_port_t i2c_num){
+	if(i2c_num < 0 || i2c_num >= I2C_NUM_MAX) return ESP_ERR_INVALID_ARG;
+	sim_i2c_installed[i2c_num] = false;
+	return ESP_OK;
+}
+
+i2c_cmd_handle_t i2c_cmd_link_create(void){
+	sim_i2c_link_count++;
+	return (i2c_cmd_handle_t)calloc(1, sizeof(sim_i2c_cmd_t));
+}
+
+void i2c_cmd_link_delete(i2c_cmd_handle_t cmd_handle){
+	sim_i2c_cmd_t *cmd = (sim_i2c_cmd_t*)cmd_handle;
+	if(cmd == NULL) return;
+	sim_i2c_op_t *op = cmd->first;
+	while(op){
+		sim_i2c_op_t *next = op->next;
+		free(op);
+		op = next;
+	}
+	free(cmd);
+}
+
+static esp_err_t sim_i2c_append(i2c_cmd_handle_t cmd_handle, sim_i2c_op_t op){
+	sim_i2c_cmd_t *cmd = (sim_i2c_cmd_t*)cmd_handle;
+	if(cmd == NULL) return ESP_ERR_INVALID_ARG;
+
+	sim_i2c_op_t *node = malloc(sizeof(sim_i2c_op_t));
+	if(node == NULL) return ESP_ERR_NO_MEM;
+	*node = op;
+	node->next = NULL;
+
+	if(cmd->last) cmd->last->next = node;
+	else cmd->first = node;
+	cmd->last = node;
+
+	return ESP_OK;
+}
+
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd_handle){
+	return sim_i2c_append(cmd_handle, (sim_i2c_op_t){ .type = SIM_I2C_OP_START });
+}
+
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd_handle){
+	return sim_i2c_append(cmd_handle, (sim_i2c_op_t){ .type = SIM_I2C_OP_STOP });
+}
+
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd_handle, uint8_t data, bool ack_en){
+	return sim_i2c_append(cmd_handle, (sim_i2c_op_t){ .type = SIM_I2C_OP_WRITE, .byte = data, .len = 1, .ack_en = ack_en });
+}
+
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd_handle, const uint8_t *data, size_t data_len, bool ack_en){
+	if(data == NULL || data_len == 0) return ESP_ERR_INVALID_ARG;
+	/* esp-idf 4.4+: a single byte is copied into the link like i2c_master_write_byte, longer writes are pointed to */
+	if(data_len == 1) return i2c_master_write_byte(cmd_handle, data[0], ack_en);
+	return sim_i2c_append(cmd_handle, (sim_i2c_op_t){ .type = SIM_I2C_OP_WRITE, .write_data = data, .len = data_len, .ack_en = ack_en });
+}
+
+esp_err_t i2c_master_read_byte(i2c_cmd_handle_t cmd_handle, uint8_t *data, i2c_ack_type_t ack){
+	return sim_i2c_append(cmd_handle, (sim_i2c_op_t){ .type = SIM_I2C_OP_READ, .read_data = data, .len = 1, .ack = ack });
+}
+
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd_handle, uint8_t *data, size_t data_len, i2c_ack_type_t ack){
+	if(data == NULL || data_len == 0) return ESP_ERR_INVALID_ARG;
+	return sim_i2c_append(cmd_handle, (sim_i2c_op_t){ .type = SIM_I2C_OP_READ, .read_data = data, .len = data_len, .ack = ack });
+}
+
+esp_err_t i2c_master_cmd_begin(i2c_port_t i2c_num, i2c_cmd_handle_t cmd_handle, TickType_t ticks_to_wait){
+
+	sim_i2c_cmd_t *cmd = (sim_i2c_cmd_t*)cmd_handle;
+	if(i2c_num < 0 || i2c_num >= I2C_NUM_MAX || cmd == NULL) return ESP_ERR_INVALID_ARG;
+	if(!sim_i2c_installed[i2c_num]) return ESP_ERR_INVALID_STATE;
+
+	esp_err_t ret = ESP_OK;
+	unsigned int bits = 0;
+	bool expect_address = false;
+	bool selected = false;
+	bool reading = false;
+	bool expect_pointer = false;
+	int64_t now = sim_now();
+
+	pthread_mutex_lock(&sim_ds3231_lock);
+	sim_i2c_transaction_count++;
+	if(now >= sim_i2c_hang){
+		sim_i2c_hang = SIM_NEVER;
+		sim_i2c_hung = true;
+		sim_i2c_hang_clocks = SIM_I2C_HANG_CLOCKS;
+		sim_gpio_hold_low(SIM_I2C_SDA_GPIO, true);
+	}
+	if(sim_i2c_hung){
+		/* SDA stuck low: the master never gets its START through and gives up at the timeout */
+		pthread_mutex_unlock(&sim_ds3231_lock);
+		if(sim_in_task()){
+			sim_sleep((int64_t)ticks_to_wait * portTICK_PERIOD_MS * 1000);
+		}
+		return ESP_ERR_TIMEOUT;
+	}
+	uint8_t pointer = sim_ds3231_pointer;
+
+	for(sim_i2c_op_t *op = cmd->first; op != NULL && ret == ESP_OK; op = op->next){
+		switch(op->type){
+			case SIM_I2C_OP_START:
+				bits += 2;
+				expect_address = true;
+				break;
+
+			case SIM_I2C_OP_STOP:
+				bits += 2;
+				selected = false;
+				break;
+
+			case SIM_I2C_OP_WRITE:
+				for(size_t i = 0; i < op->len && ret == ESP_OK; i++){
+					uint8_t b = op->write_data ? op->write_data[i] : op->byte;
+					bits += 9;
+					if(expect_address){
+						expect_address = false;
+						selected = (b >> 1) == SIM_DS3231_ADDR;
+						reading = (b & 0x01) == I2C_MASTER_READ;
+						expect_pointer = !reading;
+						if(!selected && op->ack_en) ret = ESP_FAIL; /* address NACK */
+					}
+					else if(selected && !reading){
+						if(expect_pointer){
+							pointer = b % SIM_DS3231_REGISTERS;
+							expect_pointer = false;
+						}
+						else{
+							/* the DS3231 takes a byte when it acknowledges it */
+							sim_ds3231_write(pointer, b, now + ((int64_t)bits * SIM_US_PER_SECOND) / SIM_I2C_FREQ_HZ);
+							pointer = (pointer + 1) % SIM_DS3231_REGISTERS;
+						}
+					}
+				}
+				break;
+
+			case SIM_I2C_OP_READ:
+				for(size_t i = 0; i < op->len; i++){
+					bits += 9;
+					op->read_data[i] = (selected && reading) ? sim_ds3231_read(pointer, now) : 0xff;
+					pointer = (pointer + 1) % SIM_DS3231_REGISTERS;
+				}
+				break;
+		}
+	}
+	sim_ds3231_pointer = pointer;
+	pthread_mutex_unlock(&sim_ds3231_lock);
+
+	/* the driver blocks the caller for the duration of the transfer */
+	if(sim_in_task()){
+		sim_sleep(((int64_t)bits * SIM_US_PER_SECOND) / SIM_I2C_FREQ_HZ);
+	}
+
+	return ret;
+}
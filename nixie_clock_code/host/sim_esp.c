@@ -0,0 +1,245 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_esp.c
+@author Tony Pottier
+@brief ESP-IDF system services for the host simulation: logging, errors, heap and timer
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The host build links with -Wl,--wrap=malloc (and friends) so every allocation
+made by the firmware modules is accounted for. This is what the heap churn
+figures of the soak test report are based on.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp32/rom/ets_sys.h"
+#include "nvs.h"
+#include "esp_http_client.h"
+
+#include "sim.h"
+
+
+/** @brief every block handed out by the wrapped allocator is prefixed by this header */
+typedef struct sim_heap_header_t{
+	uint64_t magic;
+	uint64_t size;
+}sim_heap_header_t;
+
+#define SIM_HEAP_MAGIC					0x4e49584945484541ULL
+
+/** @brief blocks of the simulated servers: freed like the others but never accounted */
+#define SIM_HEAP_MAGIC_UNTRACKED		0x4e49584945484555ULL
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static uint64_t sim_heap_allocs = 0;
+static uint64_t sim_heap_frees = 0;
+static uint64_t sim_heap_bytes_allocated = 0;
+static int64_t sim_heap_live = 0;
+static int64_t sim_heap_peak = 0;
+static int64_t sim_heap_window_base = 0;
+static int64_t sim_heap_window_max = 0;
+static __thread bool sim_heap_thread_untracked = false;
+
+static esp_log_level_t sim_log_level = CONFIG_LOG_DEFAULT_LEVEL;
+
+
+
+static void sim_heap_account(int64_t delta){
+	if(delta > 0){
+		__atomic_add_fetch(&sim_heap_allocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&sim_heap_bytes_allocated, (uint64_t)delta, __ATOMIC_RELAXED);
+	}
+	else{
+		__atomic_add_fetch(&sim_heap_frees, 1, __ATOMIC_RELAXED);
+	}
+	int64_t live = __atomic_add_fetch(&sim_heap_live, delta, __ATOMIC_RELAXED);
+	int64_t peak = __atomic_load_n(&sim_heap_peak, __ATOMIC_RELAXED);
+	while(live > peak && !__atomic_compare_exchange_n(&sim_heap_peak, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	int64_t window = __atomic_load_n(&sim_heap_window_max, __ATOMIC_RELAXED);
+	while(live > window && !__atomic_compare_exchange_n(&sim_heap_window_max, &window, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void *__wrap_malloc(size_t size){
+	sim_heap_header_t *h = __real_malloc(sizeof(sim_heap_header_t) + size);
+	if(h == NULL) return NULL;
+	h->size = size;
+	if(sim_heap_thread_untracked){
+		h->magic = SIM_HEAP_MAGIC_UNTRACKED;
+		return h + 1;
+	}
+	h->magic = SIM_HEAP_MAGIC;
+	sim_heap_account((int64_t)size);
+	return h + 1;
+}
+
+void __wrap_free(void *ptr){
+	if(ptr == NULL) return;
+	sim_heap_header_t *h = ((sim_heap_header_t*)ptr) - 1;
+	if(h->magic == SIM_HEAP_MAGIC_UNTRACKED){
+		h->magic = 0;
+		__real_free(h);
+		return;
+	}
+	if(h->magic != SIM_HEAP_MAGIC){
+		/* not ours: allocated from within libc */
+		__real_free(ptr);
+		return;
+	}
+	h->magic = 0;
+	sim_heap_account(-(int64_t)h->size);
+	__real_free(h);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size){
+	size_t total = nmemb * size;
+	void *p = __wrap_malloc(total);
+	if(p) memset(p, 0x00, total);
+	return p;
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+	if(ptr == NULL) return __wrap_malloc(size);
+	sim_heap_header_t *h = ((sim_heap_header_t*)ptr) - 1;
+	if(h->magic != SIM_HEAP_MAGIC && h->magic != SIM_HEAP_MAGIC_UNTRACKED) return __real_realloc(ptr, size);
+
+	void *p = __wrap_malloc(size);
+	if(p == NULL) return NULL;
+	memcpy(p, ptr, h->size < size ? h->size : size);
+	__wrap_free(ptr);
+	return p;
+}
+
+void sim_heap_get_stats(sim_heap_stats_t *stats){
+	stats->allocs = __atomic_load_n(&sim_heap_allocs, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&sim_heap_frees, __ATOMIC_RELAXED);
+	stats->bytes_allocated = __atomic_load_n(&sim_heap_bytes_allocated, __ATOMIC_RELAXED);
+	stats->live_bytes = __atomic_load_n(&sim_heap_live, __ATOMIC_RELAXED);
+	stats->peak_bytes = __atomic_load_n(&sim_heap_peak, __ATOMIC_RELAXED);
+}
+
+void sim_heap_set_untracked(bool untracked){
+	sim_heap_thread_untracked = untracked;
+}
+
+void sim_heap_window_start(void){
+	int64_t live = __atomic_load_n(&sim_heap_live, __ATOMIC_RELAXED);
+	__atomic_store_n(&sim_heap_window_base, live, __ATOMIC_RELAXED);
+	__atomic_store_n(&sim_heap_window_max, live, __ATOMIC_RELAXED);
+}
+
+int64_t sim_heap_window_peak(void){
+	return __atomic_load_n(&sim_heap_window_max, __ATOMIC_RELAXED) - __atomic_load_n(&sim_heap_window_base, __ATOMIC_RELAXED);
+}
+
+uint32_t esp_get_free_heap_size(void){
+	int64_t live = __atomic_load_n(&sim_heap_live, __ATOMIC_RELAXED);
+	return live < SIM_HEAP_SIZE ? (uint32_t)(SIM_HEAP_SIZE - live) : 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void){
+	int64_t peak = __atomic_load_n(&sim_heap_peak, __ATOMIC_RELAXED);
+	return peak < SIM_HEAP_SIZE ? (uint32_t)(SIM_HEAP_SIZE - peak) : 0;
+}
+
+uint32_t esp_random(void){
+	/* xorshift32: runs are reproducible */
+	static uint32_t state = 0x2545f491;
+	uint32_t x = __atomic_load_n(&state, __ATOMIC_RELAXED);
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	__atomic_store_n(&state, x, __ATOMIC_RELAXED);
+	return x;
+}
+
+void esp_restart(void){
+	fprintf(stderr, "esp_restart() called at %.3f s of simulated time\n", (double)sim_now() / SIM_US_PER_SECOND);
+	exit(EXIT_FAILURE);
+}
+
+int64_t esp_timer_get_time(void){
+	return sim_now();
+}
+
+void ets_delay_us(uint32_t us){
+	if(sim_in_task()){
+		sim_sleep(us);
+	}
+}
+
+
+
+void esp_log_level_set(const char* tag, esp_log_level_t level){
+	/* the simulation does not keep per tag levels */
+	sim_log_level = level;
+}
+
+esp_log_level_t esp_log_level_get(void){
+	return sim_log_level;
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...){
+	static const char letters[] = "NEWIDV";
+	va_list args;
+
+	printf("%c (%lld) %s: ", letters[level], (long long)(sim_now() / 1000), tag);
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf("\n");
+}
+
+const char *esp_err_to_name(esp_err_t code){
+	switch(code){
+		case ESP_OK: return "ESP_OK";
+		case ESP_FAIL: return "ESP_FAIL";
+		case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+		case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+		case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+		case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+		case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+		case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+		case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+		case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+		case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+		case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+		case ESP_ERR_NVS_INVALID_HANDLE: return "ESP_ERR_NVS_INVALID_HANDLE";
+		case ESP_ERR_HTTP_CONNECT: return "ESP_ERR_HTTP_CONNECT";
+		case ESP_ERR_HTTP_EAGAIN: return "ESP_ERR_HTTP_EAGAIN";
+		default: return "UNKNOWN ERROR";
+	}
+}
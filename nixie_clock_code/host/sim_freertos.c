@@ -0,0 +1,680 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_freertos.c
+@author Tony Pottier
+@brief FreeRTOS stand-in for the host simulation, driven by simulated time
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Every FreeRTOS task is a POSIX thread. A single mutex protects all kernel
+objects, and each task blocks on its own condition variable. The scheduler
+(sim_run) waits until every task is blocked, then moves the simulated clock to
+the earliest pending event: a task timeout or a device event such as an SQW
+edge. Timeouts are therefore exact and deterministic however fast the host is.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "sim.h"
+
+
+#define SIM_TICK_US						(SIM_US_PER_SECOND / configTICK_RATE_HZ)
+
+/** @brief like the esp32 task watchdog: a task that keeps the simulated clock from moving for this long is reported */
+#define SIM_WATCHDOG_TIMEOUT_S			5
+
+typedef enum sim_notify_state_t{
+	SIM_NOTIFY_NONE = 0,
+	SIM_NOTIFY_WAITING = 1,
+	SIM_NOTIFY_RECEIVED = 2
+}sim_notify_state_t;
+
+typedef struct sim_task_t{
+	char name[16];
+	pthread_t thread;
+	pthread_cond_t cond;
+	TaskFunction_t code;
+	void *parameters;
+	void *stack;
+	UBaseType_t priority;
+	bool blocked;
+	int64_t wake_at;
+	const void *waiting_on;
+	uint32_t notify_value;
+	sim_notify_state_t notify_state;
+	clockid_t cpu_clock;
+	double cpu_seconds;
+	bool deleted;
+	struct sim_task_t *next;
+}sim_task_t;
+
+struct QueueDefinition{
+	uint8_t *storage;
+	UBaseType_t length;
+	UBaseType_t item_size;
+	UBaseType_t count;
+	UBaseType_t head;
+};
+
+static const char TAG[] = "sim";
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_quiescent = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t sim_critical;
+static pthread_once_t sim_critical_once = PTHREAD_ONCE_INIT;
+
+/** @brief number of tasks that are not blocked. Simulated time only moves forward when this reaches 0 */
+static int sim_running = 0;
+static sim_task_t *sim_tasks = NULL;
+static __thread sim_task_t *sim_current = NULL;
+static sim_device_t *sim_devices = NULL;
+
+static volatile int64_t sim_time = 0;
+static time_t sim_epoch = 0;
+
+
+
+int64_t sim_now(void){
+	return __atomic_load_n(&sim_time, __ATOMIC_ACQUIRE);
+}
+
+void sim_set_epoch(time_t utc){
+	sim_epoch = utc;
+}
+
+time_t sim_true_utc(void){
+	return sim_epoch + (time_t)(sim_now() / SIM_US_PER_SECOND);
+}
+
+int64_t sim_true_utc_us(void){
+	return (int64_t)sim_epoch * SIM_US_PER_SECOND + sim_now();
+}
+
+bool sim_in_task(void){
+	return sim_current != NULL;
+}
+
+void sim_register_device(sim_device_t *dev){
+	dev->next = sim_devices;
+	sim_devices = dev;
+}
+
+static int64_t sim_deadline(TickType_t ticks){
+	if(ticks == portMAX_DELAY) return SIM_NEVER;
+	return sim_time + (int64_t)ticks * SIM_TICK_US;
+}
+
+/**
+ * @brief blocks the calling task until it is woken up or until the deadline is reached.
+ * Must be called with sim_mutex held. Callers always re-check their condition afterwards.
+ * @return false if the caller is not a task (i.e. interrupt context) or if the deadline already passed.
+ */
+static bool sim_block(const void *on, int64_t deadline){
+	sim_task_t *t = sim_current;
+
+	if(t == NULL || deadline <= sim_time) return false;
+
+	t->blocked = true;
+	t->waiting_on = on;
+	t->wake_at = deadline;
+	sim_running--;
+	if(sim_running == 0){
+		pthread_cond_signal(&sim_quiescent);
+	}
+	while(t->blocked){
+		pthread_cond_wait(&t->cond, &sim_mutex);
+	}
+	return true;
+}
+
+/** @brief must be called with sim_mutex held */
+static void sim_wake(sim_task_t *t){
+	t->blocked = false;
+	t->waiting_on = NULL;
+	t->wake_at = SIM_NEVER;
+	sim_running++;
+	pthread_cond_signal(&t->cond);
+}
+
+/** @brief wakes every task waiting on a kernel object. Must be called with sim_mutex held */
+static void sim_wake_waiters(const void *on){
+	for(sim_task_t *t = sim_tasks; t != NULL; t = t->next){
+		if(t->blocked && t->waiting_on == on){
+			sim_wake(t);
+		}
+	}
+}
+
+void sim_sleep(int64_t us){
+	pthread_mutex_lock(&sim_mutex);
+	int64_t deadline = sim_time + us;
+	while(sim_time < deadline && sim_block(NULL, deadline));
+	pthread_mutex_unlock(&sim_mutex);
+}
+
+void sim_run(int64_t until, double speed){
+
+	struct timespec real_start;
+	int64_t sim_start = sim_time;
+	clock_gettime(CLOCK_MONOTONIC, &real_start);
+
+	pthread_mutex_lock(&sim_mutex);
+	for(;;){
+
+		while(sim_running > 0){
+			struct timespec timeout;
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_sec += SIM_WATCHDOG_TIMEOUT_S;
+			if(pthread_cond_timedwait(&sim_quiescent, &sim_mutex, &timeout) == ETIMEDOUT && sim_running > 0){
+				fprintf(stderr, "E (%lld) %s: Task watchdog got triggered. The following tasks did not block:\n", (long long)(sim_time / 1000), TAG);
+				for(sim_task_t *t = sim_tasks; t != NULL; t = t->next){
+					if(!t->blocked && !t->deleted) fprintf(stderr, " - %s\n", t->name);
+				}
+				abort();
+			}
+		}
+
+		/* every task is blocked: give the devices a chance to react to whatever was written in their registers */
+		bool busy = false;
+		pthread_mutex_unlock(&sim_mutex);
+		for(sim_device_t *d = sim_devices; d != NULL; d = d->next){
+			if(d->poll && d->poll()) busy = true;
+		}
+		pthread_mutex_lock(&sim_mutex);
+		if(busy) continue;
+
+		/* find the next event */
+		int64_t next = SIM_NEVER;
+		sim_device_t *next_device = NULL;
+		for(sim_task_t *t = sim_tasks; t != NULL; t = t->next){
+			if(t->blocked && t->wake_at < next){
+				next = t->wake_at;
+			}
+		}
+		for(sim_device_t *d = sim_devices; d != NULL; d = d->next){
+			int64_t e = d->next_event ? d->next_event() : SIM_NEVER;
+			if(e < next){
+				next = e;
+				next_device = d;
+			}
+		}
+
+		if(next == SIM_NEVER || next > until){
+			break;
+		}
+
+		if(speed > 0.0){
+			/* pace against the wall clock */
+			struct timespec target = real_start;
+			int64_t real_us = (int64_t)((double)(next - sim_start) / speed);
+			target.tv_sec += real_us / SIM_US_PER_SECOND;
+			target.tv_nsec += (real_us % SIM_US_PER_SECOND) * 1000;
+			if(target.tv_nsec >= 1000000000L){
+				target.tv_sec++;
+				target.tv_nsec -= 1000000000L;
+			}
+			pthread_mutex_unlock(&sim_mutex);
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR);
+			pthread_mutex_lock(&sim_mutex);
+		}
+
+		if(next > sim_time){
+			__atomic_store_n(&sim_time, next, __ATOMIC_RELEASE);
+		}
+
+		if(next_device){
+			pthread_mutex_unlock(&sim_mutex);
+			next_device->fire(next);
+			pthread_mutex_lock(&sim_mutex);
+		}
+		else{
+			for(sim_task_t *t = sim_tasks; t != NULL; t = t->next){
+				if(t->blocked && t->wake_at <= sim_time){
+					sim_wake(t);
+				}
+			}
+		}
+	}
+
+	if(until > sim_time && until != SIM_NEVER){
+		__atomic_store_n(&sim_time, until, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+}
+
+static double sim_task_cpu(sim_task_t *t){
+	if(t->deleted) return t->cpu_seconds;
+	struct timespec ts;
+	if(clock_gettime(t->cpu_clock, &ts) != 0) return 0.0;
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+double sim_task_cpu_seconds(const char *name){
+	double s = 0.0;
+	pthread_mutex_lock(&sim_mutex);
+	for(sim_task_t *t = sim_tasks; t != NULL; t = t->next){
+		if(strcmp(t->name, name) == 0) s += sim_task_cpu(t);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+	return s;
+}
+
+void sim_print_tasks(FILE *f){
+	pthread_mutex_lock(&sim_mutex);
+	for(sim_task_t *t = sim_tasks; t != NULL; t = t->next){
+		fprintf(f, "  %-16s prio %2u  cpu %10.3f s%s\n", t->name, t->priority, sim_task_cpu(t), t->deleted ? "  (deleted)" : "");
+	}
+	pthread_mutex_unlock(&sim_mutex);
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* tasks                                                                                                            */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+static void *sim_task_entry(void *arg){
+	sim_task_t *t = (sim_task_t*)arg;
+	sim_current = t;
+	pthread_getcpuclockid(pthread_self(), &t->cpu_clock);
+
+	/* wait for the creator to release the kernel lock */
+	pthread_mutex_lock(&sim_mutex);
+	pthread_mutex_unlock(&sim_mutex);
+
+	t->code(t->parameters);
+
+	/* a FreeRTOS task must never return, but be lenient */
+	vTaskDelete(NULL);
+	return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char * const pcName, const uint32_t usStackDepth, void * const pvParameters, UBaseType_t uxPriority, TaskHandle_t * const pvCreatedTask, const BaseType_t xCoreID){
+
+	sim_task_t *t = calloc(1, sizeof(sim_task_t));
+	if(t == NULL) return pdFAIL;
+
+	strncpy(t->name, pcName, sizeof(t->name) - 1);
+	t->code = pvTaskCode;
+	t->parameters = pvParameters;
+	t->priority = uxPriority;
+	t->wake_at = SIM_NEVER;
+	/* the stack comes out of the heap on the esp32: account for it the same way */
+	t->stack = malloc(usStackDepth);
+	pthread_cond_init(&t->cond, NULL);
+
+	pthread_mutex_lock(&sim_mutex);
+	t->next = sim_tasks;
+	sim_tasks = t;
+	sim_running++;
+	if(pvCreatedTask) *pvCreatedTask = (TaskHandle_t)t;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&t->thread, &attr, sim_task_entry, t);
+	pthread_attr_destroy(&attr);
+	if(err != 0){
+		sim_running--;
+		sim_tasks = t->next;
+		pthread_mutex_unlock(&sim_mutex);
+		free(t->stack);
+		free(t);
+		return pdFAIL;
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete){
+
+	sim_task_t *t = xTaskToDelete ? (sim_task_t*)xTaskToDelete : sim_current;
+
+	if(t != sim_current){
+		ESP_LOGE(TAG, "vTaskDelete on another task is not supported by the simulation");
+		return;
+	}
+
+	pthread_mutex_lock(&sim_mutex);
+	t->cpu_seconds = sim_task_cpu(t);
+	t->deleted = true;
+	free(t->stack);
+	t->stack = NULL;
+	sim_running--;
+	if(sim_running == 0){
+		pthread_cond_signal(&sim_quiescent);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+	pthread_exit(NULL);
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay){
+	pthread_mutex_lock(&sim_mutex);
+	int64_t deadline = sim_deadline(xTicksToDelay);
+	while(sim_time < deadline && sim_block(NULL, deadline));
+	pthread_mutex_unlock(&sim_mutex);
+}
+
+void vTaskDelayUntil(TickType_t * const pxPreviousWakeTime, const TickType_t xTimeIncrement){
+	pthread_mutex_lock(&sim_mutex);
+	*pxPreviousWakeTime += xTimeIncrement;
+	int64_t deadline = (int64_t)(*pxPreviousWakeTime) * SIM_TICK_US;
+	while(sim_time < deadline && sim_block(NULL, deadline));
+	pthread_mutex_unlock(&sim_mutex);
+}
+
+TickType_t xTaskGetTickCount(void){
+	return (TickType_t)(sim_now() / SIM_TICK_US);
+}
+
+TickType_t xTaskGetTickCountFromISR(void){
+	return xTaskGetTickCount();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void){
+	return (TaskHandle_t)sim_current;
+}
+
+void vPortYield(void){
+	sched_yield();
+}
+
+static void sim_critical_init(void){
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&sim_critical, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux){
+	pthread_once(&sim_critical_once, sim_critical_init);
+	pthread_mutex_lock(&sim_critical);
+}
+
+void vPortExitCritical(portMUX_TYPE *mux){
+	pthread_mutex_unlock(&sim_critical);
+}
+
+void vTaskSuspendAll(void){
+	vPortEnterCritical(NULL);
+}
+
+BaseType_t xTaskResumeAll(void){
+	vPortExitCritical(NULL);
+	return pdFALSE;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* task notifications                                                                                               */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+BaseType_t xTaskGenericNotify(TaskHandle_t xTaskToNotify, uint32_t ulValue, eNotifyAction eAction, uint32_t *pulPreviousNotificationValue){
+
+	sim_task_t *t = (sim_task_t*)xTaskToNotify;
+	BaseType_t ret = pdPASS;
+
+	if(t == NULL) return pdFAIL;
+
+	pthread_mutex_lock(&sim_mutex);
+	if(pulPreviousNotificationValue) *pulPreviousNotificationValue = t->notify_value;
+
+	switch(eAction){
+		case eSetBits:
+			t->notify_value |= ulValue;
+			break;
+		case eIncrement:
+			t->notify_value++;
+			break;
+		case eSetValueWithOverwrite:
+			t->notify_value = ulValue;
+			break;
+		case eSetValueWithoutOverwrite:
+			if(t->notify_state == SIM_NOTIFY_RECEIVED) ret = pdFAIL;
+			else t->notify_value = ulValue;
+			break;
+		case eNoAction:
+		default:
+			break;
+	}
+	t->notify_state = SIM_NOTIFY_RECEIVED;
+	if(t->blocked && t->waiting_on == &t->notify_value){
+		sim_wake(t);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	return ret;
+}
+
+BaseType_t xTaskGenericNotifyFromISR(TaskHandle_t xTaskToNotify, uint32_t ulValue, eNotifyAction eAction, uint32_t *pulPreviousNotificationValue, BaseType_t *pxHigherPriorityTaskWoken){
+	if(pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdFALSE;
+	return xTaskGenericNotify(xTaskToNotify, ulValue, eAction, pulPreviousNotificationValue);
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t *pxHigherPriorityTaskWoken){
+	xTaskGenericNotifyFromISR(xTaskToNotify, 0, eIncrement, NULL, pxHigherPriorityTaskWoken);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait){
+
+	sim_task_t *t = sim_current;
+	uint32_t ret;
+
+	if(t == NULL) return 0;
+
+	pthread_mutex_lock(&sim_mutex);
+	int64_t deadline = sim_deadline(xTicksToWait);
+	while(t->notify_value == 0){
+		t->notify_state = SIM_NOTIFY_WAITING;
+		if(!sim_block(&t->notify_value, deadline) || (sim_time >= deadline && t->notify_value == 0)) break;
+	}
+	ret = t->notify_value;
+	if(ret != 0){
+		t->notify_value = xClearCountOnExit ? 0 : ret - 1;
+	}
+	t->notify_state = SIM_NOTIFY_NONE;
+	pthread_mutex_unlock(&sim_mutex);
+
+	return ret;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t ulBitsToClearOnEntry, uint32_t ulBitsToClearOnExit, uint32_t *pulNotificationValue, TickType_t xTicksToWait){
+
+	sim_task_t *t = sim_current;
+	BaseType_t ret = pdFALSE;
+
+	if(t == NULL) return pdFALSE;
+
+	pthread_mutex_lock(&sim_mutex);
+	int64_t deadline = sim_deadline(xTicksToWait);
+	if(t->notify_state != SIM_NOTIFY_RECEIVED){
+		t->notify_value &= ~ulBitsToClearOnEntry;
+		t->notify_state = SIM_NOTIFY_WAITING;
+		while(t->notify_state != SIM_NOTIFY_RECEIVED){
+			if(!sim_block(&t->notify_value, deadline) || (sim_time >= deadline && t->notify_state != SIM_NOTIFY_RECEIVED)) break;
+		}
+	}
+	if(pulNotificationValue) *pulNotificationValue = t->notify_value;
+	if(t->notify_state == SIM_NOTIFY_RECEIVED){
+		t->notify_value &= ~ulBitsToClearOnExit;
+		ret = pdTRUE;
+	}
+	t->notify_state = SIM_NOTIFY_NONE;
+	pthread_mutex_unlock(&sim_mutex);
+
+	return ret;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* queues and semaphores                                                                                            */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+QueueHandle_t xQueueGenericCreate(const UBaseType_t uxQueueLength, const UBaseType_t uxItemSize, const uint8_t ucQueueType){
+
+	QueueHandle_t q = calloc(1, sizeof(struct QueueDefinition));
+	if(q == NULL) return NULL;
+
+	q->length = uxQueueLength;
+	q->item_size = uxItemSize;
+	if(uxItemSize){
+		q->storage = malloc(uxQueueLength * uxItemSize);
+		if(q->storage == NULL){
+			free(q);
+			return NULL;
+		}
+	}
+	return q;
+}
+
+SemaphoreHandle_t xQueueCreateCountingSemaphore(const UBaseType_t uxMaxCount, const UBaseType_t uxInitialCount){
+	QueueHandle_t q = xQueueGenericCreate(uxMaxCount, 0, 0);
+	if(q) q->count = uxInitialCount;
+	return q;
+}
+
+void vQueueDelete(QueueHandle_t xQueue){
+	if(xQueue == NULL) return;
+	free(xQueue->storage);
+	free(xQueue);
+}
+
+BaseType_t xQueueGenericSend(QueueHandle_t q, const void * const pvItemToQueue, TickType_t xTicksToWait, const BaseType_t xCopyPosition){
+
+	pthread_mutex_lock(&sim_mutex);
+	int64_t deadline = sim_deadline(xTicksToWait);
+	while(q->count >= q->length && xCopyPosition != queueOVERWRITE){
+		if(!sim_block(q, deadline) || (sim_time >= deadline && q->count >= q->length)){
+			pthread_mutex_unlock(&sim_mutex);
+			return errQUEUE_FULL;
+		}
+	}
+
+	if(xCopyPosition == queueOVERWRITE && q->count >= q->length){
+		if(q->item_size) memcpy(q->storage + q->head * q->item_size, pvItemToQueue, q->item_size);
+	}
+	else if(xCopyPosition == queueSEND_TO_FRONT){
+		q->head = (q->head + q->length - 1) % q->length;
+		if(q->item_size) memcpy(q->storage + q->head * q->item_size, pvItemToQueue, q->item_size);
+		q->count++;
+	}
+	else{
+		UBaseType_t tail = (q->head + q->count) % q->length;
+		if(q->item_size) memcpy(q->storage + tail * q->item_size, pvItemToQueue, q->item_size);
+		q->count++;
+	}
+
+	sim_wake_waiters(q);
+	pthread_mutex_unlock(&sim_mutex);
+
+	return pdTRUE;
+}
+
+BaseType_t xQueueGenericSendFromISR(QueueHandle_t xQueue, const void * const pvItemToQueue, BaseType_t * const pxHigherPriorityTaskWoken, const BaseType_t xCopyPosition){
+	if(pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdFALSE;
+	return xQueueGenericSend(xQueue, pvItemToQueue, 0, xCopyPosition);
+}
+
+BaseType_t xQueueGiveFromISR(QueueHandle_t xQueue, BaseType_t * const pxHigherPriorityTaskWoken){
+	return xQueueGenericSendFromISR(xQueue, NULL, pxHigherPriorityTaskWoken, queueSEND_TO_BACK);
+}
+
+static BaseType_t sim_queue_receive(QueueHandle_t q, void * const pvBuffer, TickType_t xTicksToWait, bool remove){
+
+	pthread_mutex_lock(&sim_mutex);
+	int64_t deadline = sim_deadline(xTicksToWait);
+	while(q->count == 0){
+		if(!sim_block(q, deadline) || (sim_time >= deadline && q->count == 0)){
+			pthread_mutex_unlock(&sim_mutex);
+			return pdFALSE;
+		}
+	}
+
+	if(q->item_size && pvBuffer){
+		memcpy(pvBuffer, q->storage + q->head * q->item_size, q->item_size);
+	}
+	if(remove){
+		q->head = (q->head + 1) % q->length;
+		q->count--;
+		sim_wake_waiters(q);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void * const pvBuffer, TickType_t xTicksToWait){
+	return sim_queue_receive(xQueue, pvBuffer, xTicksToWait, true);
+}
+
+BaseType_t xQueueReceiveFromISR(QueueHandle_t xQueue, void * const pvBuffer, BaseType_t * const pxHigherPriorityTaskWoken){
+	if(pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdFALSE;
+	return sim_queue_receive(xQueue, pvBuffer, 0, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t xQueue, void * const pvBuffer, TickType_t xTicksToWait){
+	return sim_queue_receive(xQueue, pvBuffer, xTicksToWait, false);
+}
+
+BaseType_t xQueueSemaphoreTake(QueueHandle_t xQueue, TickType_t xTicksToWait){
+	return sim_queue_receive(xQueue, NULL, xTicksToWait, true);
+}
+
+UBaseType_t uxQueueMessagesWaiting(const QueueHandle_t xQueue){
+	pthread_mutex_lock(&sim_mutex);
+	UBaseType_t n = xQueue->count;
+	pthread_mutex_unlock(&sim_mutex);
+	return n;
+}
+
+UBaseType_t uxQueueSpacesAvailable(const QueueHandle_t xQueue){
+	pthread_mutex_lock(&sim_mutex);
+	UBaseType_t n = xQueue->length - xQueue->count;
+	pthread_mutex_unlock(&sim_mutex);
+	return n;
+}
+
+BaseType_t xQueueReset(QueueHandle_t xQueue){
+	pthread_mutex_lock(&sim_mutex);
+	xQueue->count = 0;
+	xQueue->head = 0;
+	sim_wake_waiters(xQueue);
+	pthread_mutex_unlock(&sim_mutex);
+	return pdPASS;
+}
@@ -0,0 +1,565 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_http.c
+@author Tony Pottier
+@brief HTTP client and server stand-ins for the host simulation
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The client side answers the mclk.org time and transitions API in process. The
+reference time is the simulation's true UTC and timezone offsets/transitions
+are read from the host's own zoneinfo database, so daylight saving changes
+happen in the simulation when they would in real life. Connection setup and
+round trips cost simulated time, and TLS handshakes are counted.
+
+Like the real esp_http_client, a connection stays open after a request until
+the handle is closed or the server drops it after SIM_HTTP_SERVER_IDLE_US. A
+request sent on a connection the server dropped fails. Host names resolve
+through a cache that keeps answers for SIM_HTTP_DNS_TTL_US, like lwip's.
+
+The server side captures what the webapp handlers answer so that the web
+interface can be exercised by sim_httpd_request().
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "esp_http_client.h"
+#include "esp_http_server.h"
+#include "http_app.h"
+#include "esp_log.h"
+#include "cJSON.h"
+
+#include "sim.h"
+
+
+#define SIM_HTTP_DEFAULT_BUFFER_SIZE	512
+#define SIM_HTTP_MAX_RESPONSE			2048
+#define SIM_HTTP_MAX_TRANSITIONS		16
+
+/** @brief DNS lookup of the API server, and how long lwip keeps the answer */
+#define SIM_HTTP_DNS_US					(40 * 1000)
+#define SIM_HTTP_DNS_TTL_US				(300 * SIM_US_PER_SECOND)
+
+/** @brief TCP + TLS handshake to the API server */
+#define SIM_HTTP_HANDSHAKE_US			(310 * 1000)
+
+/** @brief the server closes connections idle for longer than this */
+#define SIM_HTTP_SERVER_IDLE_US			(60 * SIM_US_PER_SECOND)
+
+/** @brief requests less than this apart belong to the same sync cycle */
+#define SIM_HTTP_CYCLE_GAP_US			(10 * SIM_US_PER_SECOND)
+
+/** @brief one request/response round trip on an established connection */
+#define SIM_HTTP_ROUND_TRIP_US			(60 * 1000)
+
+/** @brief time it takes to give up when there is no network */
+#define SIM_HTTP_CONNECT_FAIL_US		(2 * SIM_US_PER_SECOND)
+
+static const char TAG[] = "sim_http";
+
+struct esp_http_client{
+	esp_http_client_config_t config;
+	char *buffer;
+	const char *post_data;
+	int post_len;
+	int status_code;
+	int content_length;
+	bool connected;
+	int64_t idle_since;
+};
+
+static bool sim_http_online = true;
+static sim_http_stats_t sim_http_stats;
+
+/** @brief when the cached DNS answer expires, and when the last request ended */
+static int64_t sim_http_dns_expiry = 0;
+static int64_t sim_http_last_request_end = -SIM_HTTP_CYCLE_GAP_US;
+
+/** @brief a request is open from the first client call that prepares it to the end of esp_http_client_perform */
+static bool sim_http_request_open = false;
+
+
+
+void sim_http_set_network(bool online){
+	sim_http_online = online;
+}
+
+void sim_http_get_stats(sim_http_stats_t *stats){
+	*stats = sim_http_stats;
+}
+
+/** @brief everything the client and its user allocate from now on counts for the request */
+static void sim_http_request_begin(void){
+	if(!sim_http_request_open){
+		sim_http_request_open = true;
+		sim_heap_window_start();
+	}
+}
+
+static void sim_http_request_end(void){
+	if(sim_http_request_open){
+		sim_http_request_open = false;
+		int64_t peak = sim_heap_window_peak();
+		if(peak > sim_http_stats.heap_peak) sim_http_stats.heap_peak = peak;
+	}
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* zoneinfo                                                                                                         */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+typedef struct sim_tzif_t{
+	int count;
+	int64_t *times;
+	int32_t *offsets; /* offset in effect from times[i] */
+	int32_t initial;
+}sim_tzif_t;
+
+static int64_t sim_be(const uint8_t *p, int n){
+	int64_t v = (p[0] & 0x80) ? -1 : 0;
+	for(int i = 0; i < n; i++) v = (v << 8) | p[i];
+	return v;
+}
+
+static void sim_tzif_free(sim_tzif_t *tz){
+	free(tz->times);
+	free(tz->offsets);
+	memset(tz, 0x00, sizeof(sim_tzif_t));
+}
+
+/**
+ * @brief loads the 64 bit transition table of a compiled TZif file (RFC 8536).
+ * Unknown zones load as UTC.
+ */
+static void sim_tzif_load(const char *name, sim_tzif_t *tz){
+
+	memset(tz, 0x00, sizeof(sim_tzif_t));
+	if(name == NULL || strstr(name, "..")) return;
+
+	char path[128];
+	snprintf(path, sizeof(path), "/usr/share/zoneinfo/%s", name);
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) return;
+
+	uint8_t *buf = malloc(64 * 1024);
+	size_t len = fread(buf, 1, 64 * 1024, f);
+	fclose(f);
+
+	if(len >= 44 && memcmp(buf, "TZif", 4) == 0 && buf[4] >= '2'){
+
+		/* skip the version 1 block */
+		const uint8_t *h = buf;
+		size_t v1 = sim_be(h + 32, 4) * 5 + sim_be(h + 36, 4) * 6 + sim_be(h + 40, 4) + sim_be(h + 28, 4) * 8 + sim_be(h + 24, 4) + sim_be(h + 20, 4);
+		h = buf + 44 + v1;
+
+		if(h + 44 <= buf + len && memcmp(h, "TZif", 4) == 0){
+			int timecnt = (int)sim_be(h + 32, 4);
+			int typecnt = (int)sim_be(h + 36, 4);
+			const uint8_t *times = h + 44;
+			const uint8_t *idx = times + timecnt * 8;
+			const uint8_t *types = idx + timecnt;
+
+			if(types + typecnt * 6 <= buf + len && typecnt > 0){
+				tz->count = timecnt;
+				tz->times = malloc(sizeof(int64_t) * (timecnt + 1));
+				tz->offsets = malloc(sizeof(int32_t) * (timecnt + 1));
+				for(int i = 0; i < timecnt; i++){
+					tz->times[i] = sim_be(times + i * 8, 8);
+					tz->offsets[i] = (int32_t)sim_be(types + idx[i] * 6, 4);
+				}
+				tz->initial = (int32_t)sim_be(types, 4);
+			}
+		}
+	}
+
+	free(buf);
+}
+
+static int32_t sim_tzif_offset(const sim_tzif_t *tz, int64_t t){
+	int32_t offset = tz->initial;
+	for(int i = 0; i < tz->count && tz->times[i] <= t; i++){
+		offset = tz->offsets[i];
+	}
+	return offset;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* mclk.org API                                                                                                     */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+static const char* sim_http_body_string(cJSON *body, const char *key, const char *def){
+	cJSON *item = cJSON_GetObjectItemCaseSensitive(body, key);
+	return cJSON_IsString(item) ? item->valuestring : def;
+}
+
+static int64_t sim_http_body_number(cJSON *body, const char *key, int64_t def){
+	cJSON *item = cJSON_GetObjectItemCaseSensitive(body, key);
+	return cJSON_IsNumber(item) ? (int64_t)item->valuedouble : def;
+}
+
+/**
+ * @brief builds the API answer for the requested url into out.
+ * @return HTTP status code
+ */
+static int sim_http_api(const char *url, const char *post, int post_len, char *out, size_t out_len){
+
+	char *copy = NULL;
+	cJSON *body = NULL;
+	if(post && post_len > 0){
+		copy = strndup(post, post_len);
+		body = cJSON_Parse(copy);
+	}
+
+	int status = 200;
+	const char *name = sim_http_body_string(body, "timezone", "UTC");
+	time_t now = sim_true_utc();
+	sim_tzif_t tz;
+	sim_tzif_load(name, &tz);
+
+	const char *path = strstr(url, "://");
+	path = path ? strchr(path + 3, '/') : url;
+
+	if(path && strcmp(path, "/time") == 0){
+		snprintf(out, out_len, "{\"timestamp\":%lld,\"timezone\":{\"name\":\"%s\",\"offset\":%d}}",
+				(long long)now, name, sim_tzif_offset(&tz, now));
+	}
+	else if(path && strcmp(path, "/transitions") == 0){
+		int64_t from = sim_http_body_number(body, "from", now);
+		int64_t to = sim_http_body_number(body, "to", now);
+		size_t n = snprintf(out, out_len, "{\"timezone\":\"%s\",\"transitions\":[", name);
+		int count = 0;
+		for(int i = 0; i < tz.count && count < SIM_HTTP_MAX_TRANSITIONS && n < out_len; i++){
+			if(tz.times[i] > from && tz.times[i] <= to){
+				n += snprintf(out + n, out_len - n, "%s{\"transitionTimestamp\":%lld,\"fromOffset\":%d,\"toOffset\":%d}",
+						count ? "," : "", (long long)tz.times[i], i ? tz.offsets[i - 1] : tz.initial, tz.offsets[i]);
+				count++;
+			}
+		}
+		if(n < out_len) snprintf(out + n, out_len - n, "]}");
+	}
+	else{
+		status = 404;
+		snprintf(out, out_len, "{\"error\":\"not found\"}");
+	}
+
+	sim_tzif_free(&tz);
+	cJSON_Delete(body);
+	free(copy);
+
+	return status;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* esp_http_client                                                                                                  */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+static void sim_http_event(esp_http_client_handle_t client, esp_http_client_event_id_t id, void *data, int len, char *key, char *value){
+	if(client->config.event_handler){
+		esp_http_client_event_t evt = {
+			.event_id = id,
+			.client = client,
+			.data = data,
+			.data_len = len,
+			.user_data = client->config.user_data,
+			.header_key = key,
+			.header_value = value
+		};
+		client->config.event_handler(&evt);
+	}
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config){
+
+	if(config == NULL || config->url == NULL) return NULL;
+	sim_http_request_begin();
+
+	esp_http_client_handle_t client = calloc(1, sizeof(struct esp_http_client));
+	if(client == NULL) return NULL;
+
+	client->config = *config;
+	if(client->config.buffer_size <= 0) client->config.buffer_size = SIM_HTTP_DEFAULT_BUFFER_SIZE;
+	client->config.url = strdup(config->url);
+	client->buffer = malloc(client->config.buffer_size);
+	client->content_length = -1;
+
+	return client;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url){
+	if(client == NULL || url == NULL) return ESP_ERR_INVALID_ARG;
+	sim_http_request_begin();
+	free((char*)client->config.url);
+	client->config.url = strdup(url);
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method){
+	if(client == NULL) return ESP_ERR_INVALID_ARG;
+	client->config.method = method;
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char *data, int len){
+	if(client == NULL) return ESP_ERR_INVALID_ARG;
+	sim_http_request_begin();
+	client->post_data = data;
+	client->post_len = len;
+	if(data) client->config.method = HTTP_METHOD_POST;
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value){
+	return client ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client){
+	return client ? client->status_code : -1;
+}
+
+int esp_http_client_get_content_length(esp_http_client_handle_t client){
+	return client ? client->content_length : -1;
+}
+
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client){
+	return false;
+}
+
+static void sim_http_connect(esp_http_client_handle_t client){
+	if(sim_now() >= sim_http_dns_expiry){
+		sim_http_stats.dns_lookups++;
+		sim_sleep(SIM_HTTP_DNS_US);
+		sim_http_dns_expiry = sim_now() + SIM_HTTP_DNS_TTL_US;
+	}
+	sim_http_stats.handshakes++;
+	sim_sleep(SIM_HTTP_HANDSHAKE_US);
+	client->connected = true;
+	sim_http_event(client, HTTP_EVENT_ON_CONNECTED, NULL, 0, NULL, NULL);
+}
+
+esp_err_t esp_http_client_perform(esp_http_client_handle_t client){
+
+	if(client == NULL) return ESP_ERR_INVALID_ARG;
+
+	int64_t start = sim_now();
+	if(start - sim_http_last_request_end >= SIM_HTTP_CYCLE_GAP_US){
+		sim_http_stats.cycles++;
+	}
+
+	sim_http_request_begin();
+
+	esp_err_t err = ESP_OK;
+	if(!sim_http_online){
+		sim_sleep(SIM_HTTP_CONNECT_FAIL_US);
+		sim_http_event(client, HTTP_EVENT_ERROR, NULL, 0, NULL, NULL);
+		err = ESP_ERR_HTTP_CONNECT;
+	}
+	else if(client->connected && start - client->idle_since >= SIM_HTTP_SERVER_IDLE_US){
+		/* the server closed the connection: the request goes out, nothing comes back */
+		sim_sleep(SIM_HTTP_ROUND_TRIP_US);
+		sim_http_stats.stale++;
+		esp_http_client_close(client);
+		err = ESP_ERR_HTTP_FETCH_HEADER;
+	}
+	else{
+		if(!client->connected){
+			sim_http_connect(client);
+		}
+
+		sim_http_stats.requests++;
+		sim_http_event(client, HTTP_EVENT_HEADERS_SENT, NULL, 0, NULL, NULL);
+		sim_sleep(SIM_HTTP_ROUND_TRIP_US / 2);
+
+		/* the server side is not part of the clock's heap. It reads its clock half way through the round trip */
+		sim_heap_set_untracked(true);
+		char *response = malloc(SIM_HTTP_MAX_RESPONSE);
+		client->status_code = sim_http_api(client->config.url, client->post_data, client->post_len, response, SIM_HTTP_MAX_RESPONSE);
+		sim_heap_set_untracked(false);
+		sim_sleep(SIM_HTTP_ROUND_TRIP_US - SIM_HTTP_ROUND_TRIP_US / 2);
+		client->content_length = (int)strlen(response);
+
+		char length[16];
+		snprintf(length, sizeof(length), "%d", client->content_length);
+		sim_http_event(client, HTTP_EVENT_ON_HEADER, NULL, 0, "Content-Type", "application/json");
+		sim_http_event(client, HTTP_EVENT_ON_HEADER, NULL, 0, "Content-Length", length);
+
+		/* body is delivered in chunks the size of the receive buffer */
+		for(int sent = 0; sent < client->content_length; ){
+			int chunk = client->content_length - sent;
+			if(chunk > client->config.buffer_size) chunk = client->config.buffer_size;
+			memcpy(client->buffer, response + sent, chunk);
+			sim_http_event(client, HTTP_EVENT_ON_DATA, client->buffer, chunk, NULL, NULL);
+			sent += chunk;
+		}
+		free(response);
+
+		sim_http_event(client, HTTP_EVENT_ON_FINISH, NULL, 0, NULL, NULL);
+		client->idle_since = sim_now();
+	}
+
+	sim_http_request_end();
+	sim_http_last_request_end = sim_now();
+	sim_http_stats.busy_us += sim_http_last_request_end - start;
+
+	return err;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client){
+	if(client == NULL) return ESP_ERR_INVALID_ARG;
+	if(client->connected){
+		client->connected = false;
+		sim_http_event(client, HTTP_EVENT_DISCONNECTED, NULL, 0, NULL, NULL);
+	}
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client){
+	if(client == NULL) return ESP_ERR_INVALID_ARG;
+	esp_http_client_close(client);
+	free((char*)client->config.url);
+	free(client->buffer);
+	free(client);
+	return ESP_OK;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* esp_http_server / http_app                                                                                       */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+typedef struct sim_httpd_ctx_t{
+	const char *body;
+	size_t body_read;
+	int status;
+	char *response;
+	size_t response_len;
+}sim_httpd_ctx_t;
+
+static esp_err_t (*sim_httpd_get_handler)(httpd_req_t *r) = NULL;
+static esp_err_t (*sim_httpd_post_handler)(httpd_req_t *r) = NULL;
+
+esp_err_t http_app_set_handler_hook(httpd_method_t method, esp_err_t (*handler)(httpd_req_t *r)){
+	if(method == HTTP_GET){
+		sim_httpd_get_handler = handler;
+	}
+	else if(method == HTTP_POST){
+		sim_httpd_post_handler = handler;
+	}
+	else{
+		return ESP_ERR_INVALID_ARG;
+	}
+	return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status){
+	((sim_httpd_ctx_t*)r->aux)->status = atoi(status);
+	return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type){
+	return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value){
+	return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len){
+	sim_httpd_ctx_t *ctx = (sim_httpd_ctx_t*)r->aux;
+	if(ctx->response && ctx->response_len){
+		size_t n = 0;
+		if(buf){
+			n = buf_len < 0 ? strlen(buf) : (size_t)buf_len;
+			if(n > ctx->response_len - 1) n = ctx->response_len - 1;
+			memcpy(ctx->response, buf, n);
+		}
+		ctx->response[n] = '\0';
+	}
+	return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_404(httpd_req_t *r){
+	httpd_resp_set_status(r, "404 Not Found");
+	return httpd_resp_send(r, NULL, 0);
+}
+
+esp_err_t httpd_resp_send_408(httpd_req_t *r){
+	httpd_resp_set_status(r, "408 Request Timeout");
+	return httpd_resp_send(r, NULL, 0);
+}
+
+esp_err_t httpd_resp_send_500(httpd_req_t *r){
+	httpd_resp_set_status(r, "500 Internal Server Error");
+	return httpd_resp_send(r, NULL, 0);
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len){
+	sim_httpd_ctx_t *ctx = (sim_httpd_ctx_t*)r->aux;
+	size_t left = r->content_len - ctx->body_read;
+	size_t n = buf_len < left ? buf_len : left;
+	if(n == 0) return HTTPD_SOCK_ERR_FAIL;
+	memcpy(buf, ctx->body + ctx->body_read, n);
+	ctx->body_read += n;
+	return (int)n;
+}
+
+int sim_httpd_request(int method, const char *uri, const char *body, char *response, size_t response_len){
+
+	esp_err_t (*handler)(httpd_req_t *r) = (method == HTTP_POST) ? sim_httpd_post_handler : sim_httpd_get_handler;
+
+	sim_httpd_ctx_t ctx = {
+		.body = body,
+		.body_read = 0,
+		.status = 200,
+		.response = response,
+		.response_len = response_len
+	};
+	if(response && response_len) response[0] = '\0';
+
+	httpd_req_t *req = calloc(1, sizeof(httpd_req_t));
+	req->method = method;
+	strncpy((char*)req->uri, uri, HTTPD_MAX_URI_LEN);
+	req->content_len = body ? strlen(body) : 0;
+	req->aux = &ctx;
+
+	if(handler == NULL){
+		ctx.status = 404;
+	}
+	else if(handler(req) != ESP_OK && ctx.status == 200){
+		ESP_LOGW(TAG, "%s %s handler failed", method == HTTP_POST ? "POST" : "GET", uri);
+	}
+
+	free(req);
+	return ctx.status;
+}
@@ -0,0 +1,434 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_main.c
+@author Tony Pottier
+@brief Entry point of the host simulation: boots the clock and soak tests it
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Boots the firmware the way app_main does, minus the wifi manager which is
+replaced by a task that reports a connection a few seconds after boot. A web
+task exercises the web interface from time to time. At the end of the run a
+report of the per-tick cost of the clock is printed: CPU time, heap
+allocations, flash writes, network handshakes and driver activity.
+
+Usage: nixie_clock_sim [--days N] [--speed X] [--epoch UTC] [--tz NAME] [--transition T] [--sleep HH:MM-HH:MM] [--ppm P] [--i2c-hang S] [--drop-edge S] [--offline] [-v|-q]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_http_server.h"
+#include "nvs_flash.h"
+
+#include "clock.h"
+#include "display.h"
+#include "ws2812.h"
+#include "webapp.h"
+#include "temperature.h"
+#include "i2c.h"
+#include "ds3231.h"
+
+#include "sim.h"
+
+
+/** @brief 2021-01-01 00:00:00 UTC */
+#define SIM_DEFAULT_EPOCH				1609459200
+
+/** @brief most queueing delay of each way of an NTP exchange */
+#define SIM_DEFAULT_NTP_JITTER_MS		20
+
+/** @brief delay between boot and the station getting an IP address */
+#define SIM_WIFI_CONNECT_DELAY_MS		4000
+
+static const char TAG[] = "sim_main";
+
+extern time_t timestamp_utc;
+
+static bool sim_option_online = true;
+static const char *sim_option_timezone = NULL;
+static const char *sim_option_transition = NULL;
+
+/** @brief every day sleepmode set from the web interface, in seconds after local midnight. -1 if none */
+static int sim_option_sleep_from = -1;
+static int sim_option_sleep_to = -1;
+
+
+
+/**
+ * @brief stands in for the wifi manager: reports the station connection after a few seconds
+ */
+static void sim_wifi_task(void *pvParameter){
+	vTaskDelay( pdMS_TO_TICKS(SIM_WIFI_CONNECT_DELAY_MS) );
+	if(sim_option_online){
+		ESP_LOGI(TAG, "WM_EVENT_STA_GOT_IP");
+		clock_notify_sta_got_ip(NULL);
+	}
+	vTaskDelete( NULL );
+}
+
+/**
+ * @brief plays a user on the web interface: sets the timezone and the sleepmode once, then looks at the config every hour
+ * and changes the backlights and the tube brightness once a day.
+ */
+static void sim_web_task(void *pvParameter){
+
+	char response[1024];
+	char body[128];
+	int hours = 0;
+
+	vTaskDelay( pdMS_TO_TICKS(SIM_WIFI_CONNECT_DELAY_MS * 2) );
+
+	if(sim_option_timezone){
+		snprintf(body, sizeof(body), "{\"timezone\":\"%s\"}", sim_option_timezone);
+		sim_httpd_request(HTTP_POST, "/timezone/", body, response, sizeof(response));
+	}
+
+	if(sim_option_sleep_from >= 0){
+		snprintf(body, sizeof(body), "{\"enabled\":true,\"data\":[{\"enabled\":true,\"days\":127,\"from\":%d,\"to\":%d}]}",
+				sim_option_sleep_from, sim_option_sleep_to);
+		sim_httpd_request(HTTP_POST, "/sleepmode/", body, response, sizeof(response));
+	}
+
+	if(sim_option_transition){
+		snprintf(body, sizeof(body), "{\"transition\":\"%s\"}", sim_option_transition);
+		sim_httpd_request(HTTP_POST, "/display/", body, response, sizeof(response));
+	}
+
+	for(;;){
+		vTaskDelay( pdMS_TO_TICKS(60 * 60 * 1000) );
+		hours++;
+
+		sim_httpd_request(HTTP_GET, "/config/", NULL, response, sizeof(response));
+		sim_httpd_request(HTTP_GET, "/temperature/", NULL, response, sizeof(response));
+
+		if(hours % 24 == 0){
+			snprintf(body, sizeof(body), "{\"r\":%d,\"g\":%d,\"b\":%d}", (hours * 7) & 0xff, (hours * 13) & 0xff, (hours * 29) & 0xff);
+			sim_httpd_request(HTTP_POST, "/backlights/", body, response, sizeof(response));
+
+			snprintf(body, sizeof(body), "{\"brightness\":%d}", 100 - ((hours / 24) * 10) % 100);
+			sim_httpd_request(HTTP_POST, "/display/", body, response, sizeof(response));
+		}
+	}
+}
+
+/** @brief the tubes are sampled once per simulated second, half way between two edges of the DS3231 */
+static int64_t sim_lit_next_sample = SIM_US_PER_SECOND / 2;
+static uint64_t sim_lit_samples = 0;
+static double sim_lit_sum = 0.0;
+
+/** @brief how lit the tubes are: high voltage on, brightness from the OE duty (active low) */
+static double sim_tubes_lit(void){
+	return sim_gpio_get_output(DISPLAY_HVEN_GPIO) ? 1.0 - sim_ledc_output_level(DISPLAY_OE_GPIO) : 0.0;
+}
+
+static int64_t sim_lit_next_event(void){
+	return sim_lit_next_sample;
+}
+
+static void sim_lit_fire(int64_t now){
+	sim_lit_sum += sim_tubes_lit();
+	sim_lit_samples++;
+	sim_lit_next_sample += SIM_US_PER_SECOND;
+}
+
+static sim_device_t sim_lit_probe = {
+	.name = "lit_probe",
+	.next_event = sim_lit_next_event,
+	.fire = sim_lit_fire,
+	.poll = NULL
+};
+
+/**
+ * @brief mirrors app_main
+ */
+static void sim_app_main(void *pvParameter){
+
+	ESP_ERROR_CHECK(nvs_flash_init());
+	ESP_ERROR_CHECK(ws2812_init());
+	ESP_ERROR_CHECK(display_init());
+	webapp_register_handlers();
+
+	xTaskCreatePinnedToCore(&clock_task, "clock_task", 16384, NULL, CLOCK_TASK_PRIORITY, NULL, 1);
+	xTaskCreate(&sim_wifi_task, "wifi_manager", 4096, NULL, 5, NULL);
+	xTaskCreate(&sim_web_task, "httpd", 4096, NULL, 5, NULL);
+
+	vTaskDelete( NULL );
+}
+
+static void sim_usage(const char *argv0){
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --days N        simulated days to run (default 1)\n"
+		"  --speed X       pace the simulation at X times real time, 0 runs as fast as possible (default 0)\n"
+		"  --epoch UTC     true time at boot as a unix timestamp (default %d)\n"
+		"  --tz NAME       timezone set from the web interface after boot, e.g. Europe/Paris\n"
+		"  --transition T  tube digit transition set from the web interface: none, crossfade or roll\n"
+		"  --sleep A-B     every day sleepmode set from the web interface, e.g. 22:30-07:00 (local time)\n"
+		"  --ppm P         frequency error of the DS3231 oscillator in ppm (default 0)\n"
+		"  --rtc-lost      the DS3231 lost power: the clock boots without a valid time\n"
+		"  --i2c-hang S    the DS3231 hangs the I2C bus S seconds after boot, until the bus is recovered\n"
+		"  --drop-edge S   one edge of the square wave in every S seconds is lost before the ISR\n"
+		"  --offline       no network connection\n"
+		"  --ntp-jitter MS most queueing delay added to each way of an NTP exchange (default %d)\n"
+		"  --ntp-kiss CODE the NTP server answers with a kiss-o'-death, e.g. RATE or DENY\n"
+		"  -v, -q          verbose (debug) or quiet (warnings only) logging\n",
+		argv0, SIM_DEFAULT_EPOCH, SIM_DEFAULT_NTP_JITTER_MS);
+}
+
+static const char* sim_message_name(clock_message_t message){
+	static const char *names[CLOCK_MESSAGE_COUNT] = {
+		"none", "tick", "sta_got_ip", "sta_disconnected", "receive_time_api", "receive_transitions_api",
+		"request_transitions", "request_time_api", "sleepmode_config", "timezone", "sleep_event",
+		"backlights_config", "tube_brightness", "display_transition", "receive_sntp"
+	};
+	return names[message];
+}
+
+static void sim_report(double days, double wall_seconds){
+
+	sim_heap_stats_t heap;
+	sim_heap_get_stats(&heap);
+
+	uint64_t ticks = sim_ds3231_sqw_edges();
+	double per_tick = ticks ? 1.0 / (double)ticks : 0.0;
+	double clock_cpu = sim_task_cpu_seconds("clock_task");
+
+	printf("\n");
+	printf("simulated:        %.2f days in %.2f s (x%.0f)\n", days, wall_seconds, days * 86400.0 / (wall_seconds > 0 ? wall_seconds : 1e-9));
+	printf("ticks:            %llu\n", (unsigned long long)ticks);
+	printf("clock_task cpu:   %.3f us/tick (host)\n", clock_cpu * 1e6 * per_tick);
+	printf("heap:             %.3f allocs/tick, %.3f frees/tick, %.1f bytes/tick, %lld live, %lld peak\n",
+			heap.allocs * per_tick, heap.frees * per_tick, heap.bytes_allocated * per_tick,
+			(long long)heap.live_bytes, (long long)heap.peak_bytes);
+	printf("nvs:              %llu bytes written, %llu commits (%.1f bytes/day)\n",
+			(unsigned long long)sim_nvs_bytes_written(), (unsigned long long)sim_nvs_commits(),
+			days > 0 ? sim_nvs_bytes_written() / days : 0.0);
+	journal_stats_t journal;
+	clock_get_config_store_stats(&journal);
+	printf("config journal:   %u records, %u compactions, %llu bytes written (%.1f bytes/day)\n",
+			(unsigned)journal.records, (unsigned)journal.compactions, (unsigned long long)journal.bytes_written,
+			days > 0 ? journal.bytes_written / days : 0.0);
+	sim_http_stats_t http;
+	sim_http_get_stats(&http);
+	printf("http:             %llu requests in %llu sync cycles, %llu handshakes, %llu dns lookups, %llu stale connections\n",
+			(unsigned long long)http.requests, (unsigned long long)http.cycles, (unsigned long long)http.handshakes,
+			(unsigned long long)http.dns_lookups, (unsigned long long)http.stale);
+	printf("                  %.1f ms per sync cycle, %lld bytes heap peak per request\n",
+			http.cycles ? http.busy_us / 1000.0 / http.cycles : 0.0, (long long)http.heap_peak);
+	ntp_stats_t ntp;
+	ntp_get_stats(&ntp);
+	printf("sntp:             %u syncs, %u failures, %u requests, %u rejected, %u stale, %u kisses, kept delay %.1f ms min %.1f ms max\n",
+			(unsigned)ntp.syncs, (unsigned)ntp.failures, (unsigned)ntp.requests, (unsigned)ntp.rejected,
+			(unsigned)ntp.stale, (unsigned)ntp.kisses,
+			ntp.min_delay_us / 1000.0, ntp.max_delay_us / 1000.0);
+	temperature_stats_t temp;
+	temperature_reading_t reading = { 0 };
+	int16_t quarters[TEMPERATURE_HISTORY_SIZE];
+	uint32_t history_age;
+	temperature_get_stats(&temp);
+	temperature_get(&reading);
+	int history = temperature_get_history(quarters, TEMPERATURE_HISTORY_SIZE, &history_age);
+	printf("temperature:      %u conversions, %u errors, %u ms max, last %.2f C, %d averages in history\n",
+			(unsigned)temp.conversions, (unsigned)temp.errors, (unsigned)temp.max_conversion_ms, reading.celsius, history);
+	i2c_stats_t i2c = { 0 };
+	i2c_get_stats(&i2c);
+	printf("i2c:              %llu transactions (%.3f/tick), %u operations (%.2f transactions each), %llu command links, %u errors\n",
+			(unsigned long long)sim_i2c_transactions(), sim_i2c_transactions() * per_tick, (unsigned)i2c.operations,
+			i2c.operations ? (double)sim_i2c_transactions() / i2c.operations : 0.0, (unsigned long long)sim_i2c_links(), (unsigned)i2c.errors);
+	i2c_device_stats_t rtc = { 0 };
+	i2c_get_device_stats(DS3231_ADDR, &rtc);
+	printf("i2c ds3231:       %u requests, %.0f us mean latency, %u us max, %u errors (%u timeouts), %u bus recoveries, %u queue full\n",
+			(unsigned)rtc.requests, rtc.requests ? (double)rtc.total_latency_us / rtc.requests : 0.0, (unsigned)rtc.max_latency_us,
+			(unsigned)rtc.errors, (unsigned)rtc.timeouts, (unsigned)i2c.recoveries, (unsigned)i2c.queue_full);
+	uint16_t tubes[DISPLAY_DIGIT_COUNT];
+	char shown[DISPLAY_DIGIT_COUNT + 3];
+	sim_spi_last_frame(tubes, DISPLAY_DIGIT_COUNT);
+	for(int i = 0, j = 0; i < DISPLAY_DIGIT_COUNT; i++){
+		/* one-hot cathodes, most significant digit last */
+		uint16_t digit = tubes[DISPLAY_DIGIT_COUNT - 1 - i] & 0x3ff;
+		shown[j++] = digit ? (char)('0' + __builtin_ctz(digit)) : ' ';
+		if(i == 1 || i == 3) shown[j++] = ':';
+		shown[j] = '\0';
+	}
+	printf("spi:              %llu frames, tubes show %s\n", (unsigned long long)sim_spi_frames(), shown);
+	display_compositor_stats_t comp;
+	display_get_compositor_stats(&comp);
+	printf("compositor:       %u transitions, %u frames, %u dropped, jitter %.1f us avg %u us max, %llu timer alarms\n",
+			(unsigned)comp.transitions, (unsigned)comp.frames, (unsigned)comp.dropped,
+			comp.frames ? (double)comp.total_jitter_us / comp.frames : 0.0, (unsigned)comp.max_jitter_us,
+			(unsigned long long)sim_timer_alarms());
+	const double lit = sim_lit_samples ? sim_lit_sum / sim_lit_samples : 0.0;
+	printf("ledc:             %llu fades, tubes lit %.1f%% of the time, %.1f%% at the end\n",
+			(unsigned long long)sim_ledc_fades(), 100.0 * lit, 100.0 * sim_tubes_lit());
+	uint8_t grb[3] = { 0, 0, 0 };
+	sim_rmt_last_frame(grb, sizeof(grb));
+	printf("rmt:              %llu frames, %llu interrupts, first led r:%d g:%d b:%d\n",
+			(unsigned long long)sim_rmt_frames(), (unsigned long long)sim_rmt_interrupts(), grb[1], grb[0], grb[2]);
+	ws2812_stats_t ws = { 0 };
+	ws2812_get_stats(&ws);
+	printf("ws2812:           %u rendered, %u sent, %u skipped\n",
+			(unsigned)ws.frames_rendered, (unsigned)ws.frames_sent, (unsigned)ws.frames_skipped);
+	printf("time:             clock %+lld s, rtc %+lld s (%+.3f s) vs reference\n",
+			(long long)(timestamp_utc - sim_true_utc()), (long long)(sim_ds3231_get_time() - sim_true_utc()),
+			(sim_ds3231_get_time_us() - sim_true_utc_us()) / 1e6);
+	clock_config_t cfg = clock_get_config();
+	printf("rtc trim:         aging offset %d, oscillator %+.3f ppm, estimated %+.3f ppm untrimmed\n",
+			sim_ds3231_get_aging(), sim_ds3231_get_ppm(), cfg.rtc.ppm);
+	clock_tick_stats_t tk;
+	clock_get_tick_stats(&tk);
+	printf("tick lane:        %u edges, %u ticks, %u late wake-ups, %u max pending, latency %u us max, jitter %u us max\n",
+			(unsigned)tk.edges, (unsigned)tk.ticks, (unsigned)tk.late, (unsigned)tk.max_pending,
+			(unsigned)tk.max_latency_us, (unsigned)tk.max_jitter_us);
+	printf("rtc check:        %u checks, %u corrections, %llu edges lost\n",
+			(unsigned)tk.rtc_checks, (unsigned)tk.rtc_corrections, (unsigned long long)sim_ds3231_dropped_edges());
+	printf("  %-10s %10s %10s\n", "below", "latency", "jitter");
+	for(int b = 0; b < CLOCK_TICK_HISTOGRAM_BUCKETS; b++){
+		if(tk.latency[b] == 0 && tk.jitter[b] == 0) continue;
+		if(b < CLOCK_TICK_HISTOGRAM_BUCKETS - 1){
+			printf("  %7u us %10u %10u\n", (unsigned)(CLOCK_TICK_HISTOGRAM_FIRST_US << b), (unsigned)tk.latency[b], (unsigned)tk.jitter[b]);
+		}
+		else{
+			printf("  %10s %10u %10u\n", "above", (unsigned)tk.latency[b], (unsigned)tk.jitter[b]);
+		}
+	}
+	printf("messages:\n");
+	for(int m = 0; m < CLOCK_MESSAGE_COUNT; m++){
+		clock_message_stats_t st;
+		clock_get_message_stats((clock_message_t)m, &st);
+		if(st.sent == 0 && st.dropped == 0) continue;
+		printf("  %-24s sent %8u  received %8u  dropped %u  coalesced %u  latency %.1f us avg %u max\n",
+				sim_message_name((clock_message_t)m), (unsigned)st.sent, (unsigned)st.received, (unsigned)st.dropped,
+				(unsigned)st.coalesced, st.received ? (double)st.total_latency_us / st.received : 0.0, (unsigned)st.max_latency_us);
+	}
+	printf("tasks:\n");
+	sim_print_tasks(stdout);
+}
+
+int main(int argc, char **argv){
+
+	double days = 1.0;
+	double speed = 0.0;
+	double ppm = 0.0;
+	time_t epoch = SIM_DEFAULT_EPOCH;
+	double ntp_jitter_ms = SIM_DEFAULT_NTP_JITTER_MS;
+	const char *ntp_kiss = NULL;
+	bool rtc_valid = true;
+	double i2c_hang = -1.0;
+	double drop_edge = 0.0;
+	esp_log_level_t level = ESP_LOG_INFO;
+
+	static const struct option options[] = {
+		{ "days", required_argument, NULL, 'd' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "epoch", required_argument, NULL, 'e' },
+		{ "tz", required_argument, NULL, 'z' },
+		{ "transition", required_argument, NULL, 't' },
+		{ "sleep", required_argument, NULL, 'l' },
+		{ "ppm", required_argument, NULL, 'p' },
+		{ "rtc-lost", no_argument, NULL, 'r' },
+		{ "i2c-hang", required_argument, NULL, 'i' },
+		{ "drop-edge", required_argument, NULL, 'g' },
+		{ "offline", no_argument, NULL, 'o' },
+		{ "ntp-jitter", required_argument, NULL, 'n' },
+		{ "ntp-kiss", required_argument, NULL, 'k' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int c;
+	while((c = getopt_long(argc, argv, "vqh", options, NULL)) != -1){
+		switch(c){
+			case 'd': days = atof(optarg); break;
+			case 's': speed = atof(optarg); break;
+			case 'e': epoch = (time_t)atoll(optarg); break;
+			case 'z': sim_option_timezone = optarg; break;
+			case 't': sim_option_transition = optarg; break;
+			case 'l':{
+				int h1, m1, h2, m2;
+				if(sscanf(optarg, "%d:%d-%d:%d", &h1, &m1, &h2, &m2) != 4){
+					sim_usage(argv[0]);
+					return 1;
+				}
+				sim_option_sleep_from = h1 * 3600 + m1 * 60;
+				sim_option_sleep_to = h2 * 3600 + m2 * 60;
+				}
+				break;
+			case 'p': ppm = atof(optarg); break;
+			case 'r': rtc_valid = false; break;
+			case 'i': i2c_hang = atof(optarg); break;
+			case 'g': drop_edge = atof(optarg); break;
+			case 'o': sim_option_online = false; break;
+			case 'n': ntp_jitter_ms = atof(optarg); break;
+			case 'k': ntp_kiss = optarg; break;
+			case 'v': level = ESP_LOG_DEBUG; break;
+			case 'q': level = ESP_LOG_WARN; break;
+			default:
+				sim_usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+
+	/* the esp32 newlib has no timezone set: localtime is gmtime */
+	setenv("TZ", "UTC0", 1);
+	tzset();
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	esp_log_level_set("*", level);
+
+	sim_set_epoch(epoch);
+	sim_http_set_network(sim_option_online);
+	sim_ntp_set_network(sim_option_online);
+	sim_ntp_set_jitter((int64_t)(ntp_jitter_ms * 1000.0));
+	if(ntp_kiss){
+		sim_ntp_set_kiss(ntp_kiss);
+	}
+	sim_periph_init();
+	sim_ds3231_init(epoch, rtc_valid);
+	sim_ds3231_set_ppm(ppm);
+	sim_register_device(&sim_lit_probe);
+	if(i2c_hang >= 0.0){
+		sim_i2c_hang_at((int64_t)(i2c_hang * SIM_US_PER_SECOND));
+	}
+	sim_ds3231_drop_edges((int64_t)(drop_edge * SIM_US_PER_SECOND));
+
+	xTaskCreate(&sim_app_main, "main", 3584, NULL, 1, NULL);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sim_run((int64_t)(days * 86400.0 * SIM_US_PER_SECOND), speed);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	sim_report(days, (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+
+	/* tasks are still blocked in the kernel: do not wait for them */
+	fflush(stdout);
+	_exit(0);
+}
@@ -0,0 +1,277 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_ntp.c
+@author Tony Pottier
+@brief Simulated UDP network and NTP server for the host simulation
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The socket calls of the firmware reach an NTP server that answers with the
+simulation's true UTC. Each way of an exchange takes SIM_NTP_ONE_WAY_US plus a
+random queueing delay of up to the configured jitter, drawn separately for
+both ways, so the offset an exchange measures is off by half the difference.
+An answer later than the client's timeout stays in the socket until read, like
+a real one. Without network, requests are sent and never answered. The server
+can be set to answer every request with a kiss-o'-death.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "sim.h"
+
+
+#define SIM_NTP_MAX_SOCKETS				4
+#define SIM_NTP_FIRST_FD				60
+
+/** @brief answers a socket holds before it drops new ones */
+#define SIM_NTP_MAX_ANSWERS				4
+
+/** @brief shortest time a packet takes to or from the server */
+#define SIM_NTP_ONE_WAY_US				(12 * 1000)
+
+/** @brief time the server holds a request before answering */
+#define SIM_NTP_SERVER_HOLD_US			40
+
+#define SIM_NTP_PACKET_SIZE				48
+#define SIM_NTP_UNIX_EPOCH_OFFSET		2208988800LL
+
+typedef struct sim_answer_t{
+	bool used;
+	int64_t at;									/**< simulated time the answer arrives */
+	uint8_t packet[SIM_NTP_PACKET_SIZE];
+}sim_answer_t;
+
+typedef struct sim_socket_t{
+	bool used;
+	int64_t timeout_us;
+	sim_answer_t answers[SIM_NTP_MAX_ANSWERS];
+}sim_socket_t;
+
+static sim_socket_t sim_sockets[SIM_NTP_MAX_SOCKETS];
+
+static bool sim_ntp_online = true;
+static int64_t sim_ntp_jitter_us = 0;
+static char sim_ntp_kiss_code[4];
+static bool sim_ntp_kiss = false;
+static uint64_t sim_ntp_request_count = 0;
+static uint32_t sim_ntp_random_state = 0x9e3779b9;
+
+
+
+void sim_ntp_set_network(bool online){
+	sim_ntp_online = online;
+}
+
+void sim_ntp_set_jitter(int64_t jitter_us){
+	sim_ntp_jitter_us = jitter_us;
+}
+
+void sim_ntp_set_kiss(const char *code){
+	memset(sim_ntp_kiss_code, ' ', sizeof(sim_ntp_kiss_code));
+	memcpy(sim_ntp_kiss_code, code, strnlen(code, sizeof(sim_ntp_kiss_code)));
+	sim_ntp_kiss = true;
+}
+
+uint64_t sim_ntp_requests(void){
+	return sim_ntp_request_count;
+}
+
+static int64_t sim_ntp_queueing(void){
+	if(sim_ntp_jitter_us <= 0) return 0;
+	uint32_t x = sim_ntp_random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim_ntp_random_state = x;
+	return (int64_t)(x % (uint32_t)(sim_ntp_jitter_us + 1));
+}
+
+static void sim_ntp_write_timestamp(uint8_t *p, int64_t utc_us){
+	uint32_t seconds = (uint32_t)(utc_us / SIM_US_PER_SECOND + SIM_NTP_UNIX_EPOCH_OFFSET);
+	uint32_t fraction = (uint32_t)(((uint64_t)(utc_us % SIM_US_PER_SECOND) << 32) / SIM_US_PER_SECOND);
+	for(int i = 0; i < 4; i++){
+		p[i] = (uint8_t)(seconds >> (24 - 8 * i));
+		p[4 + i] = (uint8_t)(fraction >> (24 - 8 * i));
+	}
+}
+
+static sim_socket_t* sim_socket_get(int s){
+	int i = s - SIM_NTP_FIRST_FD;
+	if(i < 0 || i >= SIM_NTP_MAX_SOCKETS || !sim_sockets[i].used) return NULL;
+	return &sim_sockets[i];
+}
+
+
+
+int sim_lwip_getaddrinfo(const char *nodename, const char *servname, const struct addrinfo *hints, struct addrinfo **res){
+
+	if(!sim_ntp_online) return EAI_AGAIN;
+
+	struct addrinfo *ai = calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in));
+	if(ai == NULL) return EAI_MEMORY;
+	struct sockaddr_in *sin = (struct sockaddr_in*)(ai + 1);
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(servname ? atoi(servname) : 0);
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ai->ai_family = AF_INET;
+	ai->ai_socktype = hints ? hints->ai_socktype : SOCK_DGRAM;
+	ai->ai_addr = (struct sockaddr*)sin;
+	ai->ai_addrlen = sizeof(struct sockaddr_in);
+	*res = ai;
+	return 0;
+}
+
+void sim_lwip_freeaddrinfo(struct addrinfo *ai){
+	free(ai);
+}
+
+int sim_lwip_socket(int domain, int type, int protocol){
+	if(type != SOCK_DGRAM){
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	for(int i = 0; i < SIM_NTP_MAX_SOCKETS; i++){
+		if(!sim_sockets[i].used){
+			memset(&sim_sockets[i], 0x00, sizeof(sim_socket_t));
+			sim_sockets[i].used = true;
+			return SIM_NTP_FIRST_FD + i;
+		}
+	}
+	errno = ENFILE;
+	return -1;
+}
+
+int sim_lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen){
+	sim_socket_t *sock = sim_socket_get(s);
+	if(sock == NULL){
+		errno = EBADF;
+		return -1;
+	}
+	if(level == SOL_SOCKET && optname == SO_RCVTIMEO && optlen >= sizeof(struct timeval)){
+		const struct timeval *tv = (const struct timeval*)optval;
+		sock->timeout_us = (int64_t)tv->tv_sec * SIM_US_PER_SECOND + tv->tv_usec;
+	}
+	return 0;
+}
+
+ssize_t sim_lwip_sendto(int s, const void *data, size_t size, int flags, const struct sockaddr *to, socklen_t tolen){
+
+	sim_socket_t *sock = sim_socket_get(s);
+	if(sock == NULL){
+		errno = EBADF;
+		return -1;
+	}
+
+	const uint8_t *request = (const uint8_t*)data;
+	sim_ntp_request_count++;
+
+	/* only client requests (mode 3) get an answer, and only with a network */
+	if(!sim_ntp_online || size < SIM_NTP_PACKET_SIZE || (request[0] & 0x07) != 3){
+		return (ssize_t)size;
+	}
+
+	sim_answer_t *slot = NULL;
+	for(int i = 0; i < SIM_NTP_MAX_ANSWERS && slot == NULL; i++){
+		if(!sock->answers[i].used) slot = &sock->answers[i];
+	}
+	if(slot == NULL){
+		/* receive buffer full: the answer is lost */
+		return (ssize_t)size;
+	}
+
+	int64_t now = sim_now();
+	int64_t arrival = now + SIM_NTP_ONE_WAY_US + sim_ntp_queueing();
+	int64_t departure = arrival + SIM_NTP_SERVER_HOLD_US;
+	int64_t to_utc = sim_true_utc_us() - now;
+
+	uint8_t *answer = slot->packet;
+	memset(answer, 0x00, SIM_NTP_PACKET_SIZE);
+	answer[0] = (0 << 6) | (4 << 3) | 4;		/* no leap second, version 4, server */
+	answer[1] = 2;								/* stratum */
+	answer[2] = 6;								/* poll */
+	answer[3] = (uint8_t)-20;					/* precision, about 1 us */
+	memcpy(answer + 24, request + 40, 8);		/* originate: the client's transmit timestamp */
+	sim_ntp_write_timestamp(answer + 16, departure + to_utc);
+	sim_ntp_write_timestamp(answer + 32, arrival + to_utc);
+	sim_ntp_write_timestamp(answer + 40, departure + to_utc);
+	if(sim_ntp_kiss){
+		/* stratum 0, the kiss code in the reference id */
+		answer[1] = 0;
+		memcpy(answer + 12, sim_ntp_kiss_code, 4);
+	}
+
+	slot->used = true;
+	slot->at = departure + SIM_NTP_ONE_WAY_US + sim_ntp_queueing();
+
+	return (ssize_t)size;
+}
+
+ssize_t sim_lwip_recvfrom(int s, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen){
+
+	sim_socket_t *sock = sim_socket_get(s);
+	if(sock == NULL){
+		errno = EBADF;
+		return -1;
+	}
+
+	int64_t now = sim_now();
+	int64_t timeout = sock->timeout_us > 0 ? sock->timeout_us : SIM_NEVER;
+
+	/* answers are read in the order they arrive */
+	sim_answer_t *first = NULL;
+	for(int i = 0; i < SIM_NTP_MAX_ANSWERS; i++){
+		sim_answer_t *a = &sock->answers[i];
+		if(a->used && (first == NULL || a->at < first->at)) first = a;
+	}
+
+	if(first == NULL || first->at - now > timeout){
+		sim_sleep(timeout == SIM_NEVER ? SIM_US_PER_SECOND : timeout);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if(first->at > now){
+		sim_sleep(first->at - now);
+	}
+	first->used = false;
+
+	size_t n = len < SIM_NTP_PACKET_SIZE ? len : SIM_NTP_PACKET_SIZE;
+	memcpy(mem, first->packet, n);
+	return (ssize_t)n;
+}
+
+int sim_lwip_close(int s){
+	sim_socket_t *sock = sim_socket_get(s);
+	if(sock == NULL){
+		errno = EBADF;
+		return -1;
+	}
+	sock->used = false;
+	return 0;
+}
@@ -0,0 +1,273 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_nvs.c
+@author Tony Pottier
+@brief In-memory NVS for the host simulation
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Blobs are kept in RAM. Flash usage is accounted the way the real NVS library
+writes it: every item takes 32 byte entries, a blob costs an index entry, a
+data header and its data rounded up to 32 bytes, and writing a value that is
+identical to the stored one is skipped.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#include "sim.h"
+
+
+#define SIM_NVS_MAX_NAMESPACES			8
+#define SIM_NVS_MAX_KEYS				32
+#define SIM_NVS_KEY_NAME_SIZE			16
+#define SIM_NVS_ENTRY_SIZE				32
+
+typedef struct sim_nvs_item_t{
+	char key[SIM_NVS_KEY_NAME_SIZE];
+	void *data;
+	size_t length;
+}sim_nvs_item_t;
+
+typedef struct sim_nvs_namespace_t{
+	char name[SIM_NVS_KEY_NAME_SIZE];
+	sim_nvs_item_t items[SIM_NVS_MAX_KEYS];
+}sim_nvs_namespace_t;
+
+static pthread_mutex_t sim_nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_nvs_namespace_t sim_nvs_namespaces[SIM_NVS_MAX_NAMESPACES];
+static uint64_t sim_nvs_written = 0;
+static uint64_t sim_nvs_commit_count = 0;
+
+/* handles encode the namespace index and the open mode */
+#define SIM_NVS_HANDLE(ns, mode)		((nvs_handle_t)(((ns) + 1) | ((mode) == NVS_READWRITE ? 0x100 : 0)))
+#define SIM_NVS_HANDLE_NS(h)			((int)((h) & 0xff) - 1)
+#define SIM_NVS_HANDLE_WRITABLE(h)		(((h) & 0x100) != 0)
+
+
+uint64_t sim_nvs_bytes_written(void){
+	return sim_nvs_written;
+}
+
+uint64_t sim_nvs_commits(void){
+	return sim_nvs_commit_count;
+}
+
+esp_err_t nvs_flash_init(void){
+	return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle){
+
+	if(name == NULL || out_handle == NULL) return ESP_ERR_INVALID_ARG;
+	if(strlen(name) >= SIM_NVS_KEY_NAME_SIZE) return ESP_ERR_NVS_INVALID_NAME;
+
+	esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+	pthread_mutex_lock(&sim_nvs_lock);
+
+	int free_slot = -1;
+	for(int i = 0; i < SIM_NVS_MAX_NAMESPACES; i++){
+		if(sim_nvs_namespaces[i].name[0] == '\0'){
+			if(free_slot < 0) free_slot = i;
+		}
+		else if(strcmp(sim_nvs_namespaces[i].name, name) == 0){
+			*out_handle = SIM_NVS_HANDLE(i, open_mode);
+			ret = ESP_OK;
+			break;
+		}
+	}
+
+	if(ret != ESP_OK && open_mode == NVS_READWRITE){
+		if(free_slot < 0){
+			ret = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+		}
+		else{
+			strcpy(sim_nvs_namespaces[free_slot].name, name);
+			sim_nvs_written += SIM_NVS_ENTRY_SIZE;
+			*out_handle = SIM_NVS_HANDLE(free_slot, open_mode);
+			ret = ESP_OK;
+		}
+	}
+
+	pthread_mutex_unlock(&sim_nvs_lock);
+	return ret;
+}
+
+void nvs_close(nvs_handle_t handle){
+	/* nothing to release: handles are plain indexes */
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle){
+	if(SIM_NVS_HANDLE_NS(handle) < 0 || SIM_NVS_HANDLE_NS(handle) >= SIM_NVS_MAX_NAMESPACES) return ESP_ERR_NVS_INVALID_HANDLE;
+	sim_nvs_commit_count++;
+	return ESP_OK;
+}
+
+static sim_nvs_item_t* sim_nvs_find(nvs_handle_t handle, const char *key, bool create){
+
+	sim_nvs_namespace_t *ns = &sim_nvs_namespaces[SIM_NVS_HANDLE_NS(handle)];
+	sim_nvs_item_t *free_item = NULL;
+
+	for(int i = 0; i < SIM_NVS_MAX_KEYS; i++){
+		sim_nvs_item_t *item = &ns->items[i];
+		if(item->key[0] == '\0'){
+			if(free_item == NULL) free_item = item;
+		}
+		else if(strcmp(item->key, key) == 0){
+			return item;
+		}
+	}
+
+	if(create && free_item){
+		strcpy(free_item->key, key);
+		return free_item;
+	}
+
+	return NULL;
+}
+
+static esp_err_t sim_nvs_check(nvs_handle_t handle, const char *key, bool write){
+	int ns = SIM_NVS_HANDLE_NS(handle);
+	if(ns < 0 || ns >= SIM_NVS_MAX_NAMESPACES || sim_nvs_namespaces[ns].name[0] == '\0') return ESP_ERR_NVS_INVALID_HANDLE;
+	if(write && !SIM_NVS_HANDLE_WRITABLE(handle)) return ESP_ERR_NVS_READ_ONLY;
+	if(key == NULL || strlen(key) >= SIM_NVS_KEY_NAME_SIZE) return ESP_ERR_NVS_INVALID_NAME;
+	return ESP_OK;
+}
+
+static esp_err_t sim_nvs_set(nvs_handle_t handle, const char* key, const void* value, size_t length, size_t flash_size){
+
+	esp_err_t ret = sim_nvs_check(handle, key, true);
+	if(ret != ESP_OK) return ret;
+
+	pthread_mutex_lock(&sim_nvs_lock);
+	sim_nvs_item_t *item = sim_nvs_find(handle, key, true);
+	if(item == NULL){
+		ret = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+	}
+	else if(item->data && item->length == length && memcmp(item->data, value, length) == 0){
+		/* identical value: the nvs library does not rewrite it */
+	}
+	else{
+		void *data = realloc(item->data, length ? length : 1);
+		if(data == NULL){
+			ret = ESP_ERR_NO_MEM;
+		}
+		else{
+			memcpy(data, value, length);
+			item->data = data;
+			item->length = length;
+			sim_nvs_written += flash_size;
+		}
+	}
+	pthread_mutex_unlock(&sim_nvs_lock);
+
+	return ret;
+}
+
+static esp_err_t sim_nvs_get(nvs_handle_t handle, const char* key, void* out_value, size_t* length, bool exact){
+
+	esp_err_t ret = sim_nvs_check(handle, key, false);
+	if(ret != ESP_OK) return ret;
+
+	pthread_mutex_lock(&sim_nvs_lock);
+	sim_nvs_item_t *item = sim_nvs_find(handle, key, false);
+	if(item == NULL || item->data == NULL){
+		ret = ESP_ERR_NVS_NOT_FOUND;
+	}
+	else if(out_value == NULL){
+		*length = item->length;
+	}
+	else if(exact ? (*length != item->length) : (*length < item->length)){
+		*length = item->length;
+		ret = exact ? ESP_ERR_NVS_TYPE_MISMATCH : ESP_ERR_NVS_INVALID_LENGTH;
+	}
+	else{
+		memcpy(out_value, item->data, item->length);
+		*length = item->length;
+	}
+	pthread_mutex_unlock(&sim_nvs_lock);
+
+	return ret;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key){
+
+	esp_err_t ret = sim_nvs_check(handle, key, true);
+	if(ret != ESP_OK) return ret;
+
+	pthread_mutex_lock(&sim_nvs_lock);
+	sim_nvs_item_t *item = sim_nvs_find(handle, key, false);
+	if(item == NULL){
+		ret = ESP_ERR_NVS_NOT_FOUND;
+	}
+	else{
+		free(item->data);
+		memset(item, 0x00, sizeof(sim_nvs_item_t));
+	}
+	pthread_mutex_unlock(&sim_nvs_lock);
+
+	return ret;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle){
+
+	esp_err_t ret = sim_nvs_check(handle, "", true);
+	if(ret != ESP_OK) return ret;
+
+	pthread_mutex_lock(&sim_nvs_lock);
+	sim_nvs_namespace_t *ns = &sim_nvs_namespaces[SIM_NVS_HANDLE_NS(handle)];
+	for(int i = 0; i < SIM_NVS_MAX_KEYS; i++){
+		free(ns->items[i].data);
+		memset(&ns->items[i], 0x00, sizeof(sim_nvs_item_t));
+	}
+	pthread_mutex_unlock(&sim_nvs_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length){
+	if(value == NULL && length) return ESP_ERR_INVALID_ARG;
+	/* blob index entry + data header entry + data rounded to whole entries */
+	size_t flash_size = 2 * SIM_NVS_ENTRY_SIZE + ((length + SIM_NVS_ENTRY_SIZE - 1) / SIM_NVS_ENTRY_SIZE) * SIM_NVS_ENTRY_SIZE;
+	return sim_nvs_set(handle, key, value, length, flash_size);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length){
+	if(length == NULL) return ESP_ERR_INVALID_ARG;
+	return sim_nvs_get(handle, key, out_value, length, false);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value){
+	return sim_nvs_set(handle, key, &value, sizeof(value), SIM_NVS_ENTRY_SIZE);
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* out_value){
+	size_t length = sizeof(uint32_t);
+	if(out_value == NULL) return ESP_ERR_INVALID_ARG;
+	return sim_nvs_get(handle, key, out_value, &length, true);
+}
@@ -0,0 +1,802 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sim_periph.c
+@author Tony Pottier
+@brief Simulated GPIO, SPI, RMT, LEDC and timer peripherals for the host build
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+SPI transactions take the time the real bus would take at the configured
+clock speed, so queued transfers complete asynchronously. The RMT model plays
+the channel memory back the way the hardware does: it raises the threshold
+interrupt every tx_lim entries, follows the wrap-around, stops on a zero
+duration and raises the end interrupt. Pulses are decoded back into GRB bytes
+so the colour the strip would show can be checked. LEDC channels keep their
+duty and fade linearly over simulated time; a pin driven by LEDC reports its
+average level. General purpose timers raise their alarm interrupt on
+schedule in simulated time.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_intr_alloc.h"
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "driver/rmt.h"
+#include "driver/ledc.h"
+#include "driver/timer.h"
+#include "soc/rmt_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "esp32/rom/gpio.h"
+
+#include "sim.h"
+
+
+#define SIM_SPI_MAX_QUEUE				16
+#define SIM_SPI_MAX_FRAME				64
+#define SIM_RMT_CHANNELS				8
+#define SIM_RMT_MAX_FRAME				256
+#define SIM_LEDC_CHANNELS				(LEDC_SPEED_MODE_MAX * LEDC_CHANNEL_MAX)
+
+/** @brief RMT source clock is the 80MHz APB clock: 12.5ns per tick before the divider */
+#define SIM_RMT_TICK_NS					12.5
+
+/** @brief a WS2812 high pulse longer than this is a 1 bit (T0H=350ns, T1H=900ns) */
+#define SIM_WS2812_T1H_THRESHOLD_NS		625.0
+
+
+
+rmt_dev_t RMT;
+rmt_mem_t RMTMEM;
+
+typedef struct sim_gpio_t{
+	gpio_mode_t mode;
+	uint32_t level;
+	bool held_low;								/**< an open drain line pulled down by a device */
+	void (*level_hook)(int level);
+	gpio_int_type_t intr_type;
+	gpio_isr_t isr;
+	void *isr_args;
+}sim_gpio_t;
+
+struct spi_device_t{
+	int clock_speed_hz;
+	int queue_size;
+	spi_transaction_t *pending[SIM_SPI_MAX_QUEUE];
+	int64_t pending_end[SIM_SPI_MAX_QUEUE];
+	int pending_count;
+	QueueHandle_t done;
+	SemaphoreHandle_t slots;
+};
+
+struct intr_handle_data_t{
+	int source;
+	intr_handler_t handler;
+	void *arg;
+};
+
+static sim_gpio_t sim_gpios[GPIO_NUM_MAX];
+static bool sim_gpio_isr_service = false;
+
+static pthread_mutex_t sim_spi_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spi_device_t *sim_spi_dev = NULL;
+static uint8_t sim_spi_frame[SIM_SPI_MAX_FRAME];
+static size_t sim_spi_frame_len = 0;
+static uint64_t sim_spi_frame_count = 0;
+
+static struct intr_handle_data_t sim_rmt_intr = { 0 };
+static uint8_t sim_rmt_frame[SIM_RMT_MAX_FRAME];
+static size_t sim_rmt_frame_len = 0;
+static uint64_t sim_rmt_frame_count = 0;
+static uint64_t sim_rmt_interrupt_count = 0;
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* GPIO                                                                                                             */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+esp_err_t gpio_config(const gpio_config_t *pGPIOConfig){
+	for(int i = 0; i < GPIO_NUM_MAX; i++){
+		if(pGPIOConfig->pin_bit_mask & (1ULL << i)){
+			sim_gpios[i].mode = pGPIOConfig->mode;
+			sim_gpios[i].intr_type = pGPIOConfig->intr_type;
+		}
+	}
+	return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return ESP_ERR_INVALID_ARG;
+	memset(&sim_gpios[gpio_num], 0x00, sizeof(sim_gpio_t));
+	return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return ESP_ERR_INVALID_ARG;
+	sim_gpios[gpio_num].mode = mode;
+	return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return ESP_ERR_INVALID_ARG;
+	sim_gpios[gpio_num].level = level ? 1 : 0;
+	if(sim_gpios[gpio_num].level_hook){
+		sim_gpios[gpio_num].level_hook((int)sim_gpios[gpio_num].level);
+	}
+	return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return 0;
+	if(sim_gpios[gpio_num].held_low) return 0;
+	/* inputs read low: no USB power, no button pressed */
+	return (sim_gpios[gpio_num].mode & GPIO_MODE_OUTPUT) ? (int)sim_gpios[gpio_num].level : 0;
+}
+
+void sim_gpio_set_level_hook(int gpio_num, void (*hook)(int level)){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return;
+	sim_gpios[gpio_num].level_hook = hook;
+}
+
+void sim_gpio_hold_low(int gpio_num, bool low){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return;
+	sim_gpios[gpio_num].held_low = low;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags){
+	if(sim_gpio_isr_service) return ESP_ERR_INVALID_STATE;
+	sim_gpio_isr_service = true;
+	return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return ESP_ERR_INVALID_ARG;
+	if(!sim_gpio_isr_service) return ESP_ERR_INVALID_STATE;
+	sim_gpios[gpio_num].isr = isr_handler;
+	sim_gpios[gpio_num].isr_args = args;
+	return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num){
+	if(gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) return ESP_ERR_INVALID_ARG;
+	sim_gpios[gpio_num].isr = NULL;
+	sim_gpios[gpio_num].isr_args = NULL;
+	return ESP_OK;
+}
+
+void sim_gpio_raise_isr(int gpio_num){
+	sim_gpio_t *g = &sim_gpios[gpio_num];
+	if(g->isr && g->intr_type != GPIO_INTR_DISABLE){
+		g->isr(g->isr_args);
+	}
+}
+
+int sim_gpio_get_output(int gpio_num){
+	return (int)sim_gpios[gpio_num].level;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* SPI                                                                                                              */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config, int dma_chan){
+	return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *dev_config, spi_device_handle_t *handle){
+
+	if(dev_config->queue_size <= 0 || dev_config->queue_size > SIM_SPI_MAX_QUEUE) return ESP_ERR_INVALID_ARG;
+
+	struct spi_device_t *dev = calloc(1, sizeof(struct spi_device_t));
+	if(dev == NULL) return ESP_ERR_NO_MEM;
+
+	dev->clock_speed_hz = dev_config->clock_speed_hz;
+	dev->queue_size = dev_config->queue_size;
+	dev->done = xQueueCreate(dev_config->queue_size, sizeof(spi_transaction_t*));
+	dev->slots = xSemaphoreCreateCounting(dev_config->queue_size, dev_config->queue_size);
+
+	pthread_mutex_lock(&sim_spi_lock);
+	sim_spi_dev = dev;
+	pthread_mutex_unlock(&sim_spi_lock);
+
+	*handle = dev;
+	return ESP_OK;
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans_desc, TickType_t ticks_to_wait){
+
+	if(xSemaphoreTake(handle->slots, ticks_to_wait) != pdTRUE) return ESP_ERR_TIMEOUT;
+
+	pthread_mutex_lock(&sim_spi_lock);
+	int64_t start = sim_now();
+	if(handle->pending_count > 0 && handle->pending_end[handle->pending_count - 1] > start){
+		start = handle->pending_end[handle->pending_count - 1];
+	}
+	handle->pending[handle->pending_count] = trans_desc;
+	handle->pending_end[handle->pending_count] = start + ((int64_t)trans_desc->length * SIM_US_PER_SECOND) / handle->clock_speed_hz;
+	handle->pending_count++;
+	pthread_mutex_unlock(&sim_spi_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans_desc, TickType_t ticks_to_wait){
+
+	if(xQueueReceive(handle->done, trans_desc, ticks_to_wait) != pdTRUE) return ESP_ERR_TIMEOUT;
+	xSemaphoreGive(handle->slots);
+
+	return ESP_OK;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc){
+	spi_transaction_t *ret;
+	esp_err_t err = spi_device_queue_trans(handle, trans_desc, portMAX_DELAY);
+	if(err != ESP_OK) return err;
+	return spi_device_get_trans_result(handle, &ret, portMAX_DELAY);
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc){
+	return spi_device_transmit(handle, trans_desc);
+}
+
+static int64_t sim_spi_next_event(void){
+	int64_t next = SIM_NEVER;
+	pthread_mutex_lock(&sim_spi_lock);
+	if(sim_spi_dev && sim_spi_dev->pending_count > 0){
+		next = sim_spi_dev->pending_end[0];
+	}
+	pthread_mutex_unlock(&sim_spi_lock);
+	return next;
+}
+
+static void sim_spi_fire(int64_t now){
+
+	spi_transaction_t *t = NULL;
+
+	pthread_mutex_lock(&sim_spi_lock);
+	struct spi_device_t *dev = sim_spi_dev;
+	if(dev && dev->pending_count > 0 && dev->pending_end[0] <= now){
+		t = dev->pending[0];
+		dev->pending_count--;
+		memmove(&dev->pending[0], &dev->pending[1], sizeof(dev->pending[0]) * dev->pending_count);
+		memmove(&dev->pending_end[0], &dev->pending_end[1], sizeof(dev->pending_end[0]) * dev->pending_count);
+
+		/* latch what was shifted out, that is what the tubes show */
+		size_t len = (t->length + 7) / 8;
+		if(len > SIM_SPI_MAX_FRAME) len = SIM_SPI_MAX_FRAME;
+		memcpy(sim_spi_frame, (t->flags & SPI_TRANS_USE_TXDATA) ? (const void*)t->tx_data : t->tx_buffer, len);
+		sim_spi_frame_len = len;
+		sim_spi_frame_count++;
+	}
+	pthread_mutex_unlock(&sim_spi_lock);
+
+	if(t){
+		xQueueSendFromISR(dev->done, &t, NULL);
+	}
+}
+
+uint64_t sim_spi_frames(void){
+	return sim_spi_frame_count;
+}
+
+void sim_spi_last_frame(uint16_t words[], int count){
+	pthread_mutex_lock(&sim_spi_lock);
+	for(int i = 0; i < count; i++){
+		/* shift registers are big endian */
+		words[i] = ((size_t)(2*i + 1) < sim_spi_frame_len) ? (uint16_t)((sim_spi_frame[2*i] << 8) | sim_spi_frame[2*i + 1]) : 0;
+	}
+	pthread_mutex_unlock(&sim_spi_lock);
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* RMT                                                                                                              */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+esp_err_t rmt_set_pin(rmt_channel_t channel, rmt_mode_t mode, gpio_num_t gpio_num){
+	if(channel >= RMT_CHANNEL_MAX) return ESP_ERR_INVALID_ARG;
+	return ESP_OK;
+}
+
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg, intr_handle_t *ret_handle){
+	if(source != ETS_RMT_INTR_SOURCE) return ESP_ERR_NOT_SUPPORTED;
+	sim_rmt_intr.source = source;
+	sim_rmt_intr.handler = handler;
+	sim_rmt_intr.arg = arg;
+	if(ret_handle) *ret_handle = &sim_rmt_intr;
+	return ESP_OK;
+}
+
+esp_err_t esp_intr_free(intr_handle_t handle){
+	if(handle) handle->handler = NULL;
+	return ESP_OK;
+}
+
+/** @brief raises an RMT interrupt if enabled, then acknowledges whatever the handler cleared */
+static void sim_rmt_raise(uint32_t mask){
+	if((RMT.int_ena.val & mask) == 0 || sim_rmt_intr.handler == NULL) return;
+
+	RMT.int_raw.val |= mask;
+	RMT.int_st.val |= mask;
+	sim_rmt_interrupt_count++;
+	sim_rmt_intr.handler(sim_rmt_intr.arg);
+
+	uint32_t clr = RMT.int_clr.val;
+	RMT.int_raw.val &= ~clr;
+	RMT.int_st.val &= ~clr;
+	RMT.int_clr.val = 0;
+}
+
+/** @brief decodes a single half of a pulse pair. Returns false on the end marker */
+static bool sim_rmt_pulse(int channel, uint32_t duration, uint32_t level, uint8_t *bits, size_t *bit_count){
+	if(duration == 0) return false;
+
+	if(level){
+		double ns = duration * RMT.conf_ch[channel].conf0.div_cnt * SIM_RMT_TICK_NS;
+		if(*bit_count < SIM_RMT_MAX_FRAME * 8){
+			if(ns > SIM_WS2812_T1H_THRESHOLD_NS){
+				bits[*bit_count / 8] |= (uint8_t)(0x80 >> (*bit_count % 8));
+			}
+			(*bit_count)++;
+		}
+	}
+	return true;
+}
+
+static void sim_rmt_transmit(int channel){
+
+	uint8_t bits[SIM_RMT_MAX_FRAME];
+	size_t bit_count = 0;
+	memset(bits, 0x00, sizeof(bits));
+
+	volatile rmt_item32_t *mem = &RMTMEM.chan[channel].data32[0];
+	unsigned int blocks = RMT.conf_ch[channel].conf0.mem_size;
+	if(blocks == 0) blocks = 1;
+	if(channel + blocks > SIM_RMT_CHANNELS) blocks = SIM_RMT_CHANNELS - channel;
+	const unsigned int total = blocks * 64;
+	const unsigned int limit = RMT.tx_lim_ch[channel].limit;
+
+	unsigned int pos = 0;
+	unsigned long sent = 0;
+	bool more = true;
+
+	while(more && sent < 100000){
+
+		rmt_item32_t item;
+		item.val = mem[pos].val;
+
+		more = sim_rmt_pulse(channel, item.duration0, item.level0, bits, &bit_count) &&
+			   sim_rmt_pulse(channel, item.duration1, item.level1, bits, &bit_count);
+		sent++;
+
+		if(more && limit && (sent % limit) == 0){
+			sim_rmt_raise(1u << (24 + channel));
+		}
+
+		pos++;
+		if(pos >= total){
+			if(RMT.apb_conf.mem_tx_wrap_en) pos = 0;
+			else more = false;
+		}
+	}
+
+	memcpy(sim_rmt_frame, bits, (bit_count + 7) / 8);
+	sim_rmt_frame_len = bit_count / 8;
+	sim_rmt_frame_count++;
+
+	sim_rmt_raise(1u << (3 * channel));
+}
+
+static bool sim_rmt_poll(void){
+	bool busy = false;
+	for(int c = 0; c < SIM_RMT_CHANNELS; c++){
+		if(RMT.conf_ch[c].conf1.tx_start){
+			RMT.conf_ch[c].conf1.tx_start = 0;
+			RMT.conf_ch[c].conf1.mem_rd_rst = 0;
+			sim_rmt_transmit(c);
+			busy = true;
+		}
+	}
+	return busy;
+}
+
+uint64_t sim_rmt_frames(void){
+	return sim_rmt_frame_count;
+}
+
+uint64_t sim_rmt_interrupts(void){
+	return sim_rmt_interrupt_count;
+}
+
+size_t sim_rmt_last_frame(uint8_t *grb, size_t len){
+	if(len > sim_rmt_frame_len) len = sim_rmt_frame_len;
+	memcpy(grb, sim_rmt_frame, len);
+	return len;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* LEDC                                                                                                             */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+typedef struct sim_ledc_channel_t{
+	bool configured;
+	int gpio_num;
+	ledc_timer_t timer;
+	bool running;
+	uint32_t idle_level;
+	uint32_t duty;				/* duty latched by the last update or fade start */
+	uint32_t pending_duty;		/* duty set but not yet updated */
+	uint32_t fade_target;
+	int64_t fade_start;
+	int64_t fade_duration;
+	int64_t armed_duration;		/* set by ledc_set_fade_with_time, started by ledc_fade_start */
+}sim_ledc_channel_t;
+
+static pthread_mutex_t sim_ledc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t sim_ledc_resolution[LEDC_SPEED_MODE_MAX][LEDC_TIMER_MAX];
+static sim_ledc_channel_t sim_ledc[SIM_LEDC_CHANNELS];
+static bool sim_ledc_fade_installed = false;
+static uint64_t sim_ledc_fade_count = 0;
+
+static sim_ledc_channel_t *sim_ledc_get(ledc_mode_t speed_mode, ledc_channel_t channel){
+	if(speed_mode >= LEDC_SPEED_MODE_MAX || channel >= LEDC_CHANNEL_MAX) return NULL;
+	return &sim_ledc[speed_mode * LEDC_CHANNEL_MAX + channel];
+}
+
+/** @brief duty at simulated time now, following a fade if one is in progress. Lock must be held. */
+static uint32_t sim_ledc_duty_at(sim_ledc_channel_t *c, int64_t now){
+	if(c->fade_duration <= 0) return c->duty;
+	if(now >= c->fade_start + c->fade_duration) return c->fade_target;
+	const double t = (double)(now - c->fade_start) / (double)c->fade_duration;
+	return (uint32_t)((double)c->duty + ((double)c->fade_target - (double)c->duty) * t);
+}
+
+/** @brief ends any fade at its current position. Lock must be held. */
+static void sim_ledc_settle(sim_ledc_channel_t *c, int64_t now){
+	c->duty = sim_ledc_duty_at(c, now);
+	c->fade_duration = 0;
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf){
+	if(timer_conf->speed_mode >= LEDC_SPEED_MODE_MAX || timer_conf->timer_num >= LEDC_TIMER_MAX || timer_conf->freq_hz == 0) return ESP_ERR_INVALID_ARG;
+	sim_ledc_resolution[timer_conf->speed_mode][timer_conf->timer_num] = timer_conf->duty_resolution;
+	return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *ledc_conf){
+	sim_ledc_channel_t *c = sim_ledc_get(ledc_conf->speed_mode, ledc_conf->channel);
+	if(c == NULL || ledc_conf->gpio_num < 0 || ledc_conf->gpio_num >= GPIO_NUM_MAX) return ESP_ERR_INVALID_ARG;
+
+	pthread_mutex_lock(&sim_ledc_lock);
+	memset(c, 0x00, sizeof(sim_ledc_channel_t));
+	c->configured = true;
+	c->gpio_num = ledc_conf->gpio_num;
+	c->timer = ledc_conf->timer_sel;
+	c->duty = c->pending_duty = ledc_conf->duty;
+	c->running = true;
+	pthread_mutex_unlock(&sim_ledc_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t duty){
+	sim_ledc_channel_t *c = sim_ledc_get(speed_mode, channel);
+	if(c == NULL) return ESP_ERR_INVALID_ARG;
+	pthread_mutex_lock(&sim_ledc_lock);
+	c->pending_duty = duty;
+	pthread_mutex_unlock(&sim_ledc_lock);
+	return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t speed_mode, ledc_channel_t channel){
+	sim_ledc_channel_t *c = sim_ledc_get(speed_mode, channel);
+	if(c == NULL) return ESP_ERR_INVALID_ARG;
+	pthread_mutex_lock(&sim_ledc_lock);
+	c->duty = c->pending_duty;
+	c->fade_duration = 0;
+	c->running = true;
+	pthread_mutex_unlock(&sim_ledc_lock);
+	return ESP_OK;
+}
+
+uint32_t ledc_get_duty(ledc_mode_t speed_mode, ledc_channel_t channel){
+	sim_ledc_channel_t *c = sim_ledc_get(speed_mode, channel);
+	if(c == NULL) return 0;
+	pthread_mutex_lock(&sim_ledc_lock);
+	uint32_t duty = sim_ledc_duty_at(c, sim_now());
+	pthread_mutex_unlock(&sim_ledc_lock);
+	return duty;
+}
+
+esp_err_t ledc_stop(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t idle_level){
+	sim_ledc_channel_t *c = sim_ledc_get(speed_mode, channel);
+	if(c == NULL) return ESP_ERR_INVALID_ARG;
+	pthread_mutex_lock(&sim_ledc_lock);
+	sim_ledc_settle(c, sim_now());
+	c->running = false;
+	c->idle_level = idle_level ? 1 : 0;
+	pthread_mutex_unlock(&sim_ledc_lock);
+	return ESP_OK;
+}
+
+esp_err_t ledc_fade_func_install(int intr_alloc_flags){
+	if(sim_ledc_fade_installed) return ESP_FAIL;
+	sim_ledc_fade_installed = true;
+	return ESP_OK;
+}
+
+esp_err_t ledc_set_fade_with_time(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t target_duty, int max_fade_time_ms){
+	sim_ledc_channel_t *c = sim_ledc_get(speed_mode, channel);
+	if(c == NULL || !sim_ledc_fade_installed) return ESP_ERR_INVALID_STATE;
+	pthread_mutex_lock(&sim_ledc_lock);
+	c->pending_duty = target_duty;
+	c->armed_duration = (int64_t)max_fade_time_ms * 1000;
+	pthread_mutex_unlock(&sim_ledc_lock);
+	return ESP_OK;
+}
+
+esp_err_t ledc_fade_start(ledc_mode_t speed_mode, ledc_channel_t channel, ledc_fade_mode_t fade_mode){
+	sim_ledc_channel_t *c = sim_ledc_get(speed_mode, channel);
+	if(c == NULL || !sim_ledc_fade_installed) return ESP_ERR_INVALID_STATE;
+	pthread_mutex_lock(&sim_ledc_lock);
+	const int64_t now = sim_now();
+	const int64_t duration = c->armed_duration;
+	sim_ledc_settle(c, now);
+	c->fade_target = c->pending_duty;
+	c->fade_start = now;
+	c->fade_duration = duration;
+	c->armed_duration = 0;
+	c->running = true;
+	sim_ledc_fade_count++;
+	pthread_mutex_unlock(&sim_ledc_lock);
+
+	if(fade_mode == LEDC_FADE_WAIT_DONE && duration > 0){
+		vTaskDelay(pdMS_TO_TICKS(duration / 1000));
+	}
+	return ESP_OK;
+}
+
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv){
+	if(signal_idx != SIG_GPIO_OUT_IDX) return;
+	pthread_mutex_lock(&sim_ledc_lock);
+	for(int i = 0; i < SIM_LEDC_CHANNELS; i++){
+		if(sim_ledc[i].configured && sim_ledc[i].gpio_num == (int)gpio){
+			sim_ledc[i].configured = false;
+		}
+	}
+	pthread_mutex_unlock(&sim_ledc_lock);
+}
+
+double sim_ledc_output_level(int gpio_num){
+	double level = -1.0;
+
+	pthread_mutex_lock(&sim_ledc_lock);
+	for(int i = 0; i < SIM_LEDC_CHANNELS; i++){
+		sim_ledc_channel_t *c = &sim_ledc[i];
+		if(!c->configured || c->gpio_num != gpio_num) continue;
+		if(c->running){
+			const uint32_t bits = sim_ledc_resolution[i / LEDC_CHANNEL_MAX][c->timer];
+			level = (double)sim_ledc_duty_at(c, sim_now()) / (double)(1u << bits);
+		}
+		else{
+			level = (double)c->idle_level;
+		}
+	}
+	pthread_mutex_unlock(&sim_ledc_lock);
+
+	return level < 0.0 ? (double)sim_gpio_get_output(gpio_num) : level;
+}
+
+uint64_t sim_ledc_fades(void){
+	return sim_ledc_fade_count;
+}
+
+
+
+/* ---------------------------------------------------------------------------------------------------------------- */
+/* TIMER GROUPS                                                                                                     */
+/* ---------------------------------------------------------------------------------------------------------------- */
+
+typedef struct sim_timer_t{
+	bool initialized;
+	bool running;
+	bool alarm_en;
+	bool auto_reload;
+	uint32_t divider;
+	uint64_t alarm_value;
+	int64_t next_alarm;
+	void (*isr)(void*);
+	void *isr_arg;
+}sim_timer_t;
+
+static pthread_mutex_t sim_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_timer_t sim_timers[TIMER_GROUP_MAX][TIMER_MAX];
+static uint64_t sim_timer_alarm_count = 0;
+
+static sim_timer_t *sim_timer_get(timer_group_t group_num, timer_idx_t timer_num){
+	if(group_num >= TIMER_GROUP_MAX || timer_num >= TIMER_MAX) return NULL;
+	return &sim_timers[group_num][timer_num];
+}
+
+/** @brief alarm period in simulated microseconds. Lock must be held. */
+static int64_t sim_timer_period(const sim_timer_t *t){
+	int64_t period = (int64_t)(((double)t->alarm_value * (double)t->divider * 1e6) / (double)TIMER_BASE_CLK + 0.5);
+	return period > 0 ? period : 1;
+}
+
+esp_err_t timer_init(timer_group_t group_num, timer_idx_t timer_num, const timer_config_t *config){
+	sim_timer_t *t = sim_timer_get(group_num, timer_num);
+	if(t == NULL || config->divider < 2 || config->divider > 65536) return ESP_ERR_INVALID_ARG;
+	pthread_mutex_lock(&sim_timer_lock);
+	t->initialized = true;
+	t->running = config->counter_en == TIMER_START;
+	t->alarm_en = config->alarm_en == TIMER_ALARM_EN;
+	t->auto_reload = config->auto_reload == TIMER_AUTORELOAD_EN;
+	t->divider = config->divider;
+	pthread_mutex_unlock(&sim_timer_lock);
+	return ESP_OK;
+}
+
+esp_err_t timer_set_counter_value(timer_group_t group_num, timer_idx_t timer_num, uint64_t load_val){
+	sim_timer_t *t = sim_timer_get(group_num, timer_num);
+	if(t == NULL || !t->initialized) return ESP_ERR_INVALID_STATE;
+	/* only reloading to zero is modelled: the next alarm is a full period away */
+	pthread_mutex_lock(&sim_timer_lock);
+	t->next_alarm = sim_now() + sim_timer_period(t);
+	pthread_mutex_unlock(&sim_timer_lock);
+	return ESP_OK;
+}
+
+esp_err_t timer_set_alarm_value(timer_group_t group_num, timer_idx_t timer_num, uint64_t alarm_value){
+	sim_timer_t *t = sim_timer_get(group_num, timer_num);
+	if(t == NULL || !t->initialized) return ESP_ERR_INVALID_STATE;
+	pthread_mutex_lock(&sim_timer_lock);
+	t->alarm_value = alarm_value;
+	pthread_mutex_unlock(&sim_timer_lock);
+	return ESP_OK;
+}
+
+esp_err_t timer_enable_intr(timer_group_t group_num, timer_idx_t timer_num){
+	return sim_timer_get(group_num, timer_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t timer_isr_register(timer_group_t group_num, timer_idx_t timer_num, void (*fn)(void*), void *arg, int intr_alloc_flags, timer_isr_handle_t *handle){
+	sim_timer_t *t = sim_timer_get(group_num, timer_num);
+	if(t == NULL || fn == NULL) return ESP_ERR_INVALID_ARG;
+	pthread_mutex_lock(&sim_timer_lock);
+	t->isr = fn;
+	t->isr_arg = arg;
+	pthread_mutex_unlock(&sim_timer_lock);
+	if(handle) *handle = NULL;
+	return ESP_OK;
+}
+
+esp_err_t timer_start(timer_group_t group_num, timer_idx_t timer_num){
+	sim_timer_t *t = sim_timer_get(group_num, timer_num);
+	if(t == NULL || !t->initialized) return ESP_ERR_INVALID_STATE;
+	pthread_mutex_lock(&sim_timer_lock);
+	if(!t->running && t->next_alarm <= sim_now()) t->next_alarm = sim_now() + sim_timer_period(t);
+	t->running = true;
+	pthread_mutex_unlock(&sim_timer_lock);
+	return ESP_OK;
+}
+
+esp_err_t timer_pause(timer_group_t group_num, timer_idx_t timer_num){
+	sim_timer_t *t = sim_timer_get(group_num, timer_num);
+	if(t == NULL || !t->initialized) return ESP_ERR_INVALID_STATE;
+	pthread_mutex_lock(&sim_timer_lock);
+	t->running = false;
+	pthread_mutex_unlock(&sim_timer_lock);
+	return ESP_OK;
+}
+
+void timer_group_clr_intr_status_in_isr(timer_group_t group_num, timer_idx_t timer_num){
+	/* nothing latched in the model */
+}
+
+void timer_group_enable_alarm_in_isr(timer_group_t group_num, timer_idx_t timer_num){
+	sim_timer_t *t = sim_timer_get(group_num, timer_num);
+	if(t) t->alarm_en = true; /* called with sim_timer_lock held by sim_timer_fire */
+}
+
+static int64_t sim_timer_next_event(void){
+	int64_t next = SIM_NEVER;
+	pthread_mutex_lock(&sim_timer_lock);
+	for(int g = 0; g < TIMER_GROUP_MAX; g++){
+		for(int i = 0; i < TIMER_MAX; i++){
+			sim_timer_t *t = &sim_timers[g][i];
+			if(t->running && t->alarm_en && t->isr && t->next_alarm < next) next = t->next_alarm;
+		}
+	}
+	pthread_mutex_unlock(&sim_timer_lock);
+	return next;
+}
+
+static void sim_timer_fire(int64_t now){
+	pthread_mutex_lock(&sim_timer_lock);
+	for(int g = 0; g < TIMER_GROUP_MAX; g++){
+		for(int i = 0; i < TIMER_MAX; i++){
+			sim_timer_t *t = &sim_timers[g][i];
+			if(t->running && t->alarm_en && t->isr && t->next_alarm <= now){
+				/* the alarm has to be re-enabled by the ISR, as on the hardware */
+				t->alarm_en = false;
+				if(t->auto_reload){
+					t->next_alarm += sim_timer_period(t);
+				}
+				else{
+					t->running = false;
+				}
+				sim_timer_alarm_count++;
+				t->isr(t->isr_arg);
+			}
+		}
+	}
+	pthread_mutex_unlock(&sim_timer_lock);
+}
+
+uint64_t sim_timer_alarms(void){
+	return sim_timer_alarm_count;
+}
+
+
+
+static sim_device_t sim_spi_device = {
+	.name = "spi",
+	.next_event = sim_spi_next_event,
+	.fire = sim_spi_fire,
+	.poll = NULL
+};
+
+static sim_device_t sim_rmt_device = {
+	.name = "rmt",
+	.next_event = NULL,
+	.fire = NULL,
+	.poll = sim_rmt_poll
+};
+
+static sim_device_t sim_timer_device = {
+	.name = "timer",
+	.next_event = sim_timer_next_event,
+	.fire = sim_timer_fire,
+	.poll = NULL
+};
+
+void sim_periph_init(void){
+	sim_register_device(&sim_spi_device);
+	sim_register_device(&sim_timer_device);
+	sim_register_device(&sim_rmt_device);
+}
@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file calendar.c
+@author Tony Pottier
+@brief Incremental calendar: keeps a struct tm in step with a timestamp that advances one second at a time
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The clock advances by exactly one second on every tick of the RTC square wave. Decomposing
+the timestamp again each time with localtime is wasteful and goes through a static struct tm
+shared by every caller. Instead the previous broken down time is incremented, and a full
+decomposition only happens when the timestamp jumps.
+
+*/
+
+#include <string.h>
+#include "calendar.h"
+
+
+static const int calendar_month_days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+
+bool calendar_is_leap_year(int year){
+	return (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
+}
+
+int calendar_days_in_month(int month, int year){
+	if(month == 1 && calendar_is_leap_year(year)){
+		return 29;
+	}
+	return calendar_month_days[month];
+}
+
+void calendar_set(calendar_t *cal, time_t t){
+	cal->timestamp = t;
+	gmtime_r(&t, &cal->tm);
+}
+
+void calendar_tick(calendar_t *cal){
+
+	struct tm *tm = &cal->tm;
+
+	cal->timestamp++;
+
+	/* the common case: 59 out of 60 ticks stop here */
+	if(++tm->tm_sec < 60) return;
+	tm->tm_sec = 0;
+
+	if(++tm->tm_min < 60) return;
+	tm->tm_min = 0;
+
+	if(++tm->tm_hour < 24) return;
+	tm->tm_hour = 0;
+
+	/* new day */
+	tm->tm_wday = (tm->tm_wday + 1) % 7;
+	tm->tm_yday++;
+	if(++tm->tm_mday <= calendar_days_in_month(tm->tm_mon, tm->tm_year + 1900)) return;
+	tm->tm_mday = 1;
+
+	if(++tm->tm_mon < 12) return;
+	tm->tm_mon = 0;
+	tm->tm_yday = 0;
+	tm->tm_year++;
+}
+
+const struct tm* calendar_advance(calendar_t *cal, time_t t){
+
+	if(t == cal->timestamp + 1){
+		calendar_tick(cal);
+	}
+	else if(t != cal->timestamp){
+		calendar_set(cal, t);
+	}
+
+	return &cal->tm;
+}
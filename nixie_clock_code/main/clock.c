@@ -29,6 +29,7 @@ SOFTWARE.
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -46,15 +47,20 @@ SOFTWARE.
 #include "lwip/err.h"
 #include "lwip/apps/sntp.h"
 #include "esp_http_client.h"
-#include "cJSON.h"
+#include "esp_timer.h"
 
 
 #include "ds3231.h"
+#include "temperature.h"
 #include "i2c.h"
 #include "http_client.h"
 #include "display.h"
 #include "ws2812.h"
-#include "list.h"
+#include "calendar.h"
+#include "tz.h"
+#include "sleepmap.h"
+#include "ntp.h"
+#include "journal.h"
 #include "clock.h"
 
 
@@ -66,8 +72,16 @@ static const char TAG[] = "clock";
 /** @brief flash memory namespace for the clock */
 const char clock_nvs_namespace[] = "clock";
 
-/** @brief storage for timestamp transitions */
+/** @brief storage for timestamp transitions, sorted by timestamp */
 static transition_t clock_transitions[CLOCK_MAX_TRANSITIONS];
+static int clock_transitions_count = 0;
+
+/** @brief index of the next transition to apply */
+static int clock_transitions_next = 0;
+
+/** @brief UTC time of the next thing clock_tick has to look at: the next transition or a refresh of the table.
+ * This keeps the cost of transitions to a single compare per tick. */
+static time_t clock_transitions_event = CLOCK_TIME_NEVER;
 
 /** @brief mutex to prevent several read/write to nvs at the same time */
 static SemaphoreHandle_t clock_nvs_mutex = NULL;
@@ -75,28 +89,303 @@ static SemaphoreHandle_t clock_nvs_mutex = NULL;
 time_t timestamp_utc;
 time_t timestamp_local;
 time_t timestamp_transitions_check = 0;
-struct tm *clock_time_tm_ptr = NULL; /*used for localtime function which returns a static pointer */
+struct tm *clock_time_tm_ptr = NULL; /* points to the broken down local time of clock_calendar */
 struct tm clock_time_tm;
 
+/** @brief local time, advanced incrementally on every tick instead of calling localtime */
+static calendar_t clock_calendar;
+
 //static timezone_t clock_timezone;
 static clock_config_t clock_config;
 
-static QueueHandle_t clock_queue = NULL;
+/** @brief lanes of the clock queue. The clock task drains them in this order */
+typedef enum clock_lane_t{
+	CLOCK_LANE_SLEEP = 0,
+	CLOCK_LANE_CONFIG = 1,
+	CLOCK_LANE_NETWORK = 2,
+	CLOCK_LANE_COUNT = 3
+}clock_lane_t;
+
+static QueueHandle_t clock_lanes[CLOCK_LANE_COUNT] = { NULL };
+
+/** @brief latest-wins messages waiting for the clock task, by message type. A bit of clock_latest_pending per type */
+static clock_queue_message_t clock_latest[CLOCK_MESSAGE_COUNT];
+static uint32_t clock_latest_pending = 0;
+
+/** @brief payloads of the large messages, handed out and taken back through clock_message_pool_free */
+static clock_message_payload_t clock_message_pool[CLOCK_MESSAGE_POOL_SIZE];
+static QueueHandle_t clock_message_pool_free = NULL;
+
+/** @brief counters of the clock queue, by message type. clock_queue_spinlock also protects the latest-wins messages */
+static clock_message_stats_t clock_message_stats[CLOCK_MESSAGE_COUNT];
+static portMUX_TYPE clock_queue_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/** @brief the clock task, woken by the tick ISR and by every message sent to it */
+static TaskHandle_t clock_task_handle = NULL;
+
+/** @brief 1Hz edges counted by the ISR and not yet processed by the clock task */
+static uint32_t clock_ticks_pending = 0;
+
+/** @brief esp_timer time of the last edge, captured by the ISR */
+static int64_t clock_tick_edge_us = 0;
+
+/** @brief edge of the previous wake-up, for the jitter histogram. Only touched by the clock task */
+static int64_t clock_tick_previous_edge_us = 0;
+
+/** @brief counters of the tick lane. clock_tick_spinlock also protects the two variables the ISR writes */
+static clock_tick_stats_t clock_tick_stats;
+static portMUX_TYPE clock_tick_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
 static bool time_set = false;
 
-/** @brief List holding the sleep/wake events */
-static list_t* clock_list_sleepevents = NULL;
+/* SNTP answered at least once: it is more precise than the time API, which then no longer sets the time */
+static bool clock_sntp_synced = false;
+
+/** @brief frequency error of the DS3231, measured across synchronizations */
+static drift_t clock_drift;
+
+/** @brief the sleepmodes compiled into a minute by minute map of the week */
+static sleepmap_t clock_sleepmap;
+
+/** @brief whether a sleepmode last put the clock to sleep */
+static bool clock_asleep = false;
+
+/** @brief local time of the next change of the sleep state. Computed only when the previous one happens */
+static time_t clock_sleep_next_change = CLOCK_TIME_NEVER;
 
 
 /** @brief Save task handle to notify it of saving */
 static TaskHandle_t clock_task_save_nvs = NULL;
 
+/** @brief fields of clock_config_t the journal saves separately. Bit i of clock_config_dirty is field i */
+typedef enum clock_config_field_t{
+	CLOCK_CONFIG_TIMEZONE_NAME = 0,
+	CLOCK_CONFIG_TIMEZONE_OFFSET = 1,
+	CLOCK_CONFIG_SLEEPMODES = 2,
+	CLOCK_CONFIG_LED_COLOR = 3,
+	CLOCK_CONFIG_TUBE_BRIGHTNESS = 4,
+	CLOCK_CONFIG_TRANSITION = 5,
+	CLOCK_CONFIG_RTC_DRIFT = 6,
+	CLOCK_CONFIG_FIELD_COUNT = 7
+}clock_config_field_t;
+
+#define CLOCK_CONFIG_FIELD(member)		{ offsetof(clock_config_t, member), sizeof(((clock_config_t*)0)->member) }
+
+static const journal_field_t clock_config_fields[CLOCK_CONFIG_FIELD_COUNT] = {
+	CLOCK_CONFIG_FIELD(timezone.name),
+	CLOCK_CONFIG_FIELD(timezone.offset),
+	CLOCK_CONFIG_FIELD(sleepmodes),
+	CLOCK_CONFIG_FIELD(display.led_color),
+	CLOCK_CONFIG_FIELD(display.tube_brightness),
+	CLOCK_CONFIG_FIELD(display.transition),
+	CLOCK_CONFIG_FIELD(rtc)
+};
+
+/** @brief the configuration in NVS: a base and a journal of the fields changed since */
+static journal_t clock_journal;
+
+/** @brief fields changed since the last save */
+static uint32_t clock_config_dirty = 0;
+static portMUX_TYPE clock_config_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
 
 time_t clock_get_current_time_utc(){
 	return timestamp_utc;
 }
 
 
+/**
+ * @brief true for the message types whose payload comes from the pool
+ */
+static bool clock_message_is_pooled(clock_message_t message){
+	switch(message){
+		case CLOCK_MESSAGE_RECEIVE_TIME_API:
+		case CLOCK_MESSAGE_RECEIVE_TRANSITIONS_API:
+		case CLOCK_MESSAGE_REQUEST_TIME_API:
+		case CLOCK_MESSAGE_SLEEPMODE_CONFIG:
+		case CLOCK_MESSAGE_TIMEZONE:
+		case CLOCK_MESSAGE_RECEIVE_SNTP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * @brief true for the message types where only the latest value matters: a new one replaces the one still waiting
+ */
+static bool clock_message_is_coalesced(clock_message_t message){
+	switch(message){
+		case CLOCK_MESSAGE_BACKLIGHTS_CONFIG:
+		case CLOCK_MESSAGE_TUBE_BRIGHTNESS_CONFIG:
+		case CLOCK_MESSAGE_DISPLAY_TRANSITION_CONFIG:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * @brief lane of a message type
+ */
+static clock_lane_t clock_message_lane(clock_message_t message){
+	switch(message){
+		case CLOCK_MESSAGE_SLEEP_EVENT:
+			return CLOCK_LANE_SLEEP;
+		case CLOCK_MESSAGE_SLEEPMODE_CONFIG:
+		case CLOCK_MESSAGE_TIMEZONE:
+			return CLOCK_LANE_CONFIG;
+		default:
+			return CLOCK_LANE_NETWORK;
+	}
+}
+
+clock_message_payload_t* clock_message_alloc(){
+	clock_message_payload_t *payload = NULL;
+	if(clock_message_pool_free && xQueueReceive(clock_message_pool_free, &payload, 0)){
+		memset(payload, 0x00, sizeof(clock_message_payload_t));
+		return payload;
+	}
+	return NULL;
+}
+
+void clock_message_release(clock_queue_message_t *msg){
+	if(clock_message_is_pooled(msg->message) && msg->param.payload){
+		xQueueSend(clock_message_pool_free, &msg->param.payload, 0);
+		msg->param.payload = NULL;
+	}
+}
+
+void clock_get_message_stats(clock_message_t message, clock_message_stats_t *stats){
+	memset(stats, 0x00, sizeof(clock_message_stats_t));
+	if(message < CLOCK_MESSAGE_COUNT){
+		portENTER_CRITICAL(&clock_queue_spinlock);
+		*stats = clock_message_stats[message];
+		portEXIT_CRITICAL(&clock_queue_spinlock);
+	}
+}
+
+void clock_get_tick_stats(clock_tick_stats_t *stats){
+	portENTER_CRITICAL(&clock_tick_spinlock);
+	*stats = clock_tick_stats;
+	portEXIT_CRITICAL(&clock_tick_spinlock);
+}
+
+/**
+ * @brief counts a message that could not be sent because the pool stayed empty
+ */
+static void clock_message_dropped(clock_message_t message){
+	ESP_LOGW(TAG, "Message pool empty, message %d dropped", message);
+	portENTER_CRITICAL(&clock_queue_spinlock);
+	clock_message_stats[message].dropped++;
+	portEXIT_CRITICAL(&clock_queue_spinlock);
+}
+
+/**
+ * @brief hands a message to the clock task without ever waiting: senders include the HTTP server, which must not
+ * be stalled by a busy clock. Latest-wins messages replace the one still waiting, if any, and always get through.
+ * @return ESP_OK, or ESP_ERR_TIMEOUT if the lane of the message is full. The message is dropped and its pooled
+ * payload given back.
+ */
+static esp_err_t clock_send(clock_queue_message_t *msg){
+
+	BaseType_t sent = pdTRUE;
+	bool coalesced = false;
+	msg->sent_us = esp_timer_get_time();
+
+	if(clock_message_is_coalesced(msg->message)){
+		portENTER_CRITICAL(&clock_queue_spinlock);
+		coalesced = (clock_latest_pending & (1u << msg->message)) != 0;
+		clock_latest[msg->message] = *msg;
+		clock_latest_pending |= 1u << msg->message;
+		portEXIT_CRITICAL(&clock_queue_spinlock);
+	}
+	else{
+		sent = xQueueSend(clock_lanes[clock_message_lane(msg->message)], msg, 0);
+	}
+
+	portENTER_CRITICAL(&clock_queue_spinlock);
+	clock_message_stats_t *stats = &clock_message_stats[msg->message];
+	if(sent == pdTRUE){
+		stats->sent++;
+		if(coalesced) stats->coalesced++;
+	}
+	else{
+		stats->dropped++;
+	}
+	portEXIT_CRITICAL(&clock_queue_spinlock);
+
+	if(sent != pdTRUE){
+		ESP_LOGW(TAG, "Clock queue full, message %d dropped", msg->message);
+		clock_message_release(msg);
+		return ESP_ERR_TIMEOUT;
+	}
+
+	xTaskNotifyGive(clock_task_handle);
+	return ESP_OK;
+}
+
+/**
+ * @brief takes the next message for the clock task, without waiting: the sleep lane first,
+ * then the latest-wins messages, then the config and network lanes
+ * @return false if there is none
+ */
+static bool clock_receive(clock_queue_message_t *msg){
+
+	if(xQueueReceive(clock_lanes[CLOCK_LANE_SLEEP], msg, 0)){
+		return true;
+	}
+
+	bool found = false;
+	portENTER_CRITICAL(&clock_queue_spinlock);
+	if(clock_latest_pending){
+		int message = __builtin_ctz(clock_latest_pending);
+		clock_latest_pending &= ~(1u << message);
+		*msg = clock_latest[message];
+		found = true;
+	}
+	portEXIT_CRITICAL(&clock_queue_spinlock);
+	if(found){
+		return true;
+	}
+
+	return xQueueReceive(clock_lanes[CLOCK_LANE_CONFIG], msg, 0) || xQueueReceive(clock_lanes[CLOCK_LANE_NETWORK], msg, 0);
+}
+
+/**
+ * @brief updates the latency counters of a message the clock task just received
+ */
+static void clock_message_received(const clock_queue_message_t *msg){
+
+	if(msg->message >= CLOCK_MESSAGE_COUNT) return;
+
+	uint32_t latency = (uint32_t)(esp_timer_get_time() - msg->sent_us);
+
+	portENTER_CRITICAL(&clock_queue_spinlock);
+	clock_message_stats_t *stats = &clock_message_stats[msg->message];
+	stats->received++;
+	stats->total_latency_us += latency;
+	if(latency > stats->max_latency_us) stats->max_latency_us = latency;
+	portEXIT_CRITICAL(&clock_queue_spinlock);
+}
+
+/**
+ * @brief flags a field of the configuration to be saved, and wakes up the task that saves it
+ */
+static void clock_config_changed(clock_config_field_t field){
+	portENTER_CRITICAL(&clock_config_spinlock);
+	clock_config_dirty |= 1u << field;
+	portEXIT_CRITICAL(&clock_config_spinlock);
+	xTaskNotifyGive( clock_task_save_nvs );
+}
+
+void clock_get_config_store_stats(journal_stats_t *stats){
+	if(clock_nvs_lock( portMAX_DELAY )){
+		*stats = clock_journal.stats;
+		clock_nvs_unlock();
+	}
+}
+
 /**
  * @brief task the will save the config in NVS when it is notified and it is safe to do so
  */
@@ -114,10 +403,26 @@ static void clock_save_config_task(void *pvParameter){
 			 */
 			vTaskDelay(  pdMS_TO_TICKS(10000) );
 
+			/* every change of the last 10s, whatever their number, ends up in a single record */
+			portENTER_CRITICAL(&clock_config_spinlock);
+			uint32_t dirty = clock_config_dirty;
+			clock_config_dirty = 0;
+			portEXIT_CRITICAL(&clock_config_spinlock);
+
 			clock_config_t cfg = clock_get_config();
-			if(clock_nvs_lock( portMAX_DELAY )){
-				clock_save_config(&cfg);
+			if(dirty && clock_nvs_lock( portMAX_DELAY )){
+				journal_write(&clock_journal, &cfg, dirty);
+				journal_stats_t stats = clock_journal.stats;
 				clock_nvs_unlock();
+
+				/* wear: NVS spreads its writes over the whole partition */
+				double days = esp_timer_get_time() / (86400.0 * 1000000.0);
+				if(days > 0.0){
+					double per_day = stats.bytes_written / days;
+					double years = per_day > 0.0 ? (double)JOURNAL_NVS_PARTITION_SIZE * JOURNAL_FLASH_ENDURANCE / per_day / 365.0 : 0.0;
+					ESP_LOGI(TAG, "Config saved: %u records, %u compactions, %.0f bytes/day, flash endurance reached in %.0f years",
+							(unsigned)stats.records, (unsigned)stats.compactions, per_day, years);
+				}
 			}
 		}
 	}
@@ -125,102 +430,63 @@ static void clock_save_config_task(void *pvParameter){
 	vTaskDelete( NULL );
 }
 
-static int comp_sleep_event(sleep_event_t *a, sleep_event_t *b){
+/**
+ * @brief compiles the sleepmodes into clock_sleepmap
+ */
+static void clock_sleep_compile(const sleepmodes_t *sleepmodes){
 
-	if(a && b){
+	sleepmap_clear(&clock_sleepmap);
 
-		if(a->timestamp == b->timestamp) return 0;
-		else if(a->timestamp < b->timestamp) return -1;
-		else return 1;
+	if(sleepmodes->enable_sleepmode){
+		for(int i = 0; i < CLOCK_MAX_SLEEPMODES; i++){
+			const sleepmode_t *sm = &sleepmodes->sleepmode[i];
+			if(sm->enabled){
+				sleepmap_add(&clock_sleepmap, sm->days, sm->from, sm->to);
+			}
+		}
 	}
-	else{
-		return a - b;
-	}
-}
-
-static void clock_build_new_sleepmodes(sleepmodes_t sleepmodes){
-
-    time_t time_now_utc = clock_get_current_time_utc();
-    struct tm tm_now;
-    int offset = clock_config.timezone.offset;
-
-    /* initialize the event */
-    time_t time_now_local = time_now_utc + offset; /* apply local timezone then build the tm now object */
-    gmtime_r(&time_now_local, &tm_now);
-	/* gmtime_s(&tm_now, &time_now_local); on Windows */
-
-	/* clear the previous events */
-	list_clear(clock_list_sleepevents);
-
-    if (sleepmodes.enable_sleepmode) {
-
-        /* get current day of the week at midnight */
-        time_t today_at_midight = time_now_local - (time_t)tm_now.tm_sec - ((time_t)tm_now.tm_min * 60) - ((time_t)tm_now.tm_hour * 3600);
-
-        /* process all the sleepmodes */
-        for (int i = 0; i < CLOCK_MAX_SLEEPMODES; i++) {
-
-            /* to save some typing and code clarity */
-            sleepmode_t sm = sleepmodes.sleepmode[i];
-
-            /* skip if this one is disabled */
-            if (!sm.enabled) continue;
-
-            /* transform a sleepmode into UTC timestamp and add it to the list */
-
-            int weekday = 1; /* the mask starts on mondays which is 1 on a struct tm */
-            uint8_t days = sm.days;
-            for (int j = 0; j < 7; j++) {
-               
-                if (days & (uint8_t)0x01) {
-                    /* when is the next weekday matching ?
-                        tm_wday = 1 (Monday), weekday = 1 => offset is 0
-                        tm_wday = 1 (Monday), weekday = 2 => offset is 1 (tomorrow)
-                        tm_wday = 3 (Wednesday), weekday = 1 (Next Monday) => offset is  (7-3 + 1) = 5 days
-                    */
-                    time_t day_offset;
-                    if (tm_now.tm_wday <= weekday) {
-                        day_offset = ((time_t)weekday - tm_now.tm_wday) * (time_t)86400; /* 24h * 3600 */
-                    }
-                    else {
-                        day_offset = ((time_t)7 - tm_now.tm_wday + weekday) * (time_t)86400; /* 24h * 3600 */
-                    }
- 
-                    /* build both events
-                    if the TO hour is less than from, we consider it's for the next day and so add further offset */
-                    sleep_event_t from = { .timestamp = today_at_midight + day_offset + sm.from, .action = SLEEP_ACTION_SLEEP };
-                    sleep_event_t to = { .timestamp = today_at_midight + day_offset +  ((sm.to < sm.from)?(time_t)86400:0) + sm.to, .action = SLEEP_ACTION_WAKE };
-
-					list_add_ordered(clock_list_sleepevents, from, &comp_sleep_event);
-					list_add_ordered(clock_list_sleepevents, to, &comp_sleep_event);
-
-					/* if the day is today we also build the sleep event for next week */
-					if(day_offset == 0){
-						from.timestamp += (time_t)86400*7;
-						to.timestamp += (time_t)86400*7;
-						list_add_ordered(clock_list_sleepevents, from, &comp_sleep_event);
-						list_add_ordered(clock_list_sleepevents, to, &comp_sleep_event);
-					}
-
-					/* debug -- can be deleted in production code */
-					struct tm debug;
-					static char strftime_buf[64];
-					localtime_r(&from.timestamp, &debug);
-					strftime(strftime_buf, sizeof(strftime_buf), "%c", &debug);
-					ESP_LOGI(TAG, "CLOCK WILL SLEEP AT: %s", strftime_buf);
-					localtime_r(&to.timestamp, &debug);
-					strftime(strftime_buf, sizeof(strftime_buf), "%c", &debug);
-					ESP_LOGI(TAG, "CLOCK WILL WAKE AT: %s", strftime_buf);
+}
 
+/**
+ * @brief turns the tubes and backlights off or on. Runs on the clock task
+ */
+static void clock_sleep_apply(sleep_action_t action){
+	if(action == SLEEP_ACTION_WAKE){
+		display_turn_on();
+		ws2812_fade_backlight_color(clock_config.display.led_color, WS2812_SLEEP_FADE_MS);
+	}
+	else if(action == SLEEP_ACTION_SLEEP){
+		display_turn_off();
+		ws2812_fade_backlight_color(ws2812_create_rgb(0, 0, 0), WS2812_SLEEP_FADE_MS);
+	}
+}
 
-                }
+/**
+ * @brief puts the clock to sleep or wakes it up according to the sleepmap at local time t, then finds the next change.
+ * Besides every change of state, this runs at boot, when the sleepmodes change and when the time jumps: the clock
+ * follows the map even when it starts in the middle of a sleep window.
+ */
+static void clock_sleep_update(time_t t){
 
-                days = days >> 1;
-                weekday++; if (weekday == 7) weekday = 0; /* wrap around for sunday */
+	bool asleep = sleepmap_is_asleep(&clock_sleepmap, t);
+	if(asleep != clock_asleep){
+		/* already on the clock task: applied right away rather than through a lane that could be full */
+		clock_asleep = asleep;
+		clock_sleep_apply(asleep ? SLEEP_ACTION_SLEEP : SLEEP_ACTION_WAKE);
+	}
 
-            } /* for (int j = 0; j < 7; j++) */
-        } /* for (int i = 0; i < CLOCK_MAX_SLEEPMODES; i++) */
-    } /* if (sleepmodes.enable_sleepmode) */
+	time_t next;
+	if(sleepmap_next_change(&clock_sleepmap, t, &next)){
+		struct tm tm;
+		char strftime_buf[64];
+		gmtime_r(&next, &tm); /* already local time */
+		strftime(strftime_buf, sizeof(strftime_buf), "%c", &tm);
+		ESP_LOGI(TAG, "CLOCK WILL %s AT: %s", asleep ? "WAKE" : "SLEEP", strftime_buf);
+		clock_sleep_next_change = next;
+	}
+	else{
+		clock_sleep_next_change = CLOCK_TIME_NEVER;
+	}
 }
 
 
@@ -233,110 +499,357 @@ display_config_t clock_get_config_display(){
 }
 
 void clock_notify_sta_got_ip(void *pvArgument){
-	if(clock_queue){
+	if(clock_task_handle){
 		clock_queue_message_t msg;
 		msg.message = CLOCK_MESSAGE_STA_GOT_IP;
-		xQueueSend(clock_queue, &msg, portMAX_DELAY);
+		msg.param.value = 0;
+		clock_send(&msg);
 	}
 }
 
-void clock_notify_new_backlight_color(rgb_t rgb){
-	if(clock_queue){
+esp_err_t clock_notify_new_backlight_color(rgb_t rgb){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle){
 		clock_queue_message_t msg;
 		msg.message = CLOCK_MESSAGE_BACKLIGHTS_CONFIG;
-		msg.param = (void*)rgb.num;
-		xQueueSend(clock_queue, &msg, portMAX_DELAY);
+		msg.param.rgb = rgb;
+		ret = clock_send(&msg);
+	}
+	return ret;
+}
+
+esp_err_t clock_notify_new_tube_brightness(uint8_t brightness){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle){
+		clock_queue_message_t msg;
+		msg.message = CLOCK_MESSAGE_TUBE_BRIGHTNESS_CONFIG;
+		msg.param.brightness = brightness;
+		ret = clock_send(&msg);
+	}
+	return ret;
+}
+
+esp_err_t clock_notify_new_display_transition(display_transition_t transition){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle){
+		clock_queue_message_t msg;
+		msg.message = CLOCK_MESSAGE_DISPLAY_TRANSITION_CONFIG;
+		msg.param.transition = transition;
+		ret = clock_send(&msg);
 	}
+	return ret;
 }
 
 void clock_notify_sta_disconnected(){
-	if(clock_queue){
+	if(clock_task_handle){
 		clock_queue_message_t msg;
 		msg.message = CLOCK_MESSAGE_STA_DISCONNECTED;
-		xQueueSend(clock_queue, &msg, portMAX_DELAY);
+		msg.param.value = 0;
+		clock_send(&msg);
 	}
 }
 
-void clock_notify_time_api_response(cJSON *json){
-	if(clock_queue){
+esp_err_t clock_notify_time_api_response(const clock_time_api_t *api){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle && api){
 		clock_queue_message_t msg;
 		msg.message = CLOCK_MESSAGE_RECEIVE_TIME_API;
-		msg.param = (void*)json;
-		xQueueSend(clock_queue, &msg, portMAX_DELAY);
+		msg.param.payload = clock_message_alloc();
+		if(msg.param.payload == NULL){
+			clock_message_dropped(msg.message);
+			return ESP_ERR_NO_MEM;
+		}
+		msg.param.payload->time_api = *api;
+		ret = clock_send(&msg);
 	}
+	return ret;
 }
 
 
-void clock_notify_transitions_api_response(cJSON *json){
-	if(clock_queue){
+esp_err_t clock_notify_transitions_api_response(const clock_transitions_api_t *api){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle && api){
 		clock_queue_message_t msg;
 		msg.message = CLOCK_MESSAGE_RECEIVE_TRANSITIONS_API;
-		msg.param = (void*)json;
-		xQueueSend(clock_queue, &msg, portMAX_DELAY);
+		msg.param.payload = clock_message_alloc();
+		if(msg.param.payload == NULL){
+			clock_message_dropped(msg.message);
+			return ESP_ERR_NO_MEM;
+		}
+		msg.param.payload->transitions_api = *api;
+		ret = clock_send(&msg);
 	}
+	return ret;
 }
 
-void clock_notify_new_sleepmodes(sleepmodes_t sleepmodes){
-
-	clock_queue_message_t msg;
-	sleepmodes_t* sm = malloc(sizeof(sleepmodes_t));
-	memset(sm, 0x00, sizeof(sleepmodes_t));
-	*sm = sleepmodes;
-	msg.message = CLOCK_MESSAGE_SLEEPMODE_CONFIG;
-	msg.param = (void*)sm;
-
-	xQueueSend(clock_queue, &msg, portMAX_DELAY);
+esp_err_t clock_notify_sntp_response(const ntp_result_t *result){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle && result){
+		clock_queue_message_t msg;
+		msg.message = CLOCK_MESSAGE_RECEIVE_SNTP;
+		msg.param.payload = clock_message_alloc();
+		if(msg.param.payload == NULL){
+			clock_message_dropped(msg.message);
+			return ESP_ERR_NO_MEM;
+		}
+		msg.param.payload->sntp = *result;
+		ret = clock_send(&msg);
+	}
+	return ret;
 }
 
 
-void clock_notify_new_timezone(char* timezone){
+esp_err_t clock_notify_new_sleepmodes(sleepmodes_t sleepmodes){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle){
+		clock_queue_message_t msg;
+		msg.message = CLOCK_MESSAGE_SLEEPMODE_CONFIG;
+		msg.param.payload = clock_message_alloc();
+		if(msg.param.payload == NULL){
+			clock_message_dropped(msg.message);
+			return ESP_ERR_NO_MEM;
+		}
+		msg.param.payload->sleepmodes = sleepmodes;
+		ret = clock_send(&msg);
+	}
+	return ret;
+}
 
-	clock_queue_message_t msg;
-	timezone_t* tz = malloc(sizeof(timezone_t));
-	memset(tz, 0x00, sizeof(timezone_t));
-	strncpy(  tz->name, timezone, sizeof(tz->name) - 1 );
-	msg.message = CLOCK_MESSAGE_TIMEZONE;
-	msg.param = (void*)tz;
 
-	xQueueSend(clock_queue, &msg, portMAX_DELAY);
+esp_err_t clock_notify_new_timezone(char* timezone){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	if(clock_task_handle){
+		clock_queue_message_t msg;
+		msg.message = CLOCK_MESSAGE_TIMEZONE;
+		msg.param.payload = clock_message_alloc();
+		if(msg.param.payload == NULL){
+			clock_message_dropped(msg.message);
+			return ESP_ERR_NO_MEM;
+		}
+		strncpy(msg.param.payload->timezone.name, timezone, sizeof(msg.param.payload->timezone.name) - 1);
+		ret = clock_send(&msg);
+	}
+	return ret;
 }
 
 
+/**
+ * @brief 1Hz edge of the DS3231. The tick is counted rather than queued so that it can never be dropped
+ * or wait behind other messages: the clock task is woken directly and catches up on every pending edge.
+ */
 static void IRAM_ATTR gpio_isr_handler(void* arg){
     //uint32_t gpio_num = (uint32_t) arg;
 
-	clock_queue_message_t msg;
-	msg.message = CLOCK_MESSAGE_TICK;
-	msg.param = NULL;
-    xQueueSendFromISR(clock_queue, &msg, NULL);
-	return;
+	BaseType_t woken = pdFALSE;
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL_ISR(&clock_tick_spinlock);
+	clock_ticks_pending++;
+	clock_tick_edge_us = now;
+	clock_tick_stats.edges++;
+	portEXIT_CRITICAL_ISR(&clock_tick_spinlock);
+
+	vTaskNotifyGiveFromISR(clock_task_handle, &woken);
+	if(woken == pdTRUE){
+		portYIELD_FROM_ISR();
+	}
+}
+
+
+/**
+ * @brief bucket of a tick histogram
+ */
+static int clock_tick_histogram_bucket(uint32_t us){
+	int bucket = 0;
+	while(bucket < CLOCK_TICK_HISTOGRAM_BUCKETS - 1 && us >= ((uint32_t)CLOCK_TICK_HISTOGRAM_FIRST_US << bucket)){
+		bucket++;
+	}
+	return bucket;
 }
 
 
-void clock_transitions_shift_left(){
+/**
+ * @brief processes every edge counted by the ISR since the last call. If the task was held back,
+ * the missed seconds are all applied and the display is written once, with the latest time.
+ * @return number of seconds applied
+ */
+static uint32_t clock_tick_lane_process(){
 
-	int i = CLOCK_MAX_TRANSITIONS - 1;
-	while(i > 1){
-		clock_transitions[i - 1] = clock_transitions[i];
-		i--;
+	uint32_t pending;
+	int64_t edge_us;
+
+	portENTER_CRITICAL(&clock_tick_spinlock);
+	pending = clock_ticks_pending;
+	edge_us = clock_tick_edge_us;
+	clock_ticks_pending = 0;
+	portEXIT_CRITICAL(&clock_tick_spinlock);
+
+	if(pending == 0 || !time_set) return 0;
+
+	for(uint32_t i = 0; i < pending; i++){
+		clock_tick();
+	}
+	display_write_time(clock_time_tm_ptr);
+
+	uint32_t latency = (uint32_t)(esp_timer_get_time() - edge_us);
+
+	/* jitter is only meaningful between two consecutive edges */
+	bool has_jitter = pending == 1 && clock_tick_previous_edge_us != 0;
+	int64_t interval = edge_us - clock_tick_previous_edge_us - 1000000;
+	uint32_t jitter = (uint32_t)(interval < 0 ? -interval : interval);
+	clock_tick_previous_edge_us = edge_us;
+
+	portENTER_CRITICAL(&clock_tick_spinlock);
+	clock_tick_stats.ticks += pending;
+	if(pending > 1) clock_tick_stats.late++;
+	if(pending > clock_tick_stats.max_pending) clock_tick_stats.max_pending = pending;
+	clock_tick_stats.latency[clock_tick_histogram_bucket(latency)]++;
+	if(latency > clock_tick_stats.max_latency_us) clock_tick_stats.max_latency_us = latency;
+	if(has_jitter){
+		clock_tick_stats.jitter[clock_tick_histogram_bucket(jitter)]++;
+		if(jitter > clock_tick_stats.max_jitter_us) clock_tick_stats.max_jitter_us = jitter;
+	}
+	portEXIT_CRITICAL(&clock_tick_spinlock);
+
+	if(pending > 1){
+		ESP_LOGW(TAG, "%u ticks were pending", (unsigned)pending);
 	}
+
+	char strftime_buf[64];
+	strftime(strftime_buf, sizeof(strftime_buf), "%c", clock_time_tm_ptr);
+	ESP_LOGI(TAG, "TICK! date/time is: %s", strftime_buf);
+
+	return pending;
 }
 
-void clock_tick(){
 
-	timezone_t* clock_timezone = &(clock_config.timezone);
+/**
+ * @brief recomputes clock_transitions_event after the table, the cursor or the refresh time changed
+ */
+static void clock_transitions_update_event(){
+	time_t event = timestamp_transitions_check ? timestamp_transitions_check : CLOCK_TIME_NEVER;
 
-	/* +1 second */
-	timestamp_utc++;
+	if(clock_transitions_next < clock_transitions_count && clock_transitions[clock_transitions_next].timestamp < event){
+		event = clock_transitions[clock_transitions_next].timestamp;
+	}
 
-	/* check for transitions */
-	int new_offset = clock_timezone->offset;
-	while(clock_transitions[0].timestamp && (timestamp_utc >= clock_transitions[0].timestamp)){
-		/* save found offset */
-		new_offset = clock_transitions[0].offset;
+	clock_transitions_event = event;
+}
 
-		/* shift transitions table left */
-		clock_transitions_shift_left();
+/**
+ * @brief binary search
+ * @return index of the first transition strictly after t, clock_transitions_count if there is none
+ */
+static int clock_transitions_upper_bound(time_t t){
+	int lo = 0;
+	int hi = clock_transitions_count;
+
+	while(lo < hi){
+		int mid = lo + (hi - lo) / 2;
+		if(clock_transitions[mid].timestamp <= t){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ * @brief replaces the transition table with the content of a transitions API response, already sorted by the sender
+ * @return number of transitions stored
+ */
+static int clock_transitions_load(const clock_transitions_api_t *api){
+
+	clock_transitions_count = api->count;
+	memcpy(clock_transitions, api->transitions, sizeof(transition_t) * api->count);
+
+	/* position the cursor on the last transition that already happened, if any: the request starts a day back
+	 * and the next tick applies its offset, in case the time API answered with the offset from before it */
+	clock_transitions_next = clock_transitions_upper_bound(timestamp_utc);
+	if(clock_transitions_next > 0){
+		clock_transitions_next--;
+	}
+
+	return clock_transitions_count;
+}
+
+/**
+ * @brief sets when the table is requested again after count transitions were loaded: a refresh,
+ * unless the table filled up before the horizon
+ */
+static void clock_transitions_schedule_refresh(int count){
+	if(count >= CLOCK_MAX_TRANSITIONS){
+		timestamp_transitions_check = clock_transitions[count - 1].timestamp;
+	}
+	else{
+		timestamp_transitions_check = timestamp_utc + CLOCK_TRANSITIONS_REFRESH;
+	}
+	clock_transitions_update_event();
+}
+
+/**
+ * @brief fills the transition table and sets the current offset from the rules of the offline timezone database
+ * @return false if the timezone cannot be evaluated offline, in which case the transitions API has to be used
+ */
+static bool clock_transitions_compute(){
+
+	tz_rule_t rule;
+	tz_t tz;
+	tz_transition_t transitions[CLOCK_MAX_TRANSITIONS];
+
+	if(tz_find(clock_config.timezone.name, &rule) != ESP_OK){
+		return false;
+	}
+
+	tz_init(&tz, &rule);
+	int count = tz_transitions(&tz, timestamp_utc, timestamp_utc + CLOCK_TRANSITIONS_HORIZON, transitions, CLOCK_MAX_TRANSITIONS);
+	for(int i = 0; i < count; i++){
+		clock_transitions[i].offset = transitions[i].offset;
+		clock_transitions[i].timestamp = transitions[i].timestamp;
+	}
+	clock_transitions_count = count;
+	clock_transitions_next = 0;
+	ESP_LOGI(TAG, "%d transitions computed for %s", count, clock_config.timezone.name);
+
+	int32_t offset = tz_offset(&tz, timestamp_utc);
+	if(offset != clock_config.timezone.offset){
+		ESP_LOGI(TAG, "Saving new offset: %d vs old: %d", offset, clock_config.timezone.offset);
+		clock_config.timezone.offset = offset;
+		clock_config_changed(CLOCK_CONFIG_TIMEZONE_OFFSET);
+	}
+
+	clock_transitions_schedule_refresh(count);
+
+	return true;
+}
+
+/**
+ * @brief fills the transition table of the current timezone. The API is only needed for timezones
+ * the offline database cannot evaluate
+ */
+static void clock_transitions_request(){
+	if(!clock_transitions_compute()){
+		http_client_get_transitions(clock_config.timezone, timestamp_utc);
+		/* try again later if no answer comes back */
+		timestamp_transitions_check = timestamp_utc + CLOCK_TRANSITIONS_RETRY;
+		clock_transitions_update_event();
+	}
+}
+
+/**
+ * @brief applies every transition that is due and requests a new table when it is time to refresh it
+ */
+static void clock_transitions_process(){
+
+	timezone_t* clock_timezone = &(clock_config.timezone);
+
+	int new_offset = clock_timezone->offset;
+	while(clock_transitions_next < clock_transitions_count && timestamp_utc >= clock_transitions[clock_transitions_next].timestamp){
+		new_offset = clock_transitions[clock_transitions_next].offset;
+		clock_transitions_next++;
 	}
 
 	/* found a new timezone offset ? */
@@ -345,74 +858,213 @@ void clock_tick(){
 		clock_timezone->offset = new_offset;
 
 		/* save new conf in memory */
-		xTaskNotifyGive( clock_task_save_nvs );
-
-		/* if a transition was processed it's a good idea to force a refresh soon */
-		timestamp_transitions_check = timestamp_utc + (time_t)(60*60*24*15);
+		clock_config_changed(CLOCK_CONFIG_TIMEZONE_OFFSET);
 	}
 
-
-	/* is it time to check for transitions? */
+	/* is it time to refresh the table? Also covers running out of transitions: the table only goes up to the horizon.
+	 * Queued to keep the tick short: if the lane is full, the retry below covers it */
 	if(timestamp_transitions_check && (timestamp_utc >= timestamp_transitions_check)){
 		clock_queue_message_t msg;
 		msg.message = CLOCK_MESSAGE_REQUEST_TRANSITIONS_API_CALL;
-		msg.param = NULL;
-		xQueueSend(clock_queue, &msg, portMAX_DELAY);
-		timestamp_transitions_check = timestamp_utc + (time_t)(60*60*24*15); /* do another check in 15 days */
+		msg.param.value = 0;
+		clock_send(&msg);
+		timestamp_transitions_check = timestamp_utc + CLOCK_TRANSITIONS_RETRY;
+	}
+
+	clock_transitions_update_event();
+}
+
+void clock_tick(){
+
+	timezone_t* clock_timezone = &(clock_config.timezone);
+
+	/* +1 second */
+	timestamp_utc++;
+
+	/* transitions and refresh of the transitions table */
+	if(timestamp_utc >= clock_transitions_event){
+		clock_transitions_process();
 	}
 
 	timestamp_local = timestamp_utc + clock_timezone->offset;
 
-	/* check for sleep / wake event */
-	bool process_sleep_event = false;
-	sleep_event_t sleep_event = {
-		.action = SLEEP_ACTION_UNKNOWN,
-		.timestamp = 0x7fffffff
-	};
-	while(  (list_peek(clock_list_sleepevents, &sleep_event) == 0) &&  ( timestamp_local >= sleep_event.timestamp )  ){
-		list_shift(clock_list_sleepevents, NULL);
-		process_sleep_event = true;
+	/* check for sleep / wake event: a single compare per tick */
+	if(timestamp_local >= clock_sleep_next_change){
+		clock_sleep_update(timestamp_local);
 	}
-	if(process_sleep_event){
 
-		clock_queue_message_t msg;
-		msg.message = CLOCK_MESSAGE_SLEEP_EVENT;
-		msg.param = (void*)sleep_event.action;
-		xQueueSend(clock_queue, &msg, portMAX_DELAY);
-
-		/* if a sleepevent was processed AND the count of the list is now 0, it means its time to refresh the list and
-		 * recalculate new sleep events 
-		 * Processing an item (eg sleep_event.action != SLEEP_ACTION_UNKNOWN) is important because the list can be empty
-		 * simply because user has not set any sleepmode.
-		 * */
-		if(clock_list_sleepevents->count == 0){
-			clock_build_new_sleepmodes(clock_config.sleepmodes);
+	/* O(1) on a regular tick. A jump (offset change, re-alignment) triggers a full re-derivation */
+	calendar_advance(&clock_calendar, timestamp_local);
+}
+
+
+
+/**
+ * @brief time shown by the clock at esp_timer time timer_us, in microseconds: the second of the last edge of
+ * the square wave plus the time elapsed since that edge. Only meaningful once the square wave runs.
+ */
+static int64_t clock_time_us(int64_t timer_us, bool *valid){
+	uint32_t pending;
+	int64_t edge_us;
+
+	portENTER_CRITICAL(&clock_tick_spinlock);
+	pending = clock_ticks_pending;
+	edge_us = clock_tick_edge_us;
+	portEXIT_CRITICAL(&clock_tick_spinlock);
+
+	*valid = time_set && edge_us != 0;
+	return ((int64_t)timestamp_utc + pending) * 1000000LL + (timer_us - edge_us);
+}
+
+
+/**
+ * @brief seconds the tick count is behind the RTC, from a snapshot of its registers. The shadow copy is taken
+ * when allowed and younger than CLOCK_RTC_SHADOW_MAX_AGE_US, the chip is read otherwise
+ * @return ESP_ERR_INVALID_STATE if a second boundary fell during the read: the second the RTC latched is unknown
+ */
+static esp_err_t clock_rtc_divergence(time_t *divergence, bool shadow){
+
+	ds3231_snapshot_t snapshot;
+	struct tm rtc_tm;
+	bool valid;
+
+	esp_err_t ret = ESP_OK;
+	if(!shadow || !ds3231_get_shadow(&snapshot) || esp_timer_get_time() - snapshot.completed_us > CLOCK_RTC_SHADOW_MAX_AGE_US){
+		ret = ds3231_read_snapshot(&snapshot);
+	}
+	if(ret == ESP_OK){
+		ret = ds3231_snapshot_time(&snapshot, &rtc_tm);
+	}
+	if(ret != ESP_OK){
+		return ret;
+	}
+
+	/* the tick count is extrapolated back to the read: edges lost since then show up just the same */
+	time_t second = (time_t)(clock_time_us(snapshot.timestamp_us, &valid) / 1000000LL);
+	if(!valid || second != (time_t)(clock_time_us(snapshot.completed_us, &valid) / 1000000LL)){
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	*divergence = mktime(&rtc_tm) - second;
+	return ESP_OK;
+}
+
+/**
+ * @brief compares the seconds counted from the square wave with the time of the RTC. They only differ if edges
+ * were lost or counted twice: the RTC is then right, and the tick count is moved without going on the network.
+ * The check usually costs no bus traffic, the temperature service keeps the shadow copy fresh. A snapshot read
+ * from the chip has to agree before anything is changed, so a corrupted or stale read cannot move the clock.
+ */
+static void clock_rtc_check(){
+
+	time_t divergence, confirmation;
+
+	esp_err_t ret = clock_rtc_divergence(&divergence, true);
+	if(ret == ESP_OK && divergence != 0){
+		ret = clock_rtc_divergence(&confirmation, false);
+		if(ret == ESP_OK && confirmation != divergence){
+			ret = ESP_ERR_INVALID_RESPONSE;
 		}
 	}
 
+	portENTER_CRITICAL(&clock_tick_spinlock);
+	if(ret == ESP_OK) clock_tick_stats.rtc_checks++;
+	if(ret == ESP_OK && divergence != 0) clock_tick_stats.rtc_corrections++;
+	portEXIT_CRITICAL(&clock_tick_spinlock);
+
+	if(ret != ESP_OK){
+		ESP_LOGD(TAG, "RTC check skipped: %s", esp_err_to_name(ret));
+		return;
+	}
 
+	if(divergence != 0){
+		/* the RTC itself did not move: this is not a step for the drift estimator */
+		ESP_LOGW(TAG, "Tick count is %+ld s off the RTC: corrected", (long)divergence);
+		timestamp_utc += divergence;
+		timestamp_local = timestamp_utc + clock_config.timezone.offset;
+		calendar_advance(&clock_calendar, timestamp_local);
+		display_write_time(clock_time_tm_ptr);
+	}
+}
 
 
-	clock_time_tm_ptr = localtime(&timestamp_local);
+/**
+ * @brief feeds the drift estimator with the error of the clock, and trims the DS3231 once it knows enough
+ */
+static void clock_drift_update(int64_t utc_us, int64_t error_us, int64_t uncertainty_us){
+
+	drift_add_sample(&clock_drift, utc_us, error_us, uncertainty_us);
+	if(drift_trim(&clock_drift)){
+		ESP_LOGI(TAG, "RTC oscillator is %+.2f ppm off: aging offset set to %d", drift_untrimmed_ppm(&clock_drift), clock_drift.aging);
+		if(ds3231_set_aging_offset(clock_drift.aging) == ESP_OK){
+			temperature_request();
+			clock_config.rtc.aging = clock_drift.aging;
+			clock_config.rtc.ppm = (float)drift_untrimmed_ppm(&clock_drift);
+			clock_config_changed(CLOCK_CONFIG_RTC_DRIFT);
+		}
+	}
 }
 
 
+clock_realign_t clock_realign(int64_t offset_us, int64_t uncertainty_us){
 
-bool clock_realign(time_t new_t){
+	/* whole seconds of lost edges are the tick count's fault, not the RTC's: they must not reach the drift estimator */
+	if(time_set){
+		clock_rtc_check();
+	}
 
-	double d = fabs(difftime(timestamp_utc, new_t));
-	if(d > CLOCK_MAX_ACCEPTABLE_TIME_DRIFT){
-		ESP_LOGI(TAG, "Re-alignment of the clock");
-		timestamp_utc = new_t;
+	int64_t now = esp_timer_get_time();
+	bool valid;
+	int64_t error_us = clock_time_us(now, &valid) - (now + offset_us);
+	int64_t tolerance_us = uncertainty_us > CLOCK_MAX_TIME_ERROR_US ? uncertainty_us : CLOCK_MAX_TIME_ERROR_US;
+
+	if(valid){
+		ESP_LOGI(TAG, "Clock is %+lld ms off, +/- %lld ms", (long long)(error_us / 1000), (long long)(uncertainty_us / 1000));
+#if CONFIG_CLOCK_RTC_TRIM
+		clock_drift_update(now + offset_us, error_us, uncertainty_us);
+#endif
+		if(error_us >= -tolerance_us && error_us <= tolerance_us){
+			return CLOCK_REALIGN_NOT_NEEDED;
+		}
+	}
 
-		/* set time on RTC */
-		ESP_ERROR_CHECK(ds3231_set_time(localtime(&timestamp_utc)));
+	/* the first second boundary far enough ahead to get ready for it */
+	time_t second = (time_t)((now + offset_us + CLOCK_REALIGN_LEAD_US) / 1000000LL) + 1;
+	int64_t at_us = (int64_t)second * 1000000LL - offset_us;
+
+	ESP_LOGI(TAG, "Re-alignment of the clock");
+	struct tm utc_tm;
+	gmtime_r(&second, &utc_tm);
+	esp_err_t ret = ds3231_set_time_at(&utc_tm, at_us, tolerance_us);
+	if(ret != ESP_OK && ret != ESP_ERR_INVALID_STATE){
+		/* the RTC still has its old time: the next sync tries again */
+		ESP_LOGE(TAG, "Could not set the RTC: %s", esp_err_to_name(ret));
+		return CLOCK_REALIGN_FAILED;
+	}
 
-		return true;
+	/* the countdown chain restarted at at_us: it is the new edge, and edges of the old chain no longer count */
+	portENTER_CRITICAL(&clock_tick_spinlock);
+	clock_ticks_pending = 0;
+	clock_tick_edge_us = at_us;
+	portEXIT_CRITICAL(&clock_tick_spinlock);
+	clock_tick_previous_edge_us = at_us;
+	timestamp_utc = second;
+
+	/* the estimator follows the clock across the jump, unless the clock had no time to compare with */
+	if(valid){
+		drift_stepped(&clock_drift, -error_us);
+	}
+	else{
+		drift_reset(&clock_drift);
 	}
 
-	return false;
+	if(ret == ESP_ERR_INVALID_STATE){
+		/* written too late: the edges now follow the new chain, a step too far from true time. The next sync sees it */
+		ESP_LOGE(TAG, "RTC set too late to be trusted");
+		return CLOCK_REALIGN_FAILED;
+	}
 
+	return CLOCK_REALIGN_DONE;
 }
 
 
@@ -441,32 +1093,31 @@ esp_err_t clock_get_nvs_config(clock_config_t *conf){
 	nvs_handle handle;
 	esp_err_t esp_err;
 
-	esp_err = nvs_open(clock_nvs_namespace, NVS_READONLY, &handle);
-	if(esp_err == ESP_OK){
-		ESP_LOGI(TAG, "Getting config from NVS memory");
-
-		size_t sz = sizeof(clock_config_t);
-		esp_err = nvs_get_blob(handle, "conf", conf, &sz);
-		if(esp_err != ESP_OK){
-			return esp_err;
-		}
+	journal_init(&clock_journal, clock_nvs_namespace, clock_config_fields, CLOCK_CONFIG_FIELD_COUNT, sizeof(clock_config_t));
 
-		nvs_close(handle);
+	esp_err = journal_load(&clock_journal, conf);
+	if(esp_err == ESP_OK){
+		ESP_LOGI(TAG, "Got config from NVS memory");
 	}
 	else if(esp_err == ESP_ERR_NVS_NOT_FOUND){
-		/* first time launching the program! */
-		ESP_LOGI(TAG, "Cannot find clock nvs namespace. Attempt to create it");
-		nvs_close(handle);
-
-		esp_err = nvs_open(clock_nvs_namespace, NVS_READWRITE, &handle);
-		if(esp_err == ESP_OK){
-
+		/* first time launching the program, or a config saved as a single blob by a previous firmware */
+		if(nvs_open(clock_nvs_namespace, NVS_READONLY, &handle) == ESP_OK){
 			size_t sz = sizeof(clock_config_t);
-			ESP_ERROR_CHECK(nvs_set_blob(handle, "conf", conf, sz));
-			ESP_ERROR_CHECK(nvs_commit(handle));
+			if(nvs_get_blob(handle, "conf", conf, &sz) == ESP_OK){
+				ESP_LOGI(TAG, "Migrating config to the journal");
+			}
 			nvs_close(handle);
 		}
+		else{
+			ESP_LOGI(TAG, "Cannot find clock nvs namespace. Attempt to create it");
+		}
 
+		esp_err = journal_compact(&clock_journal, conf);
+		if(esp_err == ESP_OK && nvs_open(clock_nvs_namespace, NVS_READWRITE, &handle) == ESP_OK){
+			nvs_erase_key(handle, "conf");
+			nvs_commit(handle);
+			nvs_close(handle);
+		}
 	}
 
 	return esp_err;
@@ -535,29 +1186,10 @@ void clock_nvs_unlock(){
 
 
 esp_err_t clock_save_config(clock_config_t *conf){
-	nvs_handle handle;
-	esp_err_t esp_err;
-
-
-	esp_err = nvs_open(clock_nvs_namespace, NVS_READWRITE, &handle);
-	if(esp_err == ESP_OK){
-
-		/* set timezone */
-		size_t sz = sizeof(clock_config_t);
-		esp_err = nvs_set_blob(handle, "conf", conf, sz);
-		if(esp_err != ESP_OK){
-			ESP_LOGE(TAG, "clock_save_config nvs_set_blob failed with error: %s", esp_err_to_name(esp_err) );
-			return esp_err;
-		}
-
-		esp_err = nvs_commit(handle);
-		if (esp_err != ESP_OK) return esp_err;
-
-		nvs_close(handle);
 
-	}
-	else{
-		ESP_LOGE(TAG, "Could not get a handle to NVS as NVS_READWRITE");
+	esp_err_t esp_err = journal_compact(&clock_journal, conf);
+	if(esp_err != ESP_OK){
+		ESP_LOGE(TAG, "clock_save_config failed with error: %s", esp_err_to_name(esp_err) );
 	}
 
 	return esp_err;
@@ -604,30 +1236,59 @@ void clock_task(void *pvParameter){
 	char strftime_buf[64];
 
 	/* memory init */
-	memset(&clock_transitions, 0x00, sizeof(CLOCK_MAX_TRANSITIONS) * CLOCK_MAX_TRANSITIONS);
+	memset(clock_transitions, 0x00, sizeof(clock_transitions));
+	clock_transitions_count = 0;
+	clock_transitions_next = 0;
+	clock_transitions_update_event();
 	clock_nvs_mutex = xSemaphoreCreateMutex();
 
 	/* create the task that is used to save config in memory */
 	xTaskCreate( &clock_save_config_task, "task_save_cfg", 4096, NULL, tskIDLE_PRIORITY+1, &clock_task_save_nvs );
 
-	/* register clock queue */
-	clock_queue = xQueueCreate(10, sizeof(clock_queue_message_t));
+	/* payload pool of the clock queue: every payload starts free */
+	clock_message_pool_free = xQueueCreate(CLOCK_MESSAGE_POOL_SIZE, sizeof(clock_message_payload_t*));
+	for(int i = 0; i < CLOCK_MESSAGE_POOL_SIZE; i++){
+		clock_message_payload_t *payload = &clock_message_pool[i];
+		xQueueSend(clock_message_pool_free, &payload, 0);
+	}
+
+	/* register clock queue: one bounded lane per kind of message */
+	clock_lanes[CLOCK_LANE_SLEEP] = xQueueCreate(CLOCK_QUEUE_SLEEP_LENGTH, sizeof(clock_queue_message_t));
+	clock_lanes[CLOCK_LANE_CONFIG] = xQueueCreate(CLOCK_QUEUE_CONFIG_LENGTH, sizeof(clock_queue_message_t));
+	clock_lanes[CLOCK_LANE_NETWORK] = xQueueCreate(CLOCK_QUEUE_NETWORK_LENGTH, sizeof(clock_queue_message_t));
+
+	/* the ISR and clock_send wake the task up through its notification value. Messages are accepted from now on */
+	clock_task_handle = xTaskGetCurrentTaskHandle();
 
 	/* initialized I2C */
 	ESP_ERROR_CHECK(i2c_master_init());
 
-	/* enabled 1Hz square wave */
-	ESP_ERROR_CHECK(ds3231_enable_square_wave());
+	/* enabled 1Hz square wave. A timeout gets the bus recovered: tried once more before giving up without a reboot loop */
+	esp_err_t ret = ds3231_enable_square_wave();
+	if(ret == ESP_ERR_TIMEOUT){
+		ret = ds3231_enable_square_wave();
+	}
+	if(ret != ESP_OK){
+		ESP_LOGE(TAG, "Could not enable the square wave: %s", esp_err_to_name(ret));
+	}
 
 	/* HTTP client is needed for the clock task */
 	ESP_ERROR_CHECK(http_client_init());
+#if CONFIG_CLOCK_SNTP
+	ESP_ERROR_CHECK(ntp_init());
+#endif
 
 	/* get RTC time */
 	memset(&clock_time_tm, 0x00, sizeof(struct tm));
-	ESP_ERROR_CHECK(ds3231_get_time(&clock_time_tm));
+	ret = ds3231_get_time(&clock_time_tm);
 	strftime(strftime_buf, sizeof(strftime_buf), "%c", &clock_time_tm);
 	ESP_LOGI(TAG, "The current RTC time is: %s", strftime_buf);
-	if(clock_time_tm.tm_year < 71){ /* 1971 */
+	if(ret != ESP_OK){
+		/* RTC did not answer: same as a lost time, the next sync sets it */
+		ESP_LOGE(TAG, "Could not read the RTC: %s", esp_err_to_name(ret));
+		timestamp_utc = 1;
+	}
+	else if(clock_time_tm.tm_year < 71){ /* 1971 */
 		/* time is not available: first run or battery of the RTC was dead */
 		timestamp_utc = 1;
 	}
@@ -636,18 +1297,33 @@ void clock_task(void *pvParameter){
 		timestamp_utc = mktime(&clock_time_tm);
 		time_set = true;
 	}
-	clock_time_tm_ptr = localtime(&timestamp_utc);
+	calendar_set(&clock_calendar, timestamp_utc);
+	clock_time_tm_ptr = &clock_calendar.tm;
+
+	/* the temperature is read in the background from now on */
+	ESP_ERROR_CHECK(temperature_init());
 
 	/* initialize configuration */
 	memset(&clock_config, 0x00, sizeof(clock_config));
 	clock_config.timezone.offset = 0;
 	strcpy(clock_config.timezone.name, "UTC");
 	clock_config.sleepmodes.enable_sleepmode = false;
+	clock_config.display.tube_brightness = DISPLAY_BRIGHTNESS_MAX; /* kept if the saved config predates this field */
 	ESP_ERROR_CHECK(clock_get_nvs_config(&clock_config));
 
-	/* generate the list of sleep events */
-	clock_list_sleepevents = list_create();
-	clock_notify_new_sleepmodes(clock_config.sleepmodes);
+	/* the aging offset is lost with the RTC battery: the one saved is written back */
+	drift_init(&clock_drift, clock_config.rtc.aging);
+#if CONFIG_CLOCK_RTC_TRIM
+	if(ds3231_set_aging_offset(clock_config.rtc.aging) == ESP_OK && clock_config.rtc.aging != 0){
+		temperature_request();
+		ESP_LOGI(TAG, "RTC oscillator trimmed by an aging offset of %d (%+.2f ppm untrimmed)", clock_config.rtc.aging, clock_config.rtc.ppm);
+	}
+#endif
+
+	/* timezones of the offline database get the right offset even if the network never comes up */
+	if(time_set){
+		clock_transitions_compute();
+	}
 
 	/* initialize the display */
 	display_set_config(  &(clock_config.display)  );
@@ -655,139 +1331,130 @@ void clock_task(void *pvParameter){
 	display_turn_on();
 	ws2812_set_backlight_color(clock_config.display.led_color);
 
+	/* compile the sleepmodes. If time is known the clock goes to sleep right away if it should */
+	clock_sleep_compile(&clock_config.sleepmodes);
+	if(time_set){
+		clock_sleep_update(timestamp_utc + clock_config.timezone.offset);
+	}
+
 	/* register interrupt on the 1Hz sqw signal coming from the DS3231 */
 	ESP_ERROR_CHECK(clock_register_sqw_interrupt());
 
 	clock_queue_message_t msg;
 
 	for(;;) {
-		if(xQueueReceive(clock_queue, &msg, pdMS_TO_TICKS(11001))) { /* portMAX_DELAY */
+		/* a single wait covers every lane: the ISR and clock_send give the notification */
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(11001));
+
+		/* pending ticks go first, again before every message, so a busy queue never holds a second back */
+		for(;;) {
+			/* right after an edge: the RTC is read well inside the second */
+			if(clock_tick_lane_process() && timestamp_utc % CLOCK_RTC_CHECK_INTERVAL == 0){
+				clock_rtc_check();
+			}
+			if(!clock_receive(&msg)) break;
+
+			clock_message_received(&msg);
 
 			switch(msg.message){
 				case CLOCK_MESSAGE_STA_GOT_IP:
 					ESP_LOGI(TAG, "CLOCK_MESSAGE_STA_GOT_IP");
 					http_client_get_api_time(clock_config.timezone.name);
+#if CONFIG_CLOCK_SNTP
+					ntp_request();
+#endif
 					break;
 				case CLOCK_MESSAGE_TIMEZONE:
 					ESP_LOGI(TAG, "CLOCK_MESSAGE_TIMEZONE");
-					timezone_t* tz = (timezone_t*)msg.param;
-					http_client_get_api_time(tz->name);
-					free(tz);
-					break;
-				case CLOCK_MESSAGE_TICK:
-					//ESP_LOGI(TAG, "CLOCK_MESSAGE_TICK");
-					if(time_set){
-						clock_tick();
-						display_write_time(clock_time_tm_ptr);
-						strftime(strftime_buf, sizeof(strftime_buf), "%c", clock_time_tm_ptr);
-						ESP_LOGI(TAG, "TICK! date/time is: %s", strftime_buf);
+					timezone_t* tz = &msg.param.payload->timezone;
+					/* applied right away if it can be evaluated offline. The time API then confirms it */
+					if(time_set && strcmp(clock_config.timezone.name, tz->name) != 0){
+						timezone_t previous = clock_config.timezone;
+						strcpy(clock_config.timezone.name, tz->name);
+						if(clock_transitions_compute()){
+							clock_config_changed(CLOCK_CONFIG_TIMEZONE_NAME);
+						}
+						else{
+							clock_config.timezone = previous;
+						}
 					}
+					http_client_get_api_time(tz->name);
 					break;
 				case CLOCK_MESSAGE_REQUEST_TRANSITIONS_API_CALL:
-					http_client_get_transitions(clock_config.timezone, timestamp_utc);
+					clock_transitions_request();
 					break;
 				case CLOCK_MESSAGE_RECEIVE_TRANSITIONS_API:{
-
-
-					cJSON *json = (cJSON*)msg.param;
-
-					if(json != NULL){
-						char *json_str = cJSON_Print(json);
-						ESP_LOGI(TAG, "%s", json_str);
-
-						cJSON *transition = NULL;
-						cJSON *transitions = cJSON_GetObjectItemCaseSensitive(json, "transitions");
-						if(transitions){
-
-							int i=0;
-							cJSON_ArrayForEach(transition, transitions){
-								if(transition){
-									cJSON *transitionTimestamp = cJSON_GetObjectItemCaseSensitive(transition, "transitionTimestamp");
-									cJSON *toOffset = cJSON_GetObjectItemCaseSensitive(transition, "toOffset");
-
-									if (transitionTimestamp && toOffset && cJSON_IsNumber(transitionTimestamp) && cJSON_IsNumber(toOffset)){
-
-										/* overflow protection */
-										if(!(i >= CLOCK_MAX_TRANSITIONS)){
-											/* add transitions */
-											clock_transitions[i].offset = toOffset->valueint;
-											clock_transitions[i].timestamp = (time_t)transitionTimestamp->valuedouble;
-											i++;
-										}
-									}
-								}
-							}
-
-							if(i==0){
-								/* no transitions were processed. Run another check in a few days */
-								timestamp_transitions_check = timestamp_utc + (time_t)(60*60*24*15);
-							}
-						}
-
-						free(json_str);
-						cJSON_Delete(json);
-
+					const clock_transitions_api_t *api = &msg.param.payload->transitions_api;
+					if(api->count >= 0){
+						int count = clock_transitions_load(api);
+						ESP_LOGI(TAG, "%d transitions loaded", count);
+						clock_transitions_schedule_refresh(count);
 					}
 					}
 					break;
-				case CLOCK_MESSAGE_RECEIVE_TIME_API:
-					;cJSON *json = (cJSON*)msg.param;
-					bool updateNVS = false;
-					if(json){
-
-						/* log response for debug */
-						char *json_str = cJSON_Print(json);
-						ESP_LOGI(TAG, "%s", json_str);
-
-						/* extract time from json, and set it if necessary */
-						cJSON *timestamp = cJSON_GetObjectItemCaseSensitive(json, "timestamp");
-						if(cJSON_IsNumber(timestamp)){
-							time_t t = timestamp->valueint;
-							clock_realign(t);
+				case CLOCK_MESSAGE_RECEIVE_TIME_API:{
+					const clock_time_api_t *api = &msg.param.payload->time_api;
+					clock_realign_t realign = CLOCK_REALIGN_NOT_NEEDED;
+
+					/* set time if necessary. The API is precise to the second, SNTP has the last word once it answered */
+					if(api->has_timestamp && !clock_sntp_synced){
+						/* the server read its clock somewhere between the request and the answer, and dropped the fraction */
+						int64_t rtt_us = api->response_us - api->request_us;
+						int64_t offset_us = (int64_t)api->timestamp * 1000000LL + 500000 - (api->request_us + api->response_us) / 2;
+						realign = clock_realign(offset_us, 500000 + rtt_us / 2);
+						/* a clock without time stays unset until the RTC holds one: it would otherwise run from 1970 */
+						if(realign != CLOCK_REALIGN_FAILED){
 							time_set = true;
 						}
+					}
 
-						/* check timezone, save in memory if it's different than what was saved previously */
-						cJSON *timezone = cJSON_GetObjectItemCaseSensitive(json, "timezone");
-						if(cJSON_IsObject(timezone)){
-							cJSON *timezoneName = cJSON_GetObjectItemCaseSensitive(timezone, "name");
-							if(cJSON_IsString(timezoneName) && strcmp(clock_config.timezone.name, timezoneName->valuestring) != 0){
-								/* realign clock_timezone */
-								updateNVS = true;
-								strcpy(clock_config.timezone.name, timezoneName->valuestring);
-								ESP_LOGI(TAG, "Timezone set to: %s", clock_config.timezone.name);
-							}
-
-							cJSON *offset = cJSON_GetObjectItemCaseSensitive(timezone, "offset");
-							if(cJSON_IsNumber(offset) && clock_config.timezone.offset != offset->valueint){
-								/* realign offset if needed */
-								updateNVS = true;
-								clock_config.timezone.offset = offset->valueint;
-								ESP_LOGI(TAG, "Offset set to: %d", clock_config.timezone.offset);
-							}
-						}
-
-						/* memory clean up */
-						free(json_str);
-						cJSON_Delete(json);
+					/* check timezone, save in memory if it's different than what was saved previously */
+					if(api->has_timezone_name && strcmp(clock_config.timezone.name, api->timezone.name) != 0){
+						/* realign clock_timezone */
+						clock_config_changed(CLOCK_CONFIG_TIMEZONE_NAME);
+						strcpy(clock_config.timezone.name, api->timezone.name);
+						ESP_LOGI(TAG, "Timezone set to: %s", clock_config.timezone.name);
+
+						/* transitions of the previous timezone no longer apply. New ones are requested below */
+						clock_transitions_count = 0;
+						clock_transitions_next = 0;
+						clock_transitions_update_event();
+					}
 
-						/* NVS needs to updated: notify the task that handles that */
-						if(updateNVS){
-							xTaskNotifyGive( clock_task_save_nvs );
-						}
+					if(api->has_timezone_offset && clock_config.timezone.offset != api->timezone.offset){
+						/* realign offset if needed */
+						clock_config_changed(CLOCK_CONFIG_TIMEZONE_OFFSET);
+						clock_config.timezone.offset = api->timezone.offset;
+						ESP_LOGI(TAG, "Offset set to: %d", clock_config.timezone.offset);
+					}
 
-						/* finally, enqueue a timezone transitions call with the set timezone */
-						clock_queue_message_t m;
-						m.message = CLOCK_MESSAGE_REQUEST_TRANSITIONS_API_CALL;
-						m.param = NULL;
-						xQueueSend(clock_queue, &m, portMAX_DELAY);
+					/* the next change of the sleep state was computed for the time before the jump */
+					if(realign == CLOCK_REALIGN_DONE){
+						clock_sleep_update(timestamp_utc + clock_config.timezone.offset);
+					}
 
+					/* finally, get the transitions of the set timezone. Done here rather than queued: a full lane would lose it */
+					clock_transitions_request();
+					}
+					break;
+				case CLOCK_MESSAGE_RECEIVE_SNTP:{
+					/* the offset is at worst half the round trip away from the truth */
+					const ntp_result_t *result = &msg.param.payload->sntp;
+					clock_realign_t realign = clock_realign(result->offset_us, result->delay_us / 2);
+					/* unless the clock has a time, the time API remains a way to get one */
+					if(realign != CLOCK_REALIGN_FAILED || time_set){
+						clock_sntp_synced = true;
+						time_set = true;
+					}
+					if(realign == CLOCK_REALIGN_DONE){
+						/* the next change of the sleep state was computed for the time before the jump */
+						clock_sleep_update(timestamp_utc + clock_config.timezone.offset);
+					}
 					}
 					break;
 				case CLOCK_MESSAGE_SLEEPMODE_CONFIG:{
 					ESP_LOGI(TAG, "CLOCK_MESSAGE_SLEEPMODE_CONFIG");
-					sleepmodes_t* sleepmodes = (sleepmodes_t*)msg.param;
-					clock_build_new_sleepmodes(*sleepmodes);
+					sleepmodes_t* sleepmodes = &msg.param.payload->sleepmodes;
 
 					/* if config needs to be updated then we do so and notify the task to save in flash 
 						NOTE: we can do a simple memory comparison here because all the configurations objects
@@ -796,32 +1463,42 @@ void clock_task(void *pvParameter){
 					*/
 					if( memcmp( sleepmodes, &(clock_config.sleepmodes), sizeof(sleepmodes_t) ) != 0 ){
 						clock_config.sleepmodes = *sleepmodes;
-						xTaskNotifyGive( clock_task_save_nvs );
+						clock_config_changed(CLOCK_CONFIG_SLEEPMODES);
+					}
+					clock_sleep_compile(&clock_config.sleepmodes);
+					if(time_set){
+						clock_sleep_update(timestamp_utc + clock_config.timezone.offset);
 					}
-
-					free(sleepmodes);
 					}
 					break;
 				case CLOCK_MESSAGE_SLEEP_EVENT:{
 					ESP_LOGI(TAG, "CLOCK_MESSAGE_SLEEP_EVENT");
-					sleep_action_t a = (sleep_action_t)msg.param;
-					if(a == SLEEP_ACTION_WAKE){
-						display_turn_on();
-						ws2812_set_backlight_color(clock_config.display.led_color);
-					}
-					else if(a == SLEEP_ACTION_SLEEP){
-						display_turn_off();
-						ws2812_set_backlight_color_rgb( (uint8_t)0, (uint8_t)0, (uint8_t)0);
-					}
-
+					clock_sleep_apply(msg.param.sleep_action);
 					}
 					break;
 				case CLOCK_MESSAGE_BACKLIGHTS_CONFIG:{
-					;rgb_t rgb;
-					rgb.num = (uint32_t)msg.param;
+					rgb_t rgb = msg.param.rgb;
 					if(clock_config.display.led_color.num != rgb.num){
 						clock_config.display.led_color = rgb;
-						xTaskNotifyGive( clock_task_save_nvs );
+						clock_config_changed(CLOCK_CONFIG_LED_COLOR);
+					}
+					}
+					break;
+				case CLOCK_MESSAGE_TUBE_BRIGHTNESS_CONFIG:{
+					uint8_t brightness = msg.param.brightness;
+					if(clock_config.display.tube_brightness != brightness){
+						clock_config.display.tube_brightness = brightness;
+						display_set_config( &(clock_config.display) );
+						clock_config_changed(CLOCK_CONFIG_TUBE_BRIGHTNESS);
+					}
+					}
+					break;
+				case CLOCK_MESSAGE_DISPLAY_TRANSITION_CONFIG:{
+					display_transition_t transition = msg.param.transition;
+					if(clock_config.display.transition != transition){
+						clock_config.display.transition = transition;
+						display_set_config( &(clock_config.display) );
+						clock_config_changed(CLOCK_CONFIG_TRANSITION);
 					}
 					}
 					break;
@@ -831,6 +1508,8 @@ void clock_task(void *pvParameter){
 					break;
 			}
 
+			/* pooled payloads go back to the pool, nothing is ever freed */
+			clock_message_release(&msg);
 		}
 		taskYIELD();
 	}
@@ -87,6 +87,34 @@ function colorChangeCallback(color) {
 	
 }
 
+async function getBrightness(){
+
+	try{
+		let res = await fetch("config/");
+		let config = await res.json();
+		gel("brightness-range").value = config.display.tube_brightness;
+	}
+	catch (e){
+		console.info("error" + e);
+	}
+}
+
+async function changeBrightness(){
+
+	try{
+		await fetch("display/", {
+			method: "POST",
+			headers: {
+			  "Content-Type": "application/json",
+			},
+			body: JSON.stringify({ brightness: parseInt(gel("brightness-range").value, 10) }),
+		  });
+	}
+	catch (e) {
+		console.info("error in changeBrightness");
+	}
+}
+
 async function getTimezones(){
 
 	try{
@@ -340,6 +368,7 @@ docReady(async function () {
 
 	await getSleepMode();
 	await getTimezones();
+	await getBrightness();
 
 	var colorPicker = new iro.ColorPicker('#color-picker-container');
 	colorPicker.on("color:change", colorChangeCallback);
@@ -374,6 +403,10 @@ docReady(async function () {
 	);
 
 
+	gel("brightness-range").addEventListener('change', async (event) => {
+		await changeBrightness();
+	});
+
 	gel("timezone-select").addEventListener('change', async (event) => {
 		await changeTimezone();
 	});
@@ -3,4 +3,4 @@
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
 
-COMPONENT_EMBED_FILES := style.css jquery.gz code.js index.html clock.js iro.js clock.css
\ No newline at end of file
+COMPONENT_EMBED_FILES := style.css jquery.gz code.js index.html clock.js iro.js clock.css tz.bin
\ No newline at end of file
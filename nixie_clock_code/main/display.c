@@ -31,43 +31,176 @@ Contains functions to control the nixie clock display over SPI
 #include <byteswap.h>
 
 #include <esp_err.h>
+#include <esp_heap_caps.h>
 #include <driver/gpio.h>
 #include <driver/spi_master.h>
-#include <driver/gpio.h>
+#include <driver/ledc.h>
+#include <driver/timer.h>
+#include <esp_timer.h>
+#include <esp32/rom/gpio.h>
+#include <soc/gpio_sig_map.h>
 #include <esp_intr_alloc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 
 #include "display.h"
 
 
-static uint16_t *display_vram;
+/**
+ * @brief front and back VRAM. Frames are rendered in the back buffer which is then flipped to the front.
+ * The front buffer is always the last frame sent to the display.
+ */
+static uint16_t display_vram[2][DISPLAY_DIGIT_COUNT];
+static uint8_t display_front = 0;
+
+/**
+ * @brief protects the back buffer and the page flip, so that any task can render a frame.
+ */
+static SemaphoreHandle_t display_mutex = NULL;
+
+/**
+ * @brief big endian, DMA capable copies of the frames currently queued on the SPI bus.
+ */
+static uint16_t *display_dma[DISPLAY_DMA_BUFFERS];
+static spi_transaction_t display_trans[DISPLAY_DMA_BUFFERS];
+static bool display_trans_busy[DISPLAY_DMA_BUFFERS];
+
 static spi_device_handle_t spi;
-static spi_transaction_t t;
 static display_config_t display_config;
 
+/**
+ * @brief gamma corrected (2.2) on-time of the tubes for a brightness of 0 to 100%, out of DISPLAY_PWM_DUTY_MAX.
+ * Perceived brightness is roughly linear with the index.
+ */
+static const uint16_t display_gamma[DISPLAY_BRIGHTNESS_MAX + 1] = {
+	   0,    0,    0,    0,    1,    1,    2,    3,    4,    5,
+	   6,    8,   10,   12,   14,   16,   18,   21,   24,   27,
+	  30,   33,   37,   40,   44,   49,   53,   57,   62,   67,
+	  72,   78,   83,   89,   95,  102,  108,  115,  122,  129,
+	 136,  144,  152,  160,  168,  177,  186,  194,  204,  213,
+	 223,  233,  243,  253,  264,  275,  286,  297,  309,  321,
+	 333,  345,  358,  371,  384,  397,  410,  424,  438,  453,
+	 467,  482,  497,  512,  528,  544,  560,  576,  593,  610,
+	 627,  644,  662,  680,  698,  716,  735,  754,  773,  792,
+	 812,  832,  852,  873,  894,  915,  936,  958,  979, 1002,
+	1024
+};
+
+/**
+ * @brief a digit transition in progress. Owned by the compositor task, set up by display_write_time, both under display_mutex.
+ */
+typedef struct display_transition_state_t{
+	bool active;
+	uint16_t from[DISPLAY_DIGIT_COUNT];
+	uint16_t to[DISPLAY_DIGIT_COUNT];
+	uint32_t frame;				/* timer period reached so far, out of DISPLAY_TRANSITION_FRAMES */
+	uint32_t dither;			/* crossfade error accumulator */
+	int64_t start_us;
+}display_transition_state_t;
+
+static display_transition_state_t display_transition;
+static display_compositor_stats_t display_compositor_stats;
+static TaskHandle_t display_compositor_handle = NULL;
+
+static esp_err_t display_flip();
+
+/** @brief brightness the tubes are set to, or will be set to when the display is turned on */
+static uint8_t display_brightness = DISPLAY_BRIGHTNESS_MAX;
+static bool display_on = false;
+
 
 
 static void IRAM_ATTR gpio_usb_power_isr_handler(void* arg){
 
-	/* disable display when USB is on as a measure of security for the whole board. USB powering HV power supply after going through a tiny diode = bad idea */
+	/* disable display when USB is on as a measure of security for the whole board. USB powering HV power supply after going through a tiny diode = bad idea
+	 * OE is normally driven by the LEDC peripheral: take the pin back first (ROM function, safe from an ISR). display_turn_on gives it back to LEDC. */
+	gpio_matrix_out(DISPLAY_OE_GPIO, SIG_GPIO_OUT_IDX, false, false);
 	gpio_set_level(DISPLAY_OE_GPIO, 1);
 	return;
 }
 
 
+/**
+ * @brief OE is active low: the PWM duty is the time the tubes are blanked, hence the inversion.
+ */
+static inline uint32_t display_brightness_to_duty(uint8_t brightness){
+	return DISPLAY_PWM_DUTY_MAX - display_gamma[brightness];
+}
+
+/**
+ * @brief moves the OE duty to a new value. The fade is stepped by the LEDC hardware, this returns immediately.
+ */
+static esp_err_t display_set_duty(uint32_t duty, uint32_t fade_ms){
+	esp_err_t ret;
+
+	if(fade_ms == 0){
+		ret = ledc_set_duty(DISPLAY_LEDC_MODE, DISPLAY_LEDC_CHANNEL, duty);
+		if(ret != ESP_OK) return ret;
+		return ledc_update_duty(DISPLAY_LEDC_MODE, DISPLAY_LEDC_CHANNEL);
+	}
+	else{
+		ret = ledc_set_fade_with_time(DISPLAY_LEDC_MODE, DISPLAY_LEDC_CHANNEL, duty, fade_ms);
+		if(ret != ESP_OK) return ret;
+		return ledc_fade_start(DISPLAY_LEDC_MODE, DISPLAY_LEDC_CHANNEL, LEDC_FADE_NO_WAIT);
+	}
+}
+
+/**
+ * @brief routes OE to the LEDC channel, with the tubes blanked.
+ */
+static esp_err_t display_attach_pwm(){
+
+	ledc_channel_config_t channel = {
+		.gpio_num = DISPLAY_OE_GPIO,
+		.speed_mode = DISPLAY_LEDC_MODE,
+		.channel = DISPLAY_LEDC_CHANNEL,
+		.intr_type = LEDC_INTR_DISABLE,
+		.timer_sel = DISPLAY_LEDC_TIMER,
+		.duty = DISPLAY_PWM_DUTY_MAX,
+		.hpoint = 0
+	};
+
+	return ledc_channel_config(&channel);
+}
+
+
 void display_turn_on(){
 	/* turn on does not do anything if USB power is connected */
 	if(gpio_get_level(DEBUG_USB_POWER_ON_GPIO) == 0){
 		gpio_set_level(DISPLAY_HVEN_GPIO, 1);
-		gpio_set_level(DISPLAY_OE_GPIO, 0);
+
+		/* start blanked and let the hardware ramp up to the configured brightness */
+		if(display_attach_pwm() == ESP_OK){
+			display_on = true;
+			display_set_duty(display_brightness_to_duty(display_brightness), DISPLAY_BRIGHTNESS_FADE_MS);
+		}
 	}
 }
 
 void display_turn_off(){
-	gpio_set_level(DISPLAY_OE_GPIO, 1);
+	display_on = false;
+	ledc_stop(DISPLAY_LEDC_MODE, DISPLAY_LEDC_CHANNEL, 1);
 	gpio_set_level(DISPLAY_HVEN_GPIO, 0);
 }
 
 
+esp_err_t display_set_brightness(uint8_t brightness, uint32_t fade_ms){
+
+	if(brightness > DISPLAY_BRIGHTNESS_MAX) brightness = DISPLAY_BRIGHTNESS_MAX;
+	display_brightness = brightness;
+
+	/* while off the new value is simply kept for the next display_turn_on */
+	if(!display_on) return ESP_OK;
+
+	return display_set_duty(display_brightness_to_duty(brightness), fade_ms);
+}
+
+uint8_t display_get_brightness(){
+	return display_brightness;
+}
+
+
 esp_err_t display_register_usb_power_interrupt(){
 
 	/* setup DEBUG_USB_POWER_ON_GPIO as INTERRUPT on RISING EGDE */
@@ -89,15 +222,196 @@ esp_err_t display_register_usb_power_interrupt(){
 
 
 
+/**
+ * @brief one frame period elapsed: wake up the compositor. A count above 1 when it wakes up means it missed frames.
+ */
+static void IRAM_ATTR display_timer_isr(void *arg){
+	BaseType_t woken = pdFALSE;
+
+	timer_group_clr_intr_status_in_isr(DISPLAY_TIMER_GROUP, DISPLAY_TIMER);
+	timer_group_enable_alarm_in_isr(DISPLAY_TIMER_GROUP, DISPLAY_TIMER);
+
+	vTaskNotifyGiveFromISR(display_compositor_handle, &woken);
+	if(woken == pdTRUE){
+		portYIELD_FROM_ISR();
+	}
+}
+
+
+/**
+ * @brief rolls a one-hot digit from "from" towards "to", counting up. Dots and blank tubes are not rolled.
+ */
+static uint16_t display_roll_digit(uint16_t from, uint16_t to, uint32_t frame){
+	const uint16_t digits = DISPLAY_TOP_DOT_MASK - 1;
+	const uint16_t dots = to & ~digits;
+
+	if((from & digits) == 0 || (to & digits) == 0){
+		/* blank tube: no digit to roll from or to, switch half way through */
+		return frame < DISPLAY_TRANSITION_FRAMES / 2 ? from : to;
+	}
+
+	const int a = __builtin_ctz(from & digits);
+	const int b = __builtin_ctz(to & digits);
+	const int steps = (b - a + 10) % 10;
+	const int d = (a + (int)((frame * steps) / DISPLAY_TRANSITION_FRAMES)) % 10;
+
+	return (uint16_t)(1 << d) | dots;
+}
+
+
+/**
+ * @brief builds the frame of the transition for the current timer period.
+ * @note must be called with display_mutex held
+ */
+static void display_compose(uint16_t *frame){
+	display_transition_state_t *t = &display_transition;
+
+	switch(display_config.transition){
+		case DISPLAY_TRANSITION_CROSSFADE:{
+			/* the new cathode is lit frame/DISPLAY_TRANSITION_FRAMES of the time. The accumulator spreads
+			 * the lit frames evenly, which the eye integrates into a fade at several hundred frames per second. */
+			t->dither += t->frame;
+			const bool show_new = t->dither >= DISPLAY_TRANSITION_FRAMES;
+			if(show_new) t->dither -= DISPLAY_TRANSITION_FRAMES;
+			memcpy(frame, show_new ? t->to : t->from, sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
+			}
+			break;
+		case DISPLAY_TRANSITION_ROLL:
+			for(int i=0; i < DISPLAY_DIGIT_COUNT; i++){
+				frame[i] = display_roll_digit(t->from[i], t->to[i], t->frame);
+			}
+			break;
+		default:
+			memcpy(frame, t->to, sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
+			break;
+	}
+}
+
+
+/**
+ * @brief sends the frames of digit transitions, one per hardware timer period.
+ */
+static void display_compositor_task(void *pvParameters){
+	uint16_t frame[DISPLAY_DIGIT_COUNT];
+
+	for(;;){
+		const uint32_t periods = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		const int64_t now = esp_timer_get_time();
+
+		xSemaphoreTake(display_mutex, portMAX_DELAY);
+
+		display_transition_state_t *t = &display_transition;
+		if(t->active){
+
+			/* stay on schedule: frames for the periods that went by are lost, not sent late */
+			t->frame += periods;
+			display_compositor_stats.dropped += periods - 1;
+
+			const int64_t jitter = now - (t->start_us + (int64_t)t->frame * DISPLAY_FRAME_PERIOD_US);
+			if(jitter > 0){
+				display_compositor_stats.total_jitter_us += (uint64_t)jitter;
+				if(jitter > display_compositor_stats.max_jitter_us) display_compositor_stats.max_jitter_us = (uint32_t)jitter;
+			}
+
+			const bool last = t->frame >= DISPLAY_TRANSITION_FRAMES;
+			if(last){
+				memcpy(frame, t->to, sizeof(frame));
+			}
+			else{
+				display_compose(frame);
+			}
+
+			memcpy(display_vram[display_front ^ 1], frame, sizeof(frame));
+			if(display_flip() == ESP_OK){
+				display_compositor_stats.frames++;
+				if(last){
+					t->active = false;
+					timer_pause(DISPLAY_TIMER_GROUP, DISPLAY_TIMER);
+				}
+			}
+			else{
+				/* bus still busy. The final frame must not be lost so it is retried on the next period */
+				display_compositor_stats.dropped++;
+			}
+		}
+
+		xSemaphoreGive(display_mutex);
+	}
+}
+
+
+/**
+ * @brief starts a transition towards a new frame, or writes it right away if there is nothing to animate.
+ */
+static esp_err_t display_transition_to(const uint16_t *frame){
+	esp_err_t ret = ESP_OK;
+	display_transition_state_t *t = &display_transition;
+
+	xSemaphoreTake(display_mutex, portMAX_DELAY);
+
+	/* a transition still running is completed at once: start from where it was going */
+	memcpy(t->from, t->active ? t->to : display_vram[display_front], sizeof(t->from));
+	memcpy(t->to, frame, sizeof(t->to));
+
+	if(display_config.transition == DISPLAY_TRANSITION_NONE || !display_on || display_compositor_handle == NULL || memcmp(t->from, t->to, sizeof(t->to)) == 0){
+		if(t->active){
+			t->active = false;
+			timer_pause(DISPLAY_TIMER_GROUP, DISPLAY_TIMER);
+		}
+		memcpy(display_vram[display_front ^ 1], frame, sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
+		ret = display_flip();
+	}
+	else{
+		t->frame = 0;
+		t->dither = 0;
+		t->start_us = esp_timer_get_time();
+		display_compositor_stats.transitions++;
+
+		if(!t->active){
+			t->active = true;
+			timer_set_counter_value(DISPLAY_TIMER_GROUP, DISPLAY_TIMER, 0);
+			timer_start(DISPLAY_TIMER_GROUP, DISPLAY_TIMER);
+		}
+	}
+
+	xSemaphoreGive(display_mutex);
+
+	return ret;
+}
+
+
+void display_get_compositor_stats(display_compositor_stats_t *stats){
+	xSemaphoreTake(display_mutex, portMAX_DELAY);
+	*stats = display_compositor_stats;
+	xSemaphoreGive(display_mutex);
+}
+
+
 esp_err_t display_init(){
 
 	esp_err_t ret;
 
-	display_vram = (uint16_t*)malloc(sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
-	memset(display_vram, 0x00, sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
+	memset(display_vram, 0x00, sizeof(display_vram));
+	display_front = 0;
 
 	memset(&display_config, 0x00, sizeof(display_config_t));
 
+	display_mutex = xSemaphoreCreateMutex();
+	if(display_mutex == NULL) return ESP_ERR_NO_MEM;
+
+	/* SPI DMA can only read from internal memory */
+	for(int i=0; i < DISPLAY_DMA_BUFFERS; i++){
+		display_dma[i] = (uint16_t*)heap_caps_malloc(sizeof(uint16_t) * DISPLAY_DIGIT_COUNT, MALLOC_CAP_DMA);
+		if(display_dma[i] == NULL) return ESP_ERR_NO_MEM;
+		memset(display_dma[i], 0x00, sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
+
+		memset(&display_trans[i], 0x00, sizeof(spi_transaction_t));
+		display_trans[i].length = DISPLAY_DIGIT_COUNT * 16; /* 6 digits, 16 bits per digits */
+		display_trans[i].tx_buffer = display_dma[i];
+		display_trans[i].user = (void*)(intptr_t)i;
+		display_trans_busy[i] = false;
+	}
+
 	/* setup all GPIOs */
 	gpio_set_direction(DISPLAY_SPI_CS_GPIO, GPIO_MODE_OUTPUT);
 	gpio_set_direction(DISPLAY_OE_GPIO, GPIO_MODE_OUTPUT);
@@ -108,6 +422,23 @@ esp_err_t display_init(){
 	gpio_set_level(DISPLAY_OE_GPIO, 1); /* output enable is reversed logic. This effectively has no effect since the pin is physically pulled-up to 3v3 */
 	gpio_set_level(DISPLAY_HVEN_GPIO, 1);
 
+	/* tube brightness is a PWM on OE. The hardware fades it so dimming costs no CPU time */
+	ledc_timer_config_t timer = {
+		.speed_mode = DISPLAY_LEDC_MODE,
+		.duty_resolution = DISPLAY_PWM_RESOLUTION,
+		.timer_num = DISPLAY_LEDC_TIMER,
+		.freq_hz = DISPLAY_PWM_FREQUENCY_HZ,
+		.clk_cfg = LEDC_AUTO_CLK
+	};
+	ret = ledc_timer_config(&timer);
+	if(ret != ESP_OK) return ret;
+
+	ret = ledc_fade_func_install(0);
+	if(ret != ESP_OK) return ret;
+
+	ret = display_attach_pwm();
+	if(ret != ESP_OK) return ret;
+
 	/* register interrupt on USB power */
 	//ret = display_register_usb_power_interrupt();
 	//if(ret != ESP_OK) return ret;
@@ -123,7 +454,7 @@ esp_err_t display_init(){
 		.clock_speed_hz=100000,					/* clock at 100Khz => about 1000 frames per seconds! */
 		.mode=0,                    			/* SPI mode 0 */
 		.spics_io_num=DISPLAY_SPI_CS_GPIO,      /* CS pin CS GPIO pin for this device, or -1 if not used. */
-		.queue_size=4                           /* Queue size is not really relevant for the nixie display so its kept low */
+		.queue_size=DISPLAY_DMA_BUFFERS         /* one slot per DMA buffer: queuing a frame never blocks */
 		//.pre_cb=ili_spi_pre_transfer_callback,  //Specify pre-transfer callback to handle D/C line
 	};
 
@@ -136,11 +467,28 @@ esp_err_t display_init(){
 	ret=spi_bus_add_device(HSPI_HOST, &devcfg, &spi);
 	if(ret!=ESP_OK) return ret;
 
-	/* prepare transaction */
-	memset(&t, 0x00, sizeof(t));
-	t.length = DISPLAY_DIGIT_COUNT * 16; /* 6 digits, 16 bits per digits */
-	t.tx_buffer = display_vram;
-	t.user = NULL;
+	/* frame clock of the transition compositor. It only runs while a transition is in progress */
+	memset(&display_transition, 0x00, sizeof(display_transition));
+	memset(&display_compositor_stats, 0x00, sizeof(display_compositor_stats));
+	timer_config_t timer_cfg = {
+		.alarm_en = TIMER_ALARM_EN,
+		.counter_en = TIMER_PAUSE,
+		.intr_type = TIMER_INTR_LEVEL,
+		.counter_dir = TIMER_COUNT_UP,
+		.auto_reload = TIMER_AUTORELOAD_EN,
+		.divider = DISPLAY_TIMER_DIVIDER
+	};
+	ret = timer_init(DISPLAY_TIMER_GROUP, DISPLAY_TIMER, &timer_cfg);
+	if(ret!=ESP_OK) return ret;
+	timer_set_counter_value(DISPLAY_TIMER_GROUP, DISPLAY_TIMER, 0);
+	timer_set_alarm_value(DISPLAY_TIMER_GROUP, DISPLAY_TIMER, DISPLAY_FRAME_PERIOD_US);
+	timer_enable_intr(DISPLAY_TIMER_GROUP, DISPLAY_TIMER);
+
+	if(xTaskCreatePinnedToCore(display_compositor_task, "display_compositor", 2048, NULL, DISPLAY_COMPOSITOR_TASK_PRIORITY, &display_compositor_handle, 0) != pdPASS){
+		return ESP_ERR_NO_MEM;
+	}
+
+	ret = timer_isr_register(DISPLAY_TIMER_GROUP, DISPLAY_TIMER, display_timer_isr, NULL, ESP_INTR_FLAG_IRAM, NULL);
 
 	return ret;
 }
@@ -148,46 +496,110 @@ esp_err_t display_init(){
 
 
 uint16_t* display_get_vram(){
-	return display_vram;
+	return display_vram[display_front ^ 1];
+}
+
+void display_get_front(uint16_t *frame){
+	xSemaphoreTake(display_mutex, portMAX_DELAY);
+	memcpy(frame, display_vram[display_front], sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
+	xSemaphoreGive(display_mutex);
 }
 
 void display_set_config(display_config_t* config){
 	display_config = *config;
+
+	if(display_config.tube_brightness != display_brightness){
+		display_set_brightness(display_config.tube_brightness, DISPLAY_BRIGHTNESS_FADE_MS);
+	}
 }
 
-esp_err_t display_write_vram(){
-	esp_err_t ret;
 
+/**
+ * @brief reclaims the DMA buffers of every transaction the SPI driver is done with. Never blocks.
+ * @note must be called with display_mutex held
+ */
+static void display_collect_transactions(){
+	spi_transaction_t *done;
+
+	while(spi_device_get_trans_result(spi, &done, 0) == ESP_OK){
+		display_trans_busy[(intptr_t)done->user] = false;
+	}
+}
 
-	/* due to esp32 endianess, we need to swipe bytes. The hardware assumes big endian but the esp is little endian. */
-	for(int i=0;i<6;i++){
-		display_vram[i] = __bswap_16(display_vram[i]);
+
+/**
+ * @brief queues the back buffer on the SPI bus and makes it the front buffer.
+ * @note must be called with display_mutex held
+ */
+static esp_err_t display_flip(){
+	esp_err_t ret;
+	int slot = -1;
+	const uint16_t *back = display_vram[display_front ^ 1];
+
+	display_collect_transactions();
+	for(int i=0; i < DISPLAY_DMA_BUFFERS; i++){
+		if(!display_trans_busy[i]){
+			slot = i;
+			break;
+		}
 	}
 
+	/* the bus is still busy with older frames: keep the back buffer, the caller may retry */
+	if(slot < 0) return ESP_ERR_TIMEOUT;
 
-	/* safe guard. Enable display only if USB is disconnected */
-	if(gpio_get_level(DEBUG_USB_POWER_ON_GPIO) == 0){
-		gpio_set_level(DISPLAY_OE_GPIO, 0);
+	/* due to esp32 endianess, we need to swipe bytes. The hardware assumes big endian but the esp is little endian.
+	 * This is done on the DMA copy so that the VRAM itself always stays in native order. */
+	for(int i=0; i < DISPLAY_DIGIT_COUNT; i++){
+		display_dma[slot][i] = __bswap_16(back[i]);
 	}
 
-	gpio_set_level(DISPLAY_SPI_CS_GPIO, 0);
-	ret=spi_device_transmit(spi, &t);
-	gpio_set_level(DISPLAY_SPI_CS_GPIO, 1);
+	/* CS is driven by the SPI driver itself since the transaction completes after this function returns */
+	ret = spi_device_queue_trans(spi, &display_trans[slot], 0);
+	if(ret != ESP_OK) return ret;
+
+	display_trans_busy[slot] = true;
+	display_front ^= 1;
+
+	return ESP_OK;
+}
+
+
+esp_err_t display_write_vram(){
+	esp_err_t ret;
+
+	xSemaphoreTake(display_mutex, portMAX_DELAY);
+	ret = display_flip();
+	xSemaphoreGive(display_mutex);
+
+	return ret;
+}
+
+
+esp_err_t display_write_frame(const uint16_t *frame){
+	esp_err_t ret;
+
+	xSemaphoreTake(display_mutex, portMAX_DELAY);
+	memcpy(display_vram[display_front ^ 1], frame, sizeof(uint16_t) * DISPLAY_DIGIT_COUNT);
+	ret = display_flip();
+	xSemaphoreGive(display_mutex);
 
 	return ret;
 }
 
+
 esp_err_t display_write_time(struct tm *time){
 
+	uint16_t frame[DISPLAY_DIGIT_COUNT];
+
 	if(time){
 
 		/* seconds */
-		display_vram[0] =  (uint16_t) (1 << (time->tm_sec % 10));
-		display_vram[1] =  (uint16_t) (1 << (time->tm_sec / 10));
+		frame[0] =  (uint16_t) (1 << (time->tm_sec % 10));
+		frame[1] =  (uint16_t) (1 << (time->tm_sec / 10));
 
 		/* minutes */
-		display_vram[2] =  (uint16_t) (1 << (time->tm_min % 10));
-		display_vram[3] =  (uint16_t) (1 << (time->tm_min / 10));
+		frame[2] =  (uint16_t) (1 << (time->tm_min % 10));
+		frame[3] =  (uint16_t) (1 << (time->tm_min / 10));
 
 		/* hours */
 		int hours = time->tm_hour;
@@ -201,39 +613,36 @@ esp_err_t display_write_time(struct tm *time){
 			}
 			
 		}
-		display_vram[4] =  (uint16_t) (1 << (hours % 10));
+		frame[4] =  (uint16_t) (1 << (hours % 10));
 
 
 		int hours_tens = hours / 10;
 		if(hours_tens == 0 && display_config.leading_zero == DISPLAY_LEADING_ZERO_HIDE){
-			display_vram[5] =  (uint16_t) 0;
+			frame[5] =  (uint16_t) 0;
 		}
 		else{
-			display_vram[5] =  (uint16_t) (1 << hours_tens);
+			frame[5] =  (uint16_t) (1 << hours_tens);
 		}
 		
 
 
 		if(time->tm_sec % 2 == 0){
-			display_vram[2] |= DISPLAY_TOP_DOT_MASK;
-			display_vram[2] |= DISPLAY_BOTTOM_DOT_MASK;
-			display_vram[4] |= DISPLAY_TOP_DOT_MASK;
-			display_vram[4] |= DISPLAY_BOTTOM_DOT_MASK;
+			frame[2] |= DISPLAY_TOP_DOT_MASK;
+			frame[2] |= DISPLAY_BOTTOM_DOT_MASK;
+			frame[4] |= DISPLAY_TOP_DOT_MASK;
+			frame[4] |= DISPLAY_BOTTOM_DOT_MASK;
 		}
 
 
-		return display_write_vram();
+		return display_transition_to(frame);
 	}
 	else{
 
-		display_vram[0] = (uint16_t) (1 << 0);
-		display_vram[1] = (uint16_t) (1 << 0);
-		display_vram[2] = (uint16_t) (1 << 0);
-		display_vram[3] = (uint16_t) (1 << 0);
-		display_vram[4] = (uint16_t) (1 << 0);
-		display_vram[5] = (uint16_t) (1 << 0);
+		for(int i=0; i < DISPLAY_DIGIT_COUNT; i++){
+			frame[i] = (uint16_t) (1 << 0);
+		}
 
-		return display_write_vram();
+		return display_write_frame(frame);
 	}
 
 
@@ -0,0 +1,156 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+
+@file drift.c
+@author Tony Pottier
+@brief Estimates the frequency error of the DS3231 from the error measured at every synchronization, and
+trims it with the aging offset register
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+*/
+
+#include <string.h>
+#include <math.h>
+
+#include "drift.h"
+
+
+
+void drift_init(drift_t *drift, int8_t aging){
+	memset(drift, 0x00, sizeof(drift_t));
+	drift->aging = aging;
+}
+
+void drift_reset(drift_t *drift){
+	drift->count = 0;
+	drift->steps_us = 0;
+}
+
+void drift_add_sample(drift_t *drift, int64_t utc_us, int64_t error_us, int64_t uncertainty_us){
+
+	if(uncertainty_us > DRIFT_MAX_UNCERTAINTY_US){
+		return;
+	}
+
+	drift_sample_t sample = { utc_us, error_us - drift->steps_us, uncertainty_us < 1 ? 1 : uncertainty_us };
+
+	/* too close to the previous sample to say much more: the most precise of the two is kept */
+	if(drift->count > 0){
+		drift_sample_t *last = &drift->samples[drift->count - 1];
+		if(utc_us - last->utc_us < DRIFT_SAMPLE_INTERVAL_S * 1000000LL){
+			if(sample.uncertainty_us < last->uncertainty_us){
+				*last = sample;
+			}
+			return;
+		}
+	}
+
+	if(drift->count == DRIFT_MAX_SAMPLES){
+		memmove(&drift->samples[0], &drift->samples[1], (DRIFT_MAX_SAMPLES - 1) * sizeof(drift_sample_t));
+		drift->count--;
+	}
+	drift->samples[drift->count++] = sample;
+}
+
+void drift_stepped(drift_t *drift, int64_t step_us){
+	drift->steps_us += step_us;
+}
+
+bool drift_fit(const drift_t *drift, double *ppm, double *sigma_ppm){
+
+	int n = drift->count;
+	if(n < DRIFT_MIN_SAMPLES || drift->samples[n - 1].utc_us - drift->samples[0].utc_us < DRIFT_MIN_SPAN_S * 1000000LL){
+		return false;
+	}
+
+	/* weighted by the precision of each sample. Times in seconds from the first sample, errors in us: the slope is in ppm */
+	const drift_sample_t *first = &drift->samples[0];
+	double sw = 0.0, sx = 0.0, sy = 0.0;
+	for(int i = 0; i < n; i++){
+		const drift_sample_t *s = &drift->samples[i];
+		double w = 1.0 / ((double)s->uncertainty_us * (double)s->uncertainty_us);
+		sw += w;
+		sx += w * (double)(s->utc_us - first->utc_us) / 1e6;
+		sy += w * (double)(s->error_us - first->error_us);
+	}
+	double mx = sx / sw, my = sy / sw;
+
+	double sxx = 0.0, sxy = 0.0;
+	for(int i = 0; i < n; i++){
+		const drift_sample_t *s = &drift->samples[i];
+		double w = 1.0 / ((double)s->uncertainty_us * (double)s->uncertainty_us);
+		double dx = (double)(s->utc_us - first->utc_us) / 1e6 - mx;
+		sxx += w * dx * dx;
+		sxy += w * dx * ((double)(s->error_us - first->error_us) - my);
+	}
+	double slope = sxy / sxx;
+
+	/* the standard error comes from the scatter of the samples around the line, not from their uncertainty */
+	double ssr = 0.0;
+	for(int i = 0; i < n; i++){
+		const drift_sample_t *s = &drift->samples[i];
+		double w = 1.0 / ((double)s->uncertainty_us * (double)s->uncertainty_us);
+		double dx = (double)(s->utc_us - first->utc_us) / 1e6 - mx;
+		double r = (double)(s->error_us - first->error_us) - my - slope * dx;
+		ssr += w * r * r;
+	}
+
+	*ppm = slope;
+	*sigma_ppm = sqrt(ssr / (n - 2) / sxx);
+	return true;
+}
+
+bool drift_trim(drift_t *drift){
+
+	double ppm, sigma;
+	if(!drift_fit(drift, &ppm, &sigma)){
+		return false;
+	}
+	drift->ppm = ppm;
+
+	/* the fit is checked at every sample: the error has to be at least half a unit even at 3 sigma, or the
+	 * noise of the samples ends up moving the register back and forth */
+	long units = lround(ppm / DRIFT_PPM_PER_AGING_LSB);
+	if(units == 0 || fabs(ppm) - 3.0 * sigma < DRIFT_PPM_PER_AGING_LSB / 2.0){
+		return false;
+	}
+
+	long aging = drift->aging + units;
+	if(aging > INT8_MAX) aging = INT8_MAX;
+	if(aging < INT8_MIN) aging = INT8_MIN;
+	if(aging == drift->aging){
+		return false;
+	}
+
+	/* what should be left of the error with the new value */
+	drift->ppm -= (double)(aging - drift->aging) * DRIFT_PPM_PER_AGING_LSB;
+	drift->aging = (int8_t)aging;
+	drift->trims++;
+	drift_reset(drift);
+	return true;
+}
+
+double drift_untrimmed_ppm(const drift_t *drift){
+	return drift->ppm + (double)drift->aging * DRIFT_PPM_PER_AGING_LSB;
+}
@@ -37,6 +37,8 @@ SOFTWARE.
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/i2c.h"
+#include "esp_timer.h"
+#include "esp32/rom/ets_sys.h"
 
 
 #include "i2c.h"
@@ -49,6 +51,13 @@ static const char TAG[] = "DS3231";
 
 uint8_t ds3231_time_registers_values[DS3231_TIME_REGISTERS_COUNT];
 
+/** @brief copy of the registers as of the last snapshot */
+static ds3231_snapshot_t ds3231_shadow;
+static bool ds3231_shadow_valid = false;
+/** @brief snapshots asked for before the time was last written hold the old time: they are not kept */
+static int64_t ds3231_shadow_written_us = 0;
+static portMUX_TYPE ds3231_shadow_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
 /* @brief configures the ds3231 to output a square wave on its INT/SQW pin
  *
  * Default CONTROL_REGISTER (0x0E) values
@@ -69,61 +78,40 @@ esp_err_t ds3231_enable_square_wave(){
 }
 
 /**
- * @brief get the temperature currently read by the ds3231.
- * Temperature is split in two registers:
- * Address 0x11: MSB Bit[7];Sign Bits[6..0]:Data
- * Address 0x12: LSB Bits[7..6]:Data
- * Temperature Registers (11h12h)
- * Temperature  is  represented  as  a  10-bit  code  with  a resolution of 0.25C and is accessible at location 11h and
- * 12h. The  temperature  is  encoded  in  twos  complement format. The upper 8 bits, the integer portion, are at loca
-  * tion 11h and the lower 2 bits, the fractional portion, are in the upper nibble at location 12h. For example,
-  * 00011001 01b = +25.25C. Upon power reset, the registers are set  to  a  default  temperature  of  0C  and  the
-  * controller  starts  a temperature  conversion.  The  temperature  is  read  on  initial application of VCC or I2C access
-  * on VBAT and once every  64  seconds  afterwards.  The  temperature  registers are  updated  after  each  user-initiated
-  * conversion  and  on every  64-second  conversion.  The  temperature  registers are read-only.
-  * Temp conversion time - Typical: 125ms. Max: 200ms.
+ * @brief the aging offset register moves the frequency of the crystal by about 0.1ppm per unit at 25C,
+ * a positive value slowing it down. The new value is applied by the next temperature conversion. None is started
+ * here: CONV must not be set while the temperature service has one running, it is asked for one instead.
+ * @see temperature_request
  */
-float ds3231_get_temperature(){
-
-	union int16 {
-	        int16_t i16;
-	        uint8_t ui8[2];
-	} rtc_temp;
-
-	int ret;
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, DS3231_ADDR << 1 | WRITE_BIT, ACK_CHECK_EN);
-	i2c_master_write_byte(cmd, DS3231_TEMP_MSB_REGISTER, ACK_CHECK_EN);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, 1000 / portTICK_RATE_MS);
-	i2c_cmd_link_delete(cmd);
-	if (ret != ESP_OK) {
-		ESP_LOGE(TAG, "Error addressing ds3231 in func call ds3231_get_temperature");
-		return 0.0f;
-	}
-
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, DS3231_ADDR << 1 | READ_BIT, ACK_CHECK_EN);
-	i2c_master_read_byte(cmd, &rtc_temp.ui8[1], ACK_VAL); /* Order in which to store HIGH and LOW bytes depends on processor endianness. This code is esp32 specific*/
-	i2c_master_read_byte(cmd, &rtc_temp.ui8[0], NACK_VAL);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM , cmd, 1000 / portTICK_RATE_MS);
-	i2c_cmd_link_delete(cmd);
-
-	return (float)rtc_temp.i16 / 256.0f;
-
-
+esp_err_t ds3231_set_aging_offset(int8_t aging){
+	return i2c_write_byte(DS3231_ADDR, DS3231_AGING_OFFSET_REGISTER, (uint8_t)aging);
 }
 
+esp_err_t ds3231_start_temperature_conversion(){
+	/* same control register as ds3231_enable_square_wave, with CONV set */
+	return i2c_write_byte(DS3231_ADDR, DS3231_CONTROL_REGISTER, DS3231_CONTROL_CONV);
+}
 
+esp_err_t ds3231_temperature_busy(bool *busy){
+	/* CONV stays set until a conversion the user asked for is done, BSY covers the automatic ones too */
+	uint8_t registers[2];
+	esp_err_t ret = i2c_read_bytes(DS3231_ADDR, DS3231_CONTROL_REGISTER, registers, sizeof(registers));
+	if(ret == ESP_OK){
+		*busy = (registers[0] & DS3231_CONTROL_CONV) || (registers[1] & DS3231_STATUS_BSY);
+	}
+	return ret;
+}
 
+esp_err_t ds3231_get_aging_offset(int8_t *aging){
+	uint8_t value;
+	esp_err_t ret = i2c_read_byte(DS3231_ADDR, DS3231_AGING_OFFSET_REGISTER, &value);
+	if(ret == ESP_OK){
+		*aging = (int8_t)value;
+	}
+	return ret;
+}
 
-esp_err_t ds3231_set_time(const struct tm *timeinfo){
-
-
-
+static void ds3231_time_registers_fill(const struct tm *timeinfo){
 	ds3231_time_registers_values[DS3231_SECONDS_REGISTER] = ds3231_dec2bcd(timeinfo->tm_sec);
 	ds3231_time_registers_values[DS3231_MINUTES_REGISTER] = ds3231_dec2bcd(timeinfo->tm_min);
 	ds3231_time_registers_values[DS3231_HOURS_REGISTER] = ds3231_dec2bcd(timeinfo->tm_hour);
@@ -138,27 +126,77 @@ esp_err_t ds3231_set_time(const struct tm *timeinfo){
 	else{
 		ds3231_time_registers_values[DS3231_YEAR_REGISTER] = ds3231_dec2bcd(timeinfo->tm_year);
 	}
+}
+
+static void ds3231_shadow_invalidate(){
+	portENTER_CRITICAL(&ds3231_shadow_spinlock);
+	ds3231_shadow_valid = false;
+	ds3231_shadow_written_us = esp_timer_get_time();
+	portEXIT_CRITICAL(&ds3231_shadow_spinlock);
+}
+
+esp_err_t ds3231_set_time(const struct tm *timeinfo){
+
+	ds3231_time_registers_fill(timeinfo);
+	ds3231_shadow_invalidate();
+
+	esp_err_t ret = i2c_write_bytes(DS3231_ADDR, DS3231_SECONDS_REGISTER, ds3231_time_registers_values, DS3231_TIME_REGISTERS_COUNT);
+
+	return ret;
+}
+
+esp_err_t ds3231_set_time_at(const struct tm *timeinfo, int64_t at_us, int64_t tolerance_us){
+
+	ds3231_time_registers_fill(timeinfo);
+
+	/* the transfer has to start early by the time it takes to clock the seconds register out */
+	int64_t start_us = at_us - ((int64_t)DS3231_SECONDS_WRITE_BITS * 1000000) / I2C_MASTER_FREQ_HZ;
+
+	/* sleep until the last tick, then spin: a tick is far too coarse */
+	int64_t wait_us = start_us - esp_timer_get_time();
+	TickType_t ticks = (TickType_t)(wait_us / (portTICK_PERIOD_MS * 1000));
+	if(wait_us > 0 && ticks > 1){
+		vTaskDelay(ticks - 1);
+	}
+	wait_us = start_us - esp_timer_get_time();
+	if(wait_us > 0){
+		ets_delay_us((uint32_t)wait_us);
+	}
+
+	ds3231_shadow_invalidate();
 
 	esp_err_t ret = i2c_write_bytes(DS3231_ADDR, DS3231_SECONDS_REGISTER, ds3231_time_registers_values, DS3231_TIME_REGISTERS_COUNT);
 
+	/* the seconds register was taken at the latest when the rest of the transfer began. Only now can time spent
+	 * queued behind other transactions, or on a bus recovery, be seen */
+	int64_t late_us = esp_timer_get_time() - ((int64_t)DS3231_TIME_WRITE_TAIL_BITS * 1000000) / I2C_MASTER_FREQ_HZ - at_us;
+	if(ret == ESP_OK && late_us > tolerance_us){
+		ESP_LOGW(TAG, "Time written up to %lld us late", (long long)late_us);
+		ret = ESP_ERR_INVALID_STATE;
+	}
+
 	return ret;
 }
 
+static void ds3231_time_registers_decode(const uint8_t *registers, struct tm *timeinfo){
+	timeinfo->tm_sec = ds3231_bcd2dec(registers[DS3231_SECONDS_REGISTER]);
+	timeinfo->tm_min = ds3231_bcd2dec(registers[DS3231_MINUTES_REGISTER]);
+	timeinfo->tm_hour = ds3231_bcd2dec(registers[DS3231_HOURS_REGISTER]);
+	timeinfo->tm_wday = registers[DS3231_DAY_REGISTER] - 1; /* day of the week, called DAY register in the DS3231 ranges from 1 to 7. WDAY is 0-6 format. 0=Sunday */
+	timeinfo->tm_mday = ds3231_bcd2dec(registers[DS3231_DATE_REGISTER]); /*day of the month 1-31, called the DATE register in the DS3231*/
+	timeinfo->tm_mon = ds3231_bcd2dec(0x1f & registers[DS3231_MONTH_REGISTER]) - 1; /* month is 1-12 in the ds3231, 0-11 in the time struct. Hence -1. 0x1f mask is to remove century information */
+	timeinfo->tm_year = ds3231_bcd2dec(registers[DS3231_YEAR_REGISTER]); /* year is 0-99, struct is from 1900 so 0 or 100 is added depending on century bit */
+	timeinfo->tm_year += (0x80 & registers[DS3231_MONTH_REGISTER])?100:0; /* century bit means we are in the 2000s*/
+	timeinfo->tm_isdst = 0;
+}
+
 esp_err_t ds3231_get_time(struct tm *timeinfo){
 
 	esp_err_t ret = i2c_read_bytes(DS3231_ADDR, DS3231_SECONDS_REGISTER, ds3231_time_registers_values,DS3231_TIME_REGISTERS_COUNT);
 
 	if(ret == ESP_OK){
 
-		timeinfo->tm_sec = ds3231_bcd2dec(ds3231_time_registers_values[DS3231_SECONDS_REGISTER]);
-		timeinfo->tm_min = ds3231_bcd2dec(ds3231_time_registers_values[DS3231_MINUTES_REGISTER]);
-		timeinfo->tm_hour = ds3231_bcd2dec(ds3231_time_registers_values[DS3231_HOURS_REGISTER]);
-		timeinfo->tm_wday = ds3231_time_registers_values[DS3231_DAY_REGISTER] - 1; /* day of the week, called DAY register in the DS3231 ranges from 1 to 7. WDAY is 0-6 format. 0=Sunday */
-		timeinfo->tm_mday = ds3231_bcd2dec(ds3231_time_registers_values[DS3231_DATE_REGISTER]); /*day of the month 1-31, called the DATE register in the DS3231*/
-		timeinfo->tm_mon = ds3231_bcd2dec(0x1f & ds3231_time_registers_values[DS3231_MONTH_REGISTER]) - 1; /* month is 1-12 in the ds3231, 0-11 in the time struct. Hence -1. 0x1f mask is to remove century information */
-		timeinfo->tm_year = ds3231_bcd2dec(ds3231_time_registers_values[DS3231_YEAR_REGISTER]); /* year is 0-99, struct is from 1900 so 0 or 100 is added depending on century bit */
-		timeinfo->tm_year += (0x80 & ds3231_time_registers_values[DS3231_MONTH_REGISTER])?100:0; /* century bit means we are in the 2000s*/
-		timeinfo->tm_isdst = 0;
+		ds3231_time_registers_decode(ds3231_time_registers_values, timeinfo);
 
 		ESP_LOGI(TAG, "READ: YEAR:%d MONTH:%d DAY:%d [WDAY:%d] - %d:%d:%d", timeinfo->tm_year, timeinfo->tm_mon, timeinfo->tm_mday, timeinfo->tm_wday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
 	}
@@ -167,47 +205,65 @@ esp_err_t ds3231_get_time(struct tm *timeinfo){
 
 }
 
+esp_err_t ds3231_read_snapshot(ds3231_snapshot_t *snapshot){
 
+	snapshot->timestamp_us = esp_timer_get_time();
+	esp_err_t ret = i2c_read_bytes(DS3231_ADDR, DS3231_SECONDS_REGISTER, snapshot->registers, DS3231_REGISTERS_COUNT);
+	snapshot->completed_us = esp_timer_get_time();
 
+	if(ret == ESP_OK){
+		portENTER_CRITICAL(&ds3231_shadow_spinlock);
+		if(snapshot->timestamp_us > ds3231_shadow_written_us){
+			ds3231_shadow = *snapshot;
+			ds3231_shadow_valid = true;
+		}
+		portEXIT_CRITICAL(&ds3231_shadow_spinlock);
+	}
 
-void ds3231_task(void *pvParameter){
+	return ret;
+}
 
-	ds3231_i2c_init();
+bool ds3231_get_shadow(ds3231_snapshot_t *snapshot){
+	portENTER_CRITICAL(&ds3231_shadow_spinlock);
+	bool valid = ds3231_shadow_valid;
+	*snapshot = ds3231_shadow;
+	portEXIT_CRITICAL(&ds3231_shadow_spinlock);
+	return valid;
+}
 
-	for(;;){
+esp_err_t ds3231_snapshot_time(const ds3231_snapshot_t *snapshot, struct tm *timeinfo){
 
-		int ret;
-		uint8_t data_h = 0, data_l = 0;
+	ds3231_time_registers_decode(snapshot->registers, timeinfo);
 
-		i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-		i2c_master_start(cmd);
-		i2c_master_write_byte(cmd, DS3231_ADDR << 1 | WRITE_BIT, ACK_CHECK_EN);
-		i2c_master_write_byte(cmd, 0x00, ACK_CHECK_EN);
-		i2c_master_stop(cmd);
-		ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, 1000 / portTICK_RATE_MS);
-		i2c_cmd_link_delete(cmd);
-		if (ret != ESP_OK) {
-			printf("ERROR\n");
-			return;
-		}
-		vTaskDelay(1 / portTICK_RATE_MS);
-		cmd = i2c_cmd_link_create();
-		i2c_master_start(cmd);
-		i2c_master_write_byte(cmd, DS3231_ADDR << 1 | READ_BIT, ACK_CHECK_EN);
-		i2c_master_read_byte(cmd, &data_h, ACK_VAL);
-		i2c_master_read_byte(cmd, &data_l, NACK_VAL);
-		i2c_master_stop(cmd);
-		ret = i2c_master_cmd_begin(I2C_MASTER_NUM , cmd, 1000 / portTICK_RATE_MS);
-		i2c_cmd_link_delete(cmd);
-
-
-		//printf("%d%d - ", ( (data_h>>4) & 0x0f),  (data_h & 0x0f));
-		//printf("temp: %.2f\n", ds3231_get_temperature());
-		ESP_LOGE(TAG, "temp: %.2f", ds3231_get_temperature());
-		vTaskDelay(1000 / portTICK_PERIOD_MS);
+	if(timeinfo->tm_sec > 59 || timeinfo->tm_min > 59 || timeinfo->tm_hour > 23 ||
+	   timeinfo->tm_mday < 1 || timeinfo->tm_mday > 31 || timeinfo->tm_mon < 0 || timeinfo->tm_mon > 11 || timeinfo->tm_year > 199){
+		return ESP_ERR_INVALID_RESPONSE;
 	}
+
+	return ESP_OK;
 }
 
+/**
+ * @brief temperature of the last conversion, from a snapshot.
+ * Temperature is split in two registers:
+ * Address 0x11: MSB Bit[7];Sign Bits[6..0]:Data
+ * Address 0x12: LSB Bits[7..6]:Data
+ * Temperature Registers (11h12h)
+ * Temperature  is  represented  as  a  10-bit  code  with  a resolution of 0.25C and is accessible at location 11h and
+ * 12h. The  temperature  is  encoded  in  twos  complement format. The upper 8 bits, the integer portion, are at loca
+  * tion 11h and the lower 2 bits, the fractional portion, are in the upper nibble at location 12h. For example,
+  * 00011001 01b = +25.25C. Upon power reset, the registers are set  to  a  default  temperature  of  0C  and  the
+  * controller  starts  a temperature  conversion.  The  temperature  is  read  on  initial application of VCC or I2C access
+  * on VBAT and once every  64  seconds  afterwards.  The  temperature  registers are  updated  after  each  user-initiated
+  * conversion  and  on every  64-second  conversion.  The  temperature  registers are read-only.
+  * Temp conversion time - Typical: 125ms. Max: 200ms.
+ */
+float ds3231_snapshot_temperature(const ds3231_snapshot_t *snapshot){
+	int16_t raw = (int16_t)(((uint16_t)snapshot->registers[DS3231_TEMP_MSB_REGISTER] << 8) | snapshot->registers[DS3231_TEMP_LSB_REGISTER]);
+	return (float)raw / 256.0f;
+}
+
+
 
 
 uint8_t ds3231_bcd2dec (uint8_t val) { return val - 6 * (val >> 4); }
@@ -24,6 +24,14 @@ SOFTWARE.
 
 Contains wrappers around the esp http client for the mclk.org time API.
 
+Answers are never stored: they go through a jsonstream parser chunk by chunk as they are
+received, and only the fields the clock uses are kept.
+
+A single client handle lives as long as the task. esp_http_client keeps the connection open
+after a request, so a time API call and the transitions call that follows it share one TLS
+handshake. The connection is closed when no request came for HTTP_CLIENT_IDLE_CLOSE_MS, before
+the server drops it on its side.
+
 */
 
 #include <string.h>
@@ -35,9 +43,9 @@ Contains wrappers around the esp http client for the mclk.org time API.
 #include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_http_client.h"
-#include "cJSON.h"
-
+#include "jsonstream.h"
 #include "clock.h"
 #include "http_client.h"
 
@@ -51,53 +59,152 @@ static const char *HTTP_CLIENT_TRANSITIONS_API_URL = "https://api.mclk.org/trans
 
 static QueueHandle_t http_client_queue = NULL;
 
-/* used to keep track of request bodies that eventually need to be freed */
-static char *http_client_body_str = NULL;
-
-/* used to keep track of response */
-static char *http_client_response_str = NULL;
+/* request bodies are small and written in place */
+static char http_client_body[HTTP_CLIENT_MAX_REQUEST_SIZE];
 
 static esp_http_client_handle_t http_client_handle = NULL;
 
+/* API of the request in progress */
+static const char *http_client_api_url = NULL;
 
+/* there is an open connection to the API server */
+static bool http_client_connected = false;
 
+/* the answer being parsed */
+static jsonstream_t http_client_json;
+
+/* what is extracted from the answer */
+static clock_time_api_t http_client_time_api;
+
+typedef struct http_client_transitions_t{
+	clock_transitions_api_t api;
+	transition_t transition;					/* element of the array being read */
+	bool has_timestamp;
+	bool has_offset;
+	bool overflow;
+}http_client_transitions_t;
+static http_client_transitions_t http_client_transitions;
 
-void http_client_process_data(esp_http_client_event_t *evt){
-	if(evt->user_data == (void*)HTTP_CLIENT_TIME_API_URL){
 
-		/* process json answer */
-		if(http_client_response_str){
-			cJSON *json = cJSON_Parse(http_client_response_str);
-			clock_notify_time_api_response(json);
-		}
 
+
+static void http_client_time_api_callback(const jsonstream_t *js, jsonstream_event_t event, const jsonstream_value_t *value, void *ctx){
+	clock_time_api_t *api = (clock_time_api_t*)ctx;
+
+	if(event != JSONSTREAM_EVENT_VALUE){
+		return;
 	}
-	else if(evt->user_data == (void*)HTTP_CLIENT_TRANSITIONS_API_URL){
 
-		/* process json answer */
-		if(http_client_response_str){
-			cJSON *json = cJSON_Parse(http_client_response_str);
-			clock_notify_transitions_api_response(json);
-		}
+	if(value->type == JSONSTREAM_TYPE_NUMBER && jsonstream_path_is(js, "timestamp")){
+		api->has_timestamp = true;
+		api->timestamp = (time_t)value->number;
+	}
+	else if(value->type == JSONSTREAM_TYPE_STRING && jsonstream_path_is(js, "timezone.name")){
+		api->has_timezone_name = true;
+		strncpy(api->timezone.name, value->string, sizeof(api->timezone.name) - 1);
+	}
+	else if(value->type == JSONSTREAM_TYPE_NUMBER && jsonstream_path_is(js, "timezone.offset")){
+		api->has_timezone_offset = true;
+		api->timezone.offset = (int)value->number;
 	}
 }
 
 
+static void http_client_transitions_api_callback(const jsonstream_t *js, jsonstream_event_t event, const jsonstream_value_t *value, void *ctx){
+	http_client_transitions_t *t = (http_client_transitions_t*)ctx;
+	clock_transitions_api_t *api = &t->api;
 
+	switch(event){
+		case JSONSTREAM_EVENT_BEGIN:
+			if(jsonstream_path_is(js, "transitions") && value->type == JSONSTREAM_TYPE_ARRAY){
+				api->count = 0;
+			}
+			else if(jsonstream_path_is(js, "transitions[]")){
+				t->has_timestamp = false;
+				t->has_offset = false;
+			}
+			break;
 
-void http_client_cleanup(esp_http_client_handle_t client){
+		case JSONSTREAM_EVENT_VALUE:
+			if(value->type != JSONSTREAM_TYPE_NUMBER){
+				break;
+			}
+			if(jsonstream_path_is(js, "transitions[].transitionTimestamp")){
+				t->has_timestamp = true;
+				t->transition.timestamp = (time_t)value->number;
+			}
+			else if(jsonstream_path_is(js, "transitions[].toOffset")){
+				t->has_offset = true;
+				t->transition.offset = (int)value->number;
+			}
+			break;
 
-	if(http_client_body_str){
-		free(http_client_body_str);
-		http_client_body_str = NULL;
+		case JSONSTREAM_EVENT_END:
+			if(jsonstream_path_is(js, "transitions[]") && api->count >= 0 && t->has_timestamp && t->has_offset){
+
+				/* overflow protection */
+				if(api->count >= CLOCK_MAX_TRANSITIONS){
+					if(!t->overflow){
+						ESP_LOGW(TAG, "Transition table full, transitions after %ld will be fetched later", (long)api->transitions[api->count - 1].timestamp);
+						t->overflow = true;
+					}
+					break;
+				}
+
+				/* insertion sort: the API already answers in order so this is a plain append in practice */
+				int i = api->count++;
+				while(i > 0 && api->transitions[i - 1].timestamp > t->transition.timestamp){
+					api->transitions[i] = api->transitions[i - 1];
+					i--;
+				}
+				api->transitions[i] = t->transition;
+			}
+			break;
+	}
+}
+
+
+/**
+ * @brief gets the parser ready for the answer of the API called with url
+ */
+static void http_client_parse_begin(const char *url){
+	if(url == HTTP_CLIENT_TIME_API_URL){
+		memset(&http_client_time_api, 0x00, sizeof(http_client_time_api));
+		jsonstream_init(&http_client_json, http_client_time_api_callback, &http_client_time_api);
+	}
+	else{
+		memset(&http_client_transitions, 0x00, sizeof(http_client_transitions));
+		http_client_transitions.api.count = -1;
+		jsonstream_init(&http_client_json, http_client_transitions_api_callback, &http_client_transitions);
+	}
+}
+
+
+void http_client_process_data(esp_http_client_event_t *evt){
+
+	if(jsonstream_finish(&http_client_json) != ESP_OK){
+		ESP_LOGE(TAG, "Invalid or incomplete json answer");
+		return;
 	}
 
-	if(http_client_response_str){
-		free(http_client_response_str);
-		http_client_response_str = NULL;
+	if(http_client_api_url == HTTP_CLIENT_TIME_API_URL){
+		clock_notify_time_api_response(&http_client_time_api);
 	}
+	else if(http_client_api_url == HTTP_CLIENT_TRANSITIONS_API_URL){
+		ESP_LOGI(TAG, "%d transitions received", http_client_transitions.api.count);
+		clock_notify_transitions_api_response(&http_client_transitions.api);
+	}
+}
+
+
 
+
+void http_client_cleanup(esp_http_client_handle_t client){
 	esp_http_client_cleanup(client);
+	if(client == http_client_handle){
+		http_client_handle = NULL;
+		http_client_connected = false;
+	}
 }
 
 static esp_err_t _http_event_handler(esp_http_client_event_t *evt){
@@ -109,28 +216,25 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt){
 				break;
 			case HTTP_EVENT_ON_CONNECTED:
 				ESP_LOGI(TAG, "HTTP_EVENT_ON_CONNECTED");
+				http_client_connected = true;
 				break;
 			case HTTP_EVENT_HEADER_SENT:
 				ESP_LOGI(TAG, "HTTP_EVENT_HEADER_SENT");
+				/* the time API timestamp is placed between the request and the first header of the answer */
+				http_client_time_api.request_us = esp_timer_get_time();
 				break;
 			case HTTP_EVENT_ON_HEADER:
 				ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+				if(http_client_time_api.response_us == 0){
+					http_client_time_api.response_us = esp_timer_get_time();
+				}
 				break;
 			case HTTP_EVENT_ON_DATA:
 				ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
 				if(evt->data_len > 0){
-					if(http_client_response_str == NULL){
-						/* allocate memory */
-						int sz = esp_http_client_get_content_length(evt->client) + 1;
-						http_client_response_str = (char*)malloc(sizeof(char) * sz);
-						memset(http_client_response_str, '\0', sz);
-					}
-					/* copy data over */
-					char* tmp = (char*)malloc(sizeof(char) * (evt->data_len + 1));
-					memset(tmp, '\0', evt->data_len + 1);
-					memcpy(tmp, evt->data, evt->data_len);
-					strcat(http_client_response_str, tmp);
-					free(tmp);
+					ESP_LOGD(TAG, "%.*s", evt->data_len, (const char*)evt->data);
+					/* a parse error is reported when the request finishes */
+					jsonstream_feed(&http_client_json, (const char*)evt->data, evt->data_len);
 				}
 				break;
 			case HTTP_EVENT_ON_FINISH:
@@ -139,6 +243,7 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt){
 				break;
 			case HTTP_EVENT_DISCONNECTED:
 				ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
+				http_client_connected = false;
 				break;
 		}
 
@@ -146,48 +251,85 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt){
 }
 
 
-static void http_client_api_time_process(char *timezone){
+/**
+ * @brief writes the body of an API request into http_client_body: {"timezone":"...","from":...,"to":...}
+ * with from and to only if range is set.
+ * @return the length of the body, or -1 if it does not fit
+ */
+static int http_client_body_write(const char *timezone, bool range, time_t from, time_t to){
+
+	/* escape the timezone name, the only string sent */
+	char name[2 * CLOCK_MAX_TZ_STRING_LENGTH];
+	int n = 0;
+	for(const char *c = timezone; *c && n < sizeof(name) - 2; c++){
+		if(*c == '"' || *c == '\\'){
+			name[n++] = '\\';
+		}
+		name[n++] = *c;
+	}
+	name[n] = '\0';
+
+	int len;
+	if(range){
+		len = snprintf(http_client_body, sizeof(http_client_body), "{\"timezone\":\"%s\",\"from\":%ld,\"to\":%ld}", name, (long)from, (long)to);
+	}
+	else{
+		len = snprintf(http_client_body, sizeof(http_client_body), "{\"timezone\":\"%s\"}", name);
+	}
+
+	return len < sizeof(http_client_body) ? len : -1;
+}
+
+
+/**
+ * @brief sends body to url on the long lived connection, opening it if needed.
+ *
+ * If the server closed a connection that was idle, the request fails without an answer: it is then
+ * sent again once on a new connection.
+ */
+static esp_err_t http_client_request(const char *url, const char *body, int body_len){
 
 	esp_err_t err;
-	ESP_LOGI(TAG, "tz: %s", timezone);
 
-	esp_http_client_config_t config = {
-					.url = HTTP_CLIENT_TIME_API_URL,
-					.event_handler = _http_event_handler,
-					.is_async = true,
-					.timeout_ms = 10000,
-					.user_data = (void*)HTTP_CLIENT_TIME_API_URL
-	};
-	http_client_handle = esp_http_client_init(&config);
-
-
-	if(timezone != NULL){
-		cJSON *body = NULL;
-		cJSON *tz = NULL;
-		char* body_str = NULL;
-
-		/* generate the request body */
-		body = cJSON_CreateObject();
-		tz = cJSON_CreateString(timezone);
-		cJSON_AddItemToObject(body, "timezone", tz);
-		body_str = cJSON_Print(body);
-		cJSON_Delete(body);
-
-		/* save pointer for later cleanup */
-		http_client_body_str = body_str;
-
-		/* set body */
-		esp_http_client_set_post_field(http_client_handle, body_str, strlen(body_str));
+	if(http_client_handle == NULL){
+		esp_http_client_config_t config = {
+				.url = url,
+				.event_handler = _http_event_handler,
+				.is_async = true,
+				.timeout_ms = 10000
+		};
+		http_client_handle = esp_http_client_init(&config);
+		if(http_client_handle == NULL){
+			return ESP_ERR_NO_MEM;
+		}
+	}
+	else{
+		/* same host: esp_http_client keeps the connection */
+		esp_http_client_set_url(http_client_handle, url);
 	}
 
+	http_client_api_url = url;
+	esp_http_client_set_post_field(http_client_handle, body, body_len);
 
-	for(;;) {
-		err = esp_http_client_perform(http_client_handle);
-		if (err != ESP_ERR_HTTP_EAGAIN) {
+	for(int attempt = 0; attempt < 2; attempt++){
+		bool reused = http_client_connected;
+
+		http_client_parse_begin(url);
+		for(;;) {
+			err = esp_http_client_perform(http_client_handle);
+			if (err != ESP_ERR_HTTP_EAGAIN) {
+				break;
+			}
+			vTaskDelay( pdMS_TO_TICKS(10) ); /* avoid watchdog trigger */
+		}
+
+		if(err == ESP_OK || !reused){
 			break;
 		}
-		vTaskDelay( pdMS_TO_TICKS(10) ); /* avoid watchdog trigger */
+		ESP_LOGW(TAG, "Connection lost (%s), retrying on a new one", esp_err_to_name(err));
+		esp_http_client_close(http_client_handle);
 	}
+
 	if (err == ESP_OK) {
 		ESP_LOGI(TAG, "HTTPS Status = %d, content_length = %d",
 				esp_http_client_get_status_code(http_client_handle),
@@ -195,82 +337,45 @@ static void http_client_api_time_process(char *timezone){
 	}
 	else {
 		ESP_LOGE(TAG, "Error perform http request %s", esp_err_to_name(err));
+		esp_http_client_close(http_client_handle);
 	}
 
-	http_client_cleanup(http_client_handle);
+	/* the body is not kept by the client past the request */
+	esp_http_client_set_post_field(http_client_handle, NULL, 0);
+	http_client_api_url = NULL;
 
+	return err;
 }
 
 
-static void http_client_api_transitions_process(void *pvParameter){
-	timezone_t timezone = clock_get_config_timezone();
-	time_t now = clock_get_current_time_utc();
-
-	esp_http_client_config_t config = {
-			.url = HTTP_CLIENT_TRANSITIONS_API_URL,
-			.event_handler = _http_event_handler,
-			.is_async = true,
-			.timeout_ms = 10000,
-			.user_data = (void*)HTTP_CLIENT_TRANSITIONS_API_URL
-	};
-	http_client_handle = esp_http_client_init(&config);
-
-
-	if(timezone.name != NULL){
-		cJSON *body = NULL;
-		cJSON *tz = NULL;
-		cJSON *from = NULL;
-		cJSON *to = NULL;
-		esp_err_t err;
-
-		char* body_str = NULL;
-
-		/* generate the request body */
-		body = cJSON_CreateObject();
-
-		/* timezone */
-		tz = cJSON_CreateString(timezone.name);
-		cJSON_AddItemToObject(body, "timezone", tz);
-
-		/* from */
-		time_t from_time = now - (60*60*24) ; /* -1 day back to avoid some weird edge cases by getting transitions strictly on now timestamp */
-		from = cJSON_CreateNumber(from_time);
-		cJSON_AddItemToObject(body, "from", from);
+static void http_client_api_time_process(char *timezone){
 
-		/* to */
-		time_t to_time = now + 60*60*24*365; /* +1 year */
-		to = cJSON_CreateNumber(to_time);
-		cJSON_AddItemToObject(body, "to", to);
+	ESP_LOGI(TAG, "tz: %s", timezone);
 
+	int len = http_client_body_write(timezone, false, 0, 0);
+	if(len < 0){
+		ESP_LOGE(TAG, "Time request body too long");
+		return;
+	}
 
-		/* transform to json string then clean up cJSON object */
-		body_str = cJSON_Print(body);
-		cJSON_Delete(body);
+	http_client_request(HTTP_CLIENT_TIME_API_URL, http_client_body, len);
+}
 
-		/* save pointer for later cleanup */
-		http_client_body_str = body_str;
 
-		/* set body */
-		esp_http_client_set_post_field(http_client_handle, body_str, strlen(body_str));
+static void http_client_api_transitions_process(void *pvParameter){
+	timezone_t timezone = clock_get_config_timezone();
+	time_t now = clock_get_current_time_utc();
 
-		for(;;) {
-			err = esp_http_client_perform(http_client_handle);
-			if (err != ESP_ERR_HTTP_EAGAIN) {
-				break;
-			}
-			vTaskDelay( pdMS_TO_TICKS(10) ); /* avoid watchdog trigger */
-		}
-		if (err == ESP_OK) {
-			ESP_LOGI(TAG, "HTTPS Status = %d, content_length = %d",
-					esp_http_client_get_status_code(http_client_handle),
-					esp_http_client_get_content_length(http_client_handle));
-		}
-		else {
-			ESP_LOGE(TAG, "Error perform http request %s", esp_err_to_name(err));
-		}
+	time_t from = now - (60*60*24) ; /* -1 day back to avoid some weird edge cases by getting transitions strictly on now timestamp */
+	time_t to = now + CLOCK_TRANSITIONS_HORIZON; /* the whole table is filled in one request */
 
-		http_client_cleanup(http_client_handle);
+	int len = http_client_body_write(timezone.name, true, from, to);
+	if(len < 0){
+		ESP_LOGE(TAG, "Transitions request body too long");
+		return;
 	}
+
+	http_client_request(HTTP_CLIENT_TRANSITIONS_API_URL, http_client_body, len);
 }
 
 
@@ -284,17 +389,20 @@ static void http_client_task(void *pvParameter){
 	clock_queue_message_t msg;
 
 	for(;;) {
-		if(xQueueReceive(http_client_queue, &msg, portMAX_DELAY)) {
+		/* with a connection open, wait no longer than it may stay idle */
+		TickType_t wait = http_client_connected ? pdMS_TO_TICKS(HTTP_CLIENT_IDLE_CLOSE_MS) : portMAX_DELAY;
+
+		if(!xQueueReceive(http_client_queue, &msg, wait)) {
+			ESP_LOGI(TAG, "Closing idle connection");
+			esp_http_client_close(http_client_handle);
+		}
+		else {
 
 			switch(msg.message){
 
-				case CLOCK_MESSAGE_REQUEST_TIME_API:{
-					char* tz = (char*)msg.param;
-					http_client_api_time_process( tz );
-					if(tz != NULL){
-						free(tz);
-					}
-					}
+				case CLOCK_MESSAGE_REQUEST_TIME_API:
+					http_client_api_time_process( msg.param.payload->timezone.name );
+					clock_message_release(&msg);
 					break;
 
 				case CLOCK_MESSAGE_REQUEST_TRANSITIONS_API_CALL:
@@ -319,19 +427,20 @@ esp_err_t http_client_init(){
 void http_client_get_transitions(timezone_t timezone, time_t now){
 	clock_queue_message_t msg;
 	msg.message = CLOCK_MESSAGE_REQUEST_TRANSITIONS_API_CALL;
-	msg.param = NULL;
+	msg.param.value = 0;
 	xQueueSend(http_client_queue, &msg, portMAX_DELAY);
 }
 
 
 void http_client_get_api_time(char* timezone){
 	clock_queue_message_t msg;
-	size_t sz = strlen(timezone) + 1;
-	char* param = malloc(sizeof(char) * sz);
-	memset(param, 0x00, sz);
-	strcpy(param, timezone);
 	msg.message = CLOCK_MESSAGE_REQUEST_TIME_API;
-	msg.param = (void*)param;
+	msg.param.payload = clock_message_alloc();
+	if(msg.param.payload == NULL){
+		ESP_LOGW(TAG, "Message pool empty, time request dropped");
+		return;
+	}
+	strncpy(msg.param.payload->timezone.name, timezone, sizeof(msg.param.payload->timezone.name) - 1);
 	xQueueSend(http_client_queue, &msg, portMAX_DELAY);
 }
 
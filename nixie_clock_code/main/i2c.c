@@ -24,17 +24,91 @@ SOFTWARE.
 
 Contains helper functions to communicate over the I2C bus
 
+The bus is owned by i2c_task. Clients queue requests, the task runs them one after the other and calls
+each one back with the result, so no client ever waits on the bus behind another one holding a lock.
+The helpers submit a request and wait on a future: a semaphore taken from a small pool and given by
+the callback.
+
+Every request is a single bus transaction: reads write the register pointer, then read the block after a
+repeated start, so nothing can move the pointer in between. A transaction is built once into a command
+link pointing at the buffers of an i2c_transaction_t, and replayed afterwards: the register and the data
+are copied into the buffers, never queued again. Only the first transaction of each shape allocates.
+A write of a single byte is the exception: esp-idf 4.4+ copies it into the link instead of pointing at
+it, so a read (the register address alone) is cached per register.
+Only the bus task touches them, they need no lock.
+
+A slave reset or glitched in the middle of a read can hold SDA low forever, waiting for clocks the
+master will never send. A transaction that times out is therefore followed by a recovery: the driver
+is removed, SCL is clocked by hand until SDA is released, a STOP is sent and the driver reinstalled.
+
 */
 
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "driver/i2c.h"
+#include "driver/gpio.h"
+#include "esp32/rom/ets_sys.h"
+#include "esp_timer.h"
+#include "esp_log.h"
 
 
 #include "i2c.h"
 
 
-esp_err_t i2c_master_init(){
+static const char TAG[] = "i2c";
+
+/**
+ * @brief a command link and the buffers it reads from and writes to
+ */
+typedef struct i2c_transaction_t{
+	i2c_cmd_handle_t link;
+	uint8_t slave_address;
+	uint8_t register_address;					/**< part of the key when write_len is 1: the link holds a copy of it */
+	uint8_t write_len;							/**< register address included */
+	uint8_t read_len;
+	uint8_t write_buffer[1 + I2C_TRANSACTION_MAX_DATA];
+	uint8_t read_buffer[I2C_TRANSACTION_MAX_DATA];
+#ifdef I2C_LINK_RECOMMENDED_SIZE
+	/* esp-idf 4.4+: the link itself lives here instead of on the heap */
+	uint8_t link_buffer[I2C_LINK_RECOMMENDED_SIZE(2)];
+#endif
+}i2c_transaction_t;
+
+/**
+ * @brief what a helper waits on until the bus task is done with its request
+ */
+typedef struct i2c_future_t{
+	SemaphoreHandle_t done;
+	esp_err_t result;
+}i2c_future_t;
+
+static i2c_transaction_t i2c_transactions[I2C_TRANSACTION_CACHE_SIZE];
+
+/** @brief slot taken when a new shape of transaction evicts one */
+static int i2c_transaction_evict = 0;
+
+/** @brief requests waiting for the bus, copied in */
+static QueueHandle_t i2c_queue = NULL;
+
+static i2c_future_t i2c_futures[I2C_MAX_WAITERS];
+
+/** @brief pointers to the futures nobody is waiting on */
+static QueueHandle_t i2c_futures_free = NULL;
+
+static TaskHandle_t i2c_task_handle = NULL;
+
+/** @brief guards the counters, read from any task */
+static portMUX_TYPE i2c_stats_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+static i2c_stats_t i2c_stats;
+
+static i2c_device_stats_t i2c_device_stats[I2C_MAX_DEVICES];
+
+
+static esp_err_t i2c_driver_setup(){
 	esp_err_t ret;
     int i2c_master_port = I2C_MASTER_NUM;
     i2c_config_t conf;
@@ -49,98 +123,334 @@ esp_err_t i2c_master_init(){
     	return i2c_driver_install(i2c_master_port, conf.mode, I2C_MASTER_RX_BUF_DISABLE, I2C_MASTER_TX_BUF_DISABLE, 0);
     }
     return ret;
-
 }
 
 
-esp_err_t i2c_write_bytes(const uint8_t slave_address, const uint8_t register_address, uint8_t *data, size_t data_len){
-	esp_err_t ret;
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, slave_address << 1 | WRITE_BIT, ACK_CHECK_EN);
-	i2c_master_write_byte(cmd, register_address, ACK_CHECK_EN);
+/**
+ * @brief builds the command link of a transaction: the register address and data are written from write_buffer,
+ * then read_len bytes are read into read_buffer after a repeated start
+ */
+static esp_err_t i2c_transaction_build(i2c_transaction_t *t){
+
+#ifdef I2C_LINK_RECOMMENDED_SIZE
+	t->link = i2c_cmd_link_create_static(t->link_buffer, sizeof(t->link_buffer));
+#else
+	t->link = i2c_cmd_link_create();
+#endif
+	if(t->link == NULL){
+		return ESP_ERR_NO_MEM;
+	}
 
-	for(int i=0; i<data_len; i++){
-		i2c_master_write_byte(cmd, data[i], ACK_CHECK_EN);
+	i2c_master_start(t->link);
+	i2c_master_write_byte(t->link, t->slave_address << 1 | WRITE_BIT, ACK_CHECK_EN);
+	i2c_master_write(t->link, t->write_buffer, t->write_len, ACK_CHECK_EN);
+	if(t->read_len > 0){
+		i2c_master_start(t->link);
+		i2c_master_write_byte(t->link, t->slave_address << 1 | READ_BIT, ACK_CHECK_EN);
+		if(t->read_len > 1){
+			i2c_master_read(t->link, t->read_buffer, t->read_len - 1, ACK_VAL);
+		}
+		i2c_master_read_byte(t->link, &t->read_buffer[t->read_len - 1], NACK_VAL);
 	}
+	esp_err_t ret = i2c_master_stop(t->link);
 
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS( 1000 ) );
-	i2c_cmd_link_delete(cmd);
+	portENTER_CRITICAL(&i2c_stats_spinlock);
+	i2c_stats.links_built++;
+	portEXIT_CRITICAL(&i2c_stats_spinlock);
 	return ret;
 }
 
+/**
+ * @brief the transaction of that shape, built if it is not cached yet. Its register address is already in write_buffer
+ */
+static i2c_transaction_t* i2c_transaction_get(uint8_t slave_address, uint8_t register_address, size_t write_len, size_t read_len){
 
-esp_err_t i2c_read_bytes(const uint8_t slave_address, const uint8_t register_address, uint8_t *data, size_t data_len){
+	for(int i = 0; i < I2C_TRANSACTION_CACHE_SIZE; i++){
+		i2c_transaction_t *t = &i2c_transactions[i];
+		if(t->link && t->slave_address == slave_address && t->write_len == write_len && t->read_len == read_len &&
+		   (write_len > 1 || t->register_address == register_address)){
+			return t;
+		}
+	}
 
-	/* I don't know why you'd ever call read_bytes with only one byte to read but this is an edge case we can easily handle
-	 * by re-routing this call.
-	 */
-	if(data_len == 1) return i2c_read_byte(slave_address, register_address, &data[0]);
+	i2c_transaction_t *t = &i2c_transactions[i2c_transaction_evict];
+	i2c_transaction_evict = (i2c_transaction_evict + 1) % I2C_TRANSACTION_CACHE_SIZE;
+#ifdef I2C_LINK_RECOMMENDED_SIZE
+	if(t->link) i2c_cmd_link_delete_static(t->link);
+#else
+	if(t->link) i2c_cmd_link_delete(t->link);
+#endif
+	t->link = NULL;
+	t->slave_address = slave_address;
+	t->register_address = register_address;
+	t->write_buffer[0] = register_address;
+	t->write_len = (uint8_t)write_len;
+	t->read_len = (uint8_t)read_len;
+	if(i2c_transaction_build(t) != ESP_OK){
+		return NULL;
+	}
 
-	esp_err_t ret;
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, slave_address << 1 | WRITE_BIT, ACK_CHECK_EN);
-	i2c_master_write_byte(cmd, register_address, ACK_CHECK_EN);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS( 1000 ) );
-	i2c_cmd_link_delete(cmd);
-	if (ret != ESP_OK) {
-		return ret;
+	return t;
+}
+
+/**
+ * @brief clocks SCL until the slave lets go of SDA, then sends a STOP and reinstalls the driver
+ */
+static esp_err_t i2c_bus_recover(){
+
+	i2c_driver_delete(I2C_MASTER_NUM);
+
+	gpio_set_level(I2C_MASTER_SDA_IO, 1);
+	gpio_set_level(I2C_MASTER_SCL_IO, 1);
+	gpio_set_direction(I2C_MASTER_SDA_IO, GPIO_MODE_INPUT_OUTPUT_OD);
+	gpio_set_direction(I2C_MASTER_SCL_IO, GPIO_MODE_INPUT_OUTPUT_OD);
+	ets_delay_us(I2C_RECOVERY_HALF_PERIOD_US);
+
+	/* the slave is somewhere in a byte it is sending: each clock shifts one more bit out until it sees the NACK */
+	int clocks = 0;
+	while(gpio_get_level(I2C_MASTER_SDA_IO) == 0 && clocks < I2C_RECOVERY_CLOCKS){
+		gpio_set_level(I2C_MASTER_SCL_IO, 0);
+		ets_delay_us(I2C_RECOVERY_HALF_PERIOD_US);
+		gpio_set_level(I2C_MASTER_SCL_IO, 1);
+		ets_delay_us(I2C_RECOVERY_HALF_PERIOD_US);
+		clocks++;
 	}
+	bool released = gpio_get_level(I2C_MASTER_SDA_IO) != 0;
+
+	/* STOP: SDA going high while SCL is high */
+	gpio_set_level(I2C_MASTER_SCL_IO, 0);
+	ets_delay_us(I2C_RECOVERY_HALF_PERIOD_US);
+	gpio_set_level(I2C_MASTER_SDA_IO, 0);
+	ets_delay_us(I2C_RECOVERY_HALF_PERIOD_US);
+	gpio_set_level(I2C_MASTER_SCL_IO, 1);
+	ets_delay_us(I2C_RECOVERY_HALF_PERIOD_US);
+	gpio_set_level(I2C_MASTER_SDA_IO, 1);
+	ets_delay_us(I2C_RECOVERY_HALF_PERIOD_US);
+
+	/* the cached links are only command lists: they survive the driver being reinstalled */
+	esp_err_t ret = i2c_driver_setup();
+
+	portENTER_CRITICAL(&i2c_stats_spinlock);
+	i2c_stats.recoveries++;
+	portEXIT_CRITICAL(&i2c_stats_spinlock);
 
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, slave_address << 1 | READ_BIT, ACK_CHECK_EN);
-	for(int i=0; i < data_len-1; i++){
-		i2c_master_read_byte(cmd, &data[i], ACK_VAL);
+	if(released && ret == ESP_OK){
+		ESP_LOGW(TAG, "Bus recovered after %d clocks", clocks);
+	}
+	else{
+		ESP_LOGE(TAG, "Bus recovery failed: SDA %s, driver %s", released?"released":"still low", esp_err_to_name(ret));
 	}
-	i2c_master_read_byte(cmd, &data[data_len-1], NACK_VAL);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM , cmd, pdMS_TO_TICKS( 1000 ) );
-	i2c_cmd_link_delete(cmd);
 
 	return ret;
+}
+
+static void i2c_account(uint8_t slave_address, esp_err_t result, int64_t latency_us){
+
+	portENTER_CRITICAL(&i2c_stats_spinlock);
+	i2c_stats.operations++;
+	if(result != ESP_OK) i2c_stats.errors++;
 
+	i2c_device_stats_t *d = NULL;
+	for(int i = 0; i < I2C_MAX_DEVICES && d == NULL; i++){
+		if(i2c_device_stats[i].requests == 0){
+			/* the table fills from the start: first free entry */
+			i2c_device_stats[i].address = slave_address;
+		}
+		if(i2c_device_stats[i].address == slave_address){
+			d = &i2c_device_stats[i];
+		}
+	}
+	if(d){
+		d->requests++;
+		if(result != ESP_OK) d->errors++;
+		if(result == ESP_ERR_TIMEOUT) d->timeouts++;
+		if(latency_us > d->max_latency_us) d->max_latency_us = (uint32_t)latency_us;
+		d->total_latency_us += (uint64_t)latency_us;
+	}
+	portEXIT_CRITICAL(&i2c_stats_spinlock);
 }
 
-esp_err_t i2c_read_byte(const uint8_t slave_address, const uint8_t register_address, uint8_t *value){
+/**
+ * @brief runs one request on the bus
+ */
+static esp_err_t i2c_execute(i2c_request_t *request){
 
-	esp_err_t ret;
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, slave_address << 1 | WRITE_BIT, ACK_CHECK_EN);
-	i2c_master_write_byte(cmd, register_address, ACK_CHECK_EN);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS( 1000 ) );
-	i2c_cmd_link_delete(cmd);
-	if (ret != ESP_OK) {
+	i2c_transaction_t *t = i2c_transaction_get(request->slave_address, request->register_address, 1 + request->write_len, request->read_len);
+	if(t == NULL){
+		return ESP_ERR_NO_MEM;
+	}
+
+	t->write_buffer[0] = request->register_address;
+	if(request->write_len) memcpy(&t->write_buffer[1], request->write_data, request->write_len);
+
+	esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, t->link, pdMS_TO_TICKS( I2C_TRANSACTION_TIMEOUT_MS ) );
+
+	if(ret == ESP_OK && request->read_len) memcpy(request->read_data, t->read_buffer, request->read_len);
+
+	return ret;
+}
+
+static void i2c_task(void *pvParameter){
+
+	i2c_request_t request;
+
+	for(;;){
+		if(xQueueReceive(i2c_queue, &request, portMAX_DELAY) != pdTRUE){
+			continue;
+		}
+
+		esp_err_t ret = i2c_execute(&request);
+		if(ret == ESP_ERR_TIMEOUT){
+			/* not retried: the caller knows best whether it is worth it */
+			i2c_bus_recover();
+		}
+
+		i2c_account(request.slave_address, ret, esp_timer_get_time() - request.queued_us);
+
+		if(request.callback){
+			request.callback(ret, request.arg);
+		}
+	}
+
+	vTaskDelete( NULL );
+}
+
+
+esp_err_t i2c_master_init(){
+
+	if(i2c_task_handle){
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	esp_err_t ret = i2c_driver_setup();
+	if(ret != ESP_OK){
 		return ret;
 	}
 
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, slave_address << 1 | READ_BIT, ACK_CHECK_EN);
-	i2c_master_read_byte(cmd, value, NACK_VAL);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM , cmd, pdMS_TO_TICKS( 1000 ) );
-	i2c_cmd_link_delete(cmd);
+	i2c_queue = xQueueCreate(I2C_QUEUE_LENGTH, sizeof(i2c_request_t));
+	i2c_futures_free = xQueueCreate(I2C_MAX_WAITERS, sizeof(i2c_future_t*));
+	if(i2c_queue == NULL || i2c_futures_free == NULL){
+		return ESP_ERR_NO_MEM;
+	}
+	for(int i = 0; i < I2C_MAX_WAITERS; i++){
+		i2c_future_t *f = &i2c_futures[i];
+		f->done = xSemaphoreCreateBinary();
+		if(f->done == NULL){
+			return ESP_ERR_NO_MEM;
+		}
+		xQueueSend(i2c_futures_free, &f, 0);
+	}
+
+	/* same core as the clock, its main client: a request is on the bus as soon as it is queued */
+	if(xTaskCreatePinnedToCore(&i2c_task, "i2c_task", 2048, NULL, I2C_TASK_PRIORITY, &i2c_task_handle, 1) != pdPASS){
+		return ESP_ERR_NO_MEM;
+	}
+
+	return ESP_OK;
+}
+
+
+esp_err_t i2c_submit(i2c_request_t *request, TickType_t ticks_to_wait){
+
+	if(request->write_len > I2C_TRANSACTION_MAX_DATA || request->read_len > I2C_TRANSACTION_MAX_DATA){
+		return ESP_ERR_INVALID_SIZE;
+	}
+	if(i2c_queue == NULL){
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	request->queued_us = esp_timer_get_time();
+	if(xQueueSend(i2c_queue, request, ticks_to_wait) != pdTRUE){
+		portENTER_CRITICAL(&i2c_stats_spinlock);
+		i2c_stats.queue_full++;
+		portEXIT_CRITICAL(&i2c_stats_spinlock);
+		return ESP_ERR_TIMEOUT;
+	}
+
+	return ESP_OK;
+}
+
+
+static void i2c_future_complete(esp_err_t result, void *arg){
+	i2c_future_t *f = (i2c_future_t*)arg;
+	f->result = result;
+	xSemaphoreGive(f->done);
+}
+
+/**
+ * @brief submits a request and waits for it. Once queued, a request always completes: the wait needs no timeout
+ */
+static esp_err_t i2c_transfer(const uint8_t slave_address, const uint8_t register_address, const uint8_t *write_data, size_t write_len, uint8_t *read_data, size_t read_len){
+
+	if(write_len > I2C_TRANSACTION_MAX_DATA || read_len > I2C_TRANSACTION_MAX_DATA){
+		return ESP_ERR_INVALID_SIZE;
+	}
+	if(i2c_futures_free == NULL){
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	i2c_future_t *f;
+	if(xQueueReceive(i2c_futures_free, &f, pdMS_TO_TICKS( 1000 )) != pdTRUE){
+		return ESP_ERR_TIMEOUT;
+	}
+
+	i2c_request_t request;
+	request.slave_address = slave_address;
+	request.register_address = register_address;
+	request.write_len = (uint8_t)write_len;
+	request.read_len = (uint8_t)read_len;
+	if(write_len) memcpy(request.write_data, write_data, write_len);
+	request.read_data = read_data;
+	request.callback = i2c_future_complete;
+	request.arg = f;
+
+	esp_err_t ret = i2c_submit(&request, pdMS_TO_TICKS( 1000 ));
+	if(ret == ESP_OK){
+		xSemaphoreTake(f->done, portMAX_DELAY);
+		ret = f->result;
+	}
+
+	xQueueSend(i2c_futures_free, &f, 0);
 
 	return ret;
+}
+
 
+esp_err_t i2c_write_bytes(const uint8_t slave_address, const uint8_t register_address, uint8_t *data, size_t data_len){
+	return i2c_transfer(slave_address, register_address, data, data_len, NULL, 0);
+}
+
+
+esp_err_t i2c_read_bytes(const uint8_t slave_address, const uint8_t register_address, uint8_t *data, size_t data_len){
+	if(data_len == 0) return ESP_ERR_INVALID_ARG;
+	return i2c_transfer(slave_address, register_address, NULL, 0, data, data_len);
+}
+
+esp_err_t i2c_read_byte(const uint8_t slave_address, const uint8_t register_address, uint8_t *value){
+	return i2c_transfer(slave_address, register_address, NULL, 0, value, 1);
 }
 
 
 esp_err_t i2c_write_byte(const uint8_t slave_address, const uint8_t register_address, const uint8_t value){
-	esp_err_t ret;
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, slave_address << 1 | WRITE_BIT, ACK_CHECK_EN);
-	i2c_master_write_byte(cmd, register_address, ACK_CHECK_EN);
-	i2c_master_write_byte(cmd, value, ACK_CHECK_EN);
-	i2c_master_stop(cmd);
-	ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS( 1000 ) );
-	i2c_cmd_link_delete(cmd);
+	return i2c_transfer(slave_address, register_address, &value, 1, NULL, 0);
+}
+
+void i2c_get_stats(i2c_stats_t *stats){
+	portENTER_CRITICAL(&i2c_stats_spinlock);
+	*stats = i2c_stats;
+	portEXIT_CRITICAL(&i2c_stats_spinlock);
+}
+
+esp_err_t i2c_get_device_stats(uint8_t slave_address, i2c_device_stats_t *stats){
+	esp_err_t ret = ESP_ERR_NOT_FOUND;
+	portENTER_CRITICAL(&i2c_stats_spinlock);
+	for(int i = 0; i < I2C_MAX_DEVICES; i++){
+		if(i2c_device_stats[i].requests && i2c_device_stats[i].address == slave_address){
+			*stats = i2c_device_stats[i];
+			ret = ESP_OK;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&i2c_stats_spinlock);
 	return ret;
 }
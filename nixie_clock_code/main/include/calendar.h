@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file calendar.h
+@author Tony Pottier
+@brief Incremental calendar: keeps a struct tm in step with a timestamp that advances one second at a time
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+*/
+
+#ifndef MAIN_CALENDAR_H_
+#define MAIN_CALENDAR_H_
+
+#include <time.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief a broken down time and the timestamp it stands for. No timezone is involved: the timestamp
+ * is already local time, the same way the clock calls localtime on the esp32 where TZ is never set.
+ */
+typedef struct calendar_t{
+	time_t timestamp;
+	struct tm tm;
+}calendar_t;
+
+/**
+ * @brief fully derives the calendar from a timestamp. This is the slow path, used at boot
+ * and whenever the timestamp jumps (UTC offset change, re-alignment of the clock).
+ */
+void calendar_set(calendar_t *cal, time_t t);
+
+/**
+ * @brief moves the calendar one second forward in constant time, rolling over minutes, hours, days,
+ * months and years as needed.
+ */
+void calendar_tick(calendar_t *cal);
+
+/**
+ * @brief brings the calendar to timestamp t: a single tick if t is the next second, calendar_set otherwise.
+ * @return pointer to the broken down time, owned by cal.
+ */
+const struct tm* calendar_advance(calendar_t *cal, time_t t);
+
+/**
+ * @brief true for leap years, year being the full year e.g. 2024
+ */
+bool calendar_is_leap_year(int year);
+
+/**
+ * @brief number of days of a month (0-11) of a given full year
+ */
+int calendar_days_in_month(int month, int year);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_CALENDAR_H_ */
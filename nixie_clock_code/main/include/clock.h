@@ -32,6 +32,8 @@ For a comprehensive documentation on how the timezone strings work:
 Unfortunately, it is broken on the ESP32. Things like CEST+2 simply do not work
 which makes it unusable. The clock instead references everything from UTC and
 apply offset manually to the timestamp.
+Offsets and transitions come from the rules of tz.h for every timezone of the
+compiled database, and from the transitions API for the few it cannot evaluate.
 
 */
 
@@ -45,8 +47,10 @@ apply offset manually to the timestamp.
 #include <stdbool.h> /* for bool */
 #include <esp_err.h> /* for esp_err_t */
 #include "freertos/FreeRTOS.h" /* TickType_t */
-#include "cJSON.h" /* for cJSON */
 #include "display.h" /* display_config_t */
+#include "journal.h" /* journal_stats_t */
+#include "ntp.h" /* ntp_result_t */
+#include "drift.h" /* drift_config_t */
 
 #ifdef __cplusplus
 extern "C" {
@@ -69,18 +73,38 @@ extern "C" {
 #define CLOCK_MAX_TZ_STRING_LENGTH			40
 
 
-/** in seconds, the maximum drift allowed before we force a refresh of the time */
-#define CLOCK_MAX_ACCEPTABLE_TIME_DRIFT		60.0
+/** @brief error of the clock tolerated before it is realigned, unless the time source is less precise than that */
+#define CLOCK_MAX_TIME_ERROR_US				(20 * 1000LL)
 
-/** number of transitions that will be stored in advance. Most timezones have 0 or 2 (summer time) so the default of 3 is plenty. */
-#define CLOCK_MAX_TRANSITIONS				3
+/** @brief least time between deciding to realign the clock and the second boundary at which the RTC is written */
+#define CLOCK_REALIGN_LEAD_US				(50 * 1000LL)
+
+/** @brief seconds between two checks of the tick count against the time of the RTC */
+#define CLOCK_RTC_CHECK_INTERVAL			60
+
+/** @brief oldest shadow copy of the DS3231 registers the check takes instead of reading the chip */
+#define CLOCK_RTC_SHADOW_MAX_AGE_US			(CLOCK_RTC_CHECK_INTERVAL * 1000000LL)
+/** how far ahead transitions are requested. Most timezones have 0 or 2 (summer time) transitions a year */
+#define CLOCK_TRANSITIONS_HORIZON			((time_t)60*60*24*365*5)
+
+/** number of transitions that can be stored: the horizon with some slack for timezones with unusual rules */
+#define CLOCK_MAX_TRANSITIONS				16
+
+/** the table is fetched again this often, to pick up rule changes well before they happen */
+#define CLOCK_TRANSITIONS_REFRESH			((time_t)60*60*24*90)
+
+/** if a transitions request gets no answer it is tried again after this delay */
+#define CLOCK_TRANSITIONS_RETRY				((time_t)60*60*24)
+
+/** a timestamp that is never reached */
+#define CLOCK_TIME_NEVER					((time_t)0x7fffffff)
 
 /** maximum numbers of sleepmodes a user can set */
 #define CLOCK_MAX_SLEEPMODES				4
 
 typedef enum clock_message_t{
 	CLOCK_MESSAGE_NONE = 0,
-	CLOCK_MESSAGE_TICK = 1,
+	CLOCK_MESSAGE_TICK = 1, /* no longer queued: the ISR counts ticks for the clock task, see clock_tick_stats_t */
 	CLOCK_MESSAGE_STA_GOT_IP = 2,
 	CLOCK_MESSAGE_STA_DISCONNECTED = 3,
 	CLOCK_MESSAGE_RECEIVE_TIME_API = 4,
@@ -91,15 +115,13 @@ typedef enum clock_message_t{
 	CLOCK_MESSAGE_TIMEZONE = 9,
 	CLOCK_MESSAGE_SLEEP_EVENT = 10,
 	CLOCK_MESSAGE_BACKLIGHTS_CONFIG = 11,
+	CLOCK_MESSAGE_TUBE_BRIGHTNESS_CONFIG = 12,
+	CLOCK_MESSAGE_DISPLAY_TRANSITION_CONFIG = 13,
+	CLOCK_MESSAGE_RECEIVE_SNTP = 14,
+	CLOCK_MESSAGE_COUNT = 15, /* number of message types, keep last */
 	CLOCK_MESSAGE_MAX = 0x7fffffff
 }clock_message_t;
 
-/** @brief type that is processed by the clock queue */
-typedef struct clock_queue_message_t{
-	clock_message_t message;
-	void *param;
-}clock_queue_message_t;
-
 typedef struct timezone_t{
 	int32_t offset;
 	char name[CLOCK_MAX_TZ_STRING_LENGTH];
@@ -133,10 +155,93 @@ typedef enum sleep_action_t{
 	SLEEP_ACTION_MAX = 0x7fffffff
 }sleep_action_t;
 
-typedef struct sleep_event_t{
+
+/** @brief what the clock needs of a time API answer. Extracted by http_client while the answer streams in */
+typedef struct clock_time_api_t{
+	int64_t request_us;							/**< esp_timer time the request went out */
+	int64_t response_us;						/**< esp_timer time the answer came back */
+	bool has_timestamp;
+	bool has_timezone_name;
+	bool has_timezone_offset;
 	time_t timestamp;
-	sleep_action_t action;
-}sleep_event_t;
+	timezone_t timezone;
+}clock_time_api_t;
+
+/** @brief a transitions API answer, sorted by timestamp. count is -1 if the answer had no transitions array */
+typedef struct clock_transitions_api_t{
+	int count;
+	transition_t transitions[CLOCK_MAX_TRANSITIONS];
+}clock_transitions_api_t;
+
+/** @brief payloads too large to travel inline in a message. They are taken from a preallocated pool */
+typedef union clock_message_payload_t{
+	timezone_t timezone;
+	sleepmodes_t sleepmodes;
+	clock_time_api_t time_api;
+	clock_transitions_api_t transitions_api;
+	ntp_result_t sntp;
+}clock_message_payload_t;
+
+/** @brief number of pooled payloads: enough for every large message that can be in flight at the same time */
+#define CLOCK_MESSAGE_POOL_SIZE				6
+
+/** @brief depth of the lanes of the clock queue. Sleep events come first, then config changes, then network answers */
+#define CLOCK_QUEUE_SLEEP_LENGTH			4
+#define CLOCK_QUEUE_CONFIG_LENGTH			6
+#define CLOCK_QUEUE_NETWORK_LENGTH			6
+
+/**
+ * @brief type that is processed by the clock queue. The parameter is a tagged union: message tells which member
+ * is valid. Large payloads are pooled and must be given back with clock_message_release once processed.
+ * Display settings (backlight color, tube brightness, transition) are latest-wins: a new value replaces the
+ * one the clock task has not processed yet instead of being queued behind it.
+ */
+typedef struct clock_queue_message_t{
+	clock_message_t message;
+	int64_t sent_us;							/**< esp_timer time the message was queued, for the latency counters */
+	union{
+		uint32_t value;
+		sleep_action_t sleep_action;
+		rgb_t rgb;
+		uint8_t brightness;
+		display_transition_t transition;
+		clock_message_payload_t *payload;
+	}param;
+}clock_queue_message_t;
+
+/** @brief per message type counters of the clock queue */
+typedef struct clock_message_stats_t{
+	uint32_t sent;
+	uint32_t received;
+	uint32_t dropped;							/**< no pooled payload available or lane full */
+	uint32_t coalesced;							/**< latest-wins messages replaced before being processed */
+	uint32_t max_latency_us;					/**< longest time between send and receive */
+	uint64_t total_latency_us;
+}clock_message_stats_t;
+
+/** @brief number of buckets of the tick histograms. Bucket i counts values below CLOCK_TICK_HISTOGRAM_FIRST_US << i, the last one everything else */
+#define CLOCK_TICK_HISTOGRAM_BUCKETS		10
+
+/** @brief upper bound of the first bucket of the tick histograms */
+#define CLOCK_TICK_HISTOGRAM_FIRST_US		64
+
+/**
+ * @brief counters of the tick lane. Every 1Hz edge is timestamped by the ISR:
+ * latency is the time from the edge to the display showing the new second,
+ * jitter is how far the interval between two consecutive edges is from one second.
+ */
+typedef struct clock_tick_stats_t{
+	uint32_t edges;								/**< edges counted by the ISR */
+	uint32_t ticks;								/**< seconds processed by the clock task */
+	uint32_t late;								/**< wake-ups that found more than one edge pending */
+	uint32_t max_pending;
+	uint32_t max_latency_us;
+	uint32_t max_jitter_us;
+	uint32_t latency[CLOCK_TICK_HISTOGRAM_BUCKETS];
+	uint32_t jitter[CLOCK_TICK_HISTOGRAM_BUCKETS];
+	uint32_t rtc_checks;						/**< tick count compared with a snapshot of the RTC */
+	uint32_t rtc_corrections;					/**< checks that found the tick count off, e.g. after a lost edge */
+}clock_tick_stats_t;
 
 
 /**
@@ -145,29 +250,59 @@ typedef struct clock_config_t{
 	timezone_t timezone;
 	sleepmodes_t sleepmodes;
 	display_config_t display;
+	drift_config_t rtc;							/**< trim of the DS3231 oscillator */
 }clock_config_t;
 
 
 #define GPIO_INPUT_IO_4 				4
 
 
-void clock_notify_new_timezone(char* timezone);
-void clock_notify_new_sleepmodes(sleepmodes_t sleepmodes);
+/*
+ * The clock_notify functions never wait. Those returning esp_err_t give ESP_OK if the clock task
+ * will get the message, ESP_ERR_TIMEOUT if its lane is full and ESP_ERR_NO_MEM if the payload pool is empty.
+ */
+esp_err_t clock_notify_new_timezone(char* timezone);
+esp_err_t clock_notify_new_sleepmodes(sleepmodes_t sleepmodes);
 void clock_notify_sta_got_ip(void* pvArgument);
 void clock_notify_sta_disconnected();
-void clock_notify_new_backlight_color(rgb_t rgb);
-void clock_notify_time_api_response(cJSON *json);
-void clock_notify_transitions_api_response(cJSON *json);
+esp_err_t clock_notify_new_backlight_color(rgb_t rgb);
+esp_err_t clock_notify_new_tube_brightness(uint8_t brightness);
+esp_err_t clock_notify_new_display_transition(display_transition_t transition);
+esp_err_t clock_notify_time_api_response(const clock_time_api_t *api);
+esp_err_t clock_notify_transitions_api_response(const clock_transitions_api_t *api);
+esp_err_t clock_notify_sntp_response(const ntp_result_t *result);
 void clock_tick();
 void clock_task(void *pvParameter);
 esp_err_t clock_register_sqw_interrupt();
 
 time_t clock_get_current_time_utc();
 
+/**
+ * @brief takes a payload from the message pool, without waiting
+ * @return the payload, zeroed, or NULL if the pool is empty
+ */
+clock_message_payload_t* clock_message_alloc();
+
+/**
+ * @brief gives the pooled payload of a processed message back, if it has one
+ */
+void clock_message_release(clock_queue_message_t *msg);
+
+/**
+ * @brief copies the counters of a message type
+ */
+void clock_get_message_stats(clock_message_t message, clock_message_stats_t *stats);
+
+/**
+ * @brief copies the counters and histograms of the tick lane
+ */
+void clock_get_tick_stats(clock_tick_stats_t *stats);
+
 
 
 /**
- * @brief saves the current configuration to NVS memory
+ * @brief saves the whole configuration to NVS memory, as a new base of the journal.
+ * Regular changes are saved field by field by the task that saves the config.
  */
 esp_err_t clock_save_config(clock_config_t *conf);
 
@@ -196,10 +331,16 @@ display_config_t clock_get_config_display();
 
 
 /**
- * @brief Retrieves the configuration from NVS memory
+ * @brief Retrieves the configuration from NVS memory: the journal is replayed over its base.
+ * If there is nothing saved yet, conf is saved as the first base.
  */
 esp_err_t clock_get_nvs_config(clock_config_t *conf);
 
+/**
+ * @brief copies the counters of the configuration journal, flash bytes written included
+ */
+void clock_get_config_store_stats(journal_stats_t *stats);
+
 /**
  * Mutex lock to avoid resource sharing issues when accessing the NVS
  */
@@ -219,7 +360,21 @@ esp_err_t clock_save_timezone(timezone_t *tz);
 void clock_change_timezone(timezone_t tz);
 esp_err_t clock_get_nvs_timezone(timezone_t *tz);
 
-bool clock_realign(time_t new_t);
+/**
+ * @brief outcome of clock_realign
+ */
+typedef enum clock_realign_t{
+	CLOCK_REALIGN_NOT_NEEDED = 0,				/**< the clock had a time, within tolerance */
+	CLOCK_REALIGN_DONE = 1,						/**< the RTC was rewritten: the clock jumped */
+	CLOCK_REALIGN_FAILED = 2					/**< the RTC could not be written: the clock kept whatever time it had */
+}clock_realign_t;
+
+/**
+ * @brief compares the clock with UTC, given as offset_us from esp_timer and known to +/- uncertainty_us. If it is
+ * further off than CLOCK_MAX_TIME_ERROR_US and the uncertainty, the RTC is rewritten on the next second boundary
+ * so that the square wave falls on the true seconds. A clock without a valid time is always realigned.
+ */
+clock_realign_t clock_realign(int64_t offset_us, int64_t uncertainty_us);
 
 
 #ifdef __cplusplus
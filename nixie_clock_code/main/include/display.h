@@ -32,6 +32,8 @@ Contains functions to control the nixie clock display over SPI
 
 #include <time.h>
 #include <stdbool.h>
+#include <driver/ledc.h>
+#include <driver/timer.h>
 #include "ws2812.h"
 
 #ifdef __cplusplus
@@ -47,6 +49,40 @@ extern "C" {
 
 #define DISPLAY_DIGIT_COUNT				6
 
+/**
+ * @brief number of frames that can be queued on the SPI bus at the same time.
+ * A frame is 96 bits so at 100kHz the bus is never more than one frame behind in practice.
+ */
+#define DISPLAY_DMA_BUFFERS				3
+
+/**
+ * @brief tube brightness is a PWM on OE, generated by the LEDC peripheral.
+ */
+#define DISPLAY_LEDC_MODE				LEDC_HIGH_SPEED_MODE
+#define DISPLAY_LEDC_TIMER				LEDC_TIMER_0
+#define DISPLAY_LEDC_CHANNEL			LEDC_CHANNEL_0
+#define DISPLAY_PWM_RESOLUTION			LEDC_TIMER_10_BIT
+#define DISPLAY_PWM_DUTY_MAX			(1 << 10)
+#define DISPLAY_PWM_FREQUENCY_HZ		1000
+
+/** @brief brightness is in percent */
+#define DISPLAY_BRIGHTNESS_MAX			100
+
+/** @brief duration of the hardware ramp when the brightness changes or the display is turned on */
+#define DISPLAY_BRIGHTNESS_FADE_MS		500
+
+/**
+ * @brief hardware timer pacing the compositor during digit transitions.
+ */
+#define DISPLAY_TIMER_GROUP				TIMER_GROUP_0
+#define DISPLAY_TIMER					TIMER_0
+#define DISPLAY_TIMER_DIVIDER			80		/* 1MHz: 1 tick per us */
+#define DISPLAY_FRAME_PERIOD_US			(1000000 / CONFIG_DISPLAY_FRAME_RATE)
+#define DISPLAY_TRANSITION_FRAMES		((CONFIG_DISPLAY_TRANSITION_MS * CONFIG_DISPLAY_FRAME_RATE) / 1000)
+
+/** @brief the compositor has to meet its frame deadlines, so it runs just above the clock task */
+#define DISPLAY_COMPOSITOR_TASK_PRIORITY	(CONFIG_CLOCK_TASK_PRIORITY + 1)
+
 #define DISPLAY_TOP_DOT_MASK			(uint16_t)(1<<10)
 #define DISPLAY_BOTTOM_DOT_MASK			(uint16_t)(1<<11)
 
@@ -67,18 +103,61 @@ typedef enum display_dot_mode_t{
 	DISPLAY_DOT_MODE_OFF = 0x7fffffff
 }display_dot_mode_t;
 
+typedef enum display_transition_t{
+	DISPLAY_TRANSITION_NONE = 0,		/* digits change at once */
+	DISPLAY_TRANSITION_CROSSFADE = 1,	/* old and new cathodes are time multiplexed, the new one progressively taking over */
+	DISPLAY_TRANSITION_ROLL = 2,		/* slot machine: the digit counts up through the values in between */
+	DISPLAY_TRANSITION_MAX = 0x7fffffff
+}display_transition_t;
+
 typedef struct display_config_t{
 	display_dot_mode_t dot_mode;
 	display_leading_zero_t leading_zero;
 	bool twelve_hours_format;
 	float led_brightness;
 	rgb_t led_color;
+	uint8_t tube_brightness;	/* 0 to DISPLAY_BRIGHTNESS_MAX, gamma corrected */
+	display_transition_t transition;
 }display_config_t;
 
+/**
+ * @brief statistics of the transition compositor
+ */
+typedef struct display_compositor_stats_t{
+	uint32_t transitions;
+	uint32_t frames;			/* frames sent during transitions */
+	uint32_t dropped;			/* timer periods without a frame: compositor woke up too late or the bus was still busy */
+	uint32_t max_jitter_us;		/* worst delay of a frame relative to its slot */
+	uint64_t total_jitter_us;
+}display_compositor_stats_t;
+
 esp_err_t display_init();
 esp_err_t display_write_time(struct tm *time);
+
+/**
+ * @brief returns the back buffer. Only meant for a single renderer: the buffer is not locked and
+ * after display_write_vram it points to the previous frame, so a full frame must be rendered each time.
+ * Other tasks should use display_write_frame instead.
+ */
 uint16_t* display_get_vram();
+
+/**
+ * @brief queues the back buffer on the SPI bus and flips it to the front. Does not wait for the transfer.
+ * @return ESP_ERR_TIMEOUT if all DMA buffers are still in flight, in which case nothing is flipped.
+ */
 esp_err_t display_write_vram();
+
+/**
+ * @brief copies a full frame (DISPLAY_DIGIT_COUNT words, native endianness) to the back buffer and flips it. Safe to call from any task.
+ * @see display_write_vram
+ */
+esp_err_t display_write_frame(const uint16_t *frame);
+
+/**
+ * @brief copies the frame currently shown on the display (DISPLAY_DIGIT_COUNT words, native endianness).
+ */
+void display_get_front(uint16_t *frame);
+
 esp_err_t display_register_usb_power_interrupt();
 
 /**
@@ -90,6 +169,15 @@ void display_set_config(display_config_t* config);
 void display_turn_on();
 void display_turn_off();
 
+/**
+ * @brief sets the global tube brightness, in percent. A non zero fade_ms ramps to the new value in hardware.
+ * If the display is off the value is kept for the next display_turn_on.
+ */
+esp_err_t display_set_brightness(uint8_t brightness, uint32_t fade_ms);
+uint8_t display_get_brightness();
+
+void display_get_compositor_stats(display_compositor_stats_t *stats);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,134 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+
+@file drift.h
+@author Tony Pottier
+@brief Estimates the frequency error of the DS3231 from the error measured at every synchronization, and
+trims it with the aging offset register
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Every synchronization measures how far the clock is from UTC. Realignments step the clock back to zero,
+so the steps are added back: what remains grows linearly with the frequency error of the oscillator, which
+a least squares fit over the samples gives in ppm (microseconds per second).
+
+The aging offset register moves the frequency by about DRIFT_PPM_PER_AGING_LSB per unit, a positive value
+slowing the oscillator down. Once the fit is clearly away from zero by at least half a unit, the register is
+moved by the rounded estimate and the samples start over: they were taken on the previous frequency.
+
+*/
+
+#ifndef MAIN_DRIFT_H_
+#define MAIN_DRIFT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief samples kept for the fit */
+#define DRIFT_MAX_SAMPLES				16
+
+/** @brief samples closer than this are merged: the most precise one is kept */
+#define DRIFT_SAMPLE_INTERVAL_S			3600
+
+/** @brief least time covered by the samples before the fit is trusted */
+#define DRIFT_MIN_SPAN_S				(6 * 3600)
+
+#define DRIFT_MIN_SAMPLES				4
+
+/** @brief samples less precise than this are not used. The time API, to the second, never makes it */
+#define DRIFT_MAX_UNCERTAINTY_US		(50 * 1000LL)
+
+/** @brief frequency change of one unit of the aging offset register, at 25C */
+#define DRIFT_PPM_PER_AGING_LSB			0.1
+
+/** @brief clock error at a given UTC time. error_us includes the realignments done since the first sample */
+typedef struct drift_sample_t{
+	int64_t utc_us;
+	int64_t error_us;
+	int64_t uncertainty_us;
+}drift_sample_t;
+
+/** @brief what is saved in NVS */
+typedef struct drift_config_t{
+	int8_t aging;								/**< value of the aging offset register */
+	float ppm;									/**< frequency error of the oscillator with an aging offset of 0 */
+}drift_config_t;
+
+typedef struct drift_t{
+	drift_sample_t samples[DRIFT_MAX_SAMPLES];	/**< oldest first */
+	int count;
+	int64_t steps_us;							/**< sum of the realignments since the first sample */
+	int8_t aging;
+	double ppm;									/**< last fit, with the current aging offset */
+	uint32_t trims;
+}drift_t;
+
+/**
+ * @brief starts an estimator for an oscillator currently trimmed by aging
+ */
+void drift_init(drift_t *drift, int8_t aging);
+
+/**
+ * @brief drops every sample
+ */
+void drift_reset(drift_t *drift);
+
+/**
+ * @brief records that the clock was error_us ahead of UTC at utc_us, give or take uncertainty_us
+ */
+void drift_add_sample(drift_t *drift, int64_t utc_us, int64_t error_us, int64_t uncertainty_us);
+
+/**
+ * @brief records that the clock was moved by step_us
+ */
+void drift_stepped(drift_t *drift, int64_t step_us);
+
+/**
+ * @brief least squares fit of the samples
+ * @param ppm frequency error of the oscillator, positive if it runs fast
+ * @param sigma_ppm standard error of ppm
+ * @return false if the samples are too few or too close together to be trusted
+ */
+bool drift_fit(const drift_t *drift, double *ppm, double *sigma_ppm);
+
+/**
+ * @brief computes the aging offset that corrects the fitted error. If it differs from the current one it
+ * becomes the current one and the samples are dropped
+ * @return true if the aging offset register must be written with drift->aging
+ */
+bool drift_trim(drift_t *drift);
+
+/**
+ * @brief frequency error the oscillator would have with an aging offset of 0, from the last fit
+ */
+double drift_untrimmed_ppm(const drift_t *drift);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_DRIFT_H_ */
@@ -34,6 +34,7 @@ SOFTWARE.
 #include <esp_err.h>
 #include <stdint.h>
 #include <time.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -51,25 +52,81 @@ extern "C" {
 #define DS3231_YEAR_REGISTER				0x06
 #define DS3231_TIME_REGISTERS_COUNT			7			/* 7 registers from 0x00 to 0x06 */
 
+/** @brief bits on the bus until the DS3231 acknowledges the seconds register: start, address, register pointer, seconds */
+#define DS3231_SECONDS_WRITE_BITS			(2 + 9 + 9 + 9)
+
+/** @brief bits on the bus after the seconds register is acknowledged: the other time registers and the STOP */
+#define DS3231_TIME_WRITE_TAIL_BITS			((DS3231_TIME_REGISTERS_COUNT - 1) * 9 + 1)
+
 #define DS3231_CONTROL_REGISTER				0x0E
+#define DS3231_CONTROL_CONV					(1 << 5)	/* starts a temperature conversion */
 #define DS3231_CONTROL_STATUS_REGISTER		0x0F
+#define DS3231_STATUS_BSY					(1 << 2)	/* a temperature conversion is running */
 #define DS3231_AGING_OFFSET_REGISTER		0x10
 #define DS3231_TEMP_MSB_REGISTER			0x11
 #define DS3231_TEMP_LSB_REGISTER			0x12
+#define DS3231_REGISTERS_COUNT				19			/* the whole register map, from 0x00 to 0x12 */
 
+/**
+ * @brief every register of the DS3231, read in a single burst
+ */
+typedef struct ds3231_snapshot_t{
+	uint8_t registers[DS3231_REGISTERS_COUNT];
+	int64_t timestamp_us;						/**< esp_timer time the read was asked for */
+	int64_t completed_us;						/**< esp_timer time it was done. The DS3231 latched its time in between */
+}ds3231_snapshot_t;
 
 
-void ds3231_task(void *pvParameter);
 
 esp_err_t ds3231_enable_square_wave();
 
-float ds3231_get_temperature();
+/**
+ * @brief asks for a temperature conversion now instead of waiting for the automatic one, every 64 seconds.
+ * Only the temperature service does, after checking ds3231_temperature_busy
+ */
+esp_err_t ds3231_start_temperature_conversion();
+
+/**
+ * @brief true while a conversion is running. A new conversion must not be started before
+ */
+esp_err_t ds3231_temperature_busy(bool *busy);
+esp_err_t ds3231_set_aging_offset(int8_t aging);
+esp_err_t ds3231_get_aging_offset(int8_t *aging);
 void ds3231_i2c_init();
 int ds3231_gettimeofday();
 void ds3231_set_datetime(time_t datetime);
 
 esp_err_t ds3231_get_time(struct tm *timeinfo);
+
+/**
+ * @brief reads all the registers in one transaction and keeps them as the shadow copy
+ */
+esp_err_t ds3231_read_snapshot(ds3231_snapshot_t *snapshot);
+
+/**
+ * @brief the last snapshot read, without going on the bus. The temperature service refreshes it after every conversion
+ * @return false if no snapshot was read since the time was last written
+ */
+bool ds3231_get_shadow(ds3231_snapshot_t *snapshot);
+
+/**
+ * @brief decodes the time registers of a snapshot
+ * @return ESP_ERR_INVALID_RESPONSE if a register is out of range: the read was corrupted
+ */
+esp_err_t ds3231_snapshot_time(const ds3231_snapshot_t *snapshot, struct tm *timeinfo);
+
+float ds3231_snapshot_temperature(const ds3231_snapshot_t *snapshot);
 esp_err_t ds3231_set_time(const struct tm *timeinfo);
+
+/**
+ * @brief writes timeinfo so that the DS3231 takes the seconds register when esp_timer reads at_us.
+ * Writing the seconds register restarts the countdown chain: the next edge of the square wave comes exactly
+ * a second after at_us. The caller is blocked until then.
+ * @return ESP_ERR_INVALID_STATE if the time was written, but possibly more than tolerance_us late: the transaction
+ * can wait behind others in the bus task. The countdown chain restarted all the same
+ */
+esp_err_t ds3231_set_time_at(const struct tm *timeinfo, int64_t at_us, int64_t tolerance_us);
+
 uint8_t ds3231_bcd2dec (uint8_t val);
 uint8_t ds3231_dec2bcd (uint8_t val);
 
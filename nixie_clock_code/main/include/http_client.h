@@ -40,6 +40,9 @@ extern "C" {
 
 #define HTTP_CLIENT_MAX_REQUEST_SIZE	256
 
+/** @brief the connection to the API server is closed after this long without a request. Servers commonly drop idle connections after 60s */
+#define HTTP_CLIENT_IDLE_CLOSE_MS		(30 * 1000)
+
 esp_err_t http_client_init();
 void http_client_cleanup(esp_http_client_handle_t client);
 void http_client_get_api_time(char* timezone);
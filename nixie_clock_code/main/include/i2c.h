@@ -24,6 +24,10 @@ SOFTWARE.
 
 Contains helper functions to communicate over the I2C bus
 
+The bus belongs to a task: clients queue requests with i2c_submit and are called back once they are done.
+The helpers below are built on top of it and wait for their request. A transaction that times out gets the
+bus recovered (SCL clocked until the slave lets go of SDA, then a STOP) before the next one.
+
 */
 
 #ifndef MAIN_I2C_H_
@@ -31,6 +35,7 @@ Contains helper functions to communicate over the I2C bus
 
 #include <esp_err.h>
 #include <stdint.h>
+#include "freertos/FreeRTOS.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -53,11 +58,84 @@ extern "C" {
 #define ACK_VAL                            	0x0             	/*!< I2C ack value */
 #define NACK_VAL 							0x1 				/*!< I2C nack value */
 
+/** @brief largest block of registers a transaction reads or writes: the whole DS3231 fits */
+#define I2C_TRANSACTION_MAX_DATA			32
+
+/** @brief shapes of transaction (slave, bytes written, bytes read) whose command link is kept */
+#define I2C_TRANSACTION_CACHE_SIZE			6
+
+/** @brief a transaction takes well under a millisecond at 400kHz. Past this the bus is stuck */
+#define I2C_TRANSACTION_TIMEOUT_MS			50
+
+/** @brief requests waiting for the bus */
+#define I2C_QUEUE_LENGTH					8
+
+/** @brief clients that can wait for a request at the same time */
+#define I2C_MAX_WAITERS						4
+
+/** @brief devices counters are kept for */
+#define I2C_MAX_DEVICES						4
+
+/** @brief above every client: a request is served as soon as it is queued */
+#define I2C_TASK_PRIORITY					(CONFIG_CLOCK_TASK_PRIORITY + 1)
 
+/** @brief clocks given to a slave holding SDA low: the rest of a byte and its ack */
+#define I2C_RECOVERY_CLOCKS					9
+
+/** @brief half a period of the recovery clock: 100kHz, slow enough for any slave */
+#define I2C_RECOVERY_HALF_PERIOD_US			5
+
+/**
+ * @brief called by the bus task once a request is done. The data read is already in read_data
+ */
+typedef void (*i2c_callback_t)(esp_err_t result, void *arg);
+
+/**
+ * @brief writes the register address and write_len bytes, then reads read_len bytes after a repeated start
+ */
+typedef struct i2c_request_t{
+	uint8_t slave_address;
+	uint8_t register_address;
+	uint8_t write_len;
+	uint8_t read_len;
+	uint8_t write_data[I2C_TRANSACTION_MAX_DATA];	/**< copied: the caller can reuse its buffer right away */
+	uint8_t *read_data;								/**< must stay valid until the callback */
+	i2c_callback_t callback;						/**< may be NULL */
+	void *arg;
+	int64_t queued_us;								/**< set by i2c_submit */
+}i2c_request_t;
+
+typedef struct i2c_stats_t{
+	uint32_t operations;						/**< requests served, one bus transaction each */
+	uint32_t errors;
+	uint32_t links_built;						/**< command links built: the only allocations */
+	uint32_t recoveries;
+	uint32_t queue_full;						/**< requests that could not be queued */
+}i2c_stats_t;
+
+typedef struct i2c_device_stats_t{
+	uint8_t address;
+	uint32_t requests;
+	uint32_t errors;
+	uint32_t timeouts;							/**< errors that needed a recovery of the bus */
+	uint32_t max_latency_us;					/**< from the request being queued to its callback */
+	uint64_t total_latency_us;
+}i2c_device_stats_t;
 
 
+
+
+/**
+ * @brief installs the driver and starts the task that owns the bus
+ */
 esp_err_t i2c_master_init();
 
+/**
+ * @brief queues a request for the bus task
+ * @return ESP_OK if the callback will be called, ESP_ERR_TIMEOUT if the queue stayed full, ESP_ERR_INVALID_SIZE
+ */
+esp_err_t i2c_submit(i2c_request_t *request, TickType_t ticks_to_wait);
+
 
 
 
@@ -75,14 +153,24 @@ esp_err_t i2c_read_byte(const uint8_t slave_address, const uint8_t register_addr
 
 
 /**
- * @brief I2C helper function to read bytes starting from specified register
+ * @brief I2C helper function to read bytes starting from specified register, up to I2C_TRANSACTION_MAX_DATA
  * @warning: it is the caller responsability to ensure data buffer is big enough to store data_len bytes.
  */
 esp_err_t i2c_read_bytes(const uint8_t slave_address, const uint8_t register_address, uint8_t *data, size_t data_len);
 
 
+/**
+ * @brief I2C helper function to write bytes starting from specified register, up to I2C_TRANSACTION_MAX_DATA
+ */
 esp_err_t i2c_write_bytes(const uint8_t slave_address, const uint8_t register_address, uint8_t *data, size_t data_len);
 
+void i2c_get_stats(i2c_stats_t *stats);
+
+/**
+ * @return ESP_ERR_NOT_FOUND if the device was never addressed
+ */
+esp_err_t i2c_get_device_stats(uint8_t slave_address, i2c_device_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file journal.h
+@author Tony Pottier
+@brief Journaled configuration store on top of NVS: only the fields that changed are written
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+A configuration struct is split into fields. The whole struct is written once as a base blob, then
+every save appends a small record holding only the dirty fields to one of JOURNAL_MAX_RECORDS slots.
+Loading replays the records over the base. When the slots run out, or when a record would not be
+smaller than the base, the journal is compacted: the base is rewritten and the slots start over.
+
+The base carries a generation number that every record repeats. A record from another generation is
+ignored, so losing power in the middle of a compaction never replays stale fields over a newer base.
+
+*/
+
+#ifndef MAIN_JOURNAL_H_
+#define MAIN_JOURNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief number of record slots before the journal gets compacted */
+#define JOURNAL_MAX_RECORDS				8
+
+/** @brief maximum number of fields, one bit each in a record */
+#define JOURNAL_MAX_FIELDS				16
+
+/** @brief size of an NVS entry: every item written to flash takes whole entries */
+#define JOURNAL_NVS_ENTRY_SIZE			32
+
+/** @brief size of the nvs partition of the default partition table, over which NVS spreads its writes */
+#define JOURNAL_NVS_PARTITION_SIZE		(24 * 1024)
+
+/** @brief erase cycles a flash sector is rated for */
+#define JOURNAL_FLASH_ENDURANCE			100000
+
+/** @brief where a field lives in the configuration struct */
+typedef struct journal_field_t{
+	uint16_t offset;
+	uint16_t size;
+}journal_field_t;
+
+typedef struct journal_stats_t{
+	uint32_t records;							/**< records appended */
+	uint32_t compactions;						/**< base rewrites, including the first one */
+	uint64_t bytes_written;						/**< flash written by the journal, in whole NVS entries */
+}journal_stats_t;
+
+typedef struct journal_t{
+	const char *name_space;
+	const journal_field_t *fields;
+	int field_count;
+	size_t size;								/**< size of the configuration struct */
+	uint16_t generation;
+	uint16_t next_record;						/**< first free slot */
+	journal_stats_t stats;
+}journal_t;
+
+/**
+ * @brief sets up a journal for a configuration struct of size bytes made of the given fields. Nothing is read yet.
+ */
+void journal_init(journal_t *journal, const char *name_space, const journal_field_t *fields, int field_count, size_t size);
+
+/**
+ * @brief reads the base into data and replays the records of its generation over it
+ * @return ESP_OK, ESP_ERR_NVS_NOT_FOUND if there is no base yet: data is left untouched
+ */
+esp_err_t journal_load(journal_t *journal, void *data);
+
+/**
+ * @brief saves the fields of data flagged in dirty (bit i for field i): a record is appended, or the journal
+ * is compacted if it is full
+ */
+esp_err_t journal_write(journal_t *journal, const void *data, uint32_t dirty);
+
+/**
+ * @brief writes data as the new base and drops every record
+ */
+esp_err_t journal_compact(journal_t *journal, const void *data);
+
+/**
+ * @brief flash bytes NVS uses to store a blob of length bytes
+ */
+size_t journal_blob_flash_size(size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_JOURNAL_H_ */
@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file jsonstream.h
+@author Tony Pottier
+@brief Incremental JSON parser working in a fixed amount of memory
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The document is fed in chunks as they come off the network, and never stored: the parser
+reports every value and every start and end of an object or array to a callback, along
+with where it is in the document. The callback picks what it needs with jsonstream_path_is.
+Strings longer than JSONSTREAM_MAX_STRING and keys longer than JSONSTREAM_MAX_KEY are
+truncated, which is fine for the few short fields the clock reads.
+
+*/
+
+#ifndef MAIN_JSONSTREAM_H_
+#define MAIN_JSONSTREAM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief deepest nesting of objects and arrays */
+#define JSONSTREAM_MAX_DEPTH			6
+
+/** @brief longest key kept, \0 included */
+#define JSONSTREAM_MAX_KEY				24
+
+/** @brief longest string or number kept, \0 included */
+#define JSONSTREAM_MAX_STRING			48
+
+typedef enum jsonstream_event_t{
+	JSONSTREAM_EVENT_BEGIN = 0,					/**< an object or array starts: the path is the container */
+	JSONSTREAM_EVENT_VALUE = 1,					/**< a string, number, boolean or null */
+	JSONSTREAM_EVENT_END = 2					/**< an object or array ends: the path is the container */
+}jsonstream_event_t;
+
+typedef enum jsonstream_type_t{
+	JSONSTREAM_TYPE_OBJECT = 0,
+	JSONSTREAM_TYPE_ARRAY = 1,
+	JSONSTREAM_TYPE_STRING = 2,
+	JSONSTREAM_TYPE_NUMBER = 3,
+	JSONSTREAM_TYPE_BOOL = 4,
+	JSONSTREAM_TYPE_NULL = 5
+}jsonstream_type_t;
+
+typedef struct jsonstream_value_t{
+	jsonstream_type_t type;
+	const char *string;							/**< JSONSTREAM_TYPE_STRING only, valid during the callback */
+	double number;
+	bool boolean;
+}jsonstream_value_t;
+
+struct jsonstream_t;
+
+typedef void (*jsonstream_callback_t)(const struct jsonstream_t *js, jsonstream_event_t event, const jsonstream_value_t *value, void *ctx);
+
+/** @brief an open object or array */
+typedef struct jsonstream_level_t{
+	bool array;
+	uint16_t index;								/**< element of an array */
+	char key[JSONSTREAM_MAX_KEY];				/**< member of an object */
+}jsonstream_level_t;
+
+typedef struct jsonstream_t{
+	jsonstream_callback_t callback;
+	void *ctx;
+	uint8_t state;
+	uint8_t depth;
+	uint8_t length;								/**< characters in buffer */
+	uint8_t unicode_digits;
+	uint16_t unicode;
+	bool key;									/**< the string being read is a key */
+	bool done;
+	char buffer[JSONSTREAM_MAX_STRING];
+	jsonstream_level_t levels[JSONSTREAM_MAX_DEPTH];
+}jsonstream_t;
+
+/**
+ * @brief gets a parser ready for a new document
+ */
+void jsonstream_init(jsonstream_t *js, jsonstream_callback_t callback, void *ctx);
+
+/**
+ * @brief parses the next len characters of the document
+ * @return ESP_OK, or ESP_ERR_INVALID_RESPONSE once the document is found to be invalid
+ */
+esp_err_t jsonstream_feed(jsonstream_t *js, const char *data, size_t len);
+
+/**
+ * @brief to be called when there is nothing more to feed
+ * @return ESP_OK if a whole document was parsed
+ */
+esp_err_t jsonstream_finish(jsonstream_t *js);
+
+/**
+ * @brief tells if the parser is at path, e.g. "timezone.offset" or "transitions[].toOffset"; "[]" matching any
+ * element of an array. During BEGIN and END events the path is the one of the container.
+ */
+bool jsonstream_path_is(const jsonstream_t *js, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_JSONSTREAM_H_ */
@@ -0,0 +1,157 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file ntp.h
+@author Tony Pottier
+@brief SNTP client (RFC 4330) measuring the offset between UTC and esp_timer
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Every synchronization sends NTP_SAMPLES requests to the server. Each answer gives the four timestamps
+of the exchange: t1 and t4 are read on esp_timer when the request leaves and when the answer arrives,
+t2 and t3 are the server's UTC time when it received the request and sent the answer. Then
+
+  offset = ((t2 - t1) + (t3 - t4)) / 2      UTC minus esp_timer
+  delay  = (t4 - t1) - (t3 - t2)            round trip spent on the network
+
+The offset is exact if the network delay is the same both ways, and off by at most delay / 2
+otherwise: the sample with the smallest delay is kept, the others were held up in a queue somewhere.
+
+The clock gets the offset rather than a time. It compares it with its own time at any moment, so
+neither the time the answer takes to reach the clock task nor the DS3231 second boundaries matter.
+
+*/
+
+#ifndef MAIN_NTP_H_
+#define MAIN_NTP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NTP_PORT						123
+
+/** @brief size of an NTP packet without extension fields */
+#define NTP_PACKET_SIZE					48
+
+/** @brief seconds from the NTP epoch (1900) to the unix epoch (1970) */
+#define NTP_UNIX_EPOCH_OFFSET			2208988800LL
+
+/** @brief requests sent by a synchronization, the best answer is kept */
+#define NTP_SAMPLES						CONFIG_CLOCK_SNTP_SAMPLES
+
+/** @brief time between two requests of a synchronization. 2s is what ntpd waits in burst mode */
+#define NTP_SAMPLE_INTERVAL_MS			2000
+
+/** @brief time an answer is waited for */
+#define NTP_TIMEOUT_MS					1000
+
+/** @brief time between two synchronizations */
+#define NTP_SYNC_INTERVAL_MS			(CONFIG_CLOCK_SNTP_INTERVAL * 60 * 1000)
+
+/** @brief time before trying again when no answer was usable */
+#define NTP_RETRY_INTERVAL_MS			(60 * 1000)
+
+/** @brief errors of this module, clear of the esp-idf component ranges */
+#define ESP_ERR_NTP_BASE				0xf000
+
+/** @brief the server asks to be left alone: a kiss-o'-death */
+#define ESP_ERR_NTP_KISS_OF_DEATH		(ESP_ERR_NTP_BASE + 0x01)
+
+/** @brief longest the server is left alone after a kiss-o'-death, and how long after a DENY or RSTR one.
+ * A RATE starts at NTP_SYNC_INTERVAL_MS and doubles with every kiss in a row */
+#define NTP_KISS_MAX_INTERVAL_MS		(24 * 60 * 60 * 1000)
+
+/** @brief one exchange with the server */
+typedef struct ntp_sample_t{
+	int64_t offset_us;							/**< UTC minus esp_timer */
+	int64_t delay_us;							/**< round trip, without the time the server held the request */
+}ntp_sample_t;
+
+/** @brief the outcome of a synchronization: the best sample */
+typedef struct ntp_result_t{
+	int64_t offset_us;
+	int64_t delay_us;
+	uint8_t samples;							/**< usable answers */
+	uint8_t stratum;
+	char kiss_code[5];							/**< of a kiss-o'-death, such as "RATE" or "DENY". Empty otherwise */
+}ntp_result_t;
+
+typedef struct ntp_stats_t{
+	uint32_t syncs;								/**< synchronizations with at least one usable answer */
+	uint32_t failures;
+	uint32_t requests;
+	uint32_t rejected;							/**< answers that timed out or were not valid */
+	uint32_t stale;								/**< late answers to earlier requests, skipped */
+	uint32_t kisses;							/**< kiss-o'-death received */
+	uint32_t min_delay_us;						/**< of the kept samples */
+	uint32_t max_delay_us;
+}ntp_stats_t;
+
+/**
+ * @brief creates the task that synchronizes with CONFIG_CLOCK_SNTP_SERVER. It waits for ntp_request
+ */
+esp_err_t ntp_init();
+
+/**
+ * @brief synchronizes as soon as possible, then every NTP_SYNC_INTERVAL_MS. Called when the station gets an IP address
+ */
+void ntp_request();
+
+/**
+ * @brief fills an NTP client request. nonce goes in the transmit timestamp, the server sends it back
+ * as the originate timestamp
+ */
+void ntp_packet_request(uint8_t packet[NTP_PACKET_SIZE], uint64_t nonce);
+
+/**
+ * @brief checks a server answer to the request carrying nonce and reads its receive (t2) and transmit (t3) timestamps
+ * in microseconds since the unix epoch
+ * @return ESP_OK, ESP_ERR_INVALID_RESPONSE if the packet is not a valid answer to the request, ESP_ERR_NTP_KISS_OF_DEATH
+ * if the server asks to be left alone (kiss-o'-death, the code is in the reference id), ESP_ERR_INVALID_STATE if it is
+ * not synchronized
+ */
+esp_err_t ntp_packet_parse(const uint8_t *packet, size_t len, uint64_t nonce, int64_t *t2, int64_t *t3, uint8_t *stratum);
+
+/**
+ * @brief offset and delay of an exchange. t1 and t4 are on esp_timer, t2 and t3 on the server's clock
+ */
+void ntp_sample_compute(int64_t t1, int64_t t2, int64_t t3, int64_t t4, ntp_sample_t *sample);
+
+/**
+ * @brief runs a synchronization: NTP_SAMPLES requests to server, the sample with the smallest delay is kept
+ * @return ESP_OK if at least one answer was usable, ESP_ERR_NTP_KISS_OF_DEATH if the server sent a kiss-o'-death
+ * (result->kiss_code tells which)
+ */
+esp_err_t ntp_query(const char *server, ntp_result_t *result);
+
+void ntp_get_stats(ntp_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_NTP_H_ */
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sleepmap.h
+@author Tony Pottier
+@brief Weekly occupancy bitmap: one bit per minute of the week, set when the clock should be asleep
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The sleepmodes are compiled into the map once, when they change. Whether the clock should be asleep
+at a given time is then a single bit test, whatever the number of sleepmodes. The map starts on
+Monday 00:00 like the days mask of a sleepmode.
+
+*/
+
+#ifndef MAIN_SLEEPMAP_H_
+#define MAIN_SLEEPMAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SLEEPMAP_MINUTES_PER_DAY		(24 * 60)
+#define SLEEPMAP_MINUTES_PER_WEEK		(7 * SLEEPMAP_MINUTES_PER_DAY)
+#define SLEEPMAP_WORDS					(SLEEPMAP_MINUTES_PER_WEEK / 32)
+
+/** @brief 10080 bits: 1260 bytes */
+typedef struct sleepmap_t{
+	uint32_t bits[SLEEPMAP_WORDS];
+}sleepmap_t;
+
+/**
+ * @brief empties the map: awake all week
+ */
+void sleepmap_clear(sleepmap_t *map);
+
+/**
+ * @brief marks the clock asleep from from to to on the days of the mask (bit 0 is Monday, bit 6 is Sunday).
+ * from and to are in seconds after midnight, rounded down to the minute. If to is earlier than from the
+ * sleep ends the next day, Sunday nights running into Monday.
+ */
+void sleepmap_add(sleepmap_t *map, uint8_t days, time_t from, time_t to);
+
+/**
+ * @brief true if the clock should be asleep at local time t. O(1).
+ */
+bool sleepmap_is_asleep(const sleepmap_t *map, time_t t);
+
+/**
+ * @brief finds the first minute after local time t where the state differs from the state at t
+ * @param next set to the local time the state changes
+ * @return false if the state never changes: the map is all awake or all asleep
+ */
+bool sleepmap_next_change(const sleepmap_t *map, time_t t, time_t *next);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_SLEEPMAP_H_ */
@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+
+@file temperature.h
+@author Tony Pottier
+@brief Background service reading the temperature of the DS3231 into a cache
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+The DS3231 measures its temperature on its own every 64 seconds. The service asks for a conversion
+every TEMPERATURE_INTERVAL_MS with the CONV bit, sleeps while it runs and checks BSY between naps, then
+reads the result. Nobody else waits on the bus for a temperature: the last reading and a history of
+averages are read from memory.
+
+*/
+
+#ifndef MAIN_TEMPERATURE_H_
+#define MAIN_TEMPERATURE_H_
+
+#include <stdint.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief time between two conversions */
+#define TEMPERATURE_INTERVAL_MS				(30 * 1000)
+
+/** @brief time between two checks of a running conversion. It takes 125ms, 200ms at most */
+#define TEMPERATURE_POLL_MS					50
+
+/** @brief a conversion still running after this is given up */
+#define TEMPERATURE_TIMEOUT_MS				1000
+
+/** @brief the history keeps the average of the readings of each period of this length */
+#define TEMPERATURE_HISTORY_PERIOD_S		300
+
+/** @brief periods of the history: a day */
+#define TEMPERATURE_HISTORY_SIZE			(24 * 3600 / TEMPERATURE_HISTORY_PERIOD_S)
+
+typedef struct temperature_reading_t{
+	float celsius;
+	int64_t timestamp_us;						/**< esp_timer time of the reading */
+}temperature_reading_t;
+
+typedef struct temperature_stats_t{
+	uint32_t conversions;
+	uint32_t errors;							/**< bus errors and conversions that timed out */
+	uint32_t max_conversion_ms;
+}temperature_stats_t;
+
+/**
+ * @brief creates the task reading the temperature
+ */
+esp_err_t temperature_init();
+
+/**
+ * @brief runs a conversion as soon as possible instead of at the end of the interval. A new aging offset is
+ * applied by the next conversion
+ */
+void temperature_request();
+
+/**
+ * @brief last reading
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if there was no reading yet
+ */
+esp_err_t temperature_get(temperature_reading_t *reading);
+
+/**
+ * @brief copies up to max averages of the history, oldest first, in quarters of a degree like the DS3231 gives them
+ * @param age_s seconds since the end of the period of the last one
+ * @return number of averages copied
+ */
+int temperature_get_history(int16_t *quarters, int max, uint32_t *age_s);
+
+void temperature_get_stats(temperature_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_TEMPERATURE_H_ */
@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file tz.h
+@author Tony Pottier
+@brief Offline evaluation of POSIX TZ rules and lookup of the compiled timezone database
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+newlib's TZ support is broken on the ESP32 (see clock.h), so rules are evaluated here instead.
+A rule is the POSIX TZ string of a zone, e.g. "CET-1CEST,M3.5.0,M10.5.0/3":
+@see https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap08.html
+
+The rules of every zone of timezones.json are compiled by tz_compile.py into tz.bin, which is
+embedded in flash. Zones such as Africa/Casablanca, whose future transitions are listed one by one in
+the tz database rather than following a rule, are flagged irregular and cannot be evaluated here.
+Layout, little endian:
+	header		"TZR1", u16 zone count, u16 bucket count (power of 2), u16 rule count, u16 0, u32 names size
+	buckets		u16[bucket count]: zone index + 1, 0 if empty. Open addressing on the FNV-1a hash of the name
+	zones		{ u32 hash, u16 name offset, u16 rule index | 0x8000 if irregular }[zone count]
+	rules		tz_rule_t[rule count], 32 bytes each
+	names		NUL terminated zone names
+
+*/
+
+#ifndef MAIN_TZ_H_
+#define MAIN_TZ_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief first four bytes of tz.bin */
+#define TZ_DATABASE_MAGIC				"TZR1"
+
+/** @brief time of day of a transition when a rule does not say: 02:00 */
+#define TZ_DEFAULT_RULE_TIME			(2 * 3600)
+
+/** @brief how a transition date is written in the rule */
+typedef enum tz_date_type_t{
+	TZ_DATE_NONE = 0,					/**< no daylight saving time */
+	TZ_DATE_JULIAN = 1,					/**< Jn: 1 to 365, February 29th is never counted */
+	TZ_DATE_ZERO_BASED = 2,				/**< n: 0 to 365, February 29th is counted in leap years */
+	TZ_DATE_MONTH_WEEK_DAY = 3			/**< Mm.w.d: day d (0 = Sunday) of week w (5 = last) of month m */
+}tz_date_type_t;
+
+/** @brief a transition date. Same layout as in tz.bin */
+typedef struct tz_date_t{
+	uint8_t type;
+	uint8_t month;
+	uint8_t week;
+	uint8_t wday;
+	uint16_t day;
+	int16_t reserved;
+	int32_t time;						/**< seconds after local midnight, -167h to 167h */
+}tz_date_t;
+
+/**
+ * @brief a compiled POSIX TZ rule. Offsets are in seconds east of UTC, the opposite of the
+ * POSIX sign convention, to match the offsets used everywhere else in the clock.
+ * start is in local standard time, end in local daylight saving time.
+ */
+typedef struct tz_rule_t{
+	int32_t std_offset;
+	int32_t dst_offset;
+	tz_date_t start;
+	tz_date_t end;
+}tz_rule_t;
+
+/** @brief a rule and the transitions of the year it was last evaluated for */
+typedef struct tz_t{
+	tz_rule_t rule;
+	time_t year_begin;					/**< UTC time of January 1st 00:00 local standard time of the cached year */
+	time_t year_end;					/**< same, for the following year */
+	time_t dst_start;					/**< UTC time daylight saving time starts in the cached year */
+	time_t dst_end;						/**< UTC time daylight saving time ends in the cached year */
+}tz_t;
+
+/** @brief a change of UTC offset */
+typedef struct tz_transition_t{
+	int32_t offset;
+	time_t timestamp;
+}tz_transition_t;
+
+/**
+ * @brief compiles a POSIX TZ string.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if the string is not a valid rule.
+ */
+esp_err_t tz_parse(const char *posix, tz_rule_t *rule);
+
+/**
+ * @brief looks up the rule of a zone such as "Europe/Paris" in the compiled database. O(1).
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if the zone is not in the database, ESP_ERR_NOT_SUPPORTED if it is irregular.
+ */
+esp_err_t tz_find(const char *name, tz_rule_t *rule);
+
+/**
+ * @brief prepares a tz_t for evaluation of rule. Nothing is cached until the first call to tz_offset.
+ */
+void tz_init(tz_t *tz, const tz_rule_t *rule);
+
+/**
+ * @brief UTC offset in seconds at a given UTC time. Constant time: transitions are computed once
+ * per year and cached in tz, after which a call is a couple of comparisons.
+ */
+int32_t tz_offset(tz_t *tz, time_t utc);
+
+/**
+ * @brief lists the changes of offset that happen after from, up to and including to, in chronological order.
+ * @return number of transitions written to out, at most max.
+ */
+int tz_transitions(tz_t *tz, time_t from, time_t to, tz_transition_t *out, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_TZ_H_ */
@@ -36,6 +36,7 @@ This is based of FozzTexx's public domain code on WS2812
 
 #include <stdint.h>
 #include <esp_err.h>
+#include "freertos/FreeRTOS.h" /* TickType_t */
 
 
 #ifdef __cplusplus
@@ -57,14 +58,52 @@ typedef union {
 } rgb_t;
 
 
+/** @brief pixel index meaning every pixel of the strip */
+#define WS2812_ALL_PIXELS		0xff
+
+/** @brief duration of the fade when the clock goes to sleep or wakes up */
+#define WS2812_SLEEP_FADE_MS	2000
+
+/**
+ * @brief effects applied on top of the pixel colors
+ */
+typedef enum ws2812_effect_t {
+	WS2812_EFFECT_NONE = 0,
+	WS2812_EFFECT_BREATHE = 1,	/* brightness slowly rises and falls */
+	WS2812_EFFECT_CYCLE = 2		/* rainbow moving across the strip */
+} ws2812_effect_t;
+
+typedef enum ws2812_message_type_t {
+	WS2812_MESSAGE_COLOR = 0,
+	WS2812_MESSAGE_EFFECT = 1,
+	WS2812_MESSAGE_BACKLIGHT = 2	/* wakes the task to pick up the pending backlight color */
+} ws2812_message_type_t;
+
 /**
  * @brief defines the type of message to be sent to the queue.
- * The WS2812 queue can only process color information for simplicity
+ * A color message fades one pixel (or all of them) to rgb in duration_ms. An effect message sets the
+ * effect, duration_ms is then its period.
  */
 typedef struct ws2812_message_t {
+	ws2812_message_type_t type;
 	rgb_t rgb;
+	uint8_t pixel;
+	uint16_t duration_ms;
+	ws2812_effect_t effect;
 } ws2812_message_t;
 
+/**
+ * @brief counters of the animation engine
+ */
+typedef struct ws2812_stats_t {
+	uint32_t frames_rendered;
+	uint32_t frames_sent;
+	uint32_t frames_skipped;	/* identical to the frame already shown */
+	uint32_t last_frame_us;
+	uint32_t max_frame_us;
+	uint64_t total_frame_us;
+} ws2812_stats_t;
+
 esp_err_t ws2812_init();
 
 
@@ -82,11 +121,34 @@ inline rgb_t ws2812_create_rgb(uint8_t r, uint8_t g, uint8_t b){
 }
 
 /**
- * @brief Sends the message to the ws2812 queue to process a color change
- * @return ESP_OK if success, ESP_FAIL if the queue was full or any other error
+ * @brief Changes the color of every pixel at once. Never waits: only the latest color not yet picked up by the
+ * ws2812 task is kept, earlier ones are simply replaced.
+ * @return ESP_OK if success, ESP_ERR_INVALID_STATE if the driver is not initialized
  */
 esp_err_t ws2812_set_backlight_color(rgb_t c);
 
+/**
+ * @brief Fades every pixel to color c over duration_ms
+ */
+esp_err_t ws2812_fade_backlight_color(rgb_t c, uint16_t duration_ms);
+
+/**
+ * @brief Fades a single pixel (or WS2812_ALL_PIXELS) to color c over duration_ms. A duration of 0 changes it at once.
+ */
+esp_err_t ws2812_fade_pixel_color(uint8_t pixel, rgb_t c, uint16_t duration_ms);
+
+/**
+ * @brief Sets the effect applied on top of the pixel colors. Never waits.
+ * @param period_ms length of a breath or of a full color cycle
+ * @return ESP_OK if success, ESP_FAIL if the queue was full
+ */
+esp_err_t ws2812_set_effect(ws2812_effect_t effect, uint16_t period_ms);
+
+/**
+ * @brief Copies the animation engine counters. Frame times are measured with esp_timer.
+ */
+void ws2812_get_stats(ws2812_stats_t *stats);
+
 /**
  * @brief helper for ws2812_set_backlight_color
  * @see ws2812_set_backlight_color
@@ -96,7 +158,26 @@ inline esp_err_t ws2812_set_backlight_color_rgb(uint8_t r, uint8_t g, uint8_t b)
 }
 
 
-void ws2812_set_colors(unsigned int length, rgb_t *array);
+/**
+ * @brief Hands a frame over to the driver without waiting for it to be sent.
+ * The frame is copied into the back buffer, which the RMT interrupt swaps in when the current
+ * transmission ends. If a frame was already waiting, it is replaced: only the latest one is shown.
+ * @return ESP_OK, or ESP_ERR_INVALID_ARG if length is bigger than WS2812_STRIP_SIZE
+ */
+esp_err_t ws2812_set_colors(unsigned int length, rgb_t *array);
+
+/**
+ * @brief Blocks until every submitted frame has been sent out to the strip.
+ * @return ESP_OK, or ESP_ERR_TIMEOUT
+ */
+esp_err_t ws2812_wait_idle(TickType_t xTicksToWait);
+
+
+/* easing functions used by the animations */
+float clamp(float d, float min, float max);
+float smoothstep(const float edge0, const float edge1, const float x);
+float impulse(float k, float x);
+float exp_step(float x, float k, float n);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,217 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file journal.c
+@author Tony Pottier
+@brief Journaled configuration store on top of NVS: only the fields that changed are written
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "journal.h"
+
+
+static const char TAG[] = "journal";
+
+static const char journal_base_key[] = "base";
+
+/** @brief starts the base and every record. In a record, bit i of fields is set if field i follows */
+typedef struct journal_header_t{
+	uint16_t generation;
+	uint16_t fields;
+}journal_header_t;
+
+
+size_t journal_blob_flash_size(size_t length){
+	/* blob index entry + data header entry + data rounded to whole entries */
+	return 2 * JOURNAL_NVS_ENTRY_SIZE + ((length + JOURNAL_NVS_ENTRY_SIZE - 1) / JOURNAL_NVS_ENTRY_SIZE) * JOURNAL_NVS_ENTRY_SIZE;
+}
+
+static void journal_record_key(char *key, int slot){
+	sprintf(key, "j%d", slot);
+}
+
+void journal_init(journal_t *journal, const char *name_space, const journal_field_t *fields, int field_count, size_t size){
+	memset(journal, 0x00, sizeof(journal_t));
+	journal->name_space = name_space;
+	journal->fields = fields;
+	journal->field_count = field_count < JOURNAL_MAX_FIELDS ? field_count : JOURNAL_MAX_FIELDS;
+	journal->size = size;
+}
+
+esp_err_t journal_load(journal_t *journal, void *data){
+
+	nvs_handle handle;
+	esp_err_t esp_err;
+	uint8_t buffer[sizeof(journal_header_t) + journal->size];
+	journal_header_t header;
+	size_t sz = sizeof(buffer);
+
+	esp_err = nvs_open(journal->name_space, NVS_READONLY, &handle);
+	if(esp_err != ESP_OK){
+		return esp_err;
+	}
+
+	esp_err = nvs_get_blob(handle, journal_base_key, buffer, &sz);
+	if(esp_err != ESP_OK || sz < sizeof(journal_header_t)){
+		nvs_close(handle);
+		return esp_err != ESP_OK ? esp_err : ESP_ERR_NVS_NOT_FOUND;
+	}
+
+	/* a base written by an older firmware can be shorter: the fields it did not have keep their default */
+	memcpy(&header, buffer, sizeof(journal_header_t));
+	memcpy(data, buffer + sizeof(journal_header_t), sz - sizeof(journal_header_t));
+	journal->generation = header.generation;
+
+	/* records are appended from slot 0: the first missing one, or one left over from a previous generation, ends the journal */
+	int slot;
+	for(slot = 0; slot < JOURNAL_MAX_RECORDS; slot++){
+		char key[8];
+		journal_record_key(key, slot);
+		sz = sizeof(buffer);
+		if(nvs_get_blob(handle, key, buffer, &sz) != ESP_OK || sz < sizeof(journal_header_t)){
+			break;
+		}
+		memcpy(&header, buffer, sizeof(journal_header_t));
+		if(header.generation != journal->generation){
+			break;
+		}
+
+		const uint8_t *p = buffer + sizeof(journal_header_t);
+		const uint8_t *end = buffer + sz;
+		for(int i = 0; i < journal->field_count; i++){
+			const journal_field_t *field = &journal->fields[i];
+			if(header.fields & (1u << i)){
+				if(p + field->size > end){
+					ESP_LOGW(TAG, "Record %d is truncated", slot);
+					break;
+				}
+				memcpy((uint8_t*)data + field->offset, p, field->size);
+				p += field->size;
+			}
+		}
+	}
+	journal->next_record = slot;
+	ESP_LOGI(TAG, "Loaded %s: generation %u, %d records", journal->name_space, journal->generation, slot);
+
+	nvs_close(handle);
+	return ESP_OK;
+}
+
+esp_err_t journal_compact(journal_t *journal, const void *data){
+
+	nvs_handle handle;
+	esp_err_t esp_err;
+	uint8_t buffer[sizeof(journal_header_t) + journal->size];
+	journal_header_t header = { .generation = (uint16_t)(journal->generation + 1), .fields = 0 };
+
+	esp_err = nvs_open(journal->name_space, NVS_READWRITE, &handle);
+	if(esp_err != ESP_OK){
+		return esp_err;
+	}
+
+	memcpy(buffer, &header, sizeof(journal_header_t));
+	memcpy(buffer + sizeof(journal_header_t), data, journal->size);
+	esp_err = nvs_set_blob(handle, journal_base_key, buffer, sizeof(buffer));
+	if(esp_err == ESP_OK){
+		esp_err = nvs_commit(handle);
+	}
+	if(esp_err != ESP_OK){
+		ESP_LOGE(TAG, "Compaction of %s failed with error: %s", journal->name_space, esp_err_to_name(esp_err));
+		nvs_close(handle);
+		return esp_err;
+	}
+
+	/* the records no longer match the generation of the base. Erasing them only gives the space back */
+	for(int slot = 0; slot < journal->next_record; slot++){
+		char key[8];
+		journal_record_key(key, slot);
+		nvs_erase_key(handle, key);
+	}
+	nvs_commit(handle);
+	nvs_close(handle);
+
+	journal->generation = header.generation;
+	journal->next_record = 0;
+	journal->stats.compactions++;
+	journal->stats.bytes_written += journal_blob_flash_size(sizeof(buffer));
+
+	return ESP_OK;
+}
+
+esp_err_t journal_write(journal_t *journal, const void *data, uint32_t dirty){
+
+	nvs_handle handle;
+	esp_err_t esp_err;
+	uint8_t buffer[sizeof(journal_header_t) + journal->size];
+	journal_header_t header = { .generation = journal->generation, .fields = 0 };
+	size_t length = sizeof(journal_header_t);
+
+	for(int i = 0; i < journal->field_count; i++){
+		if(dirty & (1u << i)){
+			const journal_field_t *field = &journal->fields[i];
+			memcpy(buffer + length, (const uint8_t*)data + field->offset, field->size);
+			length += field->size;
+			header.fields |= 1u << i;
+		}
+	}
+
+	if(header.fields == 0){
+		return ESP_OK;
+	}
+
+	/* a full journal, or a record as costly as the base itself, is better folded into a new base */
+	if(journal->next_record >= JOURNAL_MAX_RECORDS || journal_blob_flash_size(length) >= journal_blob_flash_size(sizeof(buffer))){
+		return journal_compact(journal, data);
+	}
+
+	memcpy(buffer, &header, sizeof(journal_header_t));
+
+	esp_err = nvs_open(journal->name_space, NVS_READWRITE, &handle);
+	if(esp_err != ESP_OK){
+		return esp_err;
+	}
+
+	char key[8];
+	journal_record_key(key, journal->next_record);
+	esp_err = nvs_set_blob(handle, key, buffer, length);
+	if(esp_err == ESP_OK){
+		esp_err = nvs_commit(handle);
+	}
+	nvs_close(handle);
+
+	if(esp_err != ESP_OK){
+		ESP_LOGE(TAG, "Record of %s failed with error: %s", journal->name_space, esp_err_to_name(esp_err));
+		return esp_err;
+	}
+
+	journal->next_record++;
+	journal->stats.records++;
+	journal->stats.bytes_written += journal_blob_flash_size(length);
+
+	return ESP_OK;
+}
@@ -0,0 +1,403 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file jsonstream.c
+@author Tony Pottier
+@brief Incremental JSON parser working in a fixed amount of memory
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include "jsonstream.h"
+
+
+typedef enum jsonstream_state_t{
+	JSONSTREAM_STATE_VALUE = 0,					/**< a value is expected */
+	JSONSTREAM_STATE_VALUE_OR_END,				/**< after [ */
+	JSONSTREAM_STATE_KEY_OR_END,				/**< after { */
+	JSONSTREAM_STATE_KEY,						/**< after , in an object */
+	JSONSTREAM_STATE_COLON,
+	JSONSTREAM_STATE_NEXT,						/**< after a value in a container: , or its end */
+	JSONSTREAM_STATE_STRING,
+	JSONSTREAM_STATE_ESCAPE,
+	JSONSTREAM_STATE_UNICODE,
+	JSONSTREAM_STATE_NUMBER,
+	JSONSTREAM_STATE_LITERAL,
+	JSONSTREAM_STATE_DONE,
+	JSONSTREAM_STATE_ERROR
+}jsonstream_state_t;
+
+
+static inline bool jsonstream_is_space(char c){
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void jsonstream_append(jsonstream_t *js, char c){
+	/* truncated beyond the buffer */
+	if(js->length < JSONSTREAM_MAX_STRING - 1){
+		js->buffer[js->length++] = c;
+	}
+}
+
+static void jsonstream_emit(jsonstream_t *js, jsonstream_event_t event, const jsonstream_value_t *value){
+	if(js->callback){
+		js->callback(js, event, value, js->ctx);
+	}
+}
+
+/** @brief a value is complete: what comes next depends on where it was */
+static void jsonstream_value_end(jsonstream_t *js){
+	if(js->depth == 0){
+		js->done = true;
+		js->state = JSONSTREAM_STATE_DONE;
+	}
+	else{
+		js->state = JSONSTREAM_STATE_NEXT;
+	}
+}
+
+static void jsonstream_begin(jsonstream_t *js, bool array){
+
+	if(js->depth >= JSONSTREAM_MAX_DEPTH){
+		js->state = JSONSTREAM_STATE_ERROR;
+		return;
+	}
+
+	jsonstream_value_t value = { .type = array ? JSONSTREAM_TYPE_ARRAY : JSONSTREAM_TYPE_OBJECT };
+	jsonstream_emit(js, JSONSTREAM_EVENT_BEGIN, &value);
+
+	jsonstream_level_t *level = &js->levels[js->depth++];
+	level->array = array;
+	level->index = 0;
+	level->key[0] = '\0';
+	js->state = array ? JSONSTREAM_STATE_VALUE_OR_END : JSONSTREAM_STATE_KEY_OR_END;
+}
+
+static void jsonstream_end(jsonstream_t *js, bool array){
+
+	if(js->depth == 0 || js->levels[js->depth - 1].array != array){
+		js->state = JSONSTREAM_STATE_ERROR;
+		return;
+	}
+
+	js->depth--;
+	jsonstream_value_t value = { .type = array ? JSONSTREAM_TYPE_ARRAY : JSONSTREAM_TYPE_OBJECT };
+	jsonstream_emit(js, JSONSTREAM_EVENT_END, &value);
+	jsonstream_value_end(js);
+}
+
+static void jsonstream_string_end(jsonstream_t *js){
+
+	js->buffer[js->length] = '\0';
+
+	if(js->key){
+		jsonstream_level_t *level = &js->levels[js->depth - 1];
+		size_t len = js->length < JSONSTREAM_MAX_KEY - 1 ? js->length : JSONSTREAM_MAX_KEY - 1;
+		memcpy(level->key, js->buffer, len);
+		level->key[len] = '\0';
+		js->state = JSONSTREAM_STATE_COLON;
+	}
+	else{
+		jsonstream_value_t value = { .type = JSONSTREAM_TYPE_STRING, .string = js->buffer };
+		jsonstream_emit(js, JSONSTREAM_EVENT_VALUE, &value);
+		jsonstream_value_end(js);
+	}
+}
+
+static void jsonstream_number_end(jsonstream_t *js){
+
+	char *end;
+	js->buffer[js->length] = '\0';
+
+	jsonstream_value_t value = { .type = JSONSTREAM_TYPE_NUMBER, .number = strtod(js->buffer, &end) };
+	if(end != js->buffer + js->length || js->length >= JSONSTREAM_MAX_STRING - 1){
+		/* not a number, or too long to be read without losing digits */
+		js->state = JSONSTREAM_STATE_ERROR;
+		return;
+	}
+
+	jsonstream_emit(js, JSONSTREAM_EVENT_VALUE, &value);
+	jsonstream_value_end(js);
+}
+
+static void jsonstream_literal_end(jsonstream_t *js){
+
+	jsonstream_value_t value;
+	js->buffer[js->length] = '\0';
+
+	if(strcmp(js->buffer, "true") == 0){
+		value.type = JSONSTREAM_TYPE_BOOL;
+		value.boolean = true;
+	}
+	else if(strcmp(js->buffer, "false") == 0){
+		value.type = JSONSTREAM_TYPE_BOOL;
+		value.boolean = false;
+	}
+	else if(strcmp(js->buffer, "null") == 0){
+		value.type = JSONSTREAM_TYPE_NULL;
+	}
+	else{
+		js->state = JSONSTREAM_STATE_ERROR;
+		return;
+	}
+
+	jsonstream_emit(js, JSONSTREAM_EVENT_VALUE, &value);
+	jsonstream_value_end(js);
+}
+
+/** @brief \uXXXX, stored as UTF-8. Surrogate pairs are not combined: the clock never needs them */
+static void jsonstream_unicode_end(jsonstream_t *js){
+	uint16_t u = js->unicode;
+	if(u < 0x80){
+		jsonstream_append(js, (char)u);
+	}
+	else if(u < 0x800){
+		jsonstream_append(js, (char)(0xc0 | (u >> 6)));
+		jsonstream_append(js, (char)(0x80 | (u & 0x3f)));
+	}
+	else{
+		jsonstream_append(js, (char)(0xe0 | (u >> 12)));
+		jsonstream_append(js, (char)(0x80 | ((u >> 6) & 0x3f)));
+		jsonstream_append(js, (char)(0x80 | (u & 0x3f)));
+	}
+	js->state = JSONSTREAM_STATE_STRING;
+}
+
+static int jsonstream_hex(char c){
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * @brief processes one character
+ * @return false if the character ended a number or a literal and has to be processed again
+ */
+static bool jsonstream_char(jsonstream_t *js, char c){
+
+	switch(js->state){
+
+		case JSONSTREAM_STATE_VALUE_OR_END:
+			if(c == ']'){
+				jsonstream_end(js, true);
+				break;
+			}
+			/* fall through */
+		case JSONSTREAM_STATE_VALUE:
+			if(jsonstream_is_space(c)) break;
+			js->length = 0;
+			if(c == '{'){
+				jsonstream_begin(js, false);
+			}
+			else if(c == '['){
+				jsonstream_begin(js, true);
+			}
+			else if(c == '"'){
+				js->key = false;
+				js->state = JSONSTREAM_STATE_STRING;
+			}
+			else if(c == '-' || (c >= '0' && c <= '9')){
+				jsonstream_append(js, c);
+				js->state = JSONSTREAM_STATE_NUMBER;
+			}
+			else if(c == 't' || c == 'f' || c == 'n'){
+				jsonstream_append(js, c);
+				js->state = JSONSTREAM_STATE_LITERAL;
+			}
+			else{
+				js->state = JSONSTREAM_STATE_ERROR;
+			}
+			break;
+
+		case JSONSTREAM_STATE_KEY_OR_END:
+			if(c == '}'){
+				jsonstream_end(js, false);
+				break;
+			}
+			/* fall through */
+		case JSONSTREAM_STATE_KEY:
+			if(jsonstream_is_space(c)) break;
+			if(c == '"'){
+				js->length = 0;
+				js->key = true;
+				js->state = JSONSTREAM_STATE_STRING;
+			}
+			else{
+				js->state = JSONSTREAM_STATE_ERROR;
+			}
+			break;
+
+		case JSONSTREAM_STATE_COLON:
+			if(jsonstream_is_space(c)) break;
+			js->state = (c == ':') ? JSONSTREAM_STATE_VALUE : JSONSTREAM_STATE_ERROR;
+			break;
+
+		case JSONSTREAM_STATE_NEXT:{
+			if(jsonstream_is_space(c)) break;
+			jsonstream_level_t *level = &js->levels[js->depth - 1];
+			if(c == ','){
+				if(level->array){
+					level->index++;
+					js->state = JSONSTREAM_STATE_VALUE;
+				}
+				else{
+					js->state = JSONSTREAM_STATE_KEY;
+				}
+			}
+			else if(c == '}' || c == ']'){
+				jsonstream_end(js, c == ']');
+			}
+			else{
+				js->state = JSONSTREAM_STATE_ERROR;
+			}
+			}
+			break;
+
+		case JSONSTREAM_STATE_STRING:
+			if(c == '"'){
+				jsonstream_string_end(js);
+			}
+			else if(c == '\\'){
+				js->state = JSONSTREAM_STATE_ESCAPE;
+			}
+			else if((unsigned char)c < 0x20){
+				js->state = JSONSTREAM_STATE_ERROR;
+			}
+			else{
+				jsonstream_append(js, c);
+			}
+			break;
+
+		case JSONSTREAM_STATE_ESCAPE:
+			js->state = JSONSTREAM_STATE_STRING;
+			switch(c){
+				case '"': case '\\': case '/': jsonstream_append(js, c); break;
+				case 'b': jsonstream_append(js, '\b'); break;
+				case 'f': jsonstream_append(js, '\f'); break;
+				case 'n': jsonstream_append(js, '\n'); break;
+				case 'r': jsonstream_append(js, '\r'); break;
+				case 't': jsonstream_append(js, '\t'); break;
+				case 'u':
+					js->unicode = 0;
+					js->unicode_digits = 0;
+					js->state = JSONSTREAM_STATE_UNICODE;
+					break;
+				default:
+					js->state = JSONSTREAM_STATE_ERROR;
+					break;
+			}
+			break;
+
+		case JSONSTREAM_STATE_UNICODE:{
+			int h = jsonstream_hex(c);
+			if(h < 0){
+				js->state = JSONSTREAM_STATE_ERROR;
+				break;
+			}
+			js->unicode = (uint16_t)((js->unicode << 4) | h);
+			if(++js->unicode_digits == 4){
+				jsonstream_unicode_end(js);
+			}
+			}
+			break;
+
+		case JSONSTREAM_STATE_NUMBER:
+			if((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E'){
+				jsonstream_append(js, c);
+				break;
+			}
+			jsonstream_number_end(js);
+			return false;
+
+		case JSONSTREAM_STATE_LITERAL:
+			if(c >= 'a' && c <= 'z'){
+				jsonstream_append(js, c);
+				break;
+			}
+			jsonstream_literal_end(js);
+			return false;
+
+		case JSONSTREAM_STATE_DONE:
+			if(!jsonstream_is_space(c)){
+				js->state = JSONSTREAM_STATE_ERROR;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return true;
+}
+
+void jsonstream_init(jsonstream_t *js, jsonstream_callback_t callback, void *ctx){
+	memset(js, 0x00, sizeof(jsonstream_t));
+	js->callback = callback;
+	js->ctx = ctx;
+	js->state = JSONSTREAM_STATE_VALUE;
+}
+
+esp_err_t jsonstream_feed(jsonstream_t *js, const char *data, size_t len){
+
+	size_t i = 0;
+	while(i < len && js->state != JSONSTREAM_STATE_ERROR){
+		if(jsonstream_char(js, data[i])){
+			i++;
+		}
+	}
+
+	return js->state == JSONSTREAM_STATE_ERROR ? ESP_ERR_INVALID_RESPONSE : ESP_OK;
+}
+
+esp_err_t jsonstream_finish(jsonstream_t *js){
+
+	/* a number or a literal at the top level only ends with the document */
+	if(js->state == JSONSTREAM_STATE_NUMBER || js->state == JSONSTREAM_STATE_LITERAL){
+		jsonstream_feed(js, " ", 1);
+	}
+
+	return js->done && js->state == JSONSTREAM_STATE_DONE ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
+
+bool jsonstream_path_is(const jsonstream_t *js, const char *path){
+
+	for(int i = 0; i < js->depth; i++){
+		const jsonstream_level_t *level = &js->levels[i];
+		if(level->array){
+			if(path[0] != '[' || path[1] != ']') return false;
+			path += 2;
+		}
+		else{
+			if(i > 0 && *path++ != '.') return false;
+			size_t n = strlen(level->key);
+			if(strncmp(path, level->key, n) != 0) return false;
+			path += n;
+			if(*path != '\0' && *path != '.' && *path != '[') return false;
+		}
+	}
+
+	return *path == '\0';
+}
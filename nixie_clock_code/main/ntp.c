@@ -0,0 +1,349 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file ntp.c
+@author Tony Pottier
+@brief SNTP client (RFC 4330) measuring the offset between UTC and esp_timer
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+*/
+
+#include <string.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "ntp.h"
+#include "clock.h"
+
+
+static const char TAG[] = "ntp";
+
+static TaskHandle_t ntp_task_handle = NULL;
+
+static ntp_stats_t ntp_stats;
+static portMUX_TYPE ntp_stats_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+static uint32_t ntp_read32(const uint8_t *p){
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t ntp_read64(const uint8_t *p){
+	return ((uint64_t)ntp_read32(p) << 32) | ntp_read32(p + 4);
+}
+
+static void ntp_write64(uint8_t *p, uint64_t v){
+	for(int i = 7; i >= 0; i--){
+		p[i] = (uint8_t)v;
+		v >>= 8;
+	}
+}
+
+/**
+ * @brief converts an NTP timestamp to microseconds since the unix epoch. Seconds with the top bit clear are taken
+ * to be in era 1, past 2036, as RFC 4330 suggests: this works from 1968 to 2104
+ */
+static int64_t ntp_timestamp_to_us(uint64_t timestamp){
+	int64_t seconds = (int64_t)(timestamp >> 32);
+	uint32_t fraction = (uint32_t)timestamp;
+	if((seconds & 0x80000000LL) == 0){
+		seconds += 0x100000000LL;
+	}
+	return (seconds - NTP_UNIX_EPOCH_OFFSET) * 1000000LL + (int64_t)(((uint64_t)fraction * 1000000ULL) >> 32);
+}
+
+
+void ntp_packet_request(uint8_t packet[NTP_PACKET_SIZE], uint64_t nonce){
+	memset(packet, 0x00, NTP_PACKET_SIZE);
+
+	/* leap indicator 0, version 4, mode 3 (client) */
+	packet[0] = (0 << 6) | (4 << 3) | 3;
+
+	/* the transmit timestamp need not be a time: a random value makes forged answers hard to match */
+	ntp_write64(packet + 40, nonce);
+}
+
+
+esp_err_t ntp_packet_parse(const uint8_t *packet, size_t len, uint64_t nonce, int64_t *t2, int64_t *t3, uint8_t *stratum){
+
+	if(len < NTP_PACKET_SIZE){
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	uint8_t leap = packet[0] >> 6;
+	uint8_t version = (packet[0] >> 3) & 0x07;
+	uint8_t mode = packet[0] & 0x07;
+	uint64_t originate = ntp_read64(packet + 24);
+	uint64_t receive = ntp_read64(packet + 32);
+	uint64_t transmit = ntp_read64(packet + 40);
+
+	/* mode 4 (server) answering this very request */
+	if(mode != 4 || version < 3 || version > 4 || originate != nonce){
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	/* stratum 0 is a kiss-o'-death: the timestamps of these need not be set */
+	*stratum = packet[1];
+	if(*stratum == 0){
+		return ESP_ERR_NTP_KISS_OF_DEATH;
+	}
+
+	if(receive == 0 || transmit == 0){
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+
+	/* leap indicator 3 is an unsynchronized server */
+	if(*stratum > 15 || leap == 3){
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	*t2 = ntp_timestamp_to_us(receive);
+	*t3 = ntp_timestamp_to_us(transmit);
+	return ESP_OK;
+}
+
+
+void ntp_sample_compute(int64_t t1, int64_t t2, int64_t t3, int64_t t4, ntp_sample_t *sample){
+	sample->offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+	sample->delay_us = (t4 - t1) - (t3 - t2);
+}
+
+
+esp_err_t ntp_query(const char *server, ntp_result_t *result){
+
+	memset(result, 0x00, sizeof(ntp_result_t));
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+	struct addrinfo *addr = NULL;
+	if(getaddrinfo(server, "123", &hints, &addr) != 0 || addr == NULL){
+		ESP_LOGW(TAG, "Cannot resolve %s", server);
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	int s = socket(addr->ai_family, addr->ai_socktype, 0);
+	if(s < 0){
+		freeaddrinfo(addr);
+		return ESP_FAIL;
+	}
+
+	uint8_t packet[NTP_PACKET_SIZE];
+	uint32_t requests = 0, rejected = 0, stale = 0;
+	bool kiss = false;
+
+	for(int i = 0; i < NTP_SAMPLES; i++){
+		if(i > 0){
+			vTaskDelay( pdMS_TO_TICKS(NTP_SAMPLE_INTERVAL_MS) );
+		}
+
+		uint64_t nonce = ((uint64_t)esp_random() << 32) | esp_random();
+		ntp_packet_request(packet, nonce);
+		requests++;
+
+		int64_t t1 = esp_timer_get_time();
+		if(sendto(s, packet, sizeof(packet), 0, addr->ai_addr, addr->ai_addrlen) != sizeof(packet)){
+			rejected++;
+			continue;
+		}
+
+		/* a late answer to an earlier request may be waiting in the socket: skip it and keep listening until
+		 * this request is answered or its time is up */
+		int64_t t4 = 0, t2, t3;
+		uint8_t stratum;
+		esp_err_t err = ESP_ERR_TIMEOUT;
+		for(;;){
+			int32_t left_ms = (int32_t)((t1 + (int64_t)NTP_TIMEOUT_MS * 1000 - esp_timer_get_time()) / 1000);
+			if(left_ms <= 0){
+				/* a zero SO_RCVTIMEO would wait forever */
+				break;
+			}
+			struct timeval timeout = { .tv_sec = left_ms / 1000, .tv_usec = (left_ms % 1000) * 1000 };
+			setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+			int len = recvfrom(s, packet, sizeof(packet), 0, NULL, NULL);
+			t4 = esp_timer_get_time();
+			if(len < 0){
+				break;
+			}
+			err = ntp_packet_parse(packet, len, nonce, &t2, &t3, &stratum);
+			if(err != ESP_ERR_INVALID_RESPONSE){
+				break;
+			}
+			stale++;
+			err = ESP_ERR_TIMEOUT;
+		}
+
+		if(err == ESP_ERR_NTP_KISS_OF_DEATH){
+			/* the server asks to be left alone: no more requests, ntp_task decides when to come back */
+			memcpy(result->kiss_code, packet + 12, 4);
+			result->kiss_code[4] = '\0';
+			ESP_LOGW(TAG, "%s sent a kiss-o'-death: %s", server, result->kiss_code);
+			kiss = true;
+			rejected++;
+			break;
+		}
+		if(err == ESP_ERR_INVALID_STATE){
+			/* the server is not fit: no more requests */
+			ESP_LOGW(TAG, "%s is unsynchronized", server);
+			rejected++;
+			break;
+		}
+		if(err != ESP_OK){
+			rejected++;
+			continue;
+		}
+
+		ntp_sample_t sample;
+		ntp_sample_compute(t1, t2, t3, t4, &sample);
+		ESP_LOGD(TAG, "sample %d: offset %lld us, delay %lld us", i, (long long)sample.offset_us, (long long)sample.delay_us);
+		if(sample.delay_us < 0){
+			rejected++;
+			continue;
+		}
+
+		/* the fastest exchange is the one the least held up one way more than the other */
+		if(result->samples == 0 || sample.delay_us < result->delay_us){
+			result->offset_us = sample.offset_us;
+			result->delay_us = sample.delay_us;
+			result->stratum = stratum;
+		}
+		result->samples++;
+	}
+
+	closesocket(s);
+	freeaddrinfo(addr);
+
+	portENTER_CRITICAL(&ntp_stats_spinlock);
+	ntp_stats.requests += requests;
+	ntp_stats.rejected += rejected;
+	ntp_stats.stale += stale;
+	if(kiss) ntp_stats.kisses++;
+	if(result->samples){
+		uint32_t delay = (uint32_t)result->delay_us;
+		if(ntp_stats.syncs == 0 || delay < ntp_stats.min_delay_us) ntp_stats.min_delay_us = delay;
+		if(delay > ntp_stats.max_delay_us) ntp_stats.max_delay_us = delay;
+		ntp_stats.syncs++;
+	}
+	else{
+		ntp_stats.failures++;
+	}
+	portEXIT_CRITICAL(&ntp_stats_spinlock);
+
+	if(kiss){
+		/* whatever was measured before, the server asked to be left alone */
+		return ESP_ERR_NTP_KISS_OF_DEATH;
+	}
+	return result->samples ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+
+void ntp_get_stats(ntp_stats_t *stats){
+	portENTER_CRITICAL(&ntp_stats_spinlock);
+	*stats = ntp_stats;
+	portEXIT_CRITICAL(&ntp_stats_spinlock);
+}
+
+
+/**
+ * @brief pdMS_TO_TICKS overflows on a day at 1000 Hz
+ */
+static TickType_t ntp_ms_to_ticks(uint32_t ms){
+	return (TickType_t)(((uint64_t)ms * configTICK_RATE_HZ) / 1000);
+}
+
+/**
+ * @brief freeRTOS task that synchronizes on request, then periodically
+ */
+static void ntp_task(void *pvParameter){
+
+	TickType_t wait = portMAX_DELAY;
+	ntp_result_t result;
+
+	/* after a kiss-o'-death the server is left alone until quiet_until, even if a synchronization is requested */
+	bool quiet = false;
+	TickType_t quiet_until = 0;
+	uint32_t kiss_interval_ms = 0;
+
+	for(;;) {
+		ulTaskNotifyTake(pdTRUE, wait);
+
+		if(quiet){
+			int32_t left = (int32_t)(quiet_until - xTaskGetTickCount());
+			if(left > 0){
+				wait = (TickType_t)left;
+				continue;
+			}
+			quiet = false;
+		}
+
+		esp_err_t err = ntp_query(CONFIG_CLOCK_SNTP_SERVER, &result);
+		if(err == ESP_OK){
+			ESP_LOGI(TAG, "offset %lld us, delay %lld us, %d samples, stratum %d",
+					(long long)result.offset_us, (long long)result.delay_us, result.samples, result.stratum);
+			clock_notify_sntp_response(&result);
+			wait = ntp_ms_to_ticks(NTP_SYNC_INTERVAL_MS);
+			kiss_interval_ms = 0;
+		}
+		else if(err == ESP_ERR_NTP_KISS_OF_DEATH){
+			/* DENY and RSTR ask to stop altogether, RATE (or anything else) to slow down: back off more every time */
+			if(strcmp(result.kiss_code, "DENY") == 0 || strcmp(result.kiss_code, "RSTR") == 0){
+				kiss_interval_ms = NTP_KISS_MAX_INTERVAL_MS;
+			}
+			else if(kiss_interval_ms == 0){
+				kiss_interval_ms = NTP_SYNC_INTERVAL_MS;
+			}
+			else{
+				kiss_interval_ms = kiss_interval_ms > NTP_KISS_MAX_INTERVAL_MS / 2 ? NTP_KISS_MAX_INTERVAL_MS : kiss_interval_ms * 2;
+			}
+			ESP_LOGW(TAG, "Leaving %s alone for %u min", CONFIG_CLOCK_SNTP_SERVER, (unsigned)(kiss_interval_ms / 60000));
+			wait = ntp_ms_to_ticks(kiss_interval_ms);
+			quiet_until = xTaskGetTickCount() + wait;
+			quiet = true;
+		}
+		else{
+			ESP_LOGW(TAG, "No usable answer from %s", CONFIG_CLOCK_SNTP_SERVER);
+			wait = pdMS_TO_TICKS(NTP_RETRY_INTERVAL_MS);
+		}
+	}
+}
+
+
+esp_err_t ntp_init(){
+	if(xTaskCreatePinnedToCore(&ntp_task, "ntp_task", 3072, NULL, CLOCK_TASK_PRIORITY-1, &ntp_task_handle, 1) != pdPASS){
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+
+void ntp_request(){
+	if(ntp_task_handle){
+		xTaskNotifyGive(ntp_task_handle);
+	}
+}
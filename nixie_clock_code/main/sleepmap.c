@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file sleepmap.c
+@author Tony Pottier
+@brief Weekly occupancy bitmap: one bit per minute of the week, set when the clock should be asleep
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+*/
+
+#include <string.h>
+#include "sleepmap.h"
+
+
+/** @brief minute of the week of local time t, 0 being Monday 00:00 */
+static int sleepmap_minute(time_t t){
+	int32_t days = (int32_t)(t / 86400);
+	int32_t seconds = (int32_t)(t % 86400);
+	if(seconds < 0){
+		seconds += 86400;
+		days--;
+	}
+	/* 1970-01-01 was a Thursday: day 3 of a week starting on Monday */
+	int wday = (int)(((days + 3) % 7 + 7) % 7);
+	return wday * SLEEPMAP_MINUTES_PER_DAY + seconds / 60;
+}
+
+static inline bool sleepmap_get(const sleepmap_t *map, int minute){
+	return (map->bits[minute >> 5] >> (minute & 31)) & 1;
+}
+
+/** @brief sets minutes [from, to[, to being at most SLEEPMAP_MINUTES_PER_WEEK */
+static void sleepmap_set_range(sleepmap_t *map, int from, int to){
+	while(from < to){
+		if((from & 31) == 0 && to - from >= 32){
+			map->bits[from >> 5] = 0xffffffff;
+			from += 32;
+		}
+		else{
+			map->bits[from >> 5] |= (uint32_t)1 << (from & 31);
+			from++;
+		}
+	}
+}
+
+void sleepmap_clear(sleepmap_t *map){
+	memset(map, 0x00, sizeof(sleepmap_t));
+}
+
+void sleepmap_add(sleepmap_t *map, uint8_t days, time_t from, time_t to){
+
+	int start = (int)(from / 60) % SLEEPMAP_MINUTES_PER_DAY;
+	int end = (int)(to / 60) % SLEEPMAP_MINUTES_PER_DAY;
+	int length = (end >= start) ? end - start : SLEEPMAP_MINUTES_PER_DAY - start + end;
+
+	for(int day = 0; day < 7; day++){
+		if(!(days & (1 << day))) continue;
+
+		int first = day * SLEEPMAP_MINUTES_PER_DAY + start;
+		int last = first + length;
+		if(last <= SLEEPMAP_MINUTES_PER_WEEK){
+			sleepmap_set_range(map, first, last);
+		}
+		else{
+			/* Sunday night into Monday morning */
+			sleepmap_set_range(map, first, SLEEPMAP_MINUTES_PER_WEEK);
+			sleepmap_set_range(map, 0, last - SLEEPMAP_MINUTES_PER_WEEK);
+		}
+	}
+}
+
+bool sleepmap_is_asleep(const sleepmap_t *map, time_t t){
+	return sleepmap_get(map, sleepmap_minute(t));
+}
+
+bool sleepmap_next_change(const sleepmap_t *map, time_t t, time_t *next){
+
+	const int minute = sleepmap_minute(t);
+	const uint32_t state = sleepmap_get(map, minute) ? 0xffffffff : 0;
+
+	/* word by word from the current minute, wrapping around the end of the week: at most 316 words */
+	int m = minute + 1;
+	for(int scanned = 0; scanned < SLEEPMAP_MINUTES_PER_WEEK; ){
+		int word = (m % SLEEPMAP_MINUTES_PER_WEEK) >> 5;
+		int bit = m & 31;
+		uint32_t diff = (map->bits[word] ^ state) >> bit;
+		if(diff){
+			int distance = scanned + __builtin_ctz(diff);
+			if(distance >= SLEEPMAP_MINUTES_PER_WEEK) break;
+			/* start of the minute the state changes, distance + 1 minutes after the minute of t */
+			*next = t - (t % 60 + 60) % 60 + (time_t)(distance + 1) * 60;
+			return true;
+		}
+		scanned += 32 - bit;
+		m += 32 - bit;
+	}
+
+	return false;
+}
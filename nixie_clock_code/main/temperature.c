@@ -0,0 +1,204 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+
+@file temperature.c
+@author Tony Pottier
+@brief Background service reading the temperature of the DS3231 into a cache
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+*/
+
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "ds3231.h"
+#include "temperature.h"
+
+
+static const char TAG[] = "temperature";
+
+static TaskHandle_t temperature_task_handle = NULL;
+
+/** @brief everything below is written by the task and read by anyone */
+static portMUX_TYPE temperature_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static temperature_reading_t temperature_last;
+static bool temperature_valid = false;
+static temperature_stats_t temperature_stats;
+
+/** @brief ring of averages, temperature_history_next is the slot of the next one */
+static int16_t temperature_history[TEMPERATURE_HISTORY_SIZE];
+static int temperature_history_count = 0;
+static int temperature_history_next = 0;
+
+/** @brief period being averaged, counted in TEMPERATURE_HISTORY_PERIOD_S since boot */
+static int64_t temperature_period = 0;
+static int32_t temperature_period_sum = 0;
+static uint16_t temperature_period_readings = 0;
+
+
+
+/**
+ * @brief runs a conversion and reads its result. The task sleeps while the DS3231 converts
+ */
+static esp_err_t temperature_convert(float *celsius, uint32_t *conversion_ms){
+
+	bool busy;
+	esp_err_t ret = ds3231_temperature_busy(&busy);
+
+	/* an automatic conversion is running: its result is just as fresh */
+	if(ret == ESP_OK && !busy){
+		ret = ds3231_start_temperature_conversion();
+	}
+
+	int64_t start = esp_timer_get_time();
+	while(ret == ESP_OK){
+		vTaskDelay( pdMS_TO_TICKS(TEMPERATURE_POLL_MS) );
+		ret = ds3231_temperature_busy(&busy);
+		if(ret != ESP_OK || !busy){
+			break;
+		}
+		if(esp_timer_get_time() - start > TEMPERATURE_TIMEOUT_MS * 1000LL){
+			ret = ESP_ERR_TIMEOUT;
+		}
+	}
+
+	if(ret == ESP_OK){
+		*conversion_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+		/* the whole register map for the price of one transaction: it refreshes the shadow copy as well */
+		ds3231_snapshot_t snapshot;
+		ret = ds3231_read_snapshot(&snapshot);
+		if(ret == ESP_OK){
+			*celsius = ds3231_snapshot_temperature(&snapshot);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief caches a reading and adds it to the average of its period. Called with temperature_spinlock held
+ */
+static void temperature_store(float celsius, int64_t now){
+
+	temperature_last.celsius = celsius;
+	temperature_last.timestamp_us = now;
+	temperature_valid = true;
+
+	/* a reading past the current period closes it */
+	int64_t period = now / (TEMPERATURE_HISTORY_PERIOD_S * 1000000LL);
+	if(period != temperature_period && temperature_period_readings){
+		temperature_history[temperature_history_next] = (int16_t)(temperature_period_sum / temperature_period_readings);
+		temperature_history_next = (temperature_history_next + 1) % TEMPERATURE_HISTORY_SIZE;
+		if(temperature_history_count < TEMPERATURE_HISTORY_SIZE){
+			temperature_history_count++;
+		}
+		temperature_period_sum = 0;
+		temperature_period_readings = 0;
+	}
+	temperature_period = period;
+	temperature_period_sum += (int32_t)lroundf(celsius * 4.0f);
+	temperature_period_readings++;
+}
+
+static void temperature_task(void *pvParameter){
+
+	for(;;){
+		float celsius;
+		uint32_t conversion_ms = 0;
+		esp_err_t ret = temperature_convert(&celsius, &conversion_ms);
+
+		portENTER_CRITICAL(&temperature_spinlock);
+		if(ret == ESP_OK){
+			temperature_stats.conversions++;
+			if(conversion_ms > temperature_stats.max_conversion_ms) temperature_stats.max_conversion_ms = conversion_ms;
+			temperature_store(celsius, esp_timer_get_time());
+		}
+		else{
+			temperature_stats.errors++;
+		}
+		portEXIT_CRITICAL(&temperature_spinlock);
+
+		if(ret != ESP_OK){
+			ESP_LOGW(TAG, "Conversion failed: %s", esp_err_to_name(ret));
+		}
+
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TEMPERATURE_INTERVAL_MS));
+	}
+
+	vTaskDelete( NULL );
+}
+
+esp_err_t temperature_init(){
+	if(temperature_task_handle == NULL){
+		if(xTaskCreate( &temperature_task, "temperature", 2048, NULL, tskIDLE_PRIORITY+2, &temperature_task_handle ) != pdPASS){
+			return ESP_ERR_NO_MEM;
+		}
+	}
+	return ESP_OK;
+}
+
+void temperature_request(){
+	if(temperature_task_handle){
+		xTaskNotifyGive(temperature_task_handle);
+	}
+}
+
+esp_err_t temperature_get(temperature_reading_t *reading){
+	esp_err_t ret = ESP_ERR_INVALID_STATE;
+	portENTER_CRITICAL(&temperature_spinlock);
+	if(temperature_valid){
+		*reading = temperature_last;
+		ret = ESP_OK;
+	}
+	portEXIT_CRITICAL(&temperature_spinlock);
+	return ret;
+}
+
+int temperature_get_history(int16_t *quarters, int max, uint32_t *age_s){
+
+	portENTER_CRITICAL(&temperature_spinlock);
+	int count = temperature_history_count < max ? temperature_history_count : max;
+	for(int i = 0; i < count; i++){
+		int slot = (temperature_history_next - count + i + TEMPERATURE_HISTORY_SIZE) % TEMPERATURE_HISTORY_SIZE;
+		quarters[i] = temperature_history[slot];
+	}
+	int64_t period = temperature_period;
+	portEXIT_CRITICAL(&temperature_spinlock);
+
+	/* the last average is that of the period before the current one */
+	*age_s = (uint32_t)(esp_timer_get_time() / 1000000LL - period * TEMPERATURE_HISTORY_PERIOD_S);
+
+	return count;
+}
+
+void temperature_get_stats(temperature_stats_t *stats){
+	portENTER_CRITICAL(&temperature_spinlock);
+	*stats = temperature_stats;
+	portEXIT_CRITICAL(&temperature_spinlock);
+}
@@ -0,0 +1,344 @@
+/*
+Copyright (c) 2020 Tony Pottier
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+@file tz.c
+@author Tony Pottier
+@brief Offline evaluation of POSIX TZ rules and lookup of the compiled timezone database
+
+@see https://idyl.io
+@see https://github.com/tonyp7/esp32-nixie-clock
+
+Dates are turned into day numbers with the days_from_civil / civil_from_days algorithms:
+@see http://howardhinnant.github.io/date_algorithms.html
+
+*/
+
+#include <string.h>
+#include <ctype.h>
+#include "tz.h"
+
+
+/* compiled timezone database, generated by tz_compile.py */
+extern const uint8_t tz_bin_start[] asm("_binary_tz_bin_start");
+extern const uint8_t tz_bin_end[]   asm("_binary_tz_bin_end");
+
+#define TZ_HEADER_SIZE					16
+#define TZ_ZONE_SIZE					8
+#define TZ_RULE_SIZE					32
+#define TZ_SECONDS_PER_DAY				86400
+
+/** @brief set in the rule index of zones whose transitions no POSIX rule can express */
+#define TZ_ZONE_IRREGULAR				0x8000
+
+
+static uint16_t tz_read_u16(const uint8_t *p){
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t tz_read_u32(const uint8_t *p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/** @brief FNV-1a, the hash tz_compile.py uses to place the zones in the buckets */
+static uint32_t tz_hash(const char *name){
+	uint32_t h = 0x811c9dc5;
+	while(*name){
+		h ^= (uint8_t)*name++;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+static int tz_is_leap_year(int year){
+	return (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
+}
+
+/** @brief days since 1970-01-01 of a date of the proleptic Gregorian calendar, month 1 to 12 */
+static int32_t tz_days_from_civil(int y, int m, int d){
+	y -= m <= 2;
+	const int era = (y >= 0 ? y : y - 399) / 400;
+	const int yoe = y - era * 400;
+	const int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/** @brief year of a day number: the inverse of tz_days_from_civil, without month and day */
+static int tz_year_from_days(int32_t z){
+	z += 719468;
+	const int32_t era = (z >= 0 ? z : z - 146096) / 146097;
+	const int32_t doe = z - era * 146097;
+	const int32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const int32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	const int32_t mp = (5 * doy + 2) / 153;
+	return (int)(yoe + era * 400 + (mp >= 10));
+}
+
+static int32_t tz_floor_div(time_t t, int32_t d){
+	return (int32_t)(t >= 0 ? t / d : -((-t + d - 1) / d));
+}
+
+/** @brief day number of a transition date in a given year */
+static int32_t tz_date_day(const tz_date_t *date, int year){
+
+	const int32_t jan1 = tz_days_from_civil(year, 1, 1);
+
+	switch(date->type){
+		case TZ_DATE_JULIAN:
+			return jan1 + date->day - 1 + ((date->day >= 60 && tz_is_leap_year(year)) ? 1 : 0);
+		case TZ_DATE_ZERO_BASED:
+			return jan1 + date->day;
+		default:{
+			static const uint8_t month_days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+			const int32_t first = tz_days_from_civil(year, date->month, 1);
+			const int first_wday = (int)(((first % 7) + 11) % 7); /* 1970-01-01 was a Thursday */
+			int mday = 1 + (date->wday - first_wday + 7) % 7 + (date->week - 1) * 7;
+			int length = month_days[date->month - 1] + ((date->month == 2 && tz_is_leap_year(year)) ? 1 : 0);
+			while(mday > length){
+				mday -= 7; /* week 5 is the last one, which may be the 4th */
+			}
+			return first + mday - 1;
+		}
+	}
+}
+
+/** @brief computes and caches the transitions of a year, in UTC */
+static void tz_load_year(tz_t *tz, int year){
+	const tz_rule_t *r = &tz->rule;
+
+	tz->year_begin = (time_t)tz_days_from_civil(year, 1, 1) * TZ_SECONDS_PER_DAY - r->std_offset;
+	tz->year_end = (time_t)tz_days_from_civil(year + 1, 1, 1) * TZ_SECONDS_PER_DAY - r->std_offset;
+	tz->dst_start = (time_t)tz_date_day(&r->start, year) * TZ_SECONDS_PER_DAY + r->start.time - r->std_offset;
+	tz->dst_end = (time_t)tz_date_day(&r->end, year) * TZ_SECONDS_PER_DAY + r->end.time - r->dst_offset;
+}
+
+static int tz_year_of(const tz_t *tz, time_t utc){
+	return tz_year_from_days(tz_floor_div(utc + tz->rule.std_offset, TZ_SECONDS_PER_DAY));
+}
+
+
+/** @brief zone abbreviation: at least 3 letters, or anything between < and > */
+static const char* tz_parse_name(const char *p){
+	const char *begin;
+	if(*p == '<'){
+		begin = ++p;
+		while(*p && *p != '>') p++;
+		return (*p == '>' && p - begin >= 3) ? p + 1 : NULL;
+	}
+	begin = p;
+	while(isalpha((unsigned char)*p)) p++;
+	return (p - begin >= 3) ? p : NULL;
+}
+
+static const char* tz_parse_number(const char *p, int max_digits, int32_t *out){
+	int32_t v = 0;
+	int n = 0;
+	while(isdigit((unsigned char)*p) && n < max_digits){
+		v = v * 10 + (*p++ - '0');
+		n++;
+	}
+	*out = v;
+	return n ? p : NULL;
+}
+
+/** @brief [+|-]hh[:mm[:ss]], in seconds */
+static const char* tz_parse_time(const char *p, int32_t max_hours, int32_t *out){
+	int32_t sign = 1, h, m = 0, s = 0;
+	if(*p == '+' || *p == '-'){
+		sign = (*p++ == '-') ? -1 : 1;
+	}
+	if(!(p = tz_parse_number(p, 3, &h)) || h > max_hours) return NULL;
+	if(*p == ':'){
+		if(!(p = tz_parse_number(p + 1, 2, &m)) || m > 59) return NULL;
+		if(*p == ':'){
+			if(!(p = tz_parse_number(p + 1, 2, &s)) || s > 59) return NULL;
+		}
+	}
+	*out = sign * (h * 3600 + m * 60 + s);
+	return p;
+}
+
+/** @brief Jn, n or Mm.w.d, optionally followed by /time */
+static const char* tz_parse_date(const char *p, tz_date_t *date){
+	int32_t a, b, c;
+
+	memset(date, 0x00, sizeof(tz_date_t));
+	if(*p == 'M'){
+		if(!(p = tz_parse_number(p + 1, 2, &a)) || *p != '.') return NULL;
+		if(!(p = tz_parse_number(p + 1, 1, &b)) || *p != '.') return NULL;
+		if(!(p = tz_parse_number(p + 1, 1, &c))) return NULL;
+		if(a < 1 || a > 12 || b < 1 || b > 5 || c > 6) return NULL;
+		date->type = TZ_DATE_MONTH_WEEK_DAY;
+		date->month = a;
+		date->week = b;
+		date->wday = c;
+	}
+	else if(*p == 'J'){
+		if(!(p = tz_parse_number(p + 1, 3, &a)) || a < 1 || a > 365) return NULL;
+		date->type = TZ_DATE_JULIAN;
+		date->day = a;
+	}
+	else{
+		if(!(p = tz_parse_number(p, 3, &a)) || a > 365) return NULL;
+		date->type = TZ_DATE_ZERO_BASED;
+		date->day = a;
+	}
+
+	date->time = TZ_DEFAULT_RULE_TIME;
+	if(*p == '/'){
+		p = tz_parse_time(p + 1, 167, &date->time);
+	}
+	return p;
+}
+
+esp_err_t tz_parse(const char *posix, tz_rule_t *rule){
+
+	const char *p = posix;
+	int32_t offset;
+
+	memset(rule, 0x00, sizeof(tz_rule_t));
+
+	/* standard time: POSIX offsets are west of UTC */
+	if(!(p = tz_parse_name(p)) || !(p = tz_parse_time(p, 24, &offset))) return ESP_ERR_INVALID_ARG;
+	rule->std_offset = -offset;
+	rule->dst_offset = rule->std_offset;
+	if(*p == '\0') return ESP_OK;
+
+	/* daylight saving time, one hour ahead unless said otherwise */
+	if(!(p = tz_parse_name(p))) return ESP_ERR_INVALID_ARG;
+	rule->dst_offset = rule->std_offset + 3600;
+	if(*p != '\0' && *p != ','){
+		if(!(p = tz_parse_time(p, 24, &offset))) return ESP_ERR_INVALID_ARG;
+		rule->dst_offset = -offset;
+	}
+
+	if(*p == '\0'){
+		/* no rule: implementation defined. Use the US one, like glibc */
+		p = "M3.2.0,M11.1.0";
+	}
+	else if(*p++ != ','){
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if(!(p = tz_parse_date(p, &rule->start)) || *p++ != ',') return ESP_ERR_INVALID_ARG;
+	if(!(p = tz_parse_date(p, &rule->end)) || *p != '\0') return ESP_ERR_INVALID_ARG;
+
+	return ESP_OK;
+}
+
+esp_err_t tz_find(const char *name, tz_rule_t *rule){
+
+	const uint8_t *db = tz_bin_start;
+	const size_t size = tz_bin_end - tz_bin_start;
+
+	if(size < TZ_HEADER_SIZE || memcmp(db, TZ_DATABASE_MAGIC, 4) != 0) return ESP_ERR_NOT_FOUND;
+
+	const uint16_t zone_count = tz_read_u16(db + 4);
+	const uint16_t bucket_count = tz_read_u16(db + 6);
+	const uint16_t rule_count = tz_read_u16(db + 8);
+	const uint32_t names_size = tz_read_u32(db + 12);
+	const uint8_t *buckets = db + TZ_HEADER_SIZE;
+	const uint8_t *zones = buckets + bucket_count * 2;
+	const uint8_t *rules = zones + zone_count * TZ_ZONE_SIZE;
+	const char *names = (const char*)(rules + rule_count * TZ_RULE_SIZE);
+
+	if((const uint8_t*)names + names_size > tz_bin_end || bucket_count == 0) return ESP_ERR_NOT_FOUND;
+
+	const uint32_t hash = tz_hash(name);
+	uint32_t b = hash & (bucket_count - 1);
+	uint16_t entry;
+	while((entry = tz_read_u16(buckets + b * 2)) != 0){
+		const uint8_t *zone = zones + (entry - 1) * TZ_ZONE_SIZE;
+		if(tz_read_u32(zone) == hash && strcmp(names + tz_read_u16(zone + 4), name) == 0){
+			const uint16_t index = tz_read_u16(zone + 6);
+			if(index & TZ_ZONE_IRREGULAR){
+				return ESP_ERR_NOT_SUPPORTED;
+			}
+			memcpy(rule, rules + index * TZ_RULE_SIZE, sizeof(tz_rule_t));
+			return ESP_OK;
+		}
+		b = (b + 1) & (bucket_count - 1);
+	}
+
+	return ESP_ERR_NOT_FOUND;
+}
+
+void tz_init(tz_t *tz, const tz_rule_t *rule){
+	memset(tz, 0x00, sizeof(tz_t));
+	tz->rule = *rule;
+	/* year_begin == year_end: the first tz_offset loads its year */
+}
+
+int32_t tz_offset(tz_t *tz, time_t utc){
+
+	if(tz->rule.start.type == TZ_DATE_NONE){
+		return tz->rule.std_offset;
+	}
+
+	if(utc < tz->year_begin || utc >= tz->year_end){
+		tz_load_year(tz, tz_year_of(tz, utc));
+	}
+
+	if(tz->dst_start < tz->dst_end){
+		/* northern hemisphere */
+		return (utc >= tz->dst_start && utc < tz->dst_end) ? tz->rule.dst_offset : tz->rule.std_offset;
+	}
+	else{
+		/* southern hemisphere: the year starts in daylight saving time */
+		return (utc >= tz->dst_end && utc < tz->dst_start) ? tz->rule.std_offset : tz->rule.dst_offset;
+	}
+}
+
+int tz_transitions(tz_t *tz, time_t from, time_t to, tz_transition_t *out, int max){
+
+	int count = 0;
+
+	if(tz->rule.start.type == TZ_DATE_NONE || tz->rule.std_offset == tz->rule.dst_offset){
+		return 0;
+	}
+
+	/* from a year early: a rule time past 24h can push a transition into the next year */
+	for(int year = tz_year_of(tz, from) - 1; count < max; year++){
+		tz_load_year(tz, year);
+		if(tz->year_begin > to) break;
+
+		tz_transition_t t[2] = {
+			{ .offset = tz->rule.dst_offset, .timestamp = tz->dst_start },
+			{ .offset = tz->rule.std_offset, .timestamp = tz->dst_end }
+		};
+		if(t[1].timestamp < t[0].timestamp){
+			tz_transition_t swap = t[0];
+			t[0] = t[1];
+			t[1] = swap;
+		}
+		for(int i = 0; i < 2 && count < max; i++){
+			if(t[i].timestamp > from && t[i].timestamp <= to){
+				out[count++] = t[i];
+			}
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+#
+# Compiles the zones listed in timezones.json into tz.bin, the rule table that
+# tz.c looks up by name. The POSIX TZ string of every zone is taken from the
+# footer of its TZif file (RFC 8536) in the tz database, parsed, and stored in
+# binary form so that nothing has to be parsed on the clock.
+#
+#   python3 tz_compile.py [--zoneinfo /usr/share/zoneinfo] [--since YEAR] [timezones.json] [tz.bin]
+#
+# A few zones (e.g. Africa/Casablanca, which follows Ramadan) have transitions
+# listed one by one in the tz database that no POSIX rule can express. Those are
+# flagged irregular: tz_find refuses them and the clock keeps asking the
+# transitions API. A zone is irregular if one of its listed transitions after
+# --since disagrees with its rule.
+#
+# tz.bin is committed, like iro.min.js.gz: run this again after a tzdata update.
+# The layout is described in include/tz.h. Everything is little endian.
+#
+
+import argparse
+import calendar
+import datetime
+import json
+import os
+import re
+import struct
+import sys
+
+MAGIC = b"TZR1"
+
+DATE_NONE = 0
+DATE_JULIAN = 1
+DATE_ZERO_BASED = 2
+DATE_MONTH_WEEK_DAY = 3
+
+DEFAULT_RULE_TIME = 2 * 3600
+
+ZONE_IRREGULAR = 0x8000
+
+
+def fnv1a(name):
+	h = 0x811c9dc5
+	for c in name.encode("ascii"):
+		h ^= c
+		h = (h * 0x01000193) & 0xffffffff
+	return h
+
+
+def read_tzif(path):
+	"""returns the POSIX footer and the listed transitions [(utc, offset)] of a TZif file"""
+	with open(path, "rb") as f:
+		data = f.read()
+	if not data.startswith(b"TZif") or data[4:5] < b"2":
+		raise ValueError("%s is not a TZif version 2+ file" % path)
+
+	def block_size(counts, time_size):
+		isut, isstd, leap, timecnt, typecnt, charcnt = counts
+		return timecnt * (time_size + 1) + typecnt * 6 + charcnt + leap * (time_size + 4) + isstd + isut
+
+	counts = struct.unpack(">6I", data[20:44])
+	p = 44 + block_size(counts, 4)
+	counts = struct.unpack(">6I", data[p + 20:p + 44])
+	p += 44
+	timecnt, typecnt = counts[3], counts[4]
+	times = struct.unpack(">%dq" % timecnt, data[p:p + 8 * timecnt])
+	indexes = data[p + 8 * timecnt:p + 9 * timecnt]
+	types = p + 9 * timecnt
+	offsets = [struct.unpack(">i", data[types + 6 * i:types + 6 * i + 4])[0] for i in range(typecnt)]
+
+	footer = data[p + block_size(counts, 8):].strip(b"\n").decode("ascii")
+	if not footer:
+		raise ValueError("%s has no POSIX footer" % path)
+	return footer, [(times[i], offsets[indexes[i]]) for i in range(timecnt)]
+
+
+class Parser(object):
+
+	def __init__(self, s):
+		self.s = s
+		self.i = 0
+
+	def error(self, what):
+		raise ValueError("'%s': %s at %d" % (self.s, what, self.i))
+
+	def peek(self):
+		return self.s[self.i] if self.i < len(self.s) else ""
+
+	def name(self):
+		if self.peek() == "<":
+			end = self.s.find(">", self.i)
+			if end < 0:
+				self.error("unterminated name")
+			n = self.s[self.i + 1:end]
+			self.i = end + 1
+		else:
+			m = re.match(r"[A-Za-z]+", self.s[self.i:])
+			n = m.group(0) if m else ""
+			self.i += len(n)
+		if len(n) < 3:
+			self.error("name too short")
+		return n
+
+	def hms(self, max_hours):
+		sign = 1
+		if self.peek() in "+-":
+			sign = -1 if self.peek() == "-" else 1
+			self.i += 1
+		m = re.match(r"(\d{1,3})(?::(\d{1,2}))?(?::(\d{1,2}))?", self.s[self.i:])
+		if not m:
+			self.error("time expected")
+		self.i += len(m.group(0))
+		h = int(m.group(1))
+		if h > max_hours:
+			self.error("hours out of range")
+		return sign * (h * 3600 + int(m.group(2) or 0) * 60 + int(m.group(3) or 0))
+
+	def number(self):
+		m = re.match(r"\d+", self.s[self.i:])
+		if not m:
+			self.error("number expected")
+		self.i += len(m.group(0))
+		return int(m.group(0))
+
+	def expect(self, c):
+		if self.peek() != c:
+			self.error("'%s' expected" % c)
+		self.i += 1
+
+	def date(self):
+		# (type, month, week, wday, day, time)
+		if self.peek() == "M":
+			self.i += 1
+			month = self.number()
+			self.expect(".")
+			week = self.number()
+			self.expect(".")
+			wday = self.number()
+			if not (1 <= month <= 12 and 1 <= week <= 5 and 0 <= wday <= 6):
+				self.error("bad Mm.w.d")
+			d = [DATE_MONTH_WEEK_DAY, month, week, wday, 0]
+		elif self.peek() == "J":
+			self.i += 1
+			day = self.number()
+			if not 1 <= day <= 365:
+				self.error("bad Jn")
+			d = [DATE_JULIAN, 0, 0, 0, day]
+		else:
+			day = self.number()
+			if not 0 <= day <= 365:
+				self.error("bad n")
+			d = [DATE_ZERO_BASED, 0, 0, 0, day]
+		t = DEFAULT_RULE_TIME
+		if self.peek() == "/":
+			self.i += 1
+			t = self.hms(167)
+		return tuple(d + [t])
+
+
+def parse_posix(s):
+	"""returns (std_offset, dst_offset, start, end) with offsets in seconds east of UTC"""
+	p = Parser(s)
+	p.name()
+	std = -p.hms(24)
+	if p.peek() == "":
+		none = (DATE_NONE, 0, 0, 0, 0, 0)
+		return (std, std, none, none)
+	p.name()
+	dst = std + 3600
+	if p.peek() not in ("", ","):
+		dst = -p.hms(24)
+	if p.peek() == "":
+		# no rule: the POSIX default is implementation defined, use the US one like glibc
+		start = (DATE_MONTH_WEEK_DAY, 3, 2, 0, 0, DEFAULT_RULE_TIME)
+		end = (DATE_MONTH_WEEK_DAY, 11, 1, 0, 0, DEFAULT_RULE_TIME)
+	else:
+		p.expect(",")
+		start = p.date()
+		p.expect(",")
+		end = p.date()
+	if p.peek() != "":
+		p.error("trailing characters")
+	return (std, dst, start, end)
+
+
+def days_from_civil(y, m, d):
+	return (datetime.date(y, m, d) - datetime.date(1970, 1, 1)).days
+
+
+def date_day(d, year):
+	kind, month, week, wday, day, _ = d
+	jan1 = days_from_civil(year, 1, 1)
+	if kind == DATE_JULIAN:
+		return jan1 + day - 1 + (1 if day >= 60 and calendar.isleap(year) else 0)
+	if kind == DATE_ZERO_BASED:
+		return jan1 + day
+	first = days_from_civil(year, month, 1)
+	mday = 1 + (wday - (first + 4) % 7) % 7 + (week - 1) * 7
+	while mday > calendar.monthrange(year, month)[1]:
+		mday -= 7
+	return first + mday - 1
+
+
+def rule_offset(rule, t):
+	"""the same evaluation as tz_offset"""
+	std, dst, start, end = rule
+	if start[0] == DATE_NONE:
+		return std
+	year = datetime.datetime.utcfromtimestamp(t + std).year if t + std >= 0 else 1970
+	s = date_day(start, year) * 86400 + start[5] - std
+	e = date_day(end, year) * 86400 + end[5] - dst
+	if s < e:
+		return dst if s <= t < e else std
+	return std if e <= t < s else dst
+
+
+def is_regular(rule, transitions, since):
+	return all(rule_offset(rule, t) == offset for t, offset in transitions if t >= since)
+
+
+def pack_rule(rule):
+	std, dst, start, end = rule
+	out = struct.pack("<ii", std, dst)
+	for d in (start, end):
+		out += struct.pack("<BBBBHhi", d[0], d[1], d[2], d[3], d[4], 0, d[5])
+	return out
+
+
+def compile_zones(zones, zoneinfo, since):
+	rules = []
+	rule_index = {}
+	entries = []
+	irregular = []
+	for name in zones:
+		posix, transitions = read_tzif(os.path.join(zoneinfo, name))
+		rule = parse_posix(posix)
+		if rule not in rule_index:
+			rule_index[rule] = len(rules)
+			rules.append(rule)
+		flags = 0
+		if not is_regular(rule, transitions, since):
+			flags = ZONE_IRREGULAR
+			irregular.append(name)
+		entries.append((name, rule_index[rule] | flags))
+
+	bucket_count = 1
+	while bucket_count < 2 * len(entries):
+		bucket_count *= 2
+
+	buckets = [0] * bucket_count
+	names = b""
+	zone_records = b""
+	for i, (name, r) in enumerate(entries):
+		h = fnv1a(name)
+		b = h & (bucket_count - 1)
+		while buckets[b]:
+			b = (b + 1) & (bucket_count - 1)
+		buckets[b] = i + 1
+		zone_records += struct.pack("<IHH", h, len(names), r)
+		names += name.encode("ascii") + b"\0"
+
+	if len(names) > 0xffff:
+		raise ValueError("name pool too large")
+
+	header = MAGIC + struct.pack("<HHHHI", len(entries), bucket_count, len(rules), 0, len(names))
+	blob = header + struct.pack("<%dH" % bucket_count, *buckets) + zone_records
+	blob += b"".join(pack_rule(r) for r in rules) + names
+	return blob, len(rules), irregular
+
+
+def main():
+	here = os.path.dirname(os.path.abspath(__file__))
+	ap = argparse.ArgumentParser(description="compile timezones.json into tz.bin")
+	ap.add_argument("--zoneinfo", default="/usr/share/zoneinfo")
+	ap.add_argument("--since", type=int, default=datetime.date.today().year,
+			help="year from which listed transitions must agree with the rule")
+	ap.add_argument("zones", nargs="?", default=os.path.join(here, "timezones.json"))
+	ap.add_argument("output", nargs="?", default=os.path.join(here, "tz.bin"))
+	args = ap.parse_args()
+
+	with open(args.zones) as f:
+		zones = json.load(f)
+
+	since = calendar.timegm((args.since, 1, 1, 0, 0, 0))
+	blob, rule_count, irregular = compile_zones(zones, args.zoneinfo, since)
+	with open(args.output, "wb") as f:
+		f.write(blob)
+
+	print("%s: %d zones, %d rules, %d bytes" % (os.path.basename(args.output), len(zones), rule_count, len(blob)))
+	if irregular:
+		print("irregular since %d: %s" % (args.since, " ".join(irregular)))
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -33,12 +33,14 @@ Contains page logic handling web app functionalities
 #include <esp_http_server.h>
 #include <sys/param.h> /* for the MIN macro */
 #include <esp_err.h>
+#include <esp_timer.h>
 #include <cJSON.h>
 #include <http_app.h>
 
 #include "ws2812.h"
 #include "display.h"
 #include "clock.h"
+#include "temperature.h"
 #include "webapp.h"
 
 
@@ -62,7 +64,7 @@ extern const uint8_t timezones_json_end[] asm("_binary_timezones_json_end");
 /* const httpd related values stored in ROM */
 const static char http_200_hdr[] = "200 OK";
 const static char http_400_hdr[] = "400 Bad Request";
-//const static char http_503_hdr[] = "503 Service Unavailable";
+const static char http_503_hdr[] = "503 Service Unavailable";
 const static char http_content_type_html[] = "text/html";
 const static char http_content_type_txt[] = "text/plain";
 const static char http_content_type_js[] = "text/javascript";
@@ -73,13 +75,42 @@ const static char http_cache_control_no_cache[] = "no-store, no-cache, must-reva
 const static char http_cache_control_cache[] = "public, max-age=31536000";
 const static char http_pragma_hdr[] = "Pragma";
 const static char http_pragma_no_cache[] = "no-cache";
+const static char http_retry_after_hdr[] = "Retry-After";
+const static char http_retry_after_busy[] = "1";
 
 const static char TAG[] = "webapp";
 
+/** @brief display_transition_t as read and written by /display/ and /config/ */
+const static char *webapp_transition_names[] = { "none", "crossfade", "roll" };
+#define WEBAPP_TRANSITION_COUNT		(sizeof(webapp_transition_names) / sizeof(webapp_transition_names[0]))
 
 
 
 
+
+/**
+ * @brief answers a change the clock could not take because it is busy. The change can simply be sent again
+ */
+static esp_err_t webapp_send_busy(httpd_req_t *req){
+    httpd_resp_set_status(req, http_503_hdr);
+    httpd_resp_set_hdr(req, http_retry_after_hdr, http_retry_after_busy);
+    httpd_resp_send(req, NULL, 0);
+    return ESP_FAIL;
+}
+
+/**
+ * @return false if name is not one of webapp_transition_names
+ */
+static bool webapp_parse_transition(const char *name, display_transition_t *transition){
+    for(size_t i = 0; i < WEBAPP_TRANSITION_COUNT; i++){
+        if(strcmp(name, webapp_transition_names[i]) == 0){
+            *transition = (display_transition_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
 static cJSON* webapp_get_display_cjson(display_config_t *display){
 
     cJSON *root = cJSON_CreateObject();
@@ -89,6 +120,9 @@ static cJSON* webapp_get_display_cjson(display_config_t *display){
     cJSON_AddNumberToObject( rgb, "g", display->led_color.g);
     cJSON_AddNumberToObject( rgb, "b", display->led_color.b);
     cJSON_AddItemToObject(root, "led_color", rgb);
+    cJSON_AddNumberToObject( root, "tube_brightness", display->tube_brightness);
+    /* same strings as POST /display/ takes: a GET can be posted back as is */
+    cJSON_AddStringToObject( root, "transition", display->transition < WEBAPP_TRANSITION_COUNT ? webapp_transition_names[display->transition] : webapp_transition_names[DISPLAY_TRANSITION_NONE]);
 
     return root;
 }
@@ -209,6 +243,40 @@ static char* webapp_get_sleepmodes_json(sleepmodes_t sleepmodes){
 	return str_json;
 }
 
+/**
+ * @brief the cached temperature and its history, oldest first, in degrees. Ages are in seconds.
+ * {"celsius":24.25,"age":12,"period":300,"history_age":95,"history":[23.75,24,...]}
+ * @return NULL if there was no reading yet
+ */
+static char* webapp_get_temperature_json(){
+
+	temperature_reading_t reading;
+	if(temperature_get(&reading) != ESP_OK){
+		return NULL;
+	}
+
+	int16_t quarters[TEMPERATURE_HISTORY_SIZE];
+	uint32_t history_age;
+	int count = temperature_get_history(quarters, TEMPERATURE_HISTORY_SIZE, &history_age);
+
+	cJSON *root = cJSON_CreateObject();
+	cJSON_AddNumberToObject( root, "celsius", reading.celsius );
+	cJSON_AddNumberToObject( root, "age", (double)((esp_timer_get_time() - reading.timestamp_us) / 1000000LL) );
+	cJSON_AddNumberToObject( root, "period", TEMPERATURE_HISTORY_PERIOD_S );
+	cJSON_AddNumberToObject( root, "history_age", history_age );
+	cJSON *history = cJSON_CreateArray();
+	for(int i = 0; i < count; i++){
+		cJSON_AddItemToArray( history, cJSON_CreateNumber( quarters[i] / 4.0 ) );
+	}
+	cJSON_AddItemToObject( root, "history", history );
+
+	/* a day of history: not indented */
+	char* str_json = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+
+	return str_json;
+}
+
 static esp_err_t webapp_get_hander(httpd_req_t *req){
 
     if(strcmp(req->uri, "/") == 0){
@@ -299,6 +367,27 @@ static esp_err_t webapp_get_hander(httpd_req_t *req){
             return ESP_FAIL;
         }
     }
+    else if(strcmp(req->uri, "/temperature/") == 0){
+
+        char* str_json = webapp_get_temperature_json();
+
+        if(str_json){
+
+            httpd_resp_set_status(req, http_200_hdr);
+            httpd_resp_set_type(req, http_content_type_json);
+            httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+            httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+            httpd_resp_send(req, str_json, strlen(str_json));
+
+            free(str_json);
+
+            return ESP_OK;
+        }
+        else{
+            /* no reading yet: the first conversion is done within a second of boot */
+            return webapp_send_busy(req);
+        }
+    }
     else{
 
         httpd_resp_send_404(req);
@@ -400,10 +489,13 @@ static esp_err_t webapp_post_handler(httpd_req_t *req){
 
         if(strcmp(timezone->valuestring, conf.timezone.name) != 0){
             /* timezone change!*/
-            clock_notify_new_timezone(timezone->valuestring);
+            ret = clock_notify_new_timezone(timezone->valuestring);
         }
 
         cJSON_Delete(json);
+        if(ret != ESP_OK){
+            return webapp_send_busy(req);
+        }
         return ret;
 
     }
@@ -473,7 +565,10 @@ static esp_err_t webapp_post_handler(httpd_req_t *req){
         if(ret == ESP_OK){
 
             /* send sleepmode over to the clock */
-            clock_notify_new_sleepmodes(sleepmodes);
+            if(clock_notify_new_sleepmodes(sleepmodes) != ESP_OK){
+                free(content);
+                return webapp_send_busy(req);
+            }
 
             /* web answer */
             httpd_resp_set_status(req, http_200_hdr);
@@ -493,8 +588,9 @@ static esp_err_t webapp_post_handler(httpd_req_t *req){
     }
     else if(strcmp(req->uri, "/backlights/") == 0){
 
-        /* read body buffer. The message should be { r: 123, g: 123, b: 123 } that is to say never more than 30 chars. */
-        const size_t buffer_size = 30;
+        /* read body buffer. The message should be { r: 123, g: 123, b: 123 } optionally followed by an effect
+         * such as , effect: "breathe", period: 4000 that is to say never more than 80 chars. */
+        const size_t buffer_size = 80;
         char content[buffer_size];
         esp_err_t ret = ESP_OK;
         memset(content, 0x00, buffer_size);
@@ -550,11 +646,29 @@ static esp_err_t webapp_post_handler(httpd_req_t *req){
             rgb.g = (uint8_t)g->valueint;
             rgb.b = (uint8_t)b->valueint;
 
+            /* optional animation: "none", "breathe" or "cycle" */
+            const cJSON *effect = cJSON_GetObjectItemCaseSensitive(json, "effect");
+            const cJSON *period = cJSON_GetObjectItemCaseSensitive(json, "period");
+            if(cJSON_IsString(effect)){
+                ws2812_effect_t e = WS2812_EFFECT_NONE;
+                uint16_t period_ms = (cJSON_IsNumber(period) && period->valueint > 0 && period->valueint <= UINT16_MAX) ? (uint16_t)period->valueint : 4000;
+                if(strcmp(effect->valuestring, "breathe") == 0) e = WS2812_EFFECT_BREATHE;
+                else if(strcmp(effect->valuestring, "cycle") == 0) e = WS2812_EFFECT_CYCLE;
+                ret = ws2812_set_effect(e, period_ms);
+            }
+
             /* free json object */
             cJSON_Delete(json);
 
+            if(ret != ESP_OK){
+                return webapp_send_busy(req);
+            }
+
+            /* the color is shown right away. The clock only keeps it for the config: latest wins, this never waits */
             ret = ws2812_set_backlight_color(rgb);
-            clock_notify_new_backlight_color(rgb);
+            if(ret == ESP_OK && clock_notify_new_backlight_color(rgb) != ESP_OK){
+                return webapp_send_busy(req);
+            }
             if(ret == ESP_OK){
 
                 httpd_resp_set_status(req, http_200_hdr);
@@ -578,6 +692,70 @@ static esp_err_t webapp_post_handler(httpd_req_t *req){
         }
 
     } /* if(strcmp(req->uri, "/backlights/") == 0) */
+    else if(strcmp(req->uri, "/display/") == 0){
+
+        /* read body buffer. The message should be { "brightness": 100, "transition": "crossfade" } with either field
+         * being optional, that is to say never more than 60 chars. */
+        const size_t buffer_size = 60;
+        char content[buffer_size];
+        memset(content, 0x00, buffer_size);
+
+        /* Truncate if content length larger than the buffer */
+        size_t recv_size = MIN(req->content_len, sizeof(content));
+
+        int read_count = httpd_req_recv(req, content, recv_size);
+        if (read_count <= 0) {  /* 0 return value indicates connection closed */
+            if (read_count == HTTPD_SOCK_ERR_TIMEOUT) {
+                httpd_resp_send_408(req);
+            }
+            else {
+                httpd_resp_send_500(req);
+            }
+            return ESP_FAIL;
+        }
+
+        /* avoids a buffer overflow parsing the string if the content is bigger than the buffer size */
+        content[buffer_size - 1] = '\0';
+
+        cJSON *json = cJSON_Parse(content);
+        const cJSON *brightness = cJSON_GetObjectItemCaseSensitive(json, "brightness");
+        const cJSON *transition = cJSON_GetObjectItemCaseSensitive(json, "transition");
+        bool valid_brightness = cJSON_IsNumber(brightness) && brightness->valueint >= 0 && brightness->valueint <= DISPLAY_BRIGHTNESS_MAX;
+        display_transition_t transition_value = DISPLAY_TRANSITION_NONE;
+        bool valid_transition = cJSON_IsString(transition) && webapp_parse_transition(transition->valuestring, &transition_value);
+        esp_err_t ret = ESP_OK;
+
+        /* a transition that is there but not understood fails the whole request, before anything is applied */
+        bool valid = (valid_brightness || valid_transition) && (transition == NULL || valid_transition);
+
+        /* the clock task applies the changes (the hardware does the fade) and saves them */
+        if(valid && valid_brightness){
+            ret = clock_notify_new_tube_brightness((uint8_t)brightness->valueint);
+        }
+
+        if(valid && valid_transition && ret == ESP_OK){
+            ret = clock_notify_new_display_transition(transition_value);
+        }
+
+        /* free json object. cJSON_Delete is fine with NULL if the parsing failed */
+        cJSON_Delete(json);
+
+        if(ret != ESP_OK){
+            return webapp_send_busy(req);
+        }
+        else if(valid){
+            httpd_resp_set_status(req, http_200_hdr);
+            httpd_resp_send(req, NULL, 0);
+            return ESP_OK;
+        }
+        else{
+            /* bad request */
+            httpd_resp_set_status(req, http_400_hdr);
+            httpd_resp_send(req, NULL, 0);
+            return ESP_FAIL;
+        }
+
+    } /* if(strcmp(req->uri, "/display/") == 0) */
 
     return ESP_OK;
 }
@@ -46,6 +46,7 @@ This is based of FozzTexx's public domain code on WS2812
 #include <esp_intr_alloc.h>
 #include <driver/rmt.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 
 
 #include "ws2812.h"
@@ -67,7 +68,36 @@ This is based of FozzTexx's public domain code on WS2812
 
 #define WS2812_RMT_CHANNEL				0
 
-#define WS2812_QUEUE_SIZE				3
+#if CONFIG_WS2812_ONE_SHOT
+/** @brief RMT ticks for a duration in ns, as an integer constant usable in initializers */
+#define WS2812_TICKS(ns)				((uint32_t)((ns) / (DURATION * DIVIDER)))
+
+/** @brief pulse pairs for a 0 and a 1 bit, in the raw layout of a RMT memory entry */
+#define WS2812_SYMBOL_0					(WS2812_TICKS(350) | (1u << 15) | (WS2812_TICKS(900) << 16))
+#define WS2812_SYMBOL_1					(WS2812_TICKS(900) | (1u << 15) | (WS2812_TICKS(350) << 16))
+
+/** @brief one pulse pair per bit plus the zero entry that marks the end of the transmission */
+#define WS2812_FRAME_SYMBOLS			(WS2812_STRIP_SIZE * 3 * 8 + 1)
+
+/** @brief RMT memory is made of 64 entries blocks. A channel can borrow the blocks of the channels after it. */
+#define WS2812_MEM_BLOCKS				((WS2812_FRAME_SYMBOLS + 63) / 64)
+
+#if WS2812_RMT_CHANNEL + WS2812_MEM_BLOCKS > 8
+#error "WS2812_STRIP_SIZE is too big to send a frame in one shot"
+#endif
+
+#define WS2812_LUT_SYMBOL(b, bit)		{ .val = (((b) >> (bit)) & 0x01) ? WS2812_SYMBOL_1 : WS2812_SYMBOL_0 }
+#define WS2812_LUT_ROW(b)				{ WS2812_LUT_SYMBOL(b, 7), WS2812_LUT_SYMBOL(b, 6), WS2812_LUT_SYMBOL(b, 5), WS2812_LUT_SYMBOL(b, 4), \
+										  WS2812_LUT_SYMBOL(b, 3), WS2812_LUT_SYMBOL(b, 2), WS2812_LUT_SYMBOL(b, 1), WS2812_LUT_SYMBOL(b, 0) }
+#define WS2812_LUT_4(b)					WS2812_LUT_ROW(b), WS2812_LUT_ROW((b) + 1), WS2812_LUT_ROW((b) + 2), WS2812_LUT_ROW((b) + 3)
+#define WS2812_LUT_16(b)				WS2812_LUT_4(b), WS2812_LUT_4((b) + 4), WS2812_LUT_4((b) + 8), WS2812_LUT_4((b) + 12)
+#define WS2812_LUT_64(b)				WS2812_LUT_16(b), WS2812_LUT_16((b) + 16), WS2812_LUT_16((b) + 32), WS2812_LUT_16((b) + 48)
+#endif
+
+#define WS2812_QUEUE_SIZE				8
+
+/** @brief frame period in RTOS ticks. The frame rate is rounded to a whole number of ticks. */
+#define WS2812_FRAME_PERIOD				( (configTICK_RATE_HZ / CONFIG_WS2812_FRAME_RATE) > 0 ? (configTICK_RATE_HZ / CONFIG_WS2812_FRAME_RATE) : 1 )
 
 typedef union {
   struct {
@@ -79,19 +109,80 @@ typedef union {
   uint32_t val;
 } rmt_pulse_pair_t;
 
+/**
+ * @brief GRB frames handed over to the RMT. ws2812_front is the one being sent out by the ISR,
+ * the other one is where producers write the next frame.
+ */
+static uint8_t ws2812_frames[2][WS2812_STRIP_SIZE * 3];
+static unsigned int ws2812_frames_len[2] = { 0, 0 };
+static volatile unsigned int ws2812_front = 0;
+
+#if CONFIG_WS2812_ONE_SHOT
+/**
+ * @brief byte to RMT symbols lookup table, MSB first. Generated at compile time and kept in flash.
+ */
+static const rmt_pulse_pair_t ws2812_lut[256][8] = {
+	WS2812_LUT_64(0), WS2812_LUT_64(64), WS2812_LUT_64(128), WS2812_LUT_64(192)
+};
+
+/** @brief the frames above, encoded as RMT symbols ready to be copied in the channel memory */
+static rmt_pulse_pair_t ws2812_symbols[2][WS2812_FRAME_SYMBOLS];
+#endif
+
+/** @brief true when the back frame is complete and waits for the end of the current transmission */
+static volatile bool ws2812_pending = false;
+
+/** @brief true from tx_start until the ISR finds no pending frame at tx_end */
+static volatile bool ws2812_busy = false;
+
+/** @brief protects the front/back flip between producers and the ISR */
+static portMUX_TYPE ws2812_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
 static uint8_t *ws2812_buffer = NULL;
 static unsigned int ws2812_pos, ws2812_len, ws2812_half;
-static xSemaphoreHandle ws2812_sem = NULL;
+
+/** @brief given by the ISR every time the pipeline goes idle */
+static SemaphoreHandle_t ws2812_sem = NULL;
 static intr_handle_t rmt_intr_handle = NULL;
 static rmt_pulse_pair_t ws2812_bits[2];
+
+/** @brief serializes producers writing the back frame */
 static SemaphoreHandle_t ws2812_mutex = NULL;
 
 static const char TAG[] = "ws2812";
 
 QueueHandle_t ws2812_queue = NULL; 
 
-/* the actual array holding the values of each backlight pixel */
-static rgb_t *ws2812_pixels = NULL;
+/** @brief backlight color waiting to be picked up by the task: latest wins */
+static rgb_t ws2812_backlight_color;
+static bool ws2812_backlight_pending = false;
+static portMUX_TYPE ws2812_backlight_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief keyframe of a single pixel: a fade from a color to another
+ */
+typedef struct ws2812_pixel_t{
+	rgb_t from;
+	rgb_t to;
+	rgb_t current;
+	int64_t start_us;
+	uint32_t duration_us;
+}ws2812_pixel_t;
+
+/**
+ * @brief state of the animation engine. Owned by ws2812_task.
+ */
+typedef struct ws2812_animation_t{
+	ws2812_pixel_t pixels[WS2812_STRIP_SIZE];
+	ws2812_effect_t effect;
+	uint32_t period_us;
+	int64_t effect_start_us;
+	rgb_t shown_frame[WS2812_STRIP_SIZE];
+	bool shown;
+}ws2812_animation_t;
+
+static ws2812_animation_t ws2812_anim;
+static ws2812_stats_t ws2812_stats;
 
 float clamp(float d, float min, float max) {
 	const float t = d < min ? min : d;
@@ -99,30 +190,218 @@ float clamp(float d, float min, float max) {
 }
 
 /**
- * @brief RTOS task processing backlight color changes
+ * @brief renders one pixel at time now (in us): keyframe fade then effect.
+ * @return true if the pixel is still changing
+ */
+static bool ws2812_render_pixel(uint8_t index, int64_t now, rgb_t *out){
+
+	ws2812_pixel_t *p = &ws2812_anim.pixels[index];
+	bool animating = false;
+	float t = 1.0f;
+
+	if(p->duration_us > 0 && now < p->start_us + p->duration_us){
+		t = (float)(now - p->start_us) / (float)p->duration_us;
+		animating = true;
+	}
+
+	const float f = smoothstep(0.0f, 1.0f, t);
+	float r = p->from.r + (p->to.r - p->from.r) * f;
+	float g = p->from.g + (p->to.g - p->from.g) * f;
+	float b = p->from.b + (p->to.b - p->from.b) * f;
+
+	/* base color without effect: a new keyframe starts from there */
+	p->current.r = (uint8_t)(r + 0.5f);
+	p->current.g = (uint8_t)(g + 0.5f);
+	p->current.b = (uint8_t)(b + 0.5f);
+
+	if(ws2812_anim.effect != WS2812_EFFECT_NONE && ws2812_anim.period_us > 0){
+
+		const float phase = (float)((now - ws2812_anim.effect_start_us) % ws2812_anim.period_us) / (float)ws2812_anim.period_us;
+
+		if(ws2812_anim.effect == WS2812_EFFECT_BREATHE){
+			/* bell shaped: full brightness half way through the period, ~5% at both ends */
+			const float k = exp_step(fabsf(2.0f * phase - 1.0f), 3.0f, 2.0f);
+			r *= k;
+			g *= k;
+			b *= k;
+		}
+		else if(ws2812_anim.effect == WS2812_EFFECT_CYCLE){
+			/* rainbow spread across the strip, at the brightness of the base color */
+			float v = fmaxf(r, fmaxf(g, b));
+			float h = 6.0f * (phase + (float)index / (float)WS2812_STRIP_SIZE);
+			h -= 6.0f * floorf(h / 6.0f);
+			const float x = v * (1.0f - fabsf(fmodf(h, 2.0f) - 1.0f));
+			switch((int)h){
+				case 0: r = v; g = x; b = 0; break;
+				case 1: r = x; g = v; b = 0; break;
+				case 2: r = 0; g = v; b = x; break;
+				case 3: r = 0; g = x; b = v; break;
+				case 4: r = x; g = 0; b = v; break;
+				default: r = v; g = 0; b = x; break;
+			}
+		}
+
+		animating = true;
+	}
+
+	out->num = 0;
+	out->r = (uint8_t)(clamp(r, 0.0f, 255.0f) + 0.5f);
+	out->g = (uint8_t)(clamp(g, 0.0f, 255.0f) + 0.5f);
+	out->b = (uint8_t)(clamp(b, 0.0f, 255.0f) + 0.5f);
+
+	return animating;
+}
+
+/**
+ * @brief renders the strip and hands it over to the driver if it differs from what is already shown.
+ * @return true if another frame will be needed
+ */
+static bool ws2812_render_frame(){
+
+	rgb_t frame[WS2812_STRIP_SIZE];
+	bool animating = false;
+	const int64_t start = esp_timer_get_time();
+
+	for(uint8_t i = 0; i < WS2812_STRIP_SIZE; i++){
+		animating |= ws2812_render_pixel(i, start, &frame[i]);
+	}
+
+	ws2812_stats.frames_rendered++;
+	if(ws2812_anim.shown && memcmp(frame, ws2812_anim.shown_frame, sizeof(frame)) == 0){
+		/* dirty frame detection: nothing to send */
+		ws2812_stats.frames_skipped++;
+	}
+	else{
+		memcpy(ws2812_anim.shown_frame, frame, sizeof(frame));
+		ws2812_anim.shown = true;
+		ws2812_set_colors(WS2812_STRIP_SIZE, frame);
+		ws2812_stats.frames_sent++;
+	}
+
+	const uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+	ws2812_stats.last_frame_us = elapsed;
+	ws2812_stats.total_frame_us += elapsed;
+	if(elapsed > ws2812_stats.max_frame_us) ws2812_stats.max_frame_us = elapsed;
+
+	return animating;
+}
+
+static void ws2812_start_fade(uint8_t pixel, rgb_t rgb, uint16_t duration_ms, int64_t now){
+	ESP_LOGI(TAG, "Received R:%d G:%d B:%d pixel:%d fade:%dms", rgb.r, rgb.g, rgb.b, pixel, duration_ms);
+	for(uint8_t i = 0; i < WS2812_STRIP_SIZE; i++){
+		if(pixel == WS2812_ALL_PIXELS || pixel == i){
+			ws2812_pixel_t *p = &ws2812_anim.pixels[i];
+			/* start from wherever the pixel currently is, even in the middle of a fade */
+			p->from = p->current;
+			p->to = rgb;
+			p->start_us = now;
+			p->duration_us = (uint32_t)duration_ms * 1000;
+		}
+	}
+}
+
+/**
+ * @brief takes the pending backlight color, if any
+ */
+static bool ws2812_take_backlight_color(rgb_t *c){
+	bool pending;
+	portENTER_CRITICAL(&ws2812_backlight_spinlock);
+	pending = ws2812_backlight_pending;
+	*c = ws2812_backlight_color;
+	ws2812_backlight_pending = false;
+	portEXIT_CRITICAL(&ws2812_backlight_spinlock);
+	return pending;
+}
+
+static void ws2812_process_message(ws2812_message_t *msg, int64_t now){
+
+	switch(msg->type){
+		case WS2812_MESSAGE_COLOR:
+			ws2812_start_fade(msg->pixel, msg->rgb, msg->duration_ms, now);
+			break;
+
+		case WS2812_MESSAGE_BACKLIGHT:
+			/* only a wake up: the color itself is taken from the pending slot by the task */
+			break;
+
+		case WS2812_MESSAGE_EFFECT:
+			ESP_LOGI(TAG, "Received effect:%d period:%dms", msg->effect, msg->duration_ms);
+			ws2812_anim.effect = msg->effect;
+			ws2812_anim.period_us = (uint32_t)msg->duration_ms * 1000;
+			ws2812_anim.effect_start_us = now;
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**
+ * @brief RTOS task processing backlight color changes.
+ * Frames are rendered at a fixed rate (WS2812_FRAME_RATE) while something is animating. Otherwise the task
+ * sleeps on its queue.
  */
 static void ws2812_task(void *pvParameters)
 {
 	ws2812_message_t msg;
-	const uint8_t pixel_count = WS2812_STRIP_SIZE;
-	rgb_t *pixels = malloc(sizeof(rgb_t) * pixel_count);
-	
+	bool animating = false;
+	TickType_t next_frame = xTaskGetTickCount();
+	const TickType_t period = WS2812_FRAME_PERIOD;
 
 	for(;;) {
-		if(xQueueReceive(ws2812_queue, &msg, portMAX_DELAY)) {
 
-			ESP_LOGI(TAG, "Received R:%d G:%d B:%d", msg.rgb.r, msg.rgb.g, msg.rgb.b);
+		TickType_t timeout = portMAX_DELAY;
+		if(animating){
+			int32_t d = (int32_t)(next_frame - xTaskGetTickCount());
+			timeout = d > 0 ? (TickType_t)d : 0;
+		}
+
+		bool received = xQueueReceive(ws2812_queue, &msg, timeout);
+		if(received){
+			ws2812_process_message(&msg, esp_timer_get_time());
+		}
+
+		/* checked on every pass: the wake up message may have been dropped on a full queue */
+		rgb_t backlight;
+		if(ws2812_take_backlight_color(&backlight)){
+			ws2812_start_fade(WS2812_ALL_PIXELS, backlight, 0, esp_timer_get_time());
+			received = true;
+		}
 
-			for (uint8_t i = 0; i < pixel_count; i++) {
-				pixels[i] = msg.rgb;
+		if(received){
+			if(!animating){
+				/* first frame goes out right away */
+				animating = true;
+				next_frame = xTaskGetTickCount();
+			}
+			/* a steady stream of messages must not hold frames back: render if one is due, wait otherwise */
+			if((int32_t)(next_frame - xTaskGetTickCount()) > 0){
+				continue;
 			}
+		}
 
-			ws2812_set_colors(pixel_count, pixels);
+		/* frame is due */
+		animating = ws2812_render_frame();
+
+		const TickType_t now = xTaskGetTickCount();
+		next_frame += period;
+		if((int32_t)(next_frame - now) <= 0){
+			/* running late: do not try to catch up */
+			next_frame = now + period;
+		}
+
+		if(!animating){
+			ESP_LOGD(TAG, "animation done. frames: %u rendered, %u sent. cpu: %u us last, %u us max",
+					ws2812_stats.frames_rendered, ws2812_stats.frames_sent, ws2812_stats.last_frame_us, ws2812_stats.max_frame_us);
 		}
 	}
 
 }
 
+void ws2812_get_stats(ws2812_stats_t *stats){
+	*stats = ws2812_stats;
+}
+
 
 
 float impulse( float k, float x ){
@@ -139,12 +418,9 @@ float exp_step(float x, float k, float n){
 
 
 
-esp_err_t ws2812_set_backlight_color(rgb_t c){
-
-	ws2812_message_t msg;
-	msg.rgb = c;
+static esp_err_t ws2812_send(ws2812_message_t *msg, TickType_t wait){
 
-	BaseType_t ret = xQueueSend( ws2812_queue, &msg, pdMS_TO_TICKS(1000) );
+	BaseType_t ret = xQueueSend( ws2812_queue, msg, wait );
 
 	if(ret == pdTRUE){
 		return ESP_OK;
@@ -152,7 +428,57 @@ esp_err_t ws2812_set_backlight_color(rgb_t c){
 	else{
 		return ESP_FAIL; /* ret could be errQUEUE_FULL */
 	}
+}
+
+esp_err_t ws2812_set_backlight_color(rgb_t c){
+
+	if(ws2812_queue == NULL){
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	bool was_pending;
+	portENTER_CRITICAL(&ws2812_backlight_spinlock);
+	was_pending = ws2812_backlight_pending;
+	ws2812_backlight_color = c;
+	ws2812_backlight_pending = true;
+	portEXIT_CRITICAL(&ws2812_backlight_spinlock);
+
+	if(!was_pending){
+		/* a full queue means the task is about to run anyway: it picks the color up after its next message */
+		ws2812_message_t msg;
+		memset(&msg, 0x00, sizeof(ws2812_message_t));
+		msg.type = WS2812_MESSAGE_BACKLIGHT;
+		ws2812_send(&msg, 0);
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t ws2812_fade_backlight_color(rgb_t c, uint16_t duration_ms){
+	return ws2812_fade_pixel_color(WS2812_ALL_PIXELS, c, duration_ms);
+}
+
+esp_err_t ws2812_fade_pixel_color(uint8_t pixel, rgb_t c, uint16_t duration_ms){
 
+	ws2812_message_t msg;
+	memset(&msg, 0x00, sizeof(ws2812_message_t));
+	msg.type = WS2812_MESSAGE_COLOR;
+	msg.rgb = c;
+	msg.pixel = pixel;
+	msg.duration_ms = duration_ms;
+
+	return ws2812_send(&msg, pdMS_TO_TICKS(1000));
+}
+
+esp_err_t ws2812_set_effect(ws2812_effect_t effect, uint16_t period_ms){
+
+	ws2812_message_t msg;
+	memset(&msg, 0x00, sizeof(ws2812_message_t));
+	msg.type = WS2812_MESSAGE_EFFECT;
+	msg.effect = effect;
+	msg.duration_ms = period_ms;
+
+	return ws2812_send(&msg, 0);
 }
 
 
@@ -172,9 +498,14 @@ float smoothstep(const float edge0, const float edge1, const float x){
 void ws2812_init_rmt_channel(int rmt_channel)
 {
 	RMT.apb_conf.fifo_mask = 1;  /* enable memory access, instead of FIFO mode. */
-	RMT.apb_conf.mem_tx_wrap_en = 1; /* wrap around when hitting end of buffer */
 	RMT.conf_ch[rmt_channel].conf0.div_cnt = DIVIDER;
+#if CONFIG_WS2812_ONE_SHOT
+	RMT.apb_conf.mem_tx_wrap_en = 0; /* the frame spans several blocks and is sent once */
+	RMT.conf_ch[rmt_channel].conf0.mem_size = WS2812_MEM_BLOCKS;
+#else
+	RMT.apb_conf.mem_tx_wrap_en = 1; /* wrap around when hitting end of buffer */
 	RMT.conf_ch[rmt_channel].conf0.mem_size = 1;
+#endif
 	RMT.conf_ch[rmt_channel].conf0.carrier_en = 0;
 	RMT.conf_ch[rmt_channel].conf0.carrier_out_lv = 1;
 	RMT.conf_ch[rmt_channel].conf0.mem_pd = 0;
@@ -224,16 +555,65 @@ void ws2812_copy()
   return;
 }
 
-void ws2812_handle_interrupt(void *arg){
+/**
+ * @brief loads the front frame in the RMT memory and starts the transmission.
+ * Must be called from the ISR or inside the ws2812 critical section.
+ */
+static void IRAM_ATTR ws2812_start_front(){
+
+#if CONFIG_WS2812_ONE_SHOT
+	/* the whole frame fits in the channel memory: nothing left to do until tx_end */
+	const unsigned int count = ws2812_frames_len[ws2812_front] * 8 + 1;
+	for (unsigned int i = 0; i < count; i++) {
+		RMTMEM.chan[WS2812_RMT_CHANNEL].data32[i].val = ws2812_symbols[ws2812_front][i].val;
+	}
+#else
+	ws2812_buffer = ws2812_frames[ws2812_front];
+	ws2812_len = ws2812_frames_len[ws2812_front];
+	ws2812_pos = 0;
+	ws2812_half = 0;
+
+	ws2812_copy();
+
+	if (ws2812_pos < ws2812_len)
+	ws2812_copy();
+#endif
+
+	ws2812_busy = true;
+
+	RMT.conf_ch[WS2812_RMT_CHANNEL].conf1.mem_rd_rst = 1;
+	RMT.conf_ch[WS2812_RMT_CHANNEL].conf1.tx_start = 1;
+}
+
+void IRAM_ATTR ws2812_handle_interrupt(void *arg){
 	BaseType_t task_awoken = 0;
 
   if (RMT.int_st.ch0_tx_thr_event) {
     ws2812_copy();
     RMT.int_clr.ch0_tx_thr_event = 1;
   }
-  else if (RMT.int_st.ch0_tx_end && ws2812_sem) {
-    xSemaphoreGiveFromISR(ws2812_sem, &task_awoken);
+  else if (RMT.int_st.ch0_tx_end) {
     RMT.int_clr.ch0_tx_end = 1;
+
+    portENTER_CRITICAL_ISR(&ws2812_spinlock);
+    if (ws2812_pending) {
+      /* flip: the frame that was waiting goes out right away */
+      ws2812_pending = false;
+      ws2812_front = !ws2812_front;
+      ws2812_start_front();
+    }
+    else {
+      ws2812_busy = false;
+    }
+    portEXIT_CRITICAL_ISR(&ws2812_spinlock);
+
+    if (!ws2812_busy) {
+      xSemaphoreGiveFromISR(ws2812_sem, &task_awoken);
+    }
+  }
+
+  if (task_awoken) {
+    portYIELD_FROM_ISR();
   }
 
   return;
@@ -243,8 +623,12 @@ esp_err_t ws2812_init(){
 
 	esp_err_t ret;
 
-	/* mutex for the pixels memory */
+	/* mutex for the frame buffers and completion signal for the ISR */
 	ws2812_mutex = xSemaphoreCreateMutex();
+	ws2812_sem = xSemaphoreCreateBinary();
+	if(ws2812_mutex == NULL || ws2812_sem == NULL){
+		return ESP_ERR_NO_MEM;
+	}
 
 	DPORT_SET_PERI_REG_MASK(DPORT_PERIP_CLK_EN_REG, DPORT_RMT_CLK_EN);
 	DPORT_CLEAR_PERI_REG_MASK(DPORT_PERIP_RST_EN_REG, DPORT_RMT_RST);
@@ -254,8 +638,12 @@ esp_err_t ws2812_init(){
 
 	ws2812_init_rmt_channel(WS2812_RMT_CHANNEL);
 
+#if CONFIG_WS2812_ONE_SHOT
+	RMT.int_ena.ch0_tx_thr_event = 0;
+#else
 	RMT.tx_lim_ch[WS2812_RMT_CHANNEL].limit = MAX_PULSES;
 	RMT.int_ena.ch0_tx_thr_event = 1;
+#endif
 	RMT.int_ena.ch0_tx_end = 1;
 
 	ws2812_bits[0].level0 = 1;
@@ -267,8 +655,8 @@ esp_err_t ws2812_init(){
 	ws2812_bits[1].duration0 = PULSE_T1H;
 	ws2812_bits[1].duration1 = PULSE_T1L;
 
-	/* allocate memory for the pixels */
-	ws2812_pixels = (rgb_t*)malloc(sizeof(rgb_t) * WS2812_STRIP_SIZE);
+	memset(&ws2812_anim, 0x00, sizeof(ws2812_animation_t));
+	memset(&ws2812_stats, 0x00, sizeof(ws2812_stats_t));
 
 
 	ret = esp_intr_alloc(ETS_RMT_INTR_SOURCE, 0, ws2812_handle_interrupt, NULL, &rmt_intr_handle);
@@ -288,39 +676,65 @@ esp_err_t ws2812_init(){
 
 }
 
-void ws2812_set_colors(unsigned int length, rgb_t *array){
-	unsigned int i;
-
+esp_err_t ws2812_set_colors(unsigned int length, rgb_t *array){
+	unsigned int i, back_index;
+	uint8_t *back;
 
-	ws2812_len = (length * 3) * sizeof(uint8_t);
-	ws2812_buffer = malloc(ws2812_len);
-
-	for (i = 0; i < length; i++) {
-		ws2812_buffer[i * 3 + 0] = array[i].g;
-		ws2812_buffer[i * 3 + 1] = array[i].r;
-		ws2812_buffer[i * 3 + 2] = array[i].b;
+	if(length > WS2812_STRIP_SIZE || array == NULL){
+		return ESP_ERR_INVALID_ARG;
 	}
 
-	ws2812_pos = 0;
-	ws2812_half = 0;
+	xSemaphoreTake(ws2812_mutex, portMAX_DELAY);
 
-	ws2812_copy();
-
-	if (ws2812_pos < ws2812_len)
-	ws2812_copy();
+	/* the back frame is about to be rewritten: make sure the ISR does not pick it up half way */
+	portENTER_CRITICAL(&ws2812_spinlock);
+	ws2812_pending = false;
+	back_index = !ws2812_front;
+	back = ws2812_frames[back_index];
+	portEXIT_CRITICAL(&ws2812_spinlock);
 
-	ws2812_sem = xSemaphoreCreateBinary();
+	for (i = 0; i < length; i++) {
+		back[i * 3 + 0] = array[i].g;
+		back[i * 3 + 1] = array[i].r;
+		back[i * 3 + 2] = array[i].b;
+	}
 
-	RMT.conf_ch[WS2812_RMT_CHANNEL].conf1.mem_rd_rst = 1;
-	RMT.conf_ch[WS2812_RMT_CHANNEL].conf1.tx_start = 1;
+#if CONFIG_WS2812_ONE_SHOT
+	/* pre-encode the frame so that the ISR only has to copy it */
+	rmt_pulse_pair_t *symbols = ws2812_symbols[back_index];
+	for (i = 0; i < length * 3; i++) {
+		memcpy(&symbols[i * 8], ws2812_lut[back[i]], sizeof(ws2812_lut[0]));
+	}
+	if (i) {
+		symbols[i * 8 - 1].duration1 = PULSE_TRS;
+	}
+	symbols[i * 8].val = 0;
+#endif
+
+	portENTER_CRITICAL(&ws2812_spinlock);
+	ws2812_frames_len[back_index] = length * 3;
+	if(ws2812_busy){
+		/* the ISR will flip to it at the end of the current frame. If there already was a frame waiting, it is replaced. */
+		ws2812_pending = true;
+	}
+	else{
+		ws2812_front = !ws2812_front;
+		ws2812_start_front();
+	}
+	portEXIT_CRITICAL(&ws2812_spinlock);
 
+	xSemaphoreGive(ws2812_mutex);
 
+	return ESP_OK;
+}
 
-	xSemaphoreTake(ws2812_sem, portMAX_DELAY);
-	vSemaphoreDelete(ws2812_sem);
-	ws2812_sem = NULL;
+esp_err_t ws2812_wait_idle(TickType_t xTicksToWait){
 
-	free(ws2812_buffer);
+	while(ws2812_busy){
+		if(xSemaphoreTake(ws2812_sem, xTicksToWait) != pdTRUE){
+			return ESP_ERR_TIMEOUT;
+		}
+	}
 
-	return;
+	return ESP_OK;
 }